@@ -0,0 +1,232 @@
+#include "stdafx.h"
+#include "arena.h"
+#include "stats.h"
+
+/* Arenas grow in steps of ARENA_GRANULARITY bytes to the most that their
+ * threads have needed at once, but no larger than ARENA_MAX_SIZE; what
+ * doesnt fit comes from the heap every time. */
+#define ARENA_GRANULARITY	(64 * 1024)
+#define ARENA_MAX_SIZE		(4 * 1024 * 1024)
+
+/* Rounds SIZE up to a multiple of ALIGNMENT, a power of two. */
+#define ARENA_ROUND(size, alignment)	(((size) + (alignment) - 1) & ~((size_t)(alignment) - 1))
+
+typedef struct _Arena Arena;
+typedef struct _ArenaBlock ArenaBlock;
+
+/* Memory allocated from the heap, for what doesnt fit into the arena of
+ * the thread, or if it has none.
+ *
+ * ARENA is the arena it stands in for, or NULL.
+ * OFFSET is where it would have been in ARENA.
+ * NEXT is the block allocated before it in ARENA. */
+struct _ArenaBlock
+{
+	Arena *arena;
+	ArenaBlock *next;
+	size_t offset;
+};
+
+/* The size of the header of an ArenaBlock, keeping what follows it as
+ * aligned as the heap does. */
+#define ARENA_BLOCK_HEADER	ARENA_ROUND(sizeof(ArenaBlock), MEMORY_ALLOCATION_ALIGNMENT)
+
+/* The arena of a thread.
+ *
+ * NEXT is the arena of another thread.
+ * BYTES is SIZE bytes long, of which the first USED are allocated; USED
+ * goes beyond SIZE when BLOCKS have been allocated instead.
+ * WANTED is the most that USED has been. */
+struct _Arena
+{
+	Arena *next;
+	unsigned char *bytes;
+	size_t size;
+	size_t used;
+	size_t wanted;
+	ArenaBlock *blocks;
+};
+
+/* The arenas of all threads, so that they can be freed when the plugin is
+ * unloaded, as threads that are still running then are never told. */
+static DWORD s_tls_index = TLS_OUT_OF_INDEXES;
+static CRITICAL_SECTION s_arenas_lock;
+static Arena *s_arenas;
+
+/* Prepares for arenas to be kept by threads.  If that fails, everything
+ * comes from the heap instead. */
+void
+ArenaOpen(void)
+{
+	s_tls_index = TlsAlloc();
+	if (s_tls_index != TLS_OUT_OF_INDEXES)
+		InitializeCriticalSection(&s_arenas_lock);
+}
+
+static void
+ArenaDestroy(Arena *arena)
+{
+	while (arena->blocks != NULL) {
+		ArenaBlock *block = arena->blocks;
+		arena->blocks = block->next;
+		HeapFree(GetProcessHeap(), 0, block);
+	}
+	if (arena->bytes != NULL)
+		HeapFree(GetProcessHeap(), 0, arena->bytes);
+	HeapFree(GetProcessHeap(), 0, arena);
+}
+
+/* Frees the arenas of all threads. */
+void
+ArenaClose(void)
+{
+	if (s_tls_index == TLS_OUT_OF_INDEXES)
+		return;
+
+	while (s_arenas != NULL) {
+		Arena *arena = s_arenas;
+		s_arenas = arena->next;
+		ArenaDestroy(arena);
+	}
+
+	TlsFree(s_tls_index);
+	s_tls_index = TLS_OUT_OF_INDEXES;
+	DeleteCriticalSection(&s_arenas_lock);
+}
+
+/* Frees the arena of the calling thread, which is exiting. */
+void
+ArenaThreadClose(void)
+{
+	if (s_tls_index == TLS_OUT_OF_INDEXES)
+		return;
+
+	Arena *arena = (Arena *)TlsGetValue(s_tls_index);
+	if (arena == NULL)
+		return;
+
+	EnterCriticalSection(&s_arenas_lock);
+	for (Arena **p = &s_arenas; *p != NULL; p = &(*p)->next)
+		if (*p == arena) {
+			*p = arena->next;
+			break;
+		}
+	LeaveCriticalSection(&s_arenas_lock);
+
+	TlsSetValue(s_tls_index, NULL);
+	ArenaDestroy(arena);
+}
+
+/* Gets the arena of the calling thread, creating it if it has none yet.
+ * Returns NULL if it cant have one. */
+static Arena *
+ArenaGet(void)
+{
+	if (s_tls_index == TLS_OUT_OF_INDEXES)
+		return NULL;
+
+	Arena *arena = (Arena *)TlsGetValue(s_tls_index);
+	if (arena != NULL)
+		return arena;
+
+	StatsCount(StatsCounterHeapAllocations, 1);
+	arena = (Arena *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Arena));
+	if (arena == NULL)
+		return NULL;
+
+	if (!TlsSetValue(s_tls_index, arena)) {
+		HeapFree(GetProcessHeap(), 0, arena);
+		return NULL;
+	}
+
+	EnterCriticalSection(&s_arenas_lock);
+	arena->next = s_arenas;
+	s_arenas = arena;
+	LeaveCriticalSection(&s_arenas_lock);
+
+	return arena;
+}
+
+/* Grows the empty ARENA to what it has been found to need. */
+static void
+ArenaGrow(Arena *arena)
+{
+	if (arena->wanted <= arena->size || arena->size >= ARENA_MAX_SIZE)
+		return;
+
+	if (arena->bytes != NULL)
+		HeapFree(GetProcessHeap(), 0, arena->bytes);
+
+	size_t size = min(ARENA_ROUND(arena->wanted, ARENA_GRANULARITY), (size_t)ARENA_MAX_SIZE);
+	StatsCount(StatsCounterHeapAllocations, 1);
+	arena->bytes = (unsigned char *)HeapAlloc(GetProcessHeap(), 0, size);
+	arena->size = arena->bytes != NULL ? size : 0;
+}
+
+/* Allocates SIZE bytes from the arena of the calling thread.  Returns NULL
+ * if there isnt enough memory. */
+void *
+ArenaAlloc(size_t size)
+{
+	if (size > (size_t)-1 - ARENA_BLOCK_HEADER - MEMORY_ALLOCATION_ALIGNMENT)
+		return NULL;
+	size = ARENA_ROUND(max(size, (size_t)1), MEMORY_ALLOCATION_ALIGNMENT);
+
+	Arena *arena = ArenaGet();
+	if (arena != NULL && arena->used <= arena->size && size <= arena->size - arena->used) {
+		void *bytes = arena->bytes + arena->used;
+		arena->used += size;
+		arena->wanted = max(arena->wanted, arena->used);
+		return bytes;
+	}
+
+	StatsCount(StatsCounterHeapAllocations, 1);
+	ArenaBlock *block = (ArenaBlock *)HeapAlloc(GetProcessHeap(), 0, ARENA_BLOCK_HEADER + size);
+	if (block == NULL)
+		return NULL;
+
+	block->arena = arena;
+	if (arena != NULL) {
+		block->offset = arena->used;
+		block->next = arena->blocks;
+		arena->blocks = block;
+		arena->used += size;
+		arena->wanted = max(arena->wanted, arena->used);
+	}
+
+	return (unsigned char *)block + ARENA_BLOCK_HEADER;
+}
+
+/* Frees BYTES, allocated by ArenaAlloc() on the calling thread, along with
+ * everything it allocated after them.  Once all is freed, the arena grows
+ * if it was too small, so that it is large enough the next time. */
+void
+ArenaFree(void *bytes)
+{
+	if (bytes == NULL)
+		return;
+
+	Arena *arena = s_tls_index != TLS_OUT_OF_INDEXES ? (Arena *)TlsGetValue(s_tls_index) : NULL;
+	size_t offset;
+	if (arena != NULL && bytes >= arena->bytes && bytes < arena->bytes + arena->size) {
+		offset = (unsigned char *)bytes - arena->bytes;
+	} else {
+		ArenaBlock *block = (ArenaBlock *)((unsigned char *)bytes - ARENA_BLOCK_HEADER);
+		if (block->arena == NULL) {
+			HeapFree(GetProcessHeap(), 0, block);
+			return;
+		}
+		arena = block->arena;
+		offset = block->offset;
+	}
+
+	while (arena->blocks != NULL && arena->blocks->offset >= offset) {
+		ArenaBlock *block = arena->blocks;
+		arena->blocks = block->next;
+		HeapFree(GetProcessHeap(), 0, block);
+	}
+	arena->used = offset;
+
+	if (arena->used == 0)
+		ArenaGrow(arena);
+}
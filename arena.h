@@ -0,0 +1,10 @@
+/* Scratch memory for what is only needed while a request is served, such
+ * as the bytes read from a file, taken from an arena kept by the calling
+ * thread rather than from the heap.  What is allocated must be freed by
+ * the same thread, in the reverse order. */
+
+void ArenaOpen(void);
+void ArenaClose(void);
+void ArenaThreadClose(void);
+void *ArenaAlloc(size_t size);
+void ArenaFree(void *bytes);
@@ -0,0 +1,180 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "file-mapping.h"
+#include "regions.h"
+#include "transcode.h"
+#include "convertibility.h"
+
+#include <strsafe.h>
+
+/* Whether a file can be converted to an encoding without losing any of its
+ * characters is found out without writing anything, by running through it
+ * once and looking up each character that isnt ASCII in the target.  The
+ * size of the converted file comes out of the same pass. */
+#define CONVERTIBILITY_WINDOW_SIZE	(1024 * 1024)
+
+/* Checks the bytes of INPUT between OFFSET and END, which are in FROM, for
+ * characters that cant be represented in TO, adding what is found to
+ * CHECK. */
+static BOOL
+ConvertibilityScan(FileWindow *input, Encoding const *from, Encoding const *to,
+				   ULONGLONG offset, ULONGLONG end, TranscodeCheck *check)
+{
+	while (offset < end) {
+		BOOL covered = input->bytes != NULL && offset >= input->offset &&
+			end <= input->offset + input->n_bytes;
+		if (!covered && !FileWindowMove(input, offset, CONVERTIBILITY_WINDOW_SIZE))
+			return FALSE;
+
+		ULONGLONG window_end = min(end, input->offset + input->n_bytes);
+		size_t skip = (size_t)(offset - input->offset);
+		size_t n_checked = TranscodeCheckBytes(from, to, input->bytes + skip,
+											   (size_t)(window_end - offset), offset,
+											   window_end == end, check);
+		if (n_checked == 0)
+			return FALSE;
+		offset += n_checked;
+	}
+
+	return TRUE;
+}
+
+/* Checks the N_REGIONS REGIONS of the file open in INPUT, skipping its
+ * BOM_LENGTH byte BOM, for characters that cant be represented in TO,
+ * storing what was found and the exact size of the file converted to TO,
+ * BOM and all, in CHECK.  Line endings are taken to be left as they are.
+ * The bytes of the first region up to the first character found that
+ * cant be represented, all of which are valid, are stored in PROOF,
+ * unless it is NULL. */
+static TCFieldTypeOrStatus
+ConvertibilityCheckEach(FileWindow *input, Region const *regions, size_t n_regions,
+						size_t bom_length, Encoding const *to, TranscodeCheck *check,
+						TranscodeProof *proof)
+{
+	ZeroMemory(check, sizeof(*check));
+	if (proof != NULL)
+		ZeroMemory(proof, sizeof(*proof));
+
+	for (size_t i = 0; i < n_regions; i++)
+		if (!TranscodeCanCheck(regions[i].encoding, to))
+			return TCFieldStatusFieldEmpty;
+
+	size_t to_bom_length;
+	if (FAILED(StringCbLength(EncodingBOM(to), STRSAFE_MAX_CCH, &to_bom_length)))
+		return TCFieldStatusFileError;
+	check->size = to_bom_length;
+
+	for (size_t i = 0; i < n_regions; i++) {
+		ULONGLONG offset = max(regions[i].offset, (ULONGLONG)bom_length);
+		ULONGLONG end = min(regions[i].offset + regions[i].length, input->file_size);
+		if (offset >= end)
+			continue;
+		if (!ConvertibilityScan(input, regions[i].encoding, to, offset, end, check))
+			return TCFieldStatusFileError;
+		if (i == 0 && proof != NULL) {
+			proof->encoding = regions[i].encoding;
+			proof->offset = offset;
+			proof->length = (check->n_lost > 0 ? check->lost[0] : end) - offset;
+		}
+	}
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Checks FILENAME as ConvertibilityCheckEach() does, opening it for the
+ * purpose.  Empty files can be converted to anything. */
+static TCFieldTypeOrStatus
+ConvertibilityCheckEachIn(char const *filename, Region const *regions, size_t n_regions,
+						  size_t bom_length, Encoding const *to, TranscodeCheck *check)
+{
+	FileWindow input;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &input);
+	if (status == TCFieldStatusFieldEmpty) {
+		/* There is nothing in empty files to look at, through any view. */
+		ZeroMemory(&input, sizeof(input));
+		return ConvertibilityCheckEach(&input, regions, n_regions, bom_length, to, check, NULL);
+	} else if (status != TCFieldStatusSetSuccess) {
+		return status;
+	}
+
+	status = ConvertibilityCheckEach(&input, regions, n_regions, bom_length, to, check, NULL);
+
+	FileWindowClose(&input);
+
+	return status;
+}
+
+/* Checks the file open in INPUT, which is in FROM, for characters that
+ * cant be represented in TO, as ConvertibilityCheckEach() does, leaving
+ * it open, and stores how much of it was proven to be valid in PROOF.
+ * Returns TCFieldStatusFieldEmpty if there is no telling for FROM and
+ * TO.  This is the pass that conversions take their proofs from, as it
+ * reads every byte that is converted; that detection found the file to
+ * be in FROM proves nothing past the bytes it looked at. */
+TCFieldTypeOrStatus
+ConvertibilityCheckWindow(FileWindow *input, Encoding const *from, Encoding const *to,
+						  TranscodeCheck *check, TranscodeProof *proof)
+{
+	ZeroMemory(proof, sizeof(*proof));
+
+	size_t bom_length;
+	if (FAILED(StringCbLength(EncodingBOM(from), STRSAFE_MAX_CCH, &bom_length)))
+		return TCFieldStatusFileError;
+
+	Region whole = { bom_length, (ULONGLONG)-1 - bom_length, from };
+
+	return ConvertibilityCheckEach(input, &whole, 1, bom_length, to, check, proof);
+}
+
+/* Checks FILENAME, which is in FROM, for characters that cant be
+ * represented in TO, as ConvertibilityCheckEach() does.  Returns
+ * TCFieldStatusFieldEmpty if there is no telling for FROM and TO. */
+TCFieldTypeOrStatus
+ConvertibilityCheck(char const *filename, Encoding const *from, Encoding const *to,
+					TranscodeCheck *check)
+{
+	size_t bom_length;
+	if (FAILED(StringCbLength(EncodingBOM(from), STRSAFE_MAX_CCH, &bom_length)))
+		return TCFieldStatusFileError;
+
+	Region whole = { bom_length, (ULONGLONG)-1 - bom_length, from };
+
+	return ConvertibilityCheckEachIn(filename, &whole, 1, bom_length, to, check);
+}
+
+/* Checks FILENAME, whose text is split into the regions of MAP, for
+ * characters that cant be represented in TO, as ConvertibilityCheck()
+ * does, looking at each region in its own encoding. */
+TCFieldTypeOrStatus
+ConvertibilityCheckRegions(char const *filename, RegionMap const *map, size_t bom_length,
+						   Encoding const *to, TranscodeCheck *check)
+{
+	return ConvertibilityCheckEachIn(filename, map->regions, map->n_regions, bom_length, to,
+									 check);
+}
+
+/* Checks FILENAME, which is in FROM, for characters that would be lost
+ * converting it to TO the way ContentSetValue() does: region by region,
+ * if it is pieced together from text in several encodings, and as a whole
+ * otherwise.  The regions are only looked for if checking it as a whole
+ * finds signs of them. */
+TCFieldTypeOrStatus
+ConvertibilityCheckFile(char const *filename, Encoding const *from, Encoding const *to,
+						TranscodeCheck *check)
+{
+	TCFieldTypeOrStatus status = ConvertibilityCheck(filename, from, to, check);
+	if (status != TCFieldStatusSetSuccess || !check->mixed)
+		return status;
+
+	RegionMap map;
+	if (RegionsFind(filename, from, &map) != TCFieldStatusSetSuccess)
+		return status;
+	if (map.n_regions > 1)
+		status = ConvertibilityCheckRegions(filename, &map, lstrlen(EncodingBOM(from)), to,
+											check);
+	RegionsFree(&map);
+
+	return status;
+}
@@ -0,0 +1,10 @@
+TCFieldTypeOrStatus ConvertibilityCheck(char const *filename, Encoding const *from,
+										Encoding const *to, TranscodeCheck *check);
+TCFieldTypeOrStatus ConvertibilityCheckWindow(FileWindow *input, Encoding const *from,
+											  Encoding const *to, TranscodeCheck *check,
+											  TranscodeProof *proof);
+TCFieldTypeOrStatus ConvertibilityCheckRegions(char const *filename, RegionMap const *map,
+											   size_t bom_length, Encoding const *to,
+											   TranscodeCheck *check);
+TCFieldTypeOrStatus ConvertibilityCheckFile(char const *filename, Encoding const *from,
+											Encoding const *to, TranscodeCheck *check);
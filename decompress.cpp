@@ -0,0 +1,364 @@
+#include "stdafx.h"
+#include "arena.h"
+#include "decompress.h"
+#include "stats.h"
+
+#include <string.h>
+
+/* Compressed files are recognized by their magic number and the beginning
+ * of their contents is decompressed into memory, so that it can be handed
+ * to the detectors in place of the compressed bytes.  The decompressors
+ * are loaded from zlib1.dll and libzstd.dll the first time they are
+ * needed; if they are missing, compressed files are left as they are. */
+
+/* The functions that zlib allocates and frees its state with. */
+typedef void *(*ZAllocFunc)(void *, unsigned int, unsigned int);
+typedef void (*ZFreeFunc)(void *, void *);
+
+/* The subset of zlibs z_stream that we use.  The layout has to match the
+ * one in zlib.h exactly, as inflateInit2_() checks its size. */
+typedef struct _ZStream ZStream;
+
+struct _ZStream
+{
+	unsigned char const *next_in;
+	unsigned int avail_in;
+	unsigned long total_in;
+	unsigned char *next_out;
+	unsigned int avail_out;
+	unsigned long total_out;
+	char const *msg;
+	void *state;
+	ZAllocFunc zalloc;
+	ZFreeFunc zfree;
+	void *opaque;
+	int data_type;
+	unsigned long adler;
+	unsigned long reserved;
+};
+
+#define Z_OK			0
+#define Z_STREAM_END	1
+#define Z_NO_FLUSH		0
+
+/* Makes inflate() accept both gzip and zlib headers. */
+#define Z_GZIP_OR_ZLIB_WINDOW_BITS	(15 + 32)
+
+typedef char const *(*ZlibVersionFunc)(void);
+typedef int (*InflateInit2Func)(ZStream *, int, char const *, int);
+typedef int (*InflateFunc)(ZStream *, int);
+typedef int (*InflateEndFunc)(ZStream *);
+
+/* The buffers passed to ZSTD_decompressStream(). */
+typedef struct _ZstdInBuffer ZstdInBuffer;
+
+struct _ZstdInBuffer
+{
+	void const *src;
+	size_t size;
+	size_t pos;
+};
+
+typedef struct _ZstdOutBuffer ZstdOutBuffer;
+
+struct _ZstdOutBuffer
+{
+	void *dst;
+	size_t size;
+	size_t pos;
+};
+
+typedef void *(*ZstdCreateDStreamFunc)(void);
+typedef size_t (*ZstdInitDStreamFunc)(void *);
+typedef size_t (*ZstdDecompressStreamFunc)(void *, ZstdOutBuffer *, ZstdInBuffer *);
+typedef size_t (*ZstdFreeDStreamFunc)(void *);
+typedef unsigned (*ZstdIsErrorFunc)(size_t);
+
+/* A library that a decompressor is loaded from.
+ *
+ * NAME is the file name of the DLL.
+ * FUNCTION_NAMES are the functions we need from it, which are stored in
+ * FUNCTIONS, in the same order, once DLL has been loaded.
+ * TRIED is set once loading has been attempted, so that a missing DLL is
+ * only looked for once.  LOADING is set while it is being loaded, as that
+ * may happen in several threads at once. */
+typedef struct _Decompressor Decompressor;
+
+#define DECOMPRESSOR_MAX_FUNCTIONS	5
+
+struct _Decompressor
+{
+	char const *name;
+	char const *function_names[DECOMPRESSOR_MAX_FUNCTIONS];
+	FARPROC functions[DECOMPRESSOR_MAX_FUNCTIONS];
+	HMODULE dll;
+	BOOL volatile tried;
+	LONG volatile loading;
+};
+
+static Decompressor s_zlib = {
+	"zlib1.dll",
+	{ "zlibVersion", "inflateInit2_", "inflate", "inflateEnd" },
+};
+
+static Decompressor s_zstd = {
+	"libzstd.dll",
+	{ "ZSTD_createDStream", "ZSTD_initDStream", "ZSTD_decompressStream",
+	  "ZSTD_freeDStream", "ZSTD_isError" },
+};
+
+/* Loads the DLL of DECOMPRESSOR, unless that has been tried before. */
+static BOOL
+DecompressorLoad(Decompressor *decompressor)
+{
+	if (decompressor->tried)
+		return decompressor->dll != NULL;
+
+	while (InterlockedCompareExchange(&decompressor->loading, TRUE, FALSE))
+		Sleep(0);
+
+	if (!decompressor->tried) {
+		HMODULE dll = LoadLibrary(decompressor->name);
+		for (int i = 0; dll != NULL && i < DECOMPRESSOR_MAX_FUNCTIONS; i++) {
+			if (decompressor->function_names[i] == NULL)
+				break;
+
+			decompressor->functions[i] = GetProcAddress(dll, decompressor->function_names[i]);
+			if (decompressor->functions[i] == NULL) {
+				FreeLibrary(dll);
+				dll = NULL;
+			}
+		}
+
+		decompressor->dll = dll;
+		decompressor->tried = TRUE;
+	}
+
+	InterlockedExchange(&decompressor->loading, FALSE);
+
+	return decompressor->dll != NULL;
+}
+
+static void
+DecompressorUnload(Decompressor *decompressor)
+{
+	if (decompressor->dll != NULL)
+		FreeLibrary(decompressor->dll);
+
+	decompressor->dll = NULL;
+	decompressor->tried = FALSE;
+}
+
+/* Allocates ITEMS times SIZE bytes for zlib.  Its state comes from the
+ * scratch arena of the calling thread, like the sample it inflates into,
+ * as inflateEnd() frees it in the reverse order that it was allocated. */
+static void *
+ZlibAlloc(void *opaque, unsigned int items, unsigned int size)
+{
+	UNREFERENCED_PARAMETER(opaque);
+
+	if (size != 0 && items > (size_t)-1 / size)
+		return NULL;
+
+	return ArenaAlloc((size_t)items * size);
+}
+
+static void
+ZlibFree(void *opaque, void *address)
+{
+	UNREFERENCED_PARAMETER(opaque);
+
+	ArenaFree(address);
+}
+
+/* Inflates the gzip stream in BYTES into SAMPLE, returning the number of
+ * bytes written to it. */
+static size_t
+GunzipSample(unsigned char const *bytes, size_t n_bytes,
+			 unsigned char *sample, size_t max_size)
+{
+	if (!DecompressorLoad(&s_zlib))
+		return 0;
+
+	ZlibVersionFunc zlib_version = (ZlibVersionFunc)s_zlib.functions[0];
+	InflateInit2Func inflate_init2 = (InflateInit2Func)s_zlib.functions[1];
+	InflateFunc inflate = (InflateFunc)s_zlib.functions[2];
+	InflateEndFunc inflate_end = (InflateEndFunc)s_zlib.functions[3];
+
+	ZStream stream;
+	ZeroMemory(&stream, sizeof(stream));
+	stream.zalloc = ZlibAlloc;
+	stream.zfree = ZlibFree;
+	if (inflate_init2(&stream, Z_GZIP_OR_ZLIB_WINDOW_BITS, zlib_version(),
+					  sizeof(stream)) != Z_OK)
+		return 0;
+
+	stream.next_in = bytes;
+	stream.avail_in = (unsigned int)n_bytes;
+	stream.next_out = sample;
+	stream.avail_out = (unsigned int)max_size;
+
+	/* A truncated or corrupt stream still leaves whatever came before the
+	 * damage in SAMPLE, which is as good a sample as any. */
+	while (stream.avail_out > 0 && stream.avail_in > 0 &&
+		   inflate(&stream, Z_NO_FLUSH) == Z_OK)
+		;
+
+	size_t n_sample = max_size - stream.avail_out;
+
+	inflate_end(&stream);
+
+	return n_sample;
+}
+
+/* The zstd streams that are not in use, kept to be reused, as each holds
+ * more than a hundred kilobytes that libzstd.dll allocates from its own
+ * heap.  There are enough slots for the workers of the work pool and the
+ * threads of Total Commander that detect on their own; a stream that
+ * finds no empty slot is freed. */
+#define ZSTD_MAX_STREAMS	32
+
+static void * volatile s_zstd_streams[ZSTD_MAX_STREAMS];
+
+/* Takes a zstd stream from the pool, or creates one if it is empty. */
+static void *
+ZstdStreamTake(void)
+{
+	for (int i = 0; i < ZSTD_MAX_STREAMS; i++) {
+		if (s_zstd_streams[i] == NULL)
+			continue;
+
+		void *stream = InterlockedExchangePointer(&s_zstd_streams[i], NULL);
+		if (stream != NULL)
+			return stream;
+	}
+
+	StatsCount(StatsCounterHeapAllocations, 1);
+	return ((ZstdCreateDStreamFunc)s_zstd.functions[0])();
+}
+
+/* Puts STREAM back into the pool, or frees it if the pool is full. */
+static void
+ZstdStreamGive(void *stream)
+{
+	for (int i = 0; i < ZSTD_MAX_STREAMS; i++) {
+		if (InterlockedCompareExchangePointer(&s_zstd_streams[i], stream, NULL) == NULL)
+			return;
+	}
+
+	((ZstdFreeDStreamFunc)s_zstd.functions[3])(stream);
+}
+
+/* Frees the pooled zstd streams, before libzstd.dll is unloaded. */
+static void
+ZstdStreamsFree(void)
+{
+	for (int i = 0; i < ZSTD_MAX_STREAMS; i++) {
+		void *stream = InterlockedExchangePointer(&s_zstd_streams[i], NULL);
+		if (stream != NULL)
+			((ZstdFreeDStreamFunc)s_zstd.functions[3])(stream);
+	}
+}
+
+/* Decompresses the zstd stream in BYTES into SAMPLE, returning the number
+ * of bytes written to it. */
+static size_t
+UnzstdSample(unsigned char const *bytes, size_t n_bytes,
+			 unsigned char *sample, size_t max_size)
+{
+	if (!DecompressorLoad(&s_zstd))
+		return 0;
+
+	ZstdInitDStreamFunc init_dstream = (ZstdInitDStreamFunc)s_zstd.functions[1];
+	ZstdDecompressStreamFunc decompress_stream = (ZstdDecompressStreamFunc)s_zstd.functions[2];
+	ZstdIsErrorFunc is_error = (ZstdIsErrorFunc)s_zstd.functions[4];
+
+	void *stream = ZstdStreamTake();
+	if (stream == NULL)
+		return 0;
+
+	ZstdInBuffer in = { bytes, n_bytes, 0 };
+	ZstdOutBuffer out = { sample, max_size, 0 };
+
+	/* Initializing the stream also resets what an earlier sample left in
+	 * it. */
+	if (!is_error(init_dstream(stream))) {
+		/* Zero means that a frame has ended, which, as with gzip, is as
+		 * far as we go. */
+		while (out.pos < out.size && in.pos < in.size) {
+			size_t result = decompress_stream(stream, &out, &in);
+			if (is_error(result) || result == 0)
+				break;
+		}
+	}
+
+	ZstdStreamGive(stream);
+
+	return out.pos;
+}
+
+/* The bytes that gzip and zstd streams begin with. */
+static unsigned char const gzip_magic[] = { 0x1f, 0x8b, 0x08 };
+static unsigned char const zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+/* Checks if the N_BYTES of BYTES begin with the N_MAGIC bytes of MAGIC. */
+static BOOL
+HasMagic(unsigned char const *bytes, size_t n_bytes,
+		 unsigned char const *magic, size_t n_magic)
+{
+	return n_bytes >= n_magic && memcmp(bytes, magic, n_magic) == 0;
+}
+
+/* Checks if the N_BYTES of BYTES begin a gzip or zstd stream. */
+BOOL
+DecompressIsCompressed(unsigned char const *bytes, size_t n_bytes)
+{
+	return HasMagic(bytes, n_bytes, gzip_magic, sizeof(gzip_magic)) ||
+		HasMagic(bytes, n_bytes, zstd_magic, sizeof(zstd_magic));
+}
+
+/* If BYTES begins a gzip or zstd stream, decompresses at most MAX_SIZE
+ * bytes of it into a sample in the scratch arena of the calling thread,
+ * which is returned and must be freed with DecompressFree(), and stores
+ * its size in N_SAMPLE.  Returns NULL if BYTES isnt compressed, if the
+ * decompressor is missing or if nothing could be decompressed. */
+unsigned char *
+DecompressSample(unsigned char const *bytes, size_t n_bytes,
+				 size_t max_size, size_t *n_sample)
+{
+	if (!DecompressIsCompressed(bytes, n_bytes))
+		return NULL;
+	BOOL is_gzip = HasMagic(bytes, n_bytes, gzip_magic, sizeof(gzip_magic));
+
+	unsigned char *sample = (unsigned char *)ArenaAlloc(max_size);
+	if (sample == NULL)
+		return NULL;
+
+	*n_sample = is_gzip ?
+		GunzipSample(bytes, n_bytes, sample, max_size) :
+		UnzstdSample(bytes, n_bytes, sample, max_size);
+	if (*n_sample == 0) {
+		DecompressFree(sample);
+		return NULL;
+	}
+
+	return sample;
+}
+
+void
+DecompressFree(unsigned char *sample)
+{
+	ArenaFree(sample);
+}
+
+/* Unloads the decompressors that have been loaded, along with the zstd
+ * streams kept for reuse. */
+void
+DecompressUnload(void)
+{
+	if (s_zstd.dll != NULL)
+		ZstdStreamsFree();
+
+	DecompressorUnload(&s_zlib);
+	DecompressorUnload(&s_zstd);
+}
@@ -0,0 +1,5 @@
+BOOL DecompressIsCompressed(unsigned char const *bytes, size_t n_bytes);
+unsigned char *DecompressSample(unsigned char const *bytes, size_t n_bytes,
+								size_t max_size, size_t *n_sample);
+void DecompressFree(unsigned char *sample);
+void DecompressUnload(void);
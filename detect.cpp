@@ -0,0 +1,605 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "file-mapping.h"
+#include "decompress.h"
+#include "fingerprint.h"
+#include "scripts.h"
+#include "detect.h"
+#include "settings.h"
+#include "shared-cache.h"
+#include "stats.h"
+#include "work-pool.h"
+
+#include <psapi.h>
+#include <strsafe.h>
+
+/* The maximum number of files that may be waiting to be detected in the
+ * background. */
+#define DETECT_MAX_QUEUED	1024
+
+/* The number of times that detection has been aborted, so that a
+ * detection can tell if it was aborted while it ran, even if
+ * G_GET_VALUE_ABORTED has been reset since. */
+static LONG volatile s_n_aborts;
+
+/* Aborts the detections in progress on the threads that
+ * EncodingAbortable() has marked: those of ContentGetValue() and the
+ * workers detecting what it queued, but not those of batches. */
+void
+DetectAbort(void)
+{
+	g_get_value_aborted = TRUE;
+	InterlockedIncrement(&s_n_aborts);
+}
+
+/* Determines if the detection on the calling thread, which began when
+ * S_N_ABORTS was N_ABORTS, has been aborted since. */
+static BOOL
+DetectAborted(LONG n_aborts)
+{
+	BOOL volatile const *aborted = EncodingAbortFlag();
+
+	return aborted == &g_get_value_aborted && (*aborted || s_n_aborts != n_aborts);
+}
+
+/* Gets the number of bytes at the beginning of a file that detection
+ * looks at, where 0 means all of them. */
+size_t
+DetectScanSize(void)
+{
+	return g_settings.sampling == SettingsSamplingWhole ? 0 : g_settings.scan_budget;
+}
+
+/* Detects the ENCODING and LINE_ENDING of the N_BYTES of BYTES, which
+ * should be no more than DetectScanSize() of them.  Returns
+ * TCFieldStatusFieldEmpty without setting either if detection was aborted
+ * half-way through, as its results cant be trusted then. */
+TCFieldTypeOrStatus
+DetectBytes(unsigned char const *bytes, size_t n_bytes, Encoding const **encoding,
+			LineEnding *line_ending)
+{
+	LONG n_aborts = s_n_aborts;
+
+	/* The encoding of compressed bytes is that of their contents, so detect
+	 * it on as much of them as we would otherwise have looked at.  They
+	 * are never decompressed whole, though. */
+	StatsTime start = StatsStart();
+	size_t n_sample;
+	unsigned char *sample = DecompressSample(bytes, n_bytes, g_settings.scan_budget, &n_sample);
+	if (sample != NULL) {
+		StatsStop(StatsStageDecompress, start);
+		bytes = sample;
+		n_bytes = n_sample;
+	}
+
+	start = StatsStart();
+	Encoding const *found = EncodingFind(bytes, n_bytes);
+	StatsStop(StatsStageDetect, start);
+
+	start = StatsStart();
+	LineEnding found_line_ending = EncodingLineEndings(found, bytes, n_bytes);
+	StatsStop(StatsStageLineEndings, start);
+
+	StatsCount(StatsCounterBytesScanned, (LONGLONG)n_bytes);
+
+	if (sample != NULL)
+		DecompressFree(sample);
+
+	if (DetectAborted(n_aborts))
+		return TCFieldStatusFieldEmpty;
+
+	*encoding = found;
+	*line_ending = found_line_ending;
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Maps or reads the bytes of FILENAME that detection looks at into
+ * MAPPING, as the settings say. */
+static TCFieldTypeOrStatus
+DetectOpen(char const *filename, FileMapping *mapping)
+{
+	size_t scan_size = DetectScanSize();
+
+	return g_settings.io == SettingsIoRead ?
+		ReadFileHead(filename, mapping, scan_size) :
+		MapFile(filename, mapping, scan_size);
+}
+
+/* Gets how many of the N_BYTES of BYTES detection looks at when it finds
+ * them to be in ENCODING: all of them if they are compressed, as it is
+ * their contents that are looked at then. */
+static size_t
+DetectExtent(unsigned char const *bytes, size_t n_bytes, Encoding const *encoding)
+{
+	return DecompressIsCompressed(bytes, n_bytes) ? n_bytes : EncodingScanSize(encoding, n_bytes);
+}
+
+/* Gets the fingerprint of the first N_BYTES of BYTES. */
+static ULONGLONG
+DetectFingerprint(unsigned char const *bytes, size_t n_bytes)
+{
+	StatsTime start = StatsStart();
+	ULONGLONG fingerprint = Fingerprint(bytes, n_bytes);
+	StatsStop(StatsStageFingerprint, start);
+
+	return fingerprint;
+}
+
+/* Detects the ENCODING and LINE_ENDING of the bytes of MAPPING as
+ * DetectBytes() does, and takes the FINGERPRINT of those of them that
+ * detection looked at, which for binary files are only the first few
+ * hundred, so that finding them binary still ends there.  If VALIDATE is
+ * set, the three of them hold what was found for the file before, which
+ * is kept if the bytes that were looked at then still have that
+ * fingerprint, rather than being detected again. */
+static TCFieldTypeOrStatus
+DetectMapping(FileMapping const *mapping, Encoding const **encoding, LineEnding *line_ending,
+			  ULONGLONG *fingerprint, BOOL validate)
+{
+	/* Page faults can only be counted for the whole process, which is too
+	 * expensive to do unless someone is looking. */
+	PROCESS_MEMORY_COUNTERS memory;
+	BOOL count_page_faults = StatsWanted() &&
+		GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+	DWORD page_faults = count_page_faults ? memory.PageFaultCount : 0;
+
+	size_t n_hashed = 0;
+	ULONGLONG found = 0;
+	if (validate) {
+		n_hashed = DetectExtent(mapping->bytes, mapping->n_bytes, *encoding);
+		found = DetectFingerprint(mapping->bytes, n_hashed);
+	}
+
+	TCFieldTypeOrStatus status = TCFieldStatusSetSuccess;
+	if (validate && found == *fingerprint) {
+		StatsCount(StatsCounterContentValidations, 1);
+	} else {
+		status = DetectBytes(mapping->bytes, mapping->n_bytes, encoding, line_ending);
+
+		/* The bytes are hashed again only if detection looked at a
+		 * different number of them than were hashed to validate them. */
+		size_t n_looked_at = status == TCFieldStatusSetSuccess ?
+			DetectExtent(mapping->bytes, mapping->n_bytes, *encoding) : n_hashed;
+		if (!validate || n_looked_at != n_hashed)
+			found = DetectFingerprint(mapping->bytes, n_looked_at);
+	}
+	*fingerprint = found;
+
+	if (count_page_faults &&
+		GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory)))
+		StatsCount(StatsCounterPageFaults, memory.PageFaultCount - page_faults);
+
+	return status;
+}
+
+/* Detects the ENCODING and LINE_ENDING of FILENAME, as DetectBytes() does
+ * for the beginning of it, and takes the FINGERPRINT of the bytes that it
+ * looks at in the same go. */
+TCFieldTypeOrStatus
+DetectFile(char const *filename, Encoding const **encoding, LineEnding *line_ending,
+		   ULONGLONG *fingerprint)
+{
+	FileMapping mapping;
+	TCFieldTypeOrStatus status = DetectOpen(filename, &mapping);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+
+	status = DetectMapping(&mapping, encoding, line_ending, fingerprint, FALSE);
+
+	UnmapFile(&mapping);
+
+	return status;
+}
+
+/* Counts the letters of each Script in the beginning of FILENAME, which
+ * has been detected to be in ENCODING, into COUNTS.  The same bytes are
+ * looked at as by DetectFile(). */
+TCFieldTypeOrStatus
+DetectScripts(char const *filename, Encoding const *encoding, ScriptCounts *counts)
+{
+	TextForm form = EncodingTextForm(encoding);
+	if (form == TextFormNone)
+		return TCFieldStatusFieldEmpty;
+
+	LONG n_aborts = s_n_aborts;
+	FileMapping mapping;
+	TCFieldTypeOrStatus status = DetectOpen(filename, &mapping);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+
+	unsigned char const *bytes = mapping.bytes;
+	size_t n_bytes = mapping.n_bytes;
+	size_t n_sample;
+	unsigned char *sample = DecompressSample(bytes, n_bytes, g_settings.scan_budget, &n_sample);
+	if (sample != NULL) {
+		bytes = sample;
+		n_bytes = n_sample;
+	}
+
+	char const *bom = EncodingBOM(encoding);
+	size_t bom_length = strlen(bom);
+	if (n_bytes >= bom_length && memcmp(bytes, bom, bom_length) == 0) {
+		bytes += bom_length;
+		n_bytes -= bom_length;
+	}
+
+	ScriptsCount(bytes, n_bytes, form, counts);
+
+	if (sample != NULL)
+		DecompressFree(sample);
+	UnmapFile(&mapping);
+
+	if (DetectAborted(n_aborts))
+		return TCFieldStatusFieldEmpty;
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Detects FILENAME and publishes the results in the shared cache, unless
+ * they are there already.  When the cache is validated by content, the
+ * results found there for the file are only used once the fingerprint of
+ * what is in it now is found to match, which takes reading the file but
+ * not detecting it again. */
+TCFieldTypeOrStatus
+DetectAndPublish(char const *filename, Encoding const **encoding, LineEnding *line_ending,
+				 ULONGLONG *fingerprint)
+{
+	SharedCacheKey key;
+	BOOL has_key = SharedCacheKeyGet(filename, &key);
+	BOOL by_content = g_settings.cache_validation == SettingsValidationContent;
+	BOOL cached = has_key &&
+		SharedCacheLookup(&key, by_content, encoding, line_ending, fingerprint);
+	if (cached && !by_content)
+		return TCFieldStatusSetSuccess;
+
+	FileMapping mapping;
+	TCFieldTypeOrStatus status = DetectOpen(filename, &mapping);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+
+	status = DetectMapping(&mapping, encoding, line_ending, fingerprint, cached);
+
+	UnmapFile(&mapping);
+
+	/* Publishing validated results too keeps the key of the entry up to
+	 * date with the times of the file. */
+	if (status == TCFieldStatusSetSuccess && has_key)
+		SharedCachePublish(&key, *encoding, *line_ending, *fingerprint);
+
+	return status;
+}
+
+/* A file that has been queued for detection in the background.
+ *
+ * RUNNING is set once a worker has started on it.
+ * DONE is signalled when it is no longer queued or running.
+ * REFERENCES counts the queue and whoever is waiting for DONE. */
+typedef struct _Detection Detection;
+
+struct _Detection
+{
+	Detection *next;
+	char filename[MAX_PATH];
+	BOOL running;
+	HANDLE done;
+	LONG references;
+};
+
+/* The files that are queued or being detected, guarded by
+ * S_DETECTIONS_LOCK, which is always taken before the lock of the pool.
+ * Detections that are done with are kept in S_FREE_DETECTIONS for reuse,
+ * rather than going back to the heap. */
+static CRITICAL_SECTION s_detections_lock;
+static Detection *s_detections;
+static Detection *s_free_detections;
+static BOOL s_detections_started;
+
+/* Starts the workers, unless they have been already.  Must be called with
+ * S_DETECTIONS_LOCK held. */
+static void
+DetectWorkersStart(void)
+{
+	if (!s_detections_started)
+		s_detections_started = WorkPoolStart(g_settings.worker_threads, DETECT_MAX_QUEUED);
+}
+
+/* Finds the detection of FILENAME.  Must be called with
+ * S_DETECTIONS_LOCK held. */
+static Detection *
+DetectionFind(char const *filename)
+{
+	for (Detection *detection = s_detections; detection != NULL; detection = detection->next)
+		if (lstrcmpi(detection->filename, filename) == 0)
+			return detection;
+
+	return NULL;
+}
+
+/* Gets a Detection that isnt in use, reusing one if there is one.  Must be
+ * called with S_DETECTIONS_LOCK held. */
+static Detection *
+DetectionNew(void)
+{
+	Detection *detection = s_free_detections;
+	if (detection != NULL) {
+		s_free_detections = detection->next;
+		ResetEvent(detection->done);
+		return detection;
+	}
+
+	StatsCount(StatsCounterHeapAllocations, 1);
+	detection = (Detection *)HeapAlloc(GetProcessHeap(), 0, sizeof(Detection));
+	if (detection == NULL)
+		return NULL;
+
+	detection->done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (detection->done == NULL) {
+		HeapFree(GetProcessHeap(), 0, detection);
+		return NULL;
+	}
+
+	return detection;
+}
+
+/* Keeps DETECTION for reuse.  Must be called with S_DETECTIONS_LOCK
+ * held. */
+static void
+DetectionFree(Detection *detection)
+{
+	detection->next = s_free_detections;
+	s_free_detections = detection;
+}
+
+/* Drops a reference to DETECTION, freeing it once there are none left.
+ * Must be called with S_DETECTIONS_LOCK held. */
+static void
+DetectionRelease(Detection *detection)
+{
+	if (--detection->references > 0)
+		return;
+
+	DetectionFree(detection);
+}
+
+/* Removes DETECTION from the list of detections, signals that it is done
+ * and drops the reference held by the queue.  Must be called with
+ * S_DETECTIONS_LOCK held. */
+static void
+DetectionFinish(Detection *detection)
+{
+	for (Detection **p = &s_detections; *p != NULL; p = &(*p)->next)
+		if (*p == detection) {
+			*p = detection->next;
+			break;
+		}
+
+	SetEvent(detection->done);
+	DetectionRelease(detection);
+}
+
+/* The WorkFunc that detects files in the background. */
+static void
+DetectionWork(void *closure, BOOL dropped)
+{
+	Detection *detection = (Detection *)closure;
+
+	if (!dropped) {
+		EnterCriticalSection(&s_detections_lock);
+		detection->running = TRUE;
+		LeaveCriticalSection(&s_detections_lock);
+
+		Encoding const *encoding;
+		LineEnding line_ending;
+		ULONGLONG fingerprint;
+		BOOL abortable = EncodingAbortable(TRUE);
+		DetectAndPublish(detection->filename, &encoding, &line_ending, &fingerprint);
+		EncodingAbortable(abortable);
+	}
+
+	EnterCriticalSection(&s_detections_lock);
+	DetectionFinish(detection);
+	LeaveCriticalSection(&s_detections_lock);
+}
+
+/* Prepares for detecting files in the background.  Called when the plugin
+ * is loaded. */
+void
+DetectLaterOpen(void)
+{
+	InitializeCriticalSection(&s_detections_lock);
+}
+
+/* Stops detecting files in the background, dropping the files that are
+ * still queued, and frees the detections kept for reuse.  Called before
+ * the plugin is unloaded, as the workers cant be waited for while it is. */
+void
+DetectLaterClose(void)
+{
+	EnterCriticalSection(&s_detections_lock);
+	BOOL started = s_detections_started;
+	s_detections_started = FALSE;
+	LeaveCriticalSection(&s_detections_lock);
+
+	if (started)
+		WorkPoolStop();
+
+	EnterCriticalSection(&s_detections_lock);
+	while (s_free_detections != NULL) {
+		Detection *detection = s_free_detections;
+		s_free_detections = detection->next;
+		CloseHandle(detection->done);
+		HeapFree(GetProcessHeap(), 0, detection);
+	}
+	LeaveCriticalSection(&s_detections_lock);
+}
+
+/* Queues FILENAME for detection in the background, before the files that
+ * were queued earlier, as it was asked for more recently.  The results end
+ * up in the shared cache. */
+void
+DetectLater(char const *filename)
+{
+	EnterCriticalSection(&s_detections_lock);
+
+	DetectWorkersStart();
+
+	Detection *detection = DetectionFind(filename);
+	if (detection != NULL) {
+		/* Asked for again, so move it to the front of the queue. */
+		if (!detection->running && WorkPoolRemove(DetectionWork, detection) &&
+			!WorkPoolPush(DetectionWork, detection))
+			DetectionFinish(detection);
+	} else if (s_detections_started) {
+		detection = DetectionNew();
+		if (detection != NULL &&
+			SUCCEEDED(StringCbCopy(detection->filename, sizeof(detection->filename), filename))) {
+			detection->running = FALSE;
+			detection->references = 1;
+			detection->next = s_detections;
+			s_detections = detection;
+			if (!WorkPoolPush(DetectionWork, detection))
+				DetectionFinish(detection);
+		} else if (detection != NULL) {
+			DetectionFree(detection);
+		}
+	}
+
+	LeaveCriticalSection(&s_detections_lock);
+}
+
+/* Drops the files that are queued for detection in the background. */
+void
+DetectLaterDrop(void)
+{
+	EnterCriticalSection(&s_detections_lock);
+	BOOL started = s_detections_started;
+	LeaveCriticalSection(&s_detections_lock);
+
+	if (started)
+		WorkPoolDrop(DetectionWork);
+}
+
+/* Gets the ENCODING, LINE_ENDING and FINGERPRINT of FILENAME, like
+ * DetectFile(), but takes over if it is queued for detection in the
+ * background, or waits for it if a worker has already started on it. */
+TCFieldTypeOrStatus
+DetectNow(char const *filename, Encoding const **encoding, LineEnding *line_ending,
+		  ULONGLONG *fingerprint)
+{
+	EnterCriticalSection(&s_detections_lock);
+	Detection *detection = DetectionFind(filename);
+	if (detection != NULL && WorkPoolRemove(DetectionWork, detection)) {
+		DetectionFinish(detection);
+		detection = NULL;
+	} else if (detection != NULL) {
+		detection->references++;
+	}
+	LeaveCriticalSection(&s_detections_lock);
+
+	if (detection != NULL) {
+		WaitForSingleObject(detection->done, INFINITE);
+
+		EnterCriticalSection(&s_detections_lock);
+		DetectionRelease(detection);
+		LeaveCriticalSection(&s_detections_lock);
+	}
+
+	/* If the worker succeeded, this finds its results in the cache. */
+	return DetectAndPublish(filename, encoding, line_ending, fingerprint);
+}
+
+/* A batch of items being detected by the workers along with whoever asked
+ * for it, each calling FUNC with the index of the next item and CLOSURE
+ * until all N_ITEMS of them have been claimed.  N_RUNNING counts the
+ * workers and the asker that havent finished yet, and DONE is signalled
+ * when the last of them does. */
+typedef struct _DetectionBatch DetectionBatch;
+
+struct _DetectionBatch
+{
+	DetectBatchFunc func;
+	void *closure;
+	LONG n_items;
+	LONG volatile next;
+	LONG volatile n_running;
+	HANDLE done;
+};
+
+/* Marks one of the workers or the asker as having finished with BATCH,
+ * signalling it if that was the last of them. */
+static void
+DetectionBatchLeave(DetectionBatch *batch)
+{
+	if (InterlockedDecrement(&batch->n_running) == 0 && batch->done != NULL)
+		SetEvent(batch->done);
+}
+
+/* Detects the items of BATCH that havent been claimed yet. */
+static void
+DetectionBatchRun(DetectionBatch *batch)
+{
+	for (LONG index = InterlockedIncrement(&batch->next) - 1;
+		 index < batch->n_items;
+		 index = InterlockedIncrement(&batch->next) - 1)
+		batch->func((size_t)index, batch->closure);
+}
+
+/* The WorkFunc that helps with a batch. */
+static void
+DetectionBatchWork(void *closure, BOOL dropped)
+{
+	DetectionBatch *batch = (DetectionBatch *)closure;
+
+	if (!dropped)
+		DetectionBatchRun(batch);
+	DetectionBatchLeave(batch);
+}
+
+/* Calls FUNC with CLOSURE for each index below N_ITEMS, on as many of the
+ * workers as are free along with the calling thread, returning once all of
+ * them are done.  Returns FALSE without doing anything if there are more
+ * items than can be counted. */
+BOOL
+DetectBatch(size_t n_items, DetectBatchFunc func, void *closure)
+{
+	if (n_items > MAXLONG)
+		return FALSE;
+
+	DetectionBatch batch = { func, closure, (LONG)n_items, 0, 1, NULL };
+
+	if (n_items > 1)
+		batch.done = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (batch.done != NULL) {
+		EnterCriticalSection(&s_detections_lock);
+		DetectWorkersStart();
+		DWORD n_helpers = min(g_settings.worker_threads, (DWORD)n_items - 1);
+		for (DWORD i = 0; s_detections_started && i < n_helpers; i++) {
+			InterlockedIncrement(&batch.n_running);
+			if (!WorkPoolPush(DetectionBatchWork, &batch))
+				InterlockedDecrement(&batch.n_running);
+		}
+		LeaveCriticalSection(&s_detections_lock);
+	}
+
+	DetectionBatchRun(&batch);
+
+	/* Helpers that the workers havent got round to would find nothing left
+	 * to do, so dont wait for them. */
+	if (batch.done != NULL) {
+		EnterCriticalSection(&s_detections_lock);
+		while (s_detections_started && WorkPoolRemove(DetectionBatchWork, &batch))
+			DetectionBatchLeave(&batch);
+		LeaveCriticalSection(&s_detections_lock);
+	}
+
+	DetectionBatchLeave(&batch);
+	if (batch.done != NULL) {
+		WaitForSingleObject(batch.done, INFINITE);
+		CloseHandle(batch.done);
+	}
+
+	return TRUE;
+}
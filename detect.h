@@ -0,0 +1,22 @@
+size_t DetectScanSize(void);
+TCFieldTypeOrStatus DetectBytes(unsigned char const *bytes, size_t n_bytes,
+								Encoding const **encoding, LineEnding *line_ending);
+TCFieldTypeOrStatus DetectFile(char const *filename, Encoding const **encoding,
+							   LineEnding *line_ending, ULONGLONG *fingerprint);
+TCFieldTypeOrStatus DetectScripts(char const *filename, Encoding const *encoding,
+								  ScriptCounts *counts);
+TCFieldTypeOrStatus DetectAndPublish(char const *filename, Encoding const **encoding,
+									 LineEnding *line_ending, ULONGLONG *fingerprint);
+void DetectAbort(void);
+void DetectLaterOpen(void);
+void DetectLaterClose(void);
+void DetectLater(char const *filename);
+void DetectLaterDrop(void);
+TCFieldTypeOrStatus DetectNow(char const *filename, Encoding const **encoding,
+							  LineEnding *line_ending, ULONGLONG *fingerprint);
+
+/* A function detecting the item at INDEX of a batch described by
+ * CLOSURE. */
+typedef void (*DetectBatchFunc)(size_t index, void *closure);
+
+BOOL DetectBatch(size_t n_items, DetectBatchFunc func, void *closure);
@@ -0,0 +1,514 @@
+/* encoding-bench: measures how often and how fast the plugin detects the
+ * right encoding, next to uchardet and ICU, on a corpus of files whose
+ * encodings are known.
+ *
+ * Usage: encoding-bench CORPUS [BUDGET...]
+ *
+ * CORPUS is a directory with a directory in it for each encoding, named
+ * after it (UTF-8, UTF-16LE, ISO-8859-1, windows-1252, Shift_JIS and so
+ * on), that holds files in that encoding.  Encodings that the plugin
+ * doesnt know count as Unknown, files that are all ASCII as ASCII, and
+ * UTF files as their BOM forms if they begin with one, as the plugin would
+ * have it.
+ *
+ * Each BUDGET is the number of bytes at the beginning of every file that
+ * the detectors are given, as ScanBudget in the settings, where 0 means
+ * all of them.  By default the budgets are 4096, 16384, 65536, 262144 and
+ * 0.
+ *
+ * uchardet is used if uchardet.dll can be loaded and ICU if icu.dll can,
+ * which comes with Windows 10 version 1903 and later.  The files are read
+ * into memory before anything is measured, so the times are those of
+ * detection alone. */
+
+#include "stdafx.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "transcode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strsafe.h>
+
+/* The most budgets and encodings that can be measured. */
+#define BENCH_MAX_BUDGETS	16
+#define BENCH_MAX_ENCODINGS	16
+
+/* The most files read from the corpus, and the largest of them. */
+#define BENCH_MAX_FILES		65536
+#define BENCH_MAX_FILE_SIZE	(64 * 1024 * 1024)
+
+/* Never set, as nothing aborts detection here. */
+BOOL g_get_value_aborted;
+
+/* The functions of uchardet. */
+typedef void *(*UchardetNewFunc)(void);
+typedef int (*UchardetHandleDataFunc)(void *, char const *, size_t);
+typedef void (*UchardetDataEndFunc)(void *);
+typedef void (*UchardetResetFunc)(void *);
+typedef char const *(*UchardetGetCharsetFunc)(void *);
+
+/* The functions of ICUs charset detector. */
+typedef void *(*UcsdetOpenFunc)(int *);
+typedef void (*UcsdetSetTextFunc)(void *, char const *, int, int *);
+typedef void const *(*UcsdetDetectFunc)(void *, int *);
+typedef char const *(*UcsdetGetNameFunc)(void const *, int *);
+
+/* A file of the corpus, whose encoding is the one at index ENCODING. */
+typedef struct _BenchFile BenchFile;
+
+struct _BenchFile
+{
+	unsigned char *bytes;
+	size_t n_bytes;
+	unsigned int encoding;
+};
+
+/* The detectors that can be measured. */
+typedef enum BenchDetectorKind
+{
+	BenchDetectorPlugin,
+	BenchDetectorUchardet,
+	BenchDetectorICU,
+};
+
+/* A detector being measured.
+ *
+ * NAME is what it is called in the report.
+ * DLL_NAME is the file name of the DLL it is loaded from, unless it is the
+ * plugin, and FUNCTION_NAMES the functions needed from it, which are
+ * stored in FUNCTIONS, in the same order, once DLL has been loaded.
+ * STATE is what it keeps between files, once it has been set up. */
+typedef struct _BenchDetector BenchDetector;
+
+#define BENCH_MAX_FUNCTIONS	5
+
+struct _BenchDetector
+{
+	BenchDetectorKind kind;
+	char const *name;
+	char const *dll_name;
+	char const *function_names[BENCH_MAX_FUNCTIONS];
+	FARPROC functions[BENCH_MAX_FUNCTIONS];
+	HMODULE dll;
+	void *state;
+};
+
+static BenchDetector s_detectors[] = {
+	{ BenchDetectorPlugin, "Plugin", NULL, { NULL } },
+	{ BenchDetectorUchardet, "uchardet", "uchardet.dll",
+	  { "uchardet_new", "uchardet_handle_data", "uchardet_data_end",
+		"uchardet_reset", "uchardet_get_charset" } },
+	{ BenchDetectorICU, "ICU", "icu.dll",
+	  { "ucsdet_open", "ucsdet_setText", "ucsdet_detect", "ucsdet_getName" } },
+};
+
+/* What one detector did with one budget.
+ *
+ * CORRECT is the number of files whose encoding it got right, and
+ * TRUE_POSITIVES, FALSE_POSITIVES and FALSE_NEGATIVES break that down by
+ * encoding.  TICKS is the time it took for each file, and BYTES the
+ * number of bytes it was given in all. */
+typedef struct _BenchResult BenchResult;
+
+struct _BenchResult
+{
+	size_t correct;
+	size_t true_positives[BENCH_MAX_ENCODINGS];
+	size_t false_positives[BENCH_MAX_ENCODINGS];
+	size_t false_negatives[BENCH_MAX_ENCODINGS];
+	LONGLONG *ticks;
+	ULONGLONG bytes;
+	double mean;
+	double p99;
+	BOOL pareto;
+};
+
+/* Other names that detectors give some of the encodings, and the names
+ * that the plugin gives them. */
+static char const * const aliases[][2] = {
+	{ "US-ASCII", "ASCII" },
+	{ "ANSI_X3.4-1968", "ASCII" },
+	{ "ISO_8859-1", "ISO-8859-1" },
+	{ "LATIN1", "ISO-8859-1" },
+	{ "WINDOWS-1252", "CP1252" },
+	{ "UTF8", "UTF-8" },
+};
+
+static BenchFile *s_files;
+static size_t s_n_files;
+static unsigned int s_n_encodings;
+static unsigned int s_unknown;
+static unsigned int s_ascii;
+static LONGLONG s_frequency;
+
+/* Gets the index of the Encoding that NAME is the name of for the N_BYTES
+ * of BYTES, or S_UNKNOWN if the plugin doesnt know it. */
+static unsigned int
+BenchEncoding(char const *name, unsigned char const *bytes, size_t n_bytes)
+{
+	for (int i = 0; i < _countof(aliases); i++)
+		if (lstrcmpi(name, aliases[i][0]) == 0)
+			name = aliases[i][1];
+
+	Encoding const *encoding;
+	for (unsigned int i = 0; (encoding = EncodingsGet(i)) != NULL; i++) {
+		char const *iconv_name = EncodingIconvName(encoding);
+		if (lstrcmpi(name, EncodingName(encoding)) != 0 &&
+			(iconv_name == NULL || lstrcmpi(name, iconv_name) != 0))
+			continue;
+
+		/* The forms with and without a BOM go by the same name. */
+		char const *bom = EncodingBOM(encoding);
+		size_t bom_length = strlen(bom);
+		if (bom_length > 0 && (n_bytes < bom_length || memcmp(bytes, bom, bom_length) != 0))
+			continue;
+
+		TextForm form = EncodingTextForm(encoding);
+		if ((form == TextFormSingleByte || (form == TextFormUTF8 && bom_length == 0)) &&
+			TranscodeIsASCII(bytes, n_bytes))
+			return s_ascii;
+
+		return i;
+	}
+
+	return s_unknown;
+}
+
+/* Loads the DLL of DETECTOR and sets it up, returning FALSE if it cant be
+ * used. */
+static BOOL
+BenchDetectorLoad(BenchDetector *detector)
+{
+	if (detector->kind == BenchDetectorPlugin)
+		return TRUE;
+
+	detector->dll = LoadLibrary(detector->dll_name);
+	for (int i = 0; detector->dll != NULL && i < BENCH_MAX_FUNCTIONS; i++) {
+		if (detector->function_names[i] == NULL)
+			break;
+
+		detector->functions[i] = GetProcAddress(detector->dll, detector->function_names[i]);
+		if (detector->functions[i] == NULL) {
+			FreeLibrary(detector->dll);
+			detector->dll = NULL;
+		}
+	}
+	if (detector->dll == NULL)
+		return FALSE;
+
+	if (detector->kind == BenchDetectorUchardet) {
+		detector->state = ((UchardetNewFunc)detector->functions[0])();
+	} else {
+		int error = 0;
+		detector->state = ((UcsdetOpenFunc)detector->functions[0])(&error);
+		if (error > 0)
+			detector->state = NULL;
+	}
+
+	return detector->state != NULL;
+}
+
+/* Has DETECTOR detect the encoding of the N_BYTES of BYTES, returning the
+ * index of the Encoding it says they are in. */
+static unsigned int
+BenchDetect(BenchDetector *detector, unsigned char const *bytes, size_t n_bytes)
+{
+	if (detector->kind == BenchDetectorPlugin)
+		return EncodingIndex(EncodingFind(bytes, n_bytes));
+
+	char const *name = NULL;
+	if (detector->kind == BenchDetectorUchardet) {
+		((UchardetResetFunc)detector->functions[3])(detector->state);
+		((UchardetHandleDataFunc)detector->functions[1])(detector->state, (char const *)bytes,
+														 n_bytes);
+		((UchardetDataEndFunc)detector->functions[2])(detector->state);
+		name = ((UchardetGetCharsetFunc)detector->functions[4])(detector->state);
+	} else {
+		int error = 0;
+		((UcsdetSetTextFunc)detector->functions[1])(detector->state, (char const *)bytes,
+													(int)min(n_bytes, MAXLONG), &error);
+		void const *match = ((UcsdetDetectFunc)detector->functions[2])(detector->state, &error);
+		if (match != NULL && error <= 0)
+			name = ((UcsdetGetNameFunc)detector->functions[3])(match, &error);
+		if (error > 0)
+			name = NULL;
+	}
+
+	return name != NULL ? BenchEncoding(name, bytes, n_bytes) : s_unknown;
+}
+
+/* Reads FILENAME into S_FILES as a file in the encoding named LABEL. */
+static void
+BenchReadFile(char const *filename, char const *label)
+{
+	if (s_n_files == BENCH_MAX_FILES)
+		return;
+
+	HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+							 FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER size;
+	BenchFile *bench_file = &s_files[s_n_files];
+	if (GetFileSizeEx(file, &size) && size.QuadPart > 0 && size.QuadPart <= BENCH_MAX_FILE_SIZE &&
+		(bench_file->bytes = (unsigned char *)HeapAlloc(GetProcessHeap(), 0,
+														(SIZE_T)size.QuadPart)) != NULL) {
+		DWORD n_read;
+		if (ReadFile(file, bench_file->bytes, size.LowPart, &n_read, NULL) &&
+			n_read == size.LowPart) {
+			bench_file->n_bytes = n_read;
+			bench_file->encoding = BenchEncoding(label, bench_file->bytes, n_read);
+			s_n_files++;
+		} else {
+			HeapFree(GetProcessHeap(), 0, bench_file->bytes);
+		}
+	}
+
+	CloseHandle(file);
+}
+
+/* Reads the files in the directories of CORPUS into S_FILES. */
+static void
+BenchReadCorpus(char const *corpus)
+{
+	char pattern[MAX_PATH];
+	if (FAILED(StringCbPrintf(pattern, sizeof(pattern), "%s\\*", corpus)))
+		return;
+
+	WIN32_FIND_DATA data;
+	HANDLE find = FindFirstFile(pattern, &data);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ||
+			lstrcmp(data.cFileName, ".") == 0 || lstrcmp(data.cFileName, "..") == 0)
+			continue;
+
+		char directory[MAX_PATH];
+		char files_pattern[MAX_PATH];
+		if (FAILED(StringCbPrintf(directory, sizeof(directory), "%s\\%s", corpus, data.cFileName)) ||
+			FAILED(StringCbPrintf(files_pattern, sizeof(files_pattern), "%s\\*", directory)))
+			continue;
+
+		WIN32_FIND_DATA file_data;
+		HANDLE files_find = FindFirstFile(files_pattern, &file_data);
+		if (files_find == INVALID_HANDLE_VALUE)
+			continue;
+
+		do {
+			char path[MAX_PATH];
+			if (!(file_data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+				SUCCEEDED(StringCbPrintf(path, sizeof(path), "%s\\%s",
+										 directory, file_data.cFileName)))
+				BenchReadFile(path, data.cFileName);
+		} while (FindNextFile(files_find, &file_data));
+
+		FindClose(files_find);
+	} while (FindNextFile(find, &data));
+
+	FindClose(find);
+}
+
+static int
+CompareLongLong(void const *a, void const *b)
+{
+	LONGLONG x = *(LONGLONG const *)a;
+	LONGLONG y = *(LONGLONG const *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Runs DETECTOR over every file with BUDGET, filling in RESULT. */
+static void
+BenchRun(BenchDetector *detector, size_t budget, BenchResult *result)
+{
+	LONGLONG total = 0;
+
+	for (size_t i = 0; i < s_n_files; i++) {
+		BenchFile const *file = &s_files[i];
+		size_t n_bytes = budget == 0 ? file->n_bytes : min(file->n_bytes, budget);
+
+		LARGE_INTEGER start, stop;
+		QueryPerformanceCounter(&start);
+		unsigned int found = BenchDetect(detector, file->bytes, n_bytes);
+		QueryPerformanceCounter(&stop);
+
+		result->ticks[i] = stop.QuadPart - start.QuadPart;
+		total += result->ticks[i];
+		result->bytes += n_bytes;
+
+		if (found == file->encoding) {
+			result->correct++;
+			result->true_positives[found]++;
+		} else {
+			result->false_positives[found]++;
+			result->false_negatives[file->encoding]++;
+		}
+	}
+
+	qsort(result->ticks, s_n_files, sizeof(*result->ticks), CompareLongLong);
+	result->mean = total * 1000000.0 / s_frequency / s_n_files;
+	result->p99 = result->ticks[min((size_t)(s_n_files * 0.99), s_n_files - 1)] *
+		1000000.0 / s_frequency;
+}
+
+/* Determines if RESULT is as accurate as any other result that is at least
+ * as fast on average, and faster than any that is at least as accurate. */
+static BOOL
+BenchOnParetoFront(BenchResult const *result, BenchResult const (*results)[BENCH_MAX_BUDGETS],
+				   int n_budgets)
+{
+	for (int d = 0; d < _countof(s_detectors); d++) {
+		if (s_detectors[d].kind != BenchDetectorPlugin && s_detectors[d].state == NULL)
+			continue;
+
+		for (int b = 0; b < n_budgets; b++) {
+			BenchResult const *other = &results[d][b];
+			if (other->correct >= result->correct && other->mean <= result->mean &&
+				(other->correct > result->correct || other->mean < result->mean))
+				return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/* Prints RESULT for the detector NAMEd. */
+static void
+BenchPrintResult(char const *name, BenchResult const *result)
+{
+	double seconds = 0;
+	for (size_t i = 0; i < s_n_files; i++)
+		seconds += (double)result->ticks[i] / s_frequency;
+
+	printf("%-12s %9.2f%% %10.1f %10.1f %10.1f %8s\n", name,
+		   100.0 * result->correct / s_n_files,
+		   seconds > 0 ? result->bytes / seconds / (1024 * 1024) : 0.0,
+		   result->mean, result->p99, result->pareto ? "*" : "");
+}
+
+/* Prints the precision and recall of DETECTOR_RESULTS for each encoding
+ * that files are in or that they were said to be in. */
+static void
+BenchPrintEncodings(BenchResult const *detector_results[])
+{
+	printf("\n%-16s", "Encoding");
+	for (int d = 0; d < _countof(s_detectors); d++)
+		if (detector_results[d] != NULL)
+			printf(" %9s %-9s", s_detectors[d].name, "P / R");
+	printf("\n");
+
+	for (unsigned int k = 0; k < s_n_encodings; k++) {
+		BOOL seen = FALSE;
+		for (int d = 0; d < _countof(s_detectors); d++)
+			if (detector_results[d] != NULL &&
+				detector_results[d]->true_positives[k] + detector_results[d]->false_positives[k] +
+				detector_results[d]->false_negatives[k] > 0)
+				seen = TRUE;
+		if (!seen)
+			continue;
+
+		printf("%-16s", EncodingName(EncodingsGet(k)));
+		for (int d = 0; d < _countof(s_detectors); d++) {
+			BenchResult const *result = detector_results[d];
+			if (result == NULL)
+				continue;
+
+			size_t said = result->true_positives[k] + result->false_positives[k];
+			size_t are = result->true_positives[k] + result->false_negatives[k];
+			printf(" %9.1f %-9.1f",
+				   said > 0 ? 100.0 * result->true_positives[k] / said : 0.0,
+				   are > 0 ? 100.0 * result->true_positives[k] / are : 0.0);
+		}
+		printf("\n");
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s CORPUS [BUDGET...]\n", argv[0]);
+		return 2;
+	}
+
+	size_t budgets[BENCH_MAX_BUDGETS] = { 4096, 16384, 65536, 262144, 0 };
+	int n_budgets = 5;
+	if (argc > 2) {
+		n_budgets = min(argc - 2, BENCH_MAX_BUDGETS);
+		for (int b = 0; b < n_budgets; b++)
+			budgets[b] = strtoul(argv[b + 2], NULL, 10);
+	}
+
+	s_n_encodings = EncodingsCount();
+	if (s_n_encodings > BENCH_MAX_ENCODINGS)
+		return 1;
+	for (unsigned int k = 0; k < s_n_encodings; k++) {
+		char const *name = EncodingName(EncodingsGet(k));
+		if (lstrcmp(name, "Unknown") == 0)
+			s_unknown = k;
+		else if (lstrcmp(name, "ASCII") == 0)
+			s_ascii = k;
+	}
+
+	s_files = (BenchFile *)HeapAlloc(GetProcessHeap(), 0, BENCH_MAX_FILES * sizeof(BenchFile));
+	if (s_files == NULL)
+		return 1;
+	BenchReadCorpus(argv[1]);
+	if (s_n_files == 0) {
+		fprintf(stderr, "%s: no files in %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	for (int d = 0; d < _countof(s_detectors); d++)
+		if (!BenchDetectorLoad(&s_detectors[d]))
+			fprintf(stderr, "%s: cant load %s, so it isnt measured\n", argv[0],
+					s_detectors[d].dll_name);
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	s_frequency = frequency.QuadPart;
+
+	static BenchResult results[_countof(s_detectors)][BENCH_MAX_BUDGETS];
+	for (int d = 0; d < _countof(s_detectors); d++) {
+		if (s_detectors[d].kind != BenchDetectorPlugin && s_detectors[d].state == NULL)
+			continue;
+
+		for (int b = 0; b < n_budgets; b++) {
+			results[d][b].ticks = (LONGLONG *)HeapAlloc(GetProcessHeap(), 0,
+														s_n_files * sizeof(LONGLONG));
+			if (results[d][b].ticks == NULL)
+				return 1;
+			BenchRun(&s_detectors[d], budgets[b], &results[d][b]);
+		}
+	}
+
+	for (int d = 0; d < _countof(s_detectors); d++)
+		for (int b = 0; b < n_budgets; b++)
+			if (results[d][b].ticks != NULL)
+				results[d][b].pareto = BenchOnParetoFront(&results[d][b], results, n_budgets);
+
+	printf("%lu files\n", (unsigned long)s_n_files);
+	for (int b = 0; b < n_budgets; b++) {
+		if (budgets[b] == 0)
+			printf("\nBudget: whole files\n");
+		else
+			printf("\nBudget: %lu bytes\n", (unsigned long)budgets[b]);
+
+		printf("%-12s %10s %10s %10s %10s %8s\n",
+			   "Detector", "Accuracy", "MB/s", "Mean (us)", "p99 (us)", "Pareto");
+		BenchResult const *detector_results[_countof(s_detectors)];
+		for (int d = 0; d < _countof(s_detectors); d++) {
+			detector_results[d] = results[d][b].ticks != NULL ? &results[d][b] : NULL;
+			if (detector_results[d] != NULL)
+				BenchPrintResult(s_detectors[d].name, detector_results[d]);
+		}
+
+		BenchPrintEncodings(detector_results);
+	}
+
+	return 0;
+}
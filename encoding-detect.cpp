@@ -0,0 +1,434 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "file-mapping.h"
+#include "line-index.h"
+#include "scripts.h"
+#include "detect.h"
+#include "regions.h"
+#include "search.h"
+#include "transcode.h"
+#include "convertibility.h"
+#include "stats.h"
+#include "encoding-detect.h"
+#include "wdx-encoding.h"
+
+/* The line endings of the interface are those of LineEnding. */
+C_ASSERT(ENCODING_DETECT_LINE_ENDING_UNKNOWN == LineEndingUnknown);
+C_ASSERT(ENCODING_DETECT_LINE_ENDING_LF == LineEndingLF);
+C_ASSERT(ENCODING_DETECT_LINE_ENDING_CRLF == LineEndingCRLF);
+C_ASSERT(ENCODING_DETECT_LINE_ENDING_CR == LineEndingCR);
+C_ASSERT(ENCODING_DETECT_LINE_ENDING_LS == LineEndingLS);
+C_ASSERT(ENCODING_DETECT_LINE_ENDING_NEL == LineEndingNEL);
+
+C_ASSERT(ENCODING_DETECT_MAX_LOST == TRANSCODE_MAX_LOST);
+
+/* The items of a batch and where their results go. */
+typedef struct _EncodingDetectItems EncodingDetectItems;
+
+struct _EncodingDetectItems
+{
+	void const *items;
+	EncodingDetectResult *results;
+	LONG volatile n_detected;
+};
+
+/* The files being searched for a query, laid out as NEEDLES, one for
+ * each encoding, and where what is found in them goes. */
+typedef struct _EncodingDetectSearchItems EncodingDetectSearchItems;
+
+struct _EncodingDetectSearchItems
+{
+	char const * const *filenames;
+	SearchNeedle const *needles;
+	EncodingDetectMatches *matches;
+	LONG volatile n_found;
+};
+
+/* The files being checked for characters that would be lost converting
+ * them to TO, and where what is found goes. */
+typedef struct _EncodingDetectConvertibleItems EncodingDetectConvertibleItems;
+
+struct _EncodingDetectConvertibleItems
+{
+	char const * const *filenames;
+	Encoding const *to;
+	EncodingDetectConvertibility *reports;
+	LONG volatile n_convertible;
+};
+
+/* Stores the outcome STATUS of detecting ENCODING and LINE_ENDING for an
+ * item of ITEMS in RESULT. */
+static void
+EncodingDetectResultSet(EncodingDetectItems *items, EncodingDetectResult *result,
+						TCFieldTypeOrStatus status, Encoding const *encoding,
+						LineEnding line_ending)
+{
+	switch (status) {
+	case TCFieldStatusSetSuccess:
+		result->status = ENCODING_DETECT_OK;
+		result->encoding = (int)EncodingIndex(encoding);
+		result->line_ending = line_ending;
+		InterlockedIncrement(&items->n_detected);
+		return;
+	case TCFieldStatusFieldEmpty:
+		result->status = ENCODING_DETECT_EMPTY;
+		break;
+	default:
+		result->status = ENCODING_DETECT_ERROR;
+		break;
+	}
+
+	result->encoding = -1;
+	result->line_ending = ENCODING_DETECT_LINE_ENDING_UNKNOWN;
+}
+
+/* The DetectBatchFunc for buffers. */
+static void
+EncodingDetectBufferItem(size_t index, void *closure)
+{
+	EncodingDetectItems *items = (EncodingDetectItems *)closure;
+	EncodingDetectBuffer const *buffer = (EncodingDetectBuffer const *)items->items + index;
+
+	size_t n_bytes = buffer->n_bytes;
+	size_t scan_size = DetectScanSize();
+	if (scan_size != 0 && n_bytes > scan_size)
+		n_bytes = scan_size;
+
+	Encoding const *encoding = NULL;
+	LineEnding line_ending = LineEndingUnknown;
+	TCFieldTypeOrStatus status = n_bytes == 0 ? TCFieldStatusFieldEmpty :
+		DetectBytes((unsigned char const *)buffer->bytes, n_bytes, &encoding, &line_ending);
+
+	EncodingDetectResultSet(items, &items->results[index], status, encoding, line_ending);
+}
+
+/* The DetectBatchFunc for files, which go through the shared cache. */
+static void
+EncodingDetectFileItem(size_t index, void *closure)
+{
+	EncodingDetectItems *items = (EncodingDetectItems *)closure;
+	char const *filename = ((char const * const *)items->items)[index];
+
+	Encoding const *encoding = NULL;
+	LineEnding line_ending = LineEndingUnknown;
+	ULONGLONG fingerprint;
+	TCFieldTypeOrStatus status = DetectAndPublish(filename, &encoding, &line_ending, &fingerprint);
+
+	EncodingDetectResultSet(items, &items->results[index], status, encoding, line_ending);
+}
+
+/* The DetectBatchFunc for searching files, in the encodings that they are
+ * found to be in through the shared cache. */
+static void
+EncodingDetectSearchItem(size_t index, void *closure)
+{
+	EncodingDetectSearchItems *items = (EncodingDetectSearchItems *)closure;
+	EncodingDetectMatches *matches = &items->matches[index];
+
+	Encoding const *encoding = NULL;
+	LineEnding line_ending;
+	ULONGLONG fingerprint;
+	SearchResult result;
+	TCFieldTypeOrStatus status = DetectAndPublish(items->filenames[index], &encoding, &line_ending,
+												  &fingerprint);
+	if (status == TCFieldStatusSetSuccess)
+		status = SearchFile(items->filenames[index], encoding,
+							&items->needles[EncodingIndex(encoding)], &result);
+
+	matches->encoding = encoding != NULL ? (int)EncodingIndex(encoding) : -1;
+	matches->n_matches = 0;
+	matches->first_match = ENCODING_DETECT_NO_MATCH;
+	switch (status) {
+	case TCFieldStatusSetSuccess:
+		matches->status = ENCODING_DETECT_OK;
+		if (result.n_matches > 0) {
+			matches->n_matches = result.n_matches;
+			matches->first_match = result.first_match;
+			InterlockedIncrement(&items->n_found);
+		}
+		break;
+	case TCFieldStatusFieldEmpty:
+		matches->status = ENCODING_DETECT_EMPTY;
+		break;
+	default:
+		matches->status = ENCODING_DETECT_ERROR;
+		break;
+	}
+}
+
+/* The DetectBatchFunc for checking files for characters that would be
+ * lost converting them. */
+static void
+EncodingDetectConvertibleItem(size_t index, void *closure)
+{
+	EncodingDetectConvertibleItems *items = (EncodingDetectConvertibleItems *)closure;
+	EncodingDetectConvertibility *report = &items->reports[index];
+
+	Encoding const *encoding = NULL;
+	LineEnding line_ending;
+	ULONGLONG fingerprint;
+	TranscodeCheck check;
+	TCFieldTypeOrStatus status = DetectAndPublish(items->filenames[index], &encoding, &line_ending,
+												  &fingerprint);
+	if (status == TCFieldStatusSetSuccess)
+		status = ConvertibilityCheckFile(items->filenames[index], encoding, items->to, &check);
+
+	ZeroMemory(report, sizeof(*report));
+	report->encoding = encoding != NULL ? (int)EncodingIndex(encoding) : -1;
+	switch (status) {
+	case TCFieldStatusSetSuccess:
+		report->status = ENCODING_DETECT_OK;
+		report->size = check.size;
+		report->n_lost = check.n_lost;
+		CopyMemory(report->lost, check.lost,
+				   (size_t)min(check.n_lost, (ULONGLONG)TRANSCODE_MAX_LOST) * sizeof(ULONGLONG));
+		if (check.n_lost == 0)
+			InterlockedIncrement(&items->n_convertible);
+		break;
+	case TCFieldStatusFieldEmpty:
+		report->status = ENCODING_DETECT_EMPTY;
+		break;
+	default:
+		report->status = ENCODING_DETECT_ERROR;
+		break;
+	}
+}
+
+/* Detects the encodings and line endings of the N_BUFFERS BUFFERS, storing
+ * them in the matching RESULTS, on the background workers as well as the
+ * calling thread.  Returns the number of buffers that were detected. */
+size_t ENCODING_DETECT_API
+EncodingDetectBatch(EncodingDetectBuffer const *buffers, size_t n_buffers,
+					EncodingDetectResult *results)
+{
+	PluginOpen();
+
+	EncodingDetectItems items = { buffers, results, 0 };
+
+	if (!DetectBatch(n_buffers, EncodingDetectBufferItem, &items))
+		return 0;
+
+	return (size_t)items.n_detected;
+}
+
+/* Detects the encodings and line endings of the N_FILENAMES files named by
+ * FILENAMES like EncodingDetectBatch() does, using and filling in the
+ * shared detection cache. */
+size_t ENCODING_DETECT_API
+EncodingDetectFiles(char const * const *filenames, size_t n_filenames,
+					EncodingDetectResult *results)
+{
+	PluginOpen();
+
+	EncodingDetectItems items = { filenames, results, 0 };
+
+	if (!DetectBatch(n_filenames, EncodingDetectFileItem, &items))
+		return 0;
+
+	return (size_t)items.n_detected;
+}
+
+/* Gets the name of the encoding at index ENCODING, or NULL if there is
+ * none. */
+char const * ENCODING_DETECT_API
+EncodingDetectName(int encoding)
+{
+	if (encoding < 0)
+		return NULL;
+
+	Encoding const *found = EncodingsGet((unsigned int)encoding);
+
+	return found != NULL ? EncodingName(found) : NULL;
+}
+
+/* Splits FILENAME into the regions that are each in an encoding of their
+ * own, as files pieced together from text in different encodings are,
+ * storing the first MAX_REGIONS of them in REGIONS.  Returns the number of
+ * regions that there are, which may be more than MAX_REGIONS, or 0 if the
+ * file couldnt be split. */
+size_t ENCODING_DETECT_API
+EncodingDetectRegions(char const *filename, EncodingDetectRegion *regions,
+					  size_t max_regions)
+{
+	PluginOpen();
+
+	Encoding const *encoding;
+	LineEnding line_ending;
+	ULONGLONG fingerprint;
+	if (DetectAndPublish(filename, &encoding, &line_ending, &fingerprint) != TCFieldStatusSetSuccess)
+		return 0;
+
+	RegionMap map;
+	if (RegionsFind(filename, encoding, &map) != TCFieldStatusSetSuccess)
+		return 0;
+
+	for (size_t i = 0; i < map.n_regions && i < max_regions; i++) {
+		regions[i].offset = map.regions[i].offset;
+		regions[i].length = map.regions[i].length;
+		regions[i].encoding = (int)EncodingIndex(map.regions[i].encoding);
+	}
+
+	size_t n_regions = map.n_regions;
+	RegionsFree(&map);
+
+	return n_regions;
+}
+
+/* Indexes the lines of FILENAME into a file next to it, so that
+ * EncodingDetectLineOffset() can find any of them without reading all the
+ * lines before it.  Returns the number of lines in the file, or 0 if it
+ * couldnt be indexed. */
+unsigned long long ENCODING_DETECT_API
+EncodingDetectIndexLines(char const *filename)
+{
+	PluginOpen();
+
+	Encoding const *encoding;
+	LineEnding line_ending;
+	ULONGLONG fingerprint;
+	if (DetectAndPublish(filename, &encoding, &line_ending, &fingerprint) != TCFieldStatusSetSuccess)
+		return 0;
+
+	ULONGLONG n_lines;
+	if (LineIndexBuild(filename, encoding, line_ending, &n_lines) != TCFieldStatusSetSuccess)
+		return 0;
+
+	return n_lines;
+}
+
+/* Stores the offset at which line LINE, counting from 0, of FILENAME
+ * begins in OFFSET, using the index made by EncodingDetectIndexLines().
+ * Returns ENCODING_DETECT_EMPTY if there is no such line or no index of
+ * this version of the file. */
+int ENCODING_DETECT_API
+EncodingDetectLineOffset(char const *filename, unsigned long long line,
+						 unsigned long long *offset)
+{
+	PluginOpen();
+
+	LineIndex index;
+	TCFieldTypeOrStatus status = LineIndexOpen(filename, &index);
+	if (status == TCFieldStatusSetSuccess) {
+		ULONGLONG found;
+		status = LineIndexFind(&index, filename, line, &found);
+		LineIndexClose(&index);
+		if (status == TCFieldStatusSetSuccess)
+			*offset = found;
+	}
+
+	switch (status) {
+	case TCFieldStatusSetSuccess:
+		return ENCODING_DETECT_OK;
+	case TCFieldStatusFieldEmpty:
+		return ENCODING_DETECT_EMPTY;
+	default:
+		return ENCODING_DETECT_ERROR;
+	}
+}
+
+/* Searches the N_FILENAMES files named by FILENAMES for the UTF-8 QUERY,
+ * storing what is found in each in the matching MATCHES, on the background
+ * workers as well as the calling thread.  Each file is searched in the
+ * encoding it is found to be in, through the shared detection cache, for
+ * the query as it is laid out in that encoding, so that none of them need
+ * transcoding.  Returns the number of files that the query was found in,
+ * or 0 if it isnt valid UTF-8 or is too long. */
+size_t ENCODING_DETECT_API
+EncodingDetectSearch(char const *query, char const * const *filenames, size_t n_filenames,
+					 EncodingDetectMatches *matches)
+{
+	PluginOpen();
+
+	unsigned int n_encodings = EncodingsCount();
+	StatsCount(StatsCounterHeapAllocations, 1);
+	SearchNeedle *needles = (SearchNeedle *)HeapAlloc(GetProcessHeap(), 0,
+													  n_encodings * sizeof(SearchNeedle));
+	if (needles == NULL)
+		return 0;
+
+	for (unsigned int i = 0; i < n_encodings; i++)
+		SearchNeedleInit(&needles[i], EncodingsGet(i), query, lstrlen(query));
+
+	EncodingDetectSearchItems items = { filenames, needles, matches, 0 };
+	if (needles[EncodingIndex(EncodingNamed("UTF-8"))].length != 0) {
+		DetectBatch(n_filenames, EncodingDetectSearchItem, &items);
+	} else {
+		for (size_t i = 0; i < n_filenames; i++) {
+			matches[i].status = ENCODING_DETECT_ERROR;
+			matches[i].encoding = -1;
+			matches[i].n_matches = 0;
+			matches[i].first_match = ENCODING_DETECT_NO_MATCH;
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, needles);
+
+	return (size_t)items.n_found;
+}
+
+/* Checks the N_FILENAMES files named by FILENAMES for characters that
+ * would be lost converting them to the encoding at index ENCODING, the way
+ * the plugin converts them, without writing anything, storing what is
+ * found in the matching REPORTS, on the background workers as well as the
+ * calling thread.  Returns the number of files that can be converted
+ * without losing anything. */
+size_t ENCODING_DETECT_API
+EncodingDetectConvertible(char const * const *filenames, size_t n_filenames, int encoding,
+						  EncodingDetectConvertibility *reports)
+{
+	PluginOpen();
+
+	Encoding const *to = encoding >= 0 ? EncodingsGet((unsigned int)encoding) : NULL;
+	if (to == NULL || EncodingIsBinary(to)) {
+		for (size_t i = 0; i < n_filenames; i++) {
+			ZeroMemory(&reports[i], sizeof(reports[i]));
+			reports[i].status = ENCODING_DETECT_ERROR;
+			reports[i].encoding = -1;
+		}
+		return 0;
+	}
+
+	EncodingDetectConvertibleItems items = { filenames, to, reports, 0 };
+	if (!DetectBatch(n_filenames, EncodingDetectConvertibleItem, &items))
+		return 0;
+
+	return (size_t)items.n_convertible;
+}
+
+/* Stores the fingerprint of FILENAME in FINGERPRINT: the XXH64 hash of the
+ * bytes of it that detection looks at, which are all of them if the
+ * settings say to sample whole files and it is text, and only the first
+ * few hundred if it is binary.  It is taken along with detecting
+ * the file and kept in the shared cache, so that files that have been
+ * detected neednt be read again for it. */
+int ENCODING_DETECT_API
+EncodingDetectFingerprint(char const *filename, unsigned long long *fingerprint)
+{
+	PluginOpen();
+
+	Encoding const *encoding;
+	LineEnding line_ending;
+	ULONGLONG found;
+	switch (DetectAndPublish(filename, &encoding, &line_ending, &found)) {
+	case TCFieldStatusSetSuccess:
+		*fingerprint = found;
+		return ENCODING_DETECT_OK;
+	case TCFieldStatusFieldEmpty:
+		return ENCODING_DETECT_EMPTY;
+	default:
+		return ENCODING_DETECT_ERROR;
+	}
+}
+
+/* Stops the workers that the functions above run on along with the calling
+ * thread, waiting for those that are busy, and frees what they keep.
+ * Programs that use them call this before unloading the plugin, as the
+ * workers hold it loaded until then.  They are started again if the
+ * functions are called after it. */
+void ENCODING_DETECT_API
+EncodingDetectClose(void)
+{
+	PluginStop();
+}
@@ -0,0 +1,149 @@
+/* The C interface for detecting the encodings and line endings of many
+ * buffers or files in one call, for programs that link against the plugin
+ * directly rather than going through Total Commander.  It only depends on
+ * the C library, so that it can be included on its own. */
+#ifndef ENCODING_DETECT_H
+#define ENCODING_DETECT_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ENCODING_DETECT_API	__stdcall
+
+/* The outcomes of detecting an item. */
+#define ENCODING_DETECT_OK		0	/* ENCODING and LINE_ENDING are set. */
+#define ENCODING_DETECT_EMPTY	1	/* There was nothing to detect. */
+#define ENCODING_DETECT_ERROR	2	/* The file couldnt be read. */
+
+/* The line endings an item may use. */
+#define ENCODING_DETECT_LINE_ENDING_UNKNOWN	0
+#define ENCODING_DETECT_LINE_ENDING_LF		1
+#define ENCODING_DETECT_LINE_ENDING_CRLF	2
+#define ENCODING_DETECT_LINE_ENDING_CR		3
+#define ENCODING_DETECT_LINE_ENDING_LS		4
+#define ENCODING_DETECT_LINE_ENDING_NEL		5
+
+/* N_BYTES of BYTES to detect.  Only as much of them as the plugin is set
+ * up to look at of a file is looked at. */
+typedef struct _EncodingDetectBuffer EncodingDetectBuffer;
+
+struct _EncodingDetectBuffer
+{
+	void const *bytes;
+	size_t n_bytes;
+};
+
+/* What was detected for an item.
+ *
+ * STATUS is one of the ENCODING_DETECT_ outcomes.
+ * ENCODING is the index of the encoding, whose name EncodingDetectName()
+ * gets.
+ * LINE_ENDING is one of the ENCODING_DETECT_LINE_ENDING_ values. */
+typedef struct _EncodingDetectResult EncodingDetectResult;
+
+struct _EncodingDetectResult
+{
+	int status;
+	int encoding;
+	int line_ending;
+};
+
+/* A stretch of LENGTH bytes of a file, beginning OFFSET bytes into it,
+ * that is in the encoding at index ENCODING. */
+typedef struct _EncodingDetectRegion EncodingDetectRegion;
+
+struct _EncodingDetectRegion
+{
+	unsigned long long offset;
+	unsigned long long length;
+	int encoding;
+};
+
+/* What searching a file for a query found.
+ *
+ * STATUS is one of the ENCODING_DETECT_ outcomes.
+ * ENCODING is the index of the encoding that the file was found to be in,
+ * and that the query was looked for in.
+ * N_MATCHES is the number of times the query was found, not counting those
+ * overlapping the ones before them, and FIRST_MATCH is the offset of the
+ * first, or ENCODING_DETECT_NO_MATCH if there is none. */
+typedef struct _EncodingDetectMatches EncodingDetectMatches;
+
+struct _EncodingDetectMatches
+{
+	int status;
+	int encoding;
+	unsigned long long n_matches;
+	unsigned long long first_match;
+};
+
+#define ENCODING_DETECT_NO_MATCH	((unsigned long long)-1)
+
+/* The most offsets of characters that would be lost that are reported. */
+#define ENCODING_DETECT_MAX_LOST	16
+
+/* What checking whether a file can be converted to an encoding without
+ * losing any of its characters found.
+ *
+ * STATUS is one of the ENCODING_DETECT_ outcomes, ENCODING_DETECT_EMPTY
+ * meaning that there is no telling for the encodings.
+ * ENCODING is the index of the encoding that the file was found to be in.
+ * SIZE is the exact size that the file would have once converted, provided
+ * that its line endings are left alone.
+ * N_LOST is the number of characters that would be lost, the offsets of
+ * the first ENCODING_DETECT_MAX_LOST of which are in LOST. */
+typedef struct _EncodingDetectConvertibility EncodingDetectConvertibility;
+
+struct _EncodingDetectConvertibility
+{
+	int status;
+	int encoding;
+	unsigned long long size;
+	unsigned long long n_lost;
+	unsigned long long lost[ENCODING_DETECT_MAX_LOST];
+};
+
+size_t ENCODING_DETECT_API
+EncodingDetectBatch(EncodingDetectBuffer const *buffers, size_t n_buffers,
+					EncodingDetectResult *results);
+
+size_t ENCODING_DETECT_API
+EncodingDetectFiles(char const * const *filenames, size_t n_filenames,
+					EncodingDetectResult *results);
+
+char const * ENCODING_DETECT_API
+EncodingDetectName(int encoding);
+
+size_t ENCODING_DETECT_API
+EncodingDetectRegions(char const *filename, EncodingDetectRegion *regions,
+					  size_t max_regions);
+
+unsigned long long ENCODING_DETECT_API
+EncodingDetectIndexLines(char const *filename);
+
+int ENCODING_DETECT_API
+EncodingDetectLineOffset(char const *filename, unsigned long long line,
+						 unsigned long long *offset);
+
+size_t ENCODING_DETECT_API
+EncodingDetectSearch(char const *query, char const * const *filenames, size_t n_filenames,
+					 EncodingDetectMatches *matches);
+
+size_t ENCODING_DETECT_API
+EncodingDetectConvertible(char const * const *filenames, size_t n_filenames, int encoding,
+						  EncodingDetectConvertibility *reports);
+
+int ENCODING_DETECT_API
+EncodingDetectFingerprint(char const *filename, unsigned long long *fingerprint);
+
+void ENCODING_DETECT_API
+EncodingDetectClose(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
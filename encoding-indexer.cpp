@@ -0,0 +1,230 @@
+/* encoding-indexer: keeps the shared detection cache warm, so that the
+ * plugin finds the encodings and line endings of files there instead of
+ * having to read the files when they are first listed.
+ *
+ * Usage: encoding-indexer [INI]
+ *
+ * INI is the settings file to use, by default wdx-encoding.ini next to the
+ * tool.  Every tree listed in Paths in its [Indexer] section is indexed
+ * when the tool starts and then watched for files being created or
+ * written to, which are indexed again.  Trees that cant be watched, such
+ * as those on some network shares, are rescanned every PollInterval
+ * seconds instead.  The tool runs at background priority, so that its
+ * disk access gives way to everyone elses. */
+
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "arena.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "scripts.h"
+#include "detect.h"
+#include "settings.h"
+#include "shared-cache.h"
+
+#include <stdio.h>
+#include <strsafe.h>
+
+/* Lowers the I/O priority as well as the CPU priority of the process, on
+ * Windows Vista and later. */
+#ifndef PROCESS_MODE_BACKGROUND_BEGIN
+#	define PROCESS_MODE_BACKGROUND_BEGIN	0x00100000
+#endif
+
+/* The size of the buffer that changes to a tree are read into. */
+#define CHANGES_BUFFER_SIZE	(64 * 1024)
+
+/* Set when the tool is being stopped, which also makes a detection in
+ * progress give up without its result being published. */
+BOOL g_get_value_aborted;
+
+/* Detects the encoding and line endings of FILENAME and publishes them,
+ * unless they are already known for its current version. */
+static void
+IndexFile(char const *filename)
+{
+	Encoding const *encoding;
+	LineEnding line_ending;
+	ULONGLONG fingerprint;
+	DetectAndPublish(filename, &encoding, &line_ending, &fingerprint);
+}
+
+/* Indexes every file in the tree at DIRECTORY. */
+static void
+IndexTree(char const *directory)
+{
+	char pattern[MAX_PATH];
+	if (FAILED(StringCbPrintf(pattern, sizeof(pattern), "%s\\*", directory)))
+		return;
+
+	WIN32_FIND_DATA data;
+	HANDLE find = FindFirstFile(pattern, &data);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+
+	do {
+		if (lstrcmp(data.cFileName, ".") == 0 || lstrcmp(data.cFileName, "..") == 0)
+			continue;
+
+		char path[MAX_PATH];
+		if (FAILED(StringCbPrintf(path, sizeof(path), "%s\\%s", directory, data.cFileName)))
+			continue;
+
+		/* Junctions are skipped, as they may well lead back up the tree. */
+		if (!(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+			IndexFile(path);
+		else if (!(data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			IndexTree(path);
+	} while (!g_get_value_aborted && FindNextFile(find, &data));
+
+	FindClose(find);
+}
+
+/* Indexes the files below ROOT that CHANGES, as returned by
+ * ReadDirectoryChangesW(), say have been created or written to. */
+static void
+IndexChanges(char const *root, FILE_NOTIFY_INFORMATION const *changes)
+{
+	char previous[MAX_PATH] = "";
+
+	for (FILE_NOTIFY_INFORMATION const *change = changes; ;
+		 change = (FILE_NOTIFY_INFORMATION const *)((BYTE const *)change + change->NextEntryOffset)) {
+		if (change->Action == FILE_ACTION_ADDED ||
+			change->Action == FILE_ACTION_MODIFIED ||
+			change->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+			char name[MAX_PATH];
+			int length = WideCharToMultiByte(CP_ACP, 0, change->FileName,
+											 change->FileNameLength / sizeof(WCHAR),
+											 name, sizeof(name) - 1, NULL, NULL);
+			char path[MAX_PATH];
+			if (length > 0) {
+				name[length] = '\0';
+
+				/* A file being written to is reported several times in a
+				 * row, but only needs to be looked at once. */
+				if (SUCCEEDED(StringCbPrintf(path, sizeof(path), "%s\\%s", root, name)) &&
+					lstrcmpi(path, previous) != 0) {
+					IndexFile(path);
+					StringCbCopy(previous, sizeof(previous), path);
+				}
+			}
+		}
+
+		if (change->NextEntryOffset == 0 || g_get_value_aborted)
+			break;
+	}
+}
+
+/* Indexes the tree at ROOT and keeps it indexed, until the tool is
+ * stopped.  Runs in a thread of its own for each tree. */
+static DWORD WINAPI
+WatchTree(LPVOID closure)
+{
+	char const *root = (char const *)closure;
+
+	IndexTree(root);
+
+	HANDLE directory = CreateFile(root, FILE_LIST_DIRECTORY,
+								  FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+								  NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+	FILE_NOTIFY_INFORMATION *changes =
+		(FILE_NOTIFY_INFORMATION *)HeapAlloc(GetProcessHeap(), 0, CHANGES_BUFFER_SIZE);
+
+	while (!g_get_value_aborted) {
+		DWORD n_bytes;
+		if (directory == INVALID_HANDLE_VALUE || changes == NULL ||
+			!ReadDirectoryChangesW(directory, changes, CHANGES_BUFFER_SIZE, TRUE,
+								   FILE_NOTIFY_CHANGE_FILE_NAME |
+								   FILE_NOTIFY_CHANGE_SIZE |
+								   FILE_NOTIFY_CHANGE_LAST_WRITE,
+								   &n_bytes, NULL, NULL)) {
+			Sleep(1000 * g_settings.indexer_poll_interval);
+			IndexTree(root);
+		} else if (n_bytes == 0) {
+			/* More changed than fit in the buffer, so we dont know what. */
+			IndexTree(root);
+		} else {
+			IndexChanges(root, changes);
+		}
+	}
+
+	if (changes != NULL)
+		HeapFree(GetProcessHeap(), 0, changes);
+	if (directory != INVALID_HANDLE_VALUE)
+		CloseHandle(directory);
+
+	return 0;
+}
+
+static BOOL WINAPI
+StopIndexing(DWORD type)
+{
+	UNREFERENCED_PARAMETER(type);
+
+	DetectAbort();
+
+	/* Let the default handler end the process. */
+	return FALSE;
+}
+
+int
+main(int argc, char **argv)
+{
+	char filename[MAX_PATH];
+	if (argc > 1) {
+		if (FAILED(StringCbCopy(filename, sizeof(filename), argv[1])))
+			return 2;
+	} else {
+		char module_filename[MAX_PATH];
+		if (GetModuleFileName(NULL, module_filename, sizeof(module_filename)) == 0 ||
+			!SettingsFilenameInDirectoryOf(filename, sizeof(filename), module_filename))
+			return 2;
+	}
+
+	SettingsLoad(filename);
+	ArenaOpen();
+
+	char *roots[MAXIMUM_WAIT_OBJECTS];
+	int n_roots = 0;
+	char *context = NULL;
+	for (char *root = strtok_s(g_settings.indexer_paths, ";", &context);
+		 root != NULL && n_roots < _countof(roots);
+		 root = strtok_s(NULL, ";", &context)) {
+		size_t length = lstrlen(root);
+		while (length > 0 && root[length - 1] == '\\')
+			root[--length] = '\0';
+		if (length > 0)
+			roots[n_roots++] = root;
+	}
+	if (n_roots == 0) {
+		fprintf(stderr, "%s: no Paths to index in the [Indexer] section of %s\n",
+				argv[0], filename);
+		return 2;
+	}
+
+	/* The cache lives for as long as someone has it open, so it outlives
+	 * the hosts of the plugin as long as we run. */
+	if (!SharedCacheOpen() || !SharedCacheIsShared()) {
+		fprintf(stderr, "%s: cant create the shared cache\n", argv[0]);
+		return 1;
+	}
+
+	if (!SetPriorityClass(GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN))
+		SetPriorityClass(GetCurrentProcess(), IDLE_PRIORITY_CLASS);
+
+	SetConsoleCtrlHandler(StopIndexing, TRUE);
+
+	HANDLE threads[MAXIMUM_WAIT_OBJECTS];
+	int n_threads = 0;
+	for (int i = 0; i < n_roots; i++) {
+		threads[n_threads] = CreateThread(NULL, 0, WatchTree, roots[i], 0, NULL);
+		if (threads[n_threads] != NULL)
+			n_threads++;
+	}
+
+	WaitForMultipleObjects(n_threads, threads, TRUE, INFINITE);
+
+	SharedCacheClose();
+
+	return 0;
+}
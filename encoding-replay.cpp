@@ -0,0 +1,482 @@
+/* encoding-replay: plays back a log of the calls that a host made into the
+ * plugin, as kept when [Trace] File is set in its settings, and reports how
+ * long they took then and now.
+ *
+ * Usage: encoding-replay [-fast] [-allocations] LOG PLUGIN [FROM TO]
+ *
+ * LOG is the log and PLUGIN the plugin to play it back into.  The calls of
+ * each thread in the log are made by a thread of their own, at the same
+ * times after the start as they were made, unless -fast is given, in which
+ * case they are made one after the other.  If FROM and TO are given, file
+ * names beginning with FROM have it replaced by TO, so that a copy of the
+ * tree that the log was taken on can be used.  ContentSetValue() calls are
+ * played back too, so point it at a copy.
+ *
+ * With -allocations, the log is played back twice by the same threads, the
+ * first time to warm the plugin and what they keep up, and the heap
+ * allocations that the plugin counted on its request paths the second
+ * time are reported; it exits with 1 unless there were none.  Finding the
+ * regions of files, indexing their lines and converting them allocate what
+ * grows with the size of the file, and so are counted too, whereas
+ * detection and the fields got from it shouldnt allocate at all.
+ * ContentPluginUnloading() calls are left out then, as they free what is
+ * kept for reuse.  encoding-selftest checks detection the same way
+ * without needing a log. */
+
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "stats.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <strsafe.h>
+
+/* The most threads of the host that are played back. */
+#define REPLAY_MAX_THREADS	64
+
+/* The size of the buffer that values are got into. */
+#define REPLAY_VALUE_SIZE	4096
+
+typedef TCFieldTypeOrStatus (__stdcall *GetValueFunc)(char *, int, int, void *, int, TCContentFlag);
+typedef void (__stdcall *StopGetValueFunc)(char *);
+typedef TCFieldTypeOrStatus (__stdcall *SetValueFunc)(char *, int, int, TCFieldTypeOrStatus,
+													   void *, TCContentSetValueFlags);
+typedef void (__stdcall *PluginUnloadingFunc)(void);
+
+static GetValueFunc s_get_value;
+static StopGetValueFunc s_stop_get_value;
+static SetValueFunc s_set_value;
+static PluginUnloadingFunc s_plugin_unloading;
+
+/* The names of the calls, in the order of their enum. */
+static char const * const call_names[] = {
+	"ContentGetValue",
+	"ContentStopGetValue",
+	"ContentSetValue",
+	"ContentPluginUnloading",
+};
+
+/* A call read from the log, with the file name it was about resolved and
+ * mapped.  DURATION is how long it took when it was played back. */
+typedef struct _ReplayCall ReplayCall;
+
+struct _ReplayCall
+{
+	TraceRecord record;
+	char filename[MAX_PATH];
+	LONGLONG duration;
+};
+
+/* The calls made by one thread of the host, which are played back by
+ * THREAD once for each time GO is set, setting DONE when it has. */
+typedef struct _ReplayThread ReplayThread;
+
+struct _ReplayThread
+{
+	DWORD thread_id;
+	ReplayCall **calls;
+	size_t n_calls;
+	HANDLE thread;
+	HANDLE go;
+	HANDLE done;
+};
+
+static ReplayCall *s_calls;
+static size_t s_n_calls;
+static ReplayThread s_threads[REPLAY_MAX_THREADS];
+static int s_n_threads;
+static BOOL s_fast;
+static BOOL s_allocations;
+static int s_n_passes = 1;
+static LONGLONG s_frequency;
+static LONGLONG s_log_frequency;
+static LONGLONG s_origin;
+
+/* Reads the calls in the log in the N_BYTES of BYTES into S_CALLS, mapping
+ * file names that begin with FROM to begin with TO instead. */
+static BOOL
+ReplayRead(unsigned char const *bytes, size_t n_bytes, char const *from, char const *to)
+{
+	TraceHeader header;
+	if (n_bytes < sizeof(header))
+		return FALSE;
+	CopyMemory(&header, bytes, sizeof(header));
+	if (header.magic != TRACE_MAGIC || header.version != TRACE_VERSION)
+		return FALSE;
+	s_log_frequency = header.frequency;
+
+	size_t max_calls = (n_bytes - sizeof(header)) / sizeof(TraceRecord);
+	s_calls = (ReplayCall *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+									  max(max_calls, 1) * sizeof(ReplayCall));
+	if (s_calls == NULL)
+		return FALSE;
+
+	size_t from_length = from != NULL ? strlen(from) : 0;
+	char filename[MAX_PATH] = "";
+	size_t offset = sizeof(header);
+	while (offset + sizeof(TraceRecord) <= n_bytes) {
+		ReplayCall *call = &s_calls[s_n_calls];
+		CopyMemory(&call->record, bytes + offset, sizeof(call->record));
+		offset += sizeof(call->record);
+		if (call->record.call >= TraceCallCount ||
+			call->record.filename_length >= sizeof(filename) ||
+			offset + call->record.filename_length > n_bytes)
+			return FALSE;
+
+		if (!(call->record.flags & TRACE_SAME_FILENAME)) {
+			CopyMemory(filename, bytes + offset, call->record.filename_length);
+			filename[call->record.filename_length] = '\0';
+			offset += call->record.filename_length;
+		}
+
+		if (from_length > 0 && _strnicmp(filename, from, from_length) == 0) {
+			StringCbCopy(call->filename, sizeof(call->filename), to);
+			StringCbCat(call->filename, sizeof(call->filename), filename + from_length);
+		} else {
+			StringCbCopy(call->filename, sizeof(call->filename), filename);
+		}
+
+		s_n_calls++;
+	}
+
+	return TRUE;
+}
+
+/* Sorts the calls in S_CALLS out by the threads that made them. */
+static BOOL
+ReplayAssignThreads(void)
+{
+	for (size_t i = 0; i < s_n_calls; i++) {
+		int t;
+		for (t = 0; t < s_n_threads; t++)
+			if (s_threads[t].thread_id == s_calls[i].record.thread_id)
+				break;
+		if (t == s_n_threads) {
+			if (s_n_threads == REPLAY_MAX_THREADS)
+				return FALSE;
+			s_threads[s_n_threads++].thread_id = s_calls[i].record.thread_id;
+		}
+		s_threads[t].n_calls++;
+	}
+
+	for (int t = 0; t < s_n_threads; t++) {
+		s_threads[t].calls = (ReplayCall **)HeapAlloc(GetProcessHeap(), 0,
+													  s_threads[t].n_calls * sizeof(ReplayCall *));
+		if (s_threads[t].calls == NULL)
+			return FALSE;
+		s_threads[t].n_calls = 0;
+	}
+
+	for (size_t i = 0; i < s_n_calls; i++)
+		for (int t = 0; t < s_n_threads; t++)
+			if (s_threads[t].thread_id == s_calls[i].record.thread_id) {
+				s_threads[t].calls[s_threads[t].n_calls++] = &s_calls[i];
+				break;
+			}
+
+	return TRUE;
+}
+
+static LONGLONG
+ReplayNow(void)
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return now.QuadPart;
+}
+
+/* Makes CALL, timing it. */
+static void
+ReplayMake(ReplayCall *call)
+{
+	TraceRecord const *record = &call->record;
+	char value[REPLAY_VALUE_SIZE];
+	int value_size = min(record->value_size, (int)sizeof(value));
+
+	LONGLONG start = ReplayNow();
+	switch (record->call) {
+	case TraceCallGetValue:
+		s_get_value(call->filename, record->field_index, record->unit_index,
+					value, value_size, (TCContentFlag)record->call_flags);
+		break;
+	case TraceCallStopGetValue:
+		s_stop_get_value(call->filename);
+		break;
+	case TraceCallSetValue:
+		s_set_value(call->filename, record->field_index, record->unit_index,
+					(TCFieldTypeOrStatus)record->value_size, NULL,
+					(TCContentSetValueFlags)record->call_flags);
+		break;
+	case TraceCallPluginUnloading:
+		if (!s_allocations)
+			s_plugin_unloading();
+		break;
+	}
+	call->duration = ReplayNow() - start;
+}
+
+/* Plays back the calls of CLOSURE, a ReplayThread, S_N_PASSES times. */
+static DWORD WINAPI
+ReplayThreadRun(LPVOID closure)
+{
+	ReplayThread *thread = (ReplayThread *)closure;
+
+	for (int pass = 0; pass < s_n_passes; pass++) {
+		WaitForSingleObject(thread->go, INFINITE);
+		for (size_t i = 0; i < thread->n_calls; i++) {
+			ReplayCall *call = thread->calls[i];
+			if (!s_fast) {
+				LONGLONG due = s_origin + call->record.start * s_frequency / s_log_frequency;
+				LONGLONG wait = (due - ReplayNow()) * 1000 / s_frequency;
+				if (wait > 0)
+					Sleep((DWORD)wait);
+			}
+			ReplayMake(call);
+		}
+		SetEvent(thread->done);
+	}
+
+	return 0;
+}
+
+/* Starts the threads that play back the calls, which wait for ReplayPlay()
+ * to have them make them.  Returns FALSE if they cant be started. */
+static BOOL
+ReplayStart(void)
+{
+	/* Played back fast, the calls are made on this thread. */
+	if (s_fast)
+		return TRUE;
+
+	for (int t = 0; t < s_n_threads; t++) {
+		s_threads[t].go = CreateEvent(NULL, FALSE, FALSE, NULL);
+		s_threads[t].done = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (s_threads[t].go == NULL || s_threads[t].done == NULL)
+			return FALSE;
+		s_threads[t].thread = CreateThread(NULL, 0, ReplayThreadRun, &s_threads[t], 0, NULL);
+		if (s_threads[t].thread == NULL)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Plays back all the calls once. */
+static void
+ReplayPlay(void)
+{
+	s_origin = ReplayNow();
+
+	/* Played back fast, the calls are made in the order they were logged,
+	 * on this thread. */
+	if (s_fast) {
+		for (size_t i = 0; i < s_n_calls; i++)
+			ReplayMake(&s_calls[i]);
+		return;
+	}
+
+	HANDLE done[REPLAY_MAX_THREADS];
+	for (int t = 0; t < s_n_threads; t++) {
+		done[t] = s_threads[t].done;
+		SetEvent(s_threads[t].go);
+	}
+	WaitForMultipleObjects(s_n_threads, done, TRUE, INFINITE);
+}
+
+/* Waits for the threads that played back the calls to exit, which they do
+ * after their last pass. */
+static void
+ReplayStop(void)
+{
+	if (s_fast)
+		return;
+
+	HANDLE threads[REPLAY_MAX_THREADS];
+	for (int t = 0; t < s_n_threads; t++)
+		threads[t] = s_threads[t].thread;
+	WaitForMultipleObjects(s_n_threads, threads, TRUE, INFINITE);
+
+	for (int t = 0; t < s_n_threads; t++) {
+		CloseHandle(s_threads[t].thread);
+		CloseHandle(s_threads[t].go);
+		CloseHandle(s_threads[t].done);
+	}
+}
+
+/* Gets the number of heap allocations that the plugin has counted in its
+ * statistics, or -1 if they cant be read. */
+static LONGLONG
+ReplayHeapAllocations(void)
+{
+	char name[64];
+	if (FAILED(StringCbPrintf(name, sizeof(name), STATS_NAME_FORMAT, GetCurrentProcessId())))
+		return -1;
+
+	HANDLE map = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+	if (map == NULL)
+		return -1;
+
+	StatsBlock const *stats = (StatsBlock const *)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+	LONGLONG n_allocations = -1;
+	if (stats != NULL && stats->version == STATS_VERSION && stats->size == sizeof(StatsBlock))
+		n_allocations = stats->counters[StatsCounterHeapAllocations];
+
+	if (stats != NULL)
+		UnmapViewOfFile(stats);
+	CloseHandle(map);
+
+	return n_allocations;
+}
+
+static int
+CompareLongLong(void const *a, void const *b)
+{
+	LONGLONG x = *(LONGLONG const *)a;
+	LONGLONG y = *(LONGLONG const *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Gets the timing at fraction PERCENTILE of the N sorted TIMINGS. */
+static LONGLONG
+Percentile(LONGLONG const *timings, size_t n, double percentile)
+{
+	return timings[min((size_t)(n * percentile), n - 1)];
+}
+
+/* Prints the mean and percentiles of the N TIMINGS, in ticks of
+ * FREQUENCY, of the calls NAMEd. */
+static void
+ReplayPrint(char const *name, LONGLONG *timings, size_t n, LONGLONG frequency)
+{
+	if (n == 0)
+		return;
+
+	LONGLONG total = 0;
+	for (size_t i = 0; i < n; i++)
+		total += timings[i];
+
+	qsort(timings, n, sizeof(*timings), CompareLongLong);
+	double us = 1000000.0 / frequency;
+	printf("%-36s %10lu %12.1f %10.1f %10.1f %10.1f %12.1f\n", name, (unsigned long)n,
+		   (double)total / n * us,
+		   Percentile(timings, n, 0.50) * us, Percentile(timings, n, 0.90) * us,
+		   Percentile(timings, n, 0.99) * us, timings[n - 1] * us);
+}
+
+/* Prints the percentiles of the calls of each kind, as recorded and as
+ * played back. */
+static void
+ReplayReport(void)
+{
+	LONGLONG *timings = (LONGLONG *)HeapAlloc(GetProcessHeap(), 0,
+											  max(s_n_calls, 1) * sizeof(LONGLONG));
+	if (timings == NULL)
+		return;
+
+	printf("%-36s %10s %12s %10s %10s %10s %12s\n",
+		   "Call", "Count", "Mean (us)", "p50 (us)", "p90 (us)", "p99 (us)", "Max (us)");
+	for (int kind = 0; kind < TraceCallCount; kind++) {
+		for (int replayed = 0; replayed < 2; replayed++) {
+			size_t n = 0;
+			for (size_t i = 0; i < s_n_calls; i++)
+				if (s_calls[i].record.call == kind)
+					timings[n++] = replayed ? s_calls[i].duration : s_calls[i].record.duration;
+
+			char name[64];
+			StringCbPrintf(name, sizeof(name), "%s (%s)", call_names[kind],
+						   replayed ? "replayed" : "recorded");
+			ReplayPrint(name, timings, n, replayed ? s_frequency : s_log_frequency);
+		}
+	}
+
+	HeapFree(GetProcessHeap(), 0, timings);
+}
+
+int
+main(int argc, char **argv)
+{
+	int first = 1;
+	for (; first < argc && argv[first][0] == '-'; first++)
+		if (lstrcmpi(argv[first], "-fast") == 0)
+			s_fast = TRUE;
+		else if (lstrcmpi(argv[first], "-allocations") == 0)
+			s_allocations = TRUE;
+		else
+			break;
+
+	if (argc - first != 2 && argc - first != 4) {
+		fprintf(stderr, "Usage: %s [-fast] [-allocations] LOG PLUGIN [FROM TO]\n", argv[0]);
+		return 2;
+	}
+
+	HANDLE file = CreateFile(argv[first], GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+							 FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER size;
+	if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size) || size.HighPart != 0) {
+		fprintf(stderr, "%s: cant open %s\n", argv[0], argv[first]);
+		return 1;
+	}
+
+	HANDLE map = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	unsigned char const *bytes = map != NULL ?
+		(unsigned char const *)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (bytes == NULL ||
+		!ReplayRead(bytes, size.LowPart, argc - first == 4 ? argv[first + 2] : NULL,
+					argc - first == 4 ? argv[first + 3] : NULL) ||
+		!ReplayAssignThreads()) {
+		fprintf(stderr, "%s: %s isnt a log that can be played back\n", argv[0], argv[first]);
+		return 1;
+	}
+
+	HMODULE plugin = LoadLibrary(argv[first + 1]);
+	if (plugin != NULL) {
+		s_get_value = (GetValueFunc)GetProcAddress(plugin, "ContentGetValue");
+		s_stop_get_value = (StopGetValueFunc)GetProcAddress(plugin, "ContentStopGetValue");
+		s_set_value = (SetValueFunc)GetProcAddress(plugin, "ContentSetValue");
+		s_plugin_unloading = (PluginUnloadingFunc)GetProcAddress(plugin, "ContentPluginUnloading");
+	}
+	if (s_get_value == NULL || s_stop_get_value == NULL || s_set_value == NULL ||
+		s_plugin_unloading == NULL) {
+		fprintf(stderr, "%s: %s isnt the plugin\n", argv[0], argv[first + 1]);
+		return 1;
+	}
+
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	s_frequency = frequency.QuadPart;
+
+	if (s_allocations)
+		s_n_passes = 2;
+	if (!ReplayStart()) {
+		fprintf(stderr, "%s: cant start threads\n", argv[0]);
+		return 1;
+	}
+
+	LONGLONG n_allocations = 0;
+	if (s_allocations) {
+		ReplayPlay();
+		n_allocations = ReplayHeapAllocations();
+		if (n_allocations < 0) {
+			fprintf(stderr, "%s: cant read the statistics of %s\n", argv[0], argv[first + 1]);
+			return 1;
+		}
+	}
+
+	ReplayPlay();
+	ReplayStop();
+
+	ReplayReport();
+
+	if (s_allocations) {
+		n_allocations = ReplayHeapAllocations() - n_allocations;
+		printf("\nHeap allocations once warm: %I64d\n", n_allocations);
+		if (n_allocations != 0)
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,600 @@
+/* encoding-selftest: checks what the plugin promises about its steady state
+ * and about converting files, on files that it writes itself, so that
+ * neither a corpus nor a log is needed.
+ *
+ * Usage: encoding-selftest PLUGIN [DIRECTORY]
+ *
+ * PLUGIN is the plugin to check, and DIRECTORY where the files it is
+ * checked on are written, the directory for temporary files by default.
+ * They are deleted afterwards.
+ *
+ * Detecting files and getting the fields that come from detection should
+ * do no heap allocations once the plugin is warm.  Files of each kind are
+ * detected twice on this thread, the second time with other contents and
+ * under other names, so that nothing is found in the caches, and the heap
+ * allocations that the plugin counted the second time must be none.
+ *
+ * Converting a file to an encoding that can hold all of its characters
+ * should lose none of them.  The size that EncodingDetectConvertible()
+ * reports must be that of the converted file, which must hold exactly the
+ * text encoded in the new encoding.  Only conversions that dont need iconv
+ * are made, as those are the ones that the whole-file check proves the
+ * text valid for and then transcode without checking it again, which a
+ * file long enough that detection only looks at the beginning of it
+ * covers too.  Converting a file to an encoding that cant hold all of its
+ * characters must be reported as losing them, and must leave the file
+ * alone.
+ *
+ * What fails is printed, and it exits with 1 if anything did. */
+
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "encoding-detect.h"
+#include "stats.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <strsafe.h>
+
+/* The number of characters in the texts that files are written with, the
+ * long one being longer than detection looks at by default. */
+#define SELFTEST_SHORT_TEXT	3000
+#define SELFTEST_LONG_TEXT	400000
+
+/* The size of the buffer that values are got into. */
+#define SELFTEST_VALUE_SIZE	2048
+
+typedef TCFieldTypeOrStatus (__stdcall *GetSupportedFieldFunc)(int, char *, char *, int);
+typedef TCFieldTypeOrStatus (__stdcall *GetValueFunc)(char *, int, int, void *, int, TCContentFlag);
+typedef TCFieldTypeOrStatus (__stdcall *SetValueFunc)(char *, int, int, TCFieldTypeOrStatus,
+													   void *, TCContentSetValueFlags);
+typedef char const *(ENCODING_DETECT_API *NameFunc)(int);
+typedef size_t (ENCODING_DETECT_API *ConvertibleFunc)(char const * const *, size_t, int,
+													  EncodingDetectConvertibility *);
+typedef void (ENCODING_DETECT_API *CloseFunc)(void);
+
+static GetSupportedFieldFunc s_get_supported_field;
+static GetValueFunc s_get_value;
+static SetValueFunc s_set_value;
+static NameFunc s_name;
+static ConvertibleFunc s_convertible;
+static CloseFunc s_close;
+
+/* How the characters of a text are laid out in bytes. */
+typedef enum SelfTestForm
+{
+	SelfTestFormSingleByte,
+	SelfTestFormUTF8,
+	SelfTestFormUTF16BE,
+	SelfTestFormUTF16LE,
+};
+
+/* An encoding that files are written in and converted to.
+ *
+ * NAME is what the plugin calls it, and INDEX its index in the plugin,
+ * once it has been looked up.
+ * BOM is the byte order mark that files in it begin with, and FORM how
+ * the characters after it are laid out.
+ * MAX_CHAR is the largest character it can hold. */
+typedef struct _SelfTestEncoding SelfTestEncoding;
+
+struct _SelfTestEncoding
+{
+	char const *name;
+	char const *bom;
+	SelfTestForm form;
+	unsigned int max_char;
+	int index;
+};
+
+static SelfTestEncoding s_encodings[] = {
+	{ "ISO-8859", "", SelfTestFormSingleByte, 0xff },
+	{ "UTF-8", "", SelfTestFormUTF8, 0x10ffff },
+	{ "UTF-8 / BOM", "\357\273\277", SelfTestFormUTF8, 0x10ffff },
+	{ "UTF-16BE", "\376\377", SelfTestFormUTF16BE, 0x10ffff },
+	{ "UTF-16LE", "\377\376", SelfTestFormUTF16LE, 0x10ffff },
+};
+
+/* A kind of text that files are written with: N_CHARS characters, none
+ * of them larger than MAX_CHAR. */
+typedef struct _SelfTestText SelfTestText;
+
+struct _SelfTestText
+{
+	char const *name;
+	unsigned int max_char;
+	size_t n_chars;
+};
+
+static SelfTestText const texts[] = {
+	{ "ASCII", 0x7f, SELFTEST_SHORT_TEXT },
+	{ "Latin-1", 0xff, SELFTEST_SHORT_TEXT },
+	{ "Unicode", 0x10ffff, SELFTEST_SHORT_TEXT },
+	{ "long Unicode", 0x10ffff, SELFTEST_LONG_TEXT },
+};
+
+/* Ranges of characters that texts are made up of besides ASCII, for texts
+ * that can hold them. */
+static unsigned int const ranges[][2] = {
+	{ 0x00a1, 0x00ff },
+	{ 0x0391, 0x03c9 },
+	{ 0x0410, 0x044f },
+	{ 0x4e00, 0x9fff },
+	{ 0x1f600, 0x1f64f },
+};
+
+/* The fields that come from detection, which are checked for heap
+ * allocations. */
+static char const * const detection_fields[] = {
+	"Encoding",
+	"Line Endings",
+	"Dominant Script",
+	"Scripts",
+	"Fingerprint",
+};
+
+static char s_directory[MAX_PATH];
+static int s_field_encoding;
+static unsigned int *s_text;
+static unsigned char *s_bytes;
+static unsigned char *s_expected;
+static int s_n_checks;
+static int s_n_failed;
+
+/* Counts a check, printing the FORMATted description of it if it didnt
+ * PASS. */
+static void
+SelfTestCheck(BOOL pass, char const *format, ...)
+{
+	s_n_checks++;
+	if (pass)
+		return;
+
+	s_n_failed++;
+
+	va_list args;
+	va_start(args, format);
+	printf("FAILED: ");
+	vprintf(format, args);
+	printf("\n");
+	va_end(args);
+}
+
+/* Gets the next of the numbers that texts are made up from, which depend
+ * on the number that SEED begins at. */
+static unsigned int
+SelfTestRandom(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+
+	return *seed >> 16;
+}
+
+/* Fills S_TEXT with TEXT, from SEED.  Lines of ASCII words are mixed with
+ * the other characters the text can hold, each of them followed by ASCII,
+ * so that single-byte text is never taken for UTF-8 in places. */
+static void
+SelfTestGenerate(SelfTestText const *text, unsigned int seed)
+{
+	int n_ranges = 0;
+	while (n_ranges < _countof(ranges) && ranges[n_ranges][0] <= text->max_char)
+		n_ranges++;
+
+	size_t i = 0;
+	while (i < text->n_chars) {
+		unsigned int r = SelfTestRandom(&seed);
+		if (i % 64 == 62 && i + 2 <= text->n_chars) {
+			s_text[i++] = '\r';
+			s_text[i++] = '\n';
+		} else if (n_ranges > 0 && r % 4 == 0 && i + 2 <= text->n_chars) {
+			unsigned int const *range = ranges[(r >> 2) % n_ranges];
+			s_text[i++] = range[0] + (r >> 5) % (range[1] - range[0] + 1);
+			s_text[i++] = 'a' + (r >> 8) % 26;
+		} else {
+			s_text[i++] = r % 6 == 0 ? ' ' : 'a' + (r >> 3) % 26;
+		}
+	}
+}
+
+/* Stores the N_CHARS characters of S_TEXT in ENCODING, BOM and all, in
+ * BYTES, or only counts them if it is NULL.  Returns the number of bytes
+ * they take up.  Characters that ENCODING cant hold are stored as '?'. */
+static size_t
+SelfTestEncode(SelfTestEncoding const *encoding, size_t n_chars, unsigned char *bytes)
+{
+	size_t n = strlen(encoding->bom);
+	if (bytes != NULL)
+		CopyMemory(bytes, encoding->bom, n);
+
+	for (size_t i = 0; i < n_chars; i++) {
+		unsigned int c = s_text[i] <= encoding->max_char ? s_text[i] : '?';
+		unsigned char encoded[4];
+		size_t length = 0;
+
+		switch (encoding->form) {
+		case SelfTestFormSingleByte:
+			encoded[length++] = (unsigned char)c;
+			break;
+		case SelfTestFormUTF8:
+			if (c < 0x80) {
+				encoded[length++] = (unsigned char)c;
+			} else if (c < 0x800) {
+				encoded[length++] = (unsigned char)(0xc0 | c >> 6);
+				encoded[length++] = (unsigned char)(0x80 | (c & 0x3f));
+			} else if (c < 0x10000) {
+				encoded[length++] = (unsigned char)(0xe0 | c >> 12);
+				encoded[length++] = (unsigned char)(0x80 | (c >> 6 & 0x3f));
+				encoded[length++] = (unsigned char)(0x80 | (c & 0x3f));
+			} else {
+				encoded[length++] = (unsigned char)(0xf0 | c >> 18);
+				encoded[length++] = (unsigned char)(0x80 | (c >> 12 & 0x3f));
+				encoded[length++] = (unsigned char)(0x80 | (c >> 6 & 0x3f));
+				encoded[length++] = (unsigned char)(0x80 | (c & 0x3f));
+			}
+			break;
+		default: {
+			unsigned int units[2];
+			size_t n_units = 0;
+			if (c < 0x10000) {
+				units[n_units++] = c;
+			} else {
+				units[n_units++] = 0xd800 | (c - 0x10000) >> 10;
+				units[n_units++] = 0xdc00 | ((c - 0x10000) & 0x3ff);
+			}
+			for (size_t j = 0; j < n_units; j++) {
+				unsigned char high = (unsigned char)(units[j] >> 8);
+				unsigned char low = (unsigned char)units[j];
+				encoded[length++] = encoding->form == SelfTestFormUTF16BE ? high : low;
+				encoded[length++] = encoding->form == SelfTestFormUTF16BE ? low : high;
+			}
+			break;
+		}
+		}
+
+		if (bytes != NULL)
+			CopyMemory(bytes + n, encoded, length);
+		n += length;
+	}
+
+	return n;
+}
+
+/* Formats the name of the file that the text at index TEXT is written to
+ * in the encoding at index ENCODING into FILENAME, with TAG telling apart
+ * the files that are written for different checks. */
+static void
+SelfTestFilename(char *filename, size_t size, char const *tag, int text, int encoding)
+{
+	StringCbPrintf(filename, size, "%swdx-encoding-selftest-%lu-%s-%d-%d.txt", s_directory,
+				   GetCurrentProcessId(), tag, text, encoding);
+}
+
+static BOOL
+SelfTestWrite(char const *filename, unsigned char const *bytes, size_t n_bytes)
+{
+	HANDLE file = CreateFile(filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+							 FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return FALSE;
+
+	DWORD n_written;
+	BOOL written = WriteFile(file, bytes, (DWORD)n_bytes, &n_written, NULL) &&
+		n_written == n_bytes;
+	CloseHandle(file);
+
+	return written;
+}
+
+/* Reads at most SIZE bytes of FILENAME into BYTES, returning how many
+ * there were, or -1 if it cant be read or is larger than that. */
+static LONGLONG
+SelfTestRead(char const *filename, unsigned char *bytes, size_t size)
+{
+	HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+							 FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return -1;
+
+	LARGE_INTEGER file_size;
+	DWORD n_read = 0;
+	BOOL read = GetFileSizeEx(file, &file_size) && file_size.QuadPart <= (LONGLONG)size &&
+		ReadFile(file, bytes, file_size.LowPart, &n_read, NULL) && n_read == file_size.LowPart;
+	CloseHandle(file);
+
+	return read ? n_read : -1;
+}
+
+/* Writes the text at index TEXT, from SEED, in the encoding at index
+ * ENCODING to the file for TAG, storing its name in FILENAME and the
+ * number of bytes of it in N_BYTES. */
+static BOOL
+SelfTestWriteText(char *filename, size_t size, char const *tag, int text, int encoding,
+				  unsigned int seed, size_t *n_bytes)
+{
+	SelfTestFilename(filename, size, tag, text, encoding);
+	SelfTestGenerate(&texts[text], seed);
+	*n_bytes = SelfTestEncode(&s_encodings[encoding], texts[text].n_chars, s_bytes);
+
+	BOOL written = SelfTestWrite(filename, s_bytes, *n_bytes);
+	SelfTestCheck(written, "cant write %s", filename);
+
+	return written;
+}
+
+/* Gets the number of heap allocations that the plugin has counted in its
+ * statistics, or -1 if they cant be read. */
+static LONGLONG
+SelfTestHeapAllocations(void)
+{
+	char name[64];
+	if (FAILED(StringCbPrintf(name, sizeof(name), STATS_NAME_FORMAT, GetCurrentProcessId())))
+		return -1;
+
+	HANDLE map = OpenFileMapping(FILE_MAP_READ, FALSE, name);
+	if (map == NULL)
+		return -1;
+
+	StatsBlock const *stats = (StatsBlock const *)MapViewOfFile(map, FILE_MAP_READ, 0, 0, 0);
+	LONGLONG n_allocations = -1;
+	if (stats != NULL && stats->version == STATS_VERSION && stats->size == sizeof(StatsBlock))
+		n_allocations = stats->counters[StatsCounterHeapAllocations];
+
+	if (stats != NULL)
+		UnmapViewOfFile(stats);
+	CloseHandle(map);
+
+	return n_allocations;
+}
+
+/* Gets the index of the field NAMEd, or -1 if the plugin has none. */
+static int
+SelfTestField(char const *name)
+{
+	char field_name[64];
+	char units[512];
+
+	for (int i = 0; s_get_supported_field(i, field_name, units, sizeof(field_name)) !=
+			 TCFieldTypeNoMoreFields; i++)
+		if (lstrcmp(field_name, name) == 0)
+			return i;
+
+	return -1;
+}
+
+/* Gets the fields that come from detection of the file written for TAG of
+ * each text in each encoding that can hold it. */
+static void
+SelfTestDetectAll(char const *tag, int const *fields)
+{
+	for (int t = 0; t < _countof(texts); t++) {
+		for (int e = 0; e < _countof(s_encodings); e++) {
+			if (texts[t].max_char > s_encodings[e].max_char)
+				continue;
+
+			char filename[MAX_PATH];
+			SelfTestFilename(filename, sizeof(filename), tag, t, e);
+			for (int f = 0; f < _countof(detection_fields); f++) {
+				char value[SELFTEST_VALUE_SIZE];
+				TCFieldTypeOrStatus status = s_get_value(filename, fields[f], 0, value,
+														 sizeof(value), (TCContentFlag)0);
+				SelfTestCheck(status >= 0 || status == TCFieldStatusFieldEmpty,
+							  "%s of %s couldnt be got", detection_fields[f], filename);
+			}
+		}
+	}
+}
+
+/* Deletes the files written for TAG. */
+static void
+SelfTestDeleteAll(char const *tag)
+{
+	for (int t = 0; t < _countof(texts); t++) {
+		for (int e = 0; e < _countof(s_encodings); e++) {
+			char filename[MAX_PATH];
+			SelfTestFilename(filename, sizeof(filename), tag, t, e);
+			DeleteFile(filename);
+		}
+	}
+}
+
+/* Checks that detection doesnt allocate once it is warm. */
+static void
+SelfTestAllocations(void)
+{
+	int fields[_countof(detection_fields)];
+	for (int f = 0; f < _countof(detection_fields); f++) {
+		fields[f] = SelfTestField(detection_fields[f]);
+		SelfTestCheck(fields[f] >= 0, "the plugin has no %s field", detection_fields[f]);
+		if (fields[f] < 0)
+			return;
+	}
+
+	for (int t = 0; t < _countof(texts); t++) {
+		for (int e = 0; e < _countof(s_encodings); e++) {
+			if (texts[t].max_char > s_encodings[e].max_char)
+				continue;
+
+			char filename[MAX_PATH];
+			size_t n_bytes;
+			if (!SelfTestWriteText(filename, sizeof(filename), "warm", t, e, 1, &n_bytes) ||
+				!SelfTestWriteText(filename, sizeof(filename), "warmed", t, e, 2, &n_bytes))
+				return;
+		}
+	}
+
+	SelfTestDetectAll("warm", fields);
+	LONGLONG n_allocations = SelfTestHeapAllocations();
+	SelfTestCheck(n_allocations >= 0, "the statistics of the plugin cant be read");
+	if (n_allocations >= 0) {
+		SelfTestDetectAll("warmed", fields);
+		n_allocations = SelfTestHeapAllocations() - n_allocations;
+		SelfTestCheck(n_allocations == 0,
+					  "detection did %I64d heap allocations once warm", n_allocations);
+	}
+
+	SelfTestDeleteAll("warm");
+	SelfTestDeleteAll("warmed");
+}
+
+/* Converts FILENAME, N_BYTES long, to ENCODING, which it checks is done
+ * without losing anything if LOSSLESS is set, and otherwise that it is
+ * refused without touching the file, with N_LOST characters lost, the
+ * first of which FIRST_LOST bytes into it.  The converted file should be
+ * N_EXPECTED bytes long and hold S_EXPECTED. */
+static void
+SelfTestConvert(char *filename, size_t n_bytes, SelfTestEncoding const *encoding,
+				BOOL lossless, size_t n_expected, size_t n_lost, size_t first_lost)
+{
+	EncodingDetectConvertibility report;
+	s_convertible(&filename, 1, encoding->index, &report);
+	if (lossless) {
+		SelfTestCheck(report.status == ENCODING_DETECT_OK && report.n_lost == 0 &&
+					  report.size == n_expected,
+					  "converting %s to %s is said to lose %I64u characters and take %I64u bytes "
+					  "rather than %lu", filename, encoding->name, report.n_lost, report.size,
+					  (unsigned long)n_expected);
+	} else {
+		SelfTestCheck(report.status == ENCODING_DETECT_OK && report.n_lost == n_lost &&
+					  report.lost[0] == first_lost,
+					  "converting %s to %s is said to lose %I64u characters, the first at %I64u, "
+					  "rather than %lu at %lu", filename, encoding->name, report.n_lost,
+					  report.lost[0], (unsigned long)n_lost, (unsigned long)first_lost);
+	}
+
+	TCFieldTypeOrStatus status =
+		s_set_value(filename, s_field_encoding, encoding->index, TCFieldTypeMultipleChoice, NULL,
+					(TCContentSetValueFlags)(TCContentSetValueFlagFirstAttribute |
+											 TCContentSetValueFlagLastAttribute));
+	SelfTestCheck((status == TCFieldStatusSetSuccess) == lossless,
+				  lossless ? "%s couldnt be converted to %s" : "%s was converted to %s",
+				  filename, encoding->name);
+
+	/* Refused conversions leave the file as it was, which is still in
+	 * S_BYTES. */
+	if (!lossless) {
+		n_expected = n_bytes;
+		CopyMemory(s_expected, s_bytes, n_bytes);
+	}
+
+	LONGLONG n_read = SelfTestRead(filename, s_bytes, n_expected);
+	SelfTestCheck(n_read == (LONGLONG)n_expected &&
+				  memcmp(s_bytes, s_expected, n_expected) == 0,
+				  lossless ? "%s doesnt hold its text once converted to %s" :
+				  "%s was changed by refusing to convert it to %s", filename, encoding->name);
+
+	DeleteFile(filename);
+}
+
+/* Checks that converting files keeps all of their characters, and that
+ * converting them to encodings that cant hold them is refused. */
+static void
+SelfTestConversions(void)
+{
+	s_field_encoding = SelfTestField("Encoding");
+	SelfTestCheck(s_field_encoding >= 0, "the plugin has no Encoding field");
+	if (s_field_encoding < 0)
+		return;
+
+	for (int t = 0; t < _countof(texts); t++) {
+		for (int from = 0; from < _countof(s_encodings); from++) {
+			if (texts[t].max_char > s_encodings[from].max_char)
+				continue;
+
+			for (int to = 0; to < _countof(s_encodings); to++) {
+				/* Unicode is only converted to single-byte encodings by
+				 * iconv, so only those that are refused are made. */
+				SelfTestEncoding const *encoding = &s_encodings[to];
+				if (to == from || (encoding->form == SelfTestFormSingleByte &&
+								   s_encodings[from].form != SelfTestFormSingleByte &&
+								   texts[t].max_char <= encoding->max_char))
+					continue;
+
+				char filename[MAX_PATH];
+				size_t n_bytes;
+				if (!SelfTestWriteText(filename, sizeof(filename), "convert", t, from, 3,
+									   &n_bytes))
+					continue;
+
+				size_t n_expected = SelfTestEncode(encoding, texts[t].n_chars, s_expected);
+				if (texts[t].max_char <= encoding->max_char) {
+					SelfTestConvert(filename, n_bytes, encoding, TRUE, n_expected, 0, 0);
+					continue;
+				}
+
+				size_t n_lost = 0;
+				size_t first = 0;
+				for (size_t i = 0; i < texts[t].n_chars; i++)
+					if (s_text[i] > encoding->max_char && n_lost++ == 0)
+						first = i;
+				size_t first_lost = SelfTestEncode(&s_encodings[from], first, NULL);
+				SelfTestConvert(filename, n_bytes, encoding, FALSE, n_expected, n_lost,
+								first_lost);
+			}
+		}
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 2 && argc != 3) {
+		fprintf(stderr, "Usage: %s PLUGIN [DIRECTORY]\n", argv[0]);
+		return 2;
+	}
+
+	HMODULE plugin = LoadLibrary(argv[1]);
+	if (plugin != NULL) {
+		s_get_supported_field =
+			(GetSupportedFieldFunc)GetProcAddress(plugin, "ContentGetSupportedField");
+		s_get_value = (GetValueFunc)GetProcAddress(plugin, "ContentGetValue");
+		s_set_value = (SetValueFunc)GetProcAddress(plugin, "ContentSetValue");
+		s_name = (NameFunc)GetProcAddress(plugin, "EncodingDetectName");
+		s_convertible = (ConvertibleFunc)GetProcAddress(plugin, "EncodingDetectConvertible");
+		s_close = (CloseFunc)GetProcAddress(plugin, "EncodingDetectClose");
+	}
+	if (s_get_supported_field == NULL || s_get_value == NULL || s_set_value == NULL ||
+		s_name == NULL || s_convertible == NULL || s_close == NULL) {
+		fprintf(stderr, "%s: %s isnt the plugin\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	if (argc == 3) {
+		size_t length = strlen(argv[2]);
+		StringCbPrintf(s_directory, sizeof(s_directory), "%s%s", argv[2],
+					   length > 0 && argv[2][length - 1] != '\\' ? "\\" : "");
+	} else if (GetTempPath(sizeof(s_directory), s_directory) == 0) {
+		fprintf(stderr, "%s: cant find the directory for temporary files\n", argv[0]);
+		return 1;
+	}
+
+	for (int e = 0; e < _countof(s_encodings); e++) {
+		char const *name;
+		s_encodings[e].index = -1;
+		for (int i = 0; (name = s_name(i)) != NULL; i++)
+			if (lstrcmp(name, s_encodings[e].name) == 0)
+				s_encodings[e].index = i;
+		if (s_encodings[e].index < 0) {
+			fprintf(stderr, "%s: %s doesnt know %s\n", argv[0], argv[1], s_encodings[e].name);
+			return 1;
+		}
+	}
+
+	/* A character takes up four bytes at most, and a BOM no more. */
+	s_text = (unsigned int *)HeapAlloc(GetProcessHeap(), 0,
+									   SELFTEST_LONG_TEXT * sizeof(unsigned int));
+	s_bytes = (unsigned char *)HeapAlloc(GetProcessHeap(), 0, (SELFTEST_LONG_TEXT + 1) * 4);
+	s_expected = (unsigned char *)HeapAlloc(GetProcessHeap(), 0, (SELFTEST_LONG_TEXT + 1) * 4);
+	if (s_text == NULL || s_bytes == NULL || s_expected == NULL) {
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+
+	SelfTestAllocations();
+	SelfTestConversions();
+
+	s_close();
+
+	printf("%d checks, %d failed\n", s_n_checks, s_n_failed);
+
+	return s_n_failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+/* encoding-stats: prints the statistics that the plugin keeps about where
+ * it spends its time in a running host.
+ *
+ * Usage: encoding-stats PID [SECONDS]
+ *
+ * PID is the process ID of the host (totalcmd.exe).  If SECONDS is given,
+ * the tool stays attached for that long before printing, so that the things
+ * that are only measured while someone is looking, such as page faults, are
+ * measured in the meantime. */
+
+#include "stdafx.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <strsafe.h>
+
+/* The names of the stages and counters, in the order of their enums. */
+static char const * const stage_names[] = {
+	"ContentGetValue",
+	"CreateFile",
+	"Mapping",
+	"EncodingFind",
+	"LineEndingFind",
+	"Decompress",
+	"Fingerprint",
+};
+
+static char const * const counter_names[] = {
+	"Cache hits",
+	"Cache misses",
+	"Bytes scanned",
+	"Page faults",
+	"Shared cache hits",
+	"Validated by content",
+	"Heap allocations",
+};
+
+/* Gets the upper bound in nanoseconds of the bucket that the timing at
+ * fraction PERCENTILE of HISTOGRAM falls in. */
+static double
+HistogramPercentile(StatsHistogram const *histogram, double percentile)
+{
+	LONG wanted = (LONG)(histogram->count * percentile);
+	LONG seen = 0;
+
+	for (int i = 0; i < STATS_N_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen > wanted)
+			return (double)((ULONGLONG)1 << (i + 1));
+	}
+
+	return (double)((ULONGLONG)1 << STATS_N_BUCKETS);
+}
+
+static void
+HistogramPrint(char const *name, StatsHistogram const *histogram)
+{
+	if (histogram->count == 0)
+		return;
+
+	printf("%-20s %10ld %12.1f %10.1f %10.1f %10.1f %14.1f\n",
+		   name, histogram->count,
+		   histogram->total / 1000.0 / histogram->count,
+		   HistogramPercentile(histogram, 0.50) / 1000.0,
+		   HistogramPercentile(histogram, 0.90) / 1000.0,
+		   HistogramPercentile(histogram, 0.99) / 1000.0,
+		   histogram->total / 1000000.0);
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s PID [SECONDS]\n", argv[0]);
+		return 2;
+	}
+
+	char name[64];
+	if (FAILED(StringCbPrintf(name, sizeof(name), STATS_NAME_FORMAT, strtoul(argv[1], NULL, 10))))
+		return 2;
+
+	HANDLE map = OpenFileMapping(FILE_MAP_WRITE, FALSE, name);
+	if (map == NULL) {
+		fprintf(stderr, "%s: no statistics for process %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	StatsBlock *stats = (StatsBlock *)MapViewOfFile(map, FILE_MAP_WRITE, 0, 0, 0);
+	if (stats == NULL || stats->version != STATS_VERSION || stats->size != sizeof(StatsBlock)) {
+		fprintf(stderr, "%s: incompatible statistics for process %s\n", argv[0], argv[1]);
+		return 1;
+	}
+
+	if (argc > 2) {
+		InterlockedIncrement(&stats->readers);
+		Sleep(1000 * strtoul(argv[2], NULL, 10));
+		InterlockedDecrement(&stats->readers);
+	}
+
+	for (int i = 0; i < StatsCounterCount; i++)
+		printf("%-20s %10I64d\n", counter_names[i], stats->counters[i]);
+
+	printf("\n%-20s %10s %12s %10s %10s %10s %14s\n",
+		   "Stage", "Count", "Mean (us)", "p50 (us)", "p90 (us)", "p99 (us)", "Total (ms)");
+	for (int i = 0; i < StatsStageCount; i++)
+		HistogramPrint(stage_names[i], &stats->stages[i]);
+	for (int i = 0; i < STATS_MAX_PROBES; i++)
+		if (stats->probe_names[i][0] != '\0') {
+			char probe[32];
+			StringCbPrintf(probe, sizeof(probe), "  %s", stats->probe_names[i]);
+			HistogramPrint(probe, &stats->probes[i]);
+		}
+
+	UnmapViewOfFile(stats);
+	CloseHandle(map);
+
+	return 0;
+}
@@ -1,17 +1,53 @@
 #include "stdafx.h"
 #include "line-endings.h"
 #include "encoding.h"
+#include "simd.h"
+#include "stats.h"
 
 #include <strsafe.h>
+#include <emmintrin.h>
 
 /* A function determining if a string of bytes uses a given encoding. */
 typedef BOOL (*IsEncodingFunc)(unsigned char const *, size_t);
 
+/* What the first few bytes of a string of bytes tell about it, which is
+ * enough to rule out some encodings without probing for them. */
+typedef enum EncodingHint
+{
+	EncodingHintNone = 0,
+	EncodingHintBOMUTF8 = 1 << 0,
+	EncodingHintBOMUTF16BE = 1 << 1,
+	EncodingHintBOMUTF16LE = 1 << 2,
+	EncodingHintNUL = 1 << 3,
+	EncodingHintOddLength = 1 << 4,
+	EncodingHintBOMs = EncodingHintBOMUTF8 | EncodingHintBOMUTF16BE | EncodingHintBOMUTF16LE,
+};
+
+/* The number of bytes at the beginning of a string of bytes that are
+ * looked at for an EncodingHintNUL. */
+#define ENCODING_HINT_SIZE	64
+
 /* An encoding.
  *
  * NAME is the name of the encoding, such as UTF-8 or similar.
  * IS_ENCODING is the function used by this encoding to check if it matches.
- * GETC is the function for reading characters in this encoding. */
+ * GETC is the function for reading characters in this encoding.
+ * FORM is how the characters of this encoding are laid out in bytes.
+ * CODE_PAGE is the Windows code page identifier of this encoding, or 0.
+ * REQUIRES are the EncodingHints that must all be found for it to match.
+ * REJECTS are the EncodingHints of which any rules it out.
+ * EXCLUDES is the mask of the EncodingIds that cannot match whenever it
+ * does, so that they need not be probed for after it.
+ * COST is the work it does per byte of input before telling that it
+ * doesnt match, which is less for those that usually stop early.
+ * SCAN_LIMIT is the most bytes it looks at, or 0 if there is no limit.
+ * PRIOR is the number of hits assumed for it before any are seen.
+ *
+ * Encodings are listed in priority order: the first that matches is the
+ * one that is found, whatever order they are probed in.  Binary comes
+ * last, so that the indexes of the others, which are the units of the
+ * Encoding field, stay as they were, but it isnt probed for along with
+ * them: it is looked for first, and wins over all of them. */
 struct _Encoding
 {
 	char const * const name;
@@ -19,8 +55,32 @@ struct _Encoding
 	char const * const bom;
 	IsEncodingFunc is_encoding;
 	GetCharacterFunc getc;
+	TextForm form;
+	UINT code_page;
+	unsigned int requires;
+	unsigned int rejects;
+	unsigned int excludes;
+	unsigned int cost;
+	size_t scan_limit;
+	LONG prior;
+};
+
+/* The indexes of the encodings. */
+typedef enum EncodingId
+{
+	EncodingIdASCII,
+	EncodingIdUTF8BOM,
+	EncodingIdUTF8,
+	EncodingIdUTF16BE,
+	EncodingIdUTF16LE,
+	EncodingIdISO8859,
+	EncodingIdNonISO,
+	EncodingIdUnknown,
+	EncodingIdBinary,
 };
 
+#define ENCODING_ID_MASK(id)	(1u << (id))
+
 /* Byte orders (used for UTF-16). */
 typedef enum ByteOrder {
 	ByteOrderBigEndian,
@@ -88,15 +148,67 @@ is_noniso(unsigned char byte)
 	return is_iso8859(byte) || ByteEncodings[byte] == X;
 }
 
+/* The TLS slot that marks the threads whose probes stop once
+ * G_GET_VALUE_ABORTED is set, or TLS_OUT_OF_INDEXES if all of them do. */
+static DWORD s_abort_slot = TLS_OUT_OF_INDEXES;
+
+/* What the probes of the threads that arent marked look at instead of
+ * G_GET_VALUE_ABORTED, which is never set. */
+static BOOL const s_never_aborted = FALSE;
+
+/* Prepares for telling the threads whose probes can be aborted from the
+ * rest.  Until this is called, all of them can be. */
+void
+EncodingAbortOpen(void)
+{
+	s_abort_slot = TlsAlloc();
+}
+
+/* Undoes EncodingAbortOpen(). */
+void
+EncodingAbortClose(void)
+{
+	if (s_abort_slot != TLS_OUT_OF_INDEXES)
+		TlsFree(s_abort_slot);
+	s_abort_slot = TLS_OUT_OF_INDEXES;
+}
+
+/* Marks the calling thread as one whose probes stop once
+ * G_GET_VALUE_ABORTED is set, if ABORTABLE is set, and as one whose probes
+ * carry on regardless otherwise, returning what it was before. */
+BOOL
+EncodingAbortable(BOOL abortable)
+{
+	if (s_abort_slot == TLS_OUT_OF_INDEXES)
+		return TRUE;
+
+	BOOL was = TlsGetValue(s_abort_slot) != NULL;
+	TlsSetValue(s_abort_slot, abortable ? (LPVOID)&g_get_value_aborted : NULL);
+
+	return was;
+}
+
+/* Gets the flag that the probes of the calling thread stop at once it is
+ * set. */
+BOOL volatile const *
+EncodingAbortFlag(void)
+{
+	if (s_abort_slot == TLS_OUT_OF_INDEXES || TlsGetValue(s_abort_slot) != NULL)
+		return &g_get_value_aborted;
+
+	return &s_never_aborted;
+}
+
 /* Checks if it looks like N_BYTES of BYTES are encoded using IS_ENCODING. */
 static BOOL
 looks_like(unsigned char const * const bytes, size_t n_bytes,
 		   IsByteEncodingFunc is_encoding)
 {
+	BOOL volatile const *aborted = EncodingAbortFlag();
 	unsigned char const *end = bytes + n_bytes;
 
 	for (unsigned char const *p = bytes; p < end; p++)
-		if (g_get_value_aborted || !is_encoding(*p))
+		if (*aborted || !is_encoding(*p))
 			return FALSE;
 
 	return TRUE;
@@ -145,9 +257,10 @@ looks_like_utf8(unsigned char const * const bytes, size_t n_bytes, BOOL want_bom
 		had_bom = TRUE;
 	}
 
+	BOOL volatile const *aborted = EncodingAbortFlag();
 	unsigned char const *end = bytes + n_bytes;
 	for (unsigned char const *p = bytes; p < end; p++) {
-		if (g_get_value_aborted)
+		if (*aborted)
 			return FALSE;
 
 		unsigned char byte = *p;
@@ -225,9 +338,10 @@ looks_like_utf16(unsigned char const * const bytes, size_t n_bytes,
 		(has_bom_little && byte_order != ByteOrderLittleEndian))
 		  return FALSE;
 
+	BOOL volatile const *aborted = EncodingAbortFlag();
 	unsigned char const *end = bytes + n_bytes;
 	for (unsigned char const *p = bytes; p < end; p += 2) {
-		if (g_get_value_aborted)
+		if (*aborted)
 			return FALSE;
 
 		byte0 = p[0];
@@ -263,6 +377,209 @@ looks_like_utf16le(unsigned char const * const bytes, size_t n_bytes)
 	return looks_like_utf16(bytes, n_bytes, ByteOrderLittleEndian);
 }
 
+/* The number of bytes at the beginning of a file that are looked at when
+ * determining if it is binary. */
+#define BINARY_SNIFF_SIZE	512
+
+/* Determines if any of the bytes from FROM up to TO of BYTES, which has
+ * at least TO of them, is one that no text has. */
+static BOOL
+has_non_text(unsigned char const * const bytes, size_t from, size_t to)
+{
+	for (size_t i = from; i < to; i++)
+		if (ByteEncodings[bytes[i]] == F)
+			return TRUE;
+
+	return FALSE;
+}
+
+/* Checks if N_BYTES of BYTES begin with the comment that a PDF file puts
+ * after its header to say that it is binary: "%PDF-1.x", the end of a
+ * line, and a "%" followed by at least four bytes above 127. */
+static BOOL
+has_pdf_header(unsigned char const * const bytes, size_t n_bytes)
+{
+	size_t i = 8;
+	if (n_bytes < i + 6 || memcmp(bytes, "%PDF-", 5) != 0 ||
+		bytes[5] < '0' || bytes[5] > '9' || bytes[6] != '.' || bytes[7] < '0' || bytes[7] > '9')
+		return FALSE;
+
+	if (bytes[i] == '\r')
+		i++;
+	if (bytes[i] == '\n')
+		i++;
+	if (i == 8 || bytes[i++] != '%')
+		return FALSE;
+
+	size_t n_high = 0;
+	for (; i < n_bytes && bytes[i] >= 0x80; i++)
+		n_high++;
+
+	return n_high >= 4;
+}
+
+/* Checks if N_BYTES of BYTES begin with the magic number of a binary file
+ * format.  The switch on the first byte compiles into a jump table, so at
+ * most a handful of magic numbers are ever compared.  Magic numbers that
+ * are made of text alone, and so could just as well begin a text file, are
+ * only trusted along with the header fields that follow them, which have
+ * bytes in them that text doesnt. */
+static BOOL
+has_binary_magic(unsigned char const * const bytes, size_t n_bytes)
+{
+#	define MAGIC(magic) \
+	(n_bytes >= sizeof(magic) - 1 && memcmp(bytes, magic, sizeof(magic) - 1) == 0)
+#	define MAGIC_AT(offset, magic) \
+	(n_bytes >= (offset) + sizeof(magic) - 1 && \
+	 memcmp(bytes + (offset), magic, sizeof(magic) - 1) == 0)
+
+	if (n_bytes < 4)
+		return FALSE;
+
+	switch (bytes[0]) {
+	case 0x7f:
+		return MAGIC("\177ELF");
+	case 'M':
+		/* Only trust MZ if it leads to a PE header. */
+		if (MAGIC("MZ") && n_bytes >= 0x40) {
+			size_t pe = bytes[0x3c] | (bytes[0x3d] << 8) | (bytes[0x3e] << 16) | (bytes[0x3f] << 24);
+			return pe <= n_bytes - 4 && memcmp(bytes + pe, "PE\0\0", 4) == 0;
+		}
+		return MAGIC("MM\0*");
+	case 'P':
+		return MAGIC("PK\003\004") || MAGIC("PK\005\006") || MAGIC("PK\007\010");
+	case 0x89:
+		return MAGIC("\211PNG\r\n\032\n");
+	case '%':
+		return has_pdf_header(bytes, n_bytes);
+	case 'S':
+		return MAGIC("SQLite format 3\0");
+	case 'G':
+		/* The logical screen descriptor: its width, height, flags,
+		 * background color and aspect ratio. */
+		return (MAGIC("GIF87a") || MAGIC("GIF89a")) && n_bytes >= 13 &&
+			has_non_text(bytes, 6, 13);
+	case 0xff:
+		return MAGIC("\377\330\377");
+	case 0x1f:
+		return MAGIC("\037\213");
+	case 0x28:
+		return MAGIC("\050\265\057\375");
+	case 'B':
+		/* The block size, and the magic number of the first block or of
+		 * the end of the stream. */
+		return MAGIC("BZh") && n_bytes >= 10 && bytes[3] >= '1' && bytes[3] <= '9' &&
+			(MAGIC_AT(4, "\061\101\131\046\123\131") ||
+			 MAGIC_AT(4, "\027\162\105\070\120\220"));
+	case 0xfd:
+		return MAGIC("\3757zXZ\0");
+	case '7':
+		return MAGIC("7z\274\257\047\034");
+	case 'R':
+		/* The size of the RIFF chunk, and its form type. */
+		if (MAGIC("RIFF"))
+			return n_bytes >= 12 && has_non_text(bytes, 4, 8) &&
+				(MAGIC_AT(8, "WAVE") || MAGIC_AT(8, "AVI ") || MAGIC_AT(8, "WEBP"));
+		return MAGIC("Rar!\032\007");
+	case 0xd0:
+		return MAGIC("\320\317\021\340\241\261\032\341");
+	case 0xca:
+		return MAGIC("\312\376\272\276");
+	case 0xce:
+	case 0xcf:
+		return MAGIC("\316\372\355\376") || MAGIC("\317\372\355\376");
+	case 0xfe:
+		return MAGIC("\376\355\372\316") || MAGIC("\376\355\372\317");
+	case 'I':
+		/* The major version of ID3v2, and its revision, which is always
+		 * zero. */
+		if (MAGIC("ID3"))
+			return n_bytes >= 5 && bytes[3] >= 2 && bytes[3] <= 4 && bytes[4] == 0;
+		return MAGIC("II*\0");
+	case 'O':
+		/* The version of the page structure, which is zero, and the type
+		 * of the page. */
+		return MAGIC("OggS") && n_bytes >= 6 && bytes[4] == 0 && bytes[5] < 8;
+	case 'f':
+		/* The header of the STREAMINFO block, which comes first and is 34
+		 * bytes long. */
+		return MAGIC("fLaC") && n_bytes >= 8 && (bytes[4] & 0x7f) == 0 &&
+			MAGIC_AT(5, "\0\0\042");
+	case 'w':
+		/* The flavor of the font, and the size of the file. */
+		if (MAGIC("wOFF") || MAGIC("wOF2"))
+			return n_bytes >= 12 && has_non_text(bytes, 4, 12) &&
+				(MAGIC_AT(4, "\0\1\0\0") || MAGIC_AT(4, "OTTO") || MAGIC_AT(4, "true"));
+		return FALSE;
+	}
+
+	return FALSE;
+
+#	undef MAGIC_AT
+#	undef MAGIC
+}
+
+/* Counts the bits set in the 16-bit MASK. */
+static unsigned int
+count_bits(unsigned int mask)
+{
+	mask = mask - ((mask >> 1) & 0x5555);
+	mask = (mask & 0x3333) + ((mask >> 2) & 0x3333);
+	mask = (mask + (mask >> 4)) & 0x0f0f;
+
+	return (mask + (mask >> 8)) & 0x1f;
+}
+
+/* Determines whether it looks like N_BYTES of BYTES are binary rather than
+ * text, looking only at the first BINARY_SNIFF_SIZE bytes: either they
+ * begin with a known magic number, or they contain NULs that dont look like
+ * the high bytes of UTF-16 text. */
+static BOOL
+looks_like_binary(unsigned char const * const bytes, size_t n_bytes)
+{
+	size_t n = min(n_bytes, (size_t)BINARY_SNIFF_SIZE);
+
+	if (has_binary_magic(bytes, n))
+		return TRUE;
+
+	/* Count the NULs at even and odd offsets, sixteen bytes at a time. */
+	size_t nuls[2] = { 0, 0 };
+	size_t i = 0;
+	if (g_simd_level >= SimdLevelSSE2) {
+		__m128i const zero = _mm_setzero_si128();
+		for (; i + 16 <= n; i += 16) {
+			unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+				_mm_loadu_si128((__m128i const *)(bytes + i)), zero));
+			nuls[0] += count_bits(mask & 0x5555);
+			nuls[1] += count_bits(mask & 0xaaaa);
+		}
+	}
+	for (; i < n; i++)
+		if (bytes[i] == 0)
+			nuls[i % 2]++;
+
+	if (nuls[0] + nuls[1] == 0)
+		return FALSE;
+
+	/* With a BOM, this would be UTF-16 if it werent for a U+0000. */
+	if (n >= 2 && ((bytes[0] == 0xfe && bytes[1] == 0xff) ||
+				   (bytes[0] == 0xff && bytes[1] == 0xfe))) {
+		for (i = 2; i + 1 < n; i += 2)
+			if (bytes[i] == 0 && bytes[i + 1] == 0)
+				return TRUE;
+		return FALSE;
+	}
+
+	/* Text in UTF-16 without a BOM has its NULs densely on one side only;
+	 * leave that to the other probes rather than calling it binary. */
+	size_t half = n / 2;
+	if ((nuls[0] == 0 && nuls[1] >= half / 4) ||
+		(nuls[1] == 0 && nuls[0] >= half / 4))
+		return FALSE;
+
+	return TRUE;
+}
+
 /* This is a NULL IsEncodingFunc that always returns TRUE. */
 static BOOL
 looks_like_unknown(unsigned char const * const bytes, size_t n_bytes)
@@ -374,18 +691,87 @@ EncodingBOM(Encoding const *encoding)
 	return encoding->bom;
 }
 
+/* Gets how the characters of ENCODING are laid out in bytes. */
+TextForm
+EncodingTextForm(Encoding const *encoding)
+{
+	return encoding->form;
+}
+
+/* Gets the Windows code page identifier of ENCODING, or 0 if it has none. */
+UINT
+EncodingCodePage(Encoding const *encoding)
+{
+	return encoding->code_page;
+}
+
+/* Determines if ENCODING has the C1 control characters, NEL among them.
+ * Of the single-byte code pages, only ISO-8859-1 does; the others use
+ * 0x80 to 0x9f for printable characters, like the ellipsis of CP1252, or
+ * not at all. */
+BOOL
+EncodingHasC1Controls(Encoding const *encoding)
+{
+	return encoding->form != TextFormSingleByte || encoding->code_page == 28591;
+}
+
+/* Gets how many of N_BYTES bytes probing for ENCODING looks at, which, as
+ * it is probed for before any that would come after it, is all that
+ * detection looks at of bytes that are found to be in it. */
+size_t
+EncodingScanSize(Encoding const *encoding, size_t n_bytes)
+{
+	return encoding->scan_limit != 0 ? min(n_bytes, encoding->scan_limit) : n_bytes;
+}
+
 /* These are the encodings that we can try to detect. */
 Encoding encodings[] = {
-	{ "ASCII", "ASCII", "", looks_like_ascii, getc_ascii },
-	{ "UTF-8 / BOM", "UTF-8", "\357\273\277", looks_like_utf8_with_bom, getc_utf8 },
-	{ "UTF-8", "UTF-8", "", looks_like_utf8_without_bom, getc_utf8 },
-	{ "UTF-16BE", "UTF-16BE", "\376\377", looks_like_utf16be, getc_utf16be },
-	{ "UTF-16LE", "UTF-16LE", "\377\376", looks_like_utf16le, getc_utf16le },
-	{ "ISO-8859", "ISO-8859-1", "", looks_like_iso8859, getc_ascii },
-	{ "ASCII++", NULL, "", looks_like_noniso, getc_ascii },
-	{ "Unknown", NULL, "", looks_like_unknown, getc_unknown }
+	{ "ASCII", "ASCII", "", looks_like_ascii, getc_ascii, TextFormSingleByte, 20127,
+	  EncodingHintNone, EncodingHintBOMs | EncodingHintNUL, 0, 1, 0, 8 },
+	{ "UTF-8 / BOM", "UTF-8", "\357\273\277", looks_like_utf8_with_bom, getc_utf8, TextFormUTF8, CP_UTF8,
+	  EncodingHintBOMUTF8, EncodingHintNUL, ENCODING_ID_MASK(EncodingIdASCII), 6, 0, 1 },
+	{ "UTF-8", "UTF-8", "", looks_like_utf8_without_bom, getc_utf8, TextFormUTF8, CP_UTF8,
+	  EncodingHintNone, EncodingHintBOMUTF16BE | EncodingHintBOMUTF16LE | EncodingHintNUL,
+	  ENCODING_ID_MASK(EncodingIdASCII), 6, 0, 8 },
+	{ "UTF-16BE", "UTF-16BE", "\376\377", looks_like_utf16be, getc_utf16be, TextFormUTF16BE, 1201,
+	  EncodingHintBOMUTF16BE, EncodingHintOddLength,
+	  ENCODING_ID_MASK(EncodingIdASCII) | ENCODING_ID_MASK(EncodingIdUTF8BOM) |
+	  ENCODING_ID_MASK(EncodingIdUTF8), 4, 0, 1 },
+	{ "UTF-16LE", "UTF-16LE", "\377\376", looks_like_utf16le, getc_utf16le, TextFormUTF16LE, 1200,
+	  EncodingHintBOMUTF16LE, EncodingHintOddLength,
+	  ENCODING_ID_MASK(EncodingIdASCII) | ENCODING_ID_MASK(EncodingIdUTF8BOM) |
+	  ENCODING_ID_MASK(EncodingIdUTF8), 4, 0, 1 },
+	{ "ISO-8859", "ISO-8859-1", "", looks_like_iso8859, getc_ascii, TextFormSingleByte, 28591,
+	  EncodingHintNone, EncodingHintNUL, 0, 4, 0, 1 },
+	{ "ASCII++", "CP1252", "", looks_like_noniso, getc_ascii, TextFormSingleByte, 1252,
+	  EncodingHintNone, EncodingHintNUL, 0, 4, 0, 1 },
+	{ "Unknown", NULL, "", looks_like_unknown, getc_unknown, TextFormNone, 0,
+	  EncodingHintNone, EncodingHintNone, 0, 0, 0, 0 },
+	{ "Binary", NULL, "", looks_like_binary, getc_unknown, TextFormNone, 0,
+	  EncodingHintNone, EncodingHintNone, 0, 0, BINARY_SNIFF_SIZE, 0 }
 };
 
+C_ASSERT(_countof(encodings) == EncodingIdBinary + 1);
+C_ASSERT(_countof(encodings) <= sizeof(unsigned int) * 8);
+
+/* The number of times that each encoding has been found, which is halved
+ * for all of them once any reaches ENCODING_MAX_HITS, so that they follow
+ * what has been found lately. */
+#define ENCODING_MAX_HITS	(1 << 16)
+
+static LONG volatile s_hits[_countof(encodings)];
+
+/* Gets the Encoding called NAME, or NULL if there is none. */
+Encoding const *
+EncodingNamed(char const *name)
+{
+	for (int i = 0; i < _countof(encodings); i++)
+		if (lstrcmp(encodings[i].name, name) == 0)
+			return &encodings[i];
+
+	return NULL;
+}
+
 /* Iterates over each defined encoding using ITERATOR, passing it
  * CLOSURE along with the encoding. */
 void
@@ -396,51 +782,141 @@ EncodingsEach(EncodingsIterator iterator, VOID *closure)
 			return;
 }
 
-/* Closure used for finding an Encoding.
- *
- * BYTES is the string of bytes we need to check against.
- * N_BYTES is the number of bytes in BYTES.
- * ENCODING will point to the encoding found. */
-typedef struct _EncodingFindClosure EncodingFindClosure;
-
-struct _EncodingFindClosure
+/* Gets the EncodingHints of N_BYTES of BYTES. */
+static unsigned int
+EncodingHints(unsigned char const * const bytes, size_t n_bytes)
 {
-	unsigned char const *bytes;
-	size_t n_bytes;
-	Encoding const *encoding;
-};
+	unsigned int hints = EncodingHintNone;
+
+	if (n_bytes % 2 != 0)
+		hints |= EncodingHintOddLength;
+	if (n_bytes >= 3 && bytes[0] == 0xef && bytes[1] == 0xbb && bytes[2] == 0xbf)
+		hints |= EncodingHintBOMUTF8;
+	else if (n_bytes >= 2 && bytes[0] == 0xfe && bytes[1] == 0xff)
+		hints |= EncodingHintBOMUTF16BE;
+	else if (n_bytes >= 2 && bytes[0] == 0xff && bytes[1] == 0xfe)
+		hints |= EncodingHintBOMUTF16LE;
+	if (memchr(bytes, 0, min(n_bytes, (size_t)ENCODING_HINT_SIZE)) != NULL)
+		hints |= EncodingHintNUL;
+
+	return hints;
+}
 
-/* Iterator for finding an ENCODING for CLOSURE; breaks as soon as
- * one is found. */
-static BOOL
-EncodingFindIterator(Encoding const *encoding, VOID *closure)
+/* Picks which of the encodings in the mask of CANDIDATES to probe N_BYTES
+ * for next.  Probing in the order of the chance of a hit over the cost of a
+ * miss is what touches the fewest bytes, if only one of them can match;
+ * ties go to the one that comes first. */
+static unsigned int
+EncodingNextProbe(unsigned int candidates, size_t n_bytes)
 {
-	EncodingFindClosure *find_closure = (EncodingFindClosure *)closure;
+	unsigned int next = _countof(encodings);
+	ULONGLONG next_hits = 0;
+	ULONGLONG next_cost = 0;
+
+	for (unsigned int i = 0; i < _countof(encodings); i++) {
+		if ((candidates & ENCODING_ID_MASK(i)) == 0)
+			continue;
+
+		Encoding const *encoding = &encodings[i];
+		ULONGLONG hits = (ULONGLONG)(s_hits[i] + encoding->prior);
+		ULONGLONG cost = (ULONGLONG)encoding->cost * EncodingScanSize(encoding, n_bytes);
+		if (next == _countof(encodings) || hits * next_cost > next_hits * cost) {
+			next = i;
+			next_hits = hits;
+			next_cost = cost;
+		}
+	}
 
-	if (!encoding->is_encoding(find_closure->bytes, find_closure->n_bytes))
-		return TRUE;
+	return next;
+}
 
-	find_closure->encoding = encoding;
+/* Counts a hit for the encoding at INDEX. */
+static void
+EncodingHit(unsigned int index)
+{
+	if (InterlockedIncrement(&s_hits[index]) < ENCODING_MAX_HITS)
+		return;
 
-	return FALSE;
+	/* Racing with someone else doing the same only loses some hits. */
+	for (unsigned int i = 0; i < _countof(encodings); i++)
+		s_hits[i] /= 2;
 }
 
-/* Finds an Encoding for N_BYTES of BYTES. */
+/* Finds an Encoding for N_BYTES of BYTES: Binary, if the first few hundred
+ * of them say so, or else the first of the other encodings that matches.
+ * Those that the first few bytes rule out are never probed for, and the
+ * rest are probed for in the order that EncodingNextProbe() picks, until
+ * none that come before the one found could still match. */
 Encoding const *
 EncodingFind(unsigned char const * const bytes, size_t n_bytes)
 {
-	EncodingFindClosure closure = { bytes, n_bytes, NULL };
+	BOOL volatile const *aborted = EncodingAbortFlag();
+
+	StatsTime start = StatsStart();
+	BOOL is_binary = encodings[EncodingIdBinary].is_encoding(bytes, n_bytes);
+	StatsStopProbe(EncodingIdBinary, start);
+	if (is_binary) {
+		if (!*aborted)
+			EncodingHit(EncodingIdBinary);
+		return &encodings[EncodingIdBinary];
+	}
+
+	unsigned int hints = EncodingHints(bytes, n_bytes);
+	unsigned int candidates = 0;
+	for (unsigned int i = 0; i < EncodingIdBinary; i++)
+		if ((hints & encodings[i].requires) == encodings[i].requires &&
+			(hints & encodings[i].rejects) == 0)
+			candidates |= ENCODING_ID_MASK(i);
+
+	unsigned int found = _countof(encodings);
+	while (candidates != 0) {
+		unsigned int next = EncodingNextProbe(candidates, n_bytes);
+		candidates &= ~ENCODING_ID_MASK(next);
+
+		start = StatsStart();
+		BOOL is_encoding = encodings[next].is_encoding(bytes, n_bytes);
+		StatsStopProbe(next, start);
+		if (!is_encoding)
+			continue;
+
+		found = next;
+		candidates &= (ENCODING_ID_MASK(next) - 1) & ~encodings[next].excludes;
+	}
 
-	EncodingsEach(EncodingFindIterator, &closure);
+	if (found == _countof(encodings))
+		return NULL;
+
+	if (!*aborted)
+		EncodingHit(found);
 
-	return closure.encoding;
+	return &encodings[found];
 }
 
 Encoding const *
 EncodingsGet(unsigned int index)
 {
-	if (index > _countof(encodings))
+	if (index >= _countof(encodings))
 		return NULL;
 
 	return &encodings[index];
 }
+
+unsigned int
+EncodingsCount(void)
+{
+	return _countof(encodings);
+}
+
+unsigned int
+EncodingIndex(Encoding const *encoding)
+{
+	return (unsigned int)(encoding - encodings);
+}
+
+/* Determines if ENCODING is Binary, which files cant be converted to and
+ * which the Encoding field has no unit for. */
+BOOL
+EncodingIsBinary(Encoding const *encoding)
+{
+	return encoding == &encodings[EncodingIdBinary];
+}
@@ -6,10 +6,23 @@ typedef BOOL (*EncodingsIterator)(Encoding const *, VOID *closure);
 
 VOID EncodingsEach(EncodingsIterator iterator, VOID *closure);
 
+void EncodingAbortOpen(void);
+void EncodingAbortClose(void);
+BOOL EncodingAbortable(BOOL abortable);
+BOOL volatile const *EncodingAbortFlag(void);
+
 Encoding const *EncodingFind(unsigned char const * const bytes, size_t n_bytes);
 
 char const *EncodingName(Encoding const *encoding);
 LineEnding EncodingLineEndings(Encoding const *encoding, unsigned char const * const bytes, size_t n_bytes);
 Encoding const *EncodingsGet(unsigned int index);
+Encoding const *EncodingNamed(char const *name);
+unsigned int EncodingsCount(void);
+unsigned int EncodingIndex(Encoding const *encoding);
 char const *EncodingIconvName(Encoding const *encoding);
 char const *EncodingBOM(Encoding const *encoding);
+TextForm EncodingTextForm(Encoding const *encoding);
+UINT EncodingCodePage(Encoding const *encoding);
+BOOL EncodingHasC1Controls(Encoding const *encoding);
+size_t EncodingScanSize(Encoding const *encoding, size_t n_bytes);
+BOOL EncodingIsBinary(Encoding const *encoding);
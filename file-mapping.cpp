@@ -0,0 +1,212 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "arena.h"
+#include "file-mapping.h"
+#include "stats.h"
+
+/* Maps at most MAX_SIZE bytes (or all of it, if MAX_SIZE is 0) of FILENAME
+ * into MAPPING. */
+TCFieldTypeOrStatus
+MapFile(char const *filename, FileMapping *mapping, size_t max_size)
+{
+	StatsTime start = StatsStart();
+	HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+							 OPEN_EXISTING,
+							 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS,
+							 NULL);
+	StatsStop(StatsStageOpen, start);
+	if (file == INVALID_HANDLE_VALUE)
+		return TCFieldStatusFileError;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) ||
+		(file_size.LowPart == 0 && file_size.HighPart == 0)) {
+		/* TODO: This should be the Unknown encoding. */
+		CloseHandle(file);
+		return TCFieldStatusFieldEmpty;
+	}
+
+	/* All of a file that doesnt fit in the address space cant be mapped. */
+	if (max_size == 0 && file_size.HighPart != 0) {
+		CloseHandle(file);
+		return TCFieldStatusFileError;
+	}
+
+	start = StatsStart();
+	size_t n_bytes = max_size == 0 ? file_size.LowPart : min(file_size.QuadPart, max_size);
+	HANDLE map = CreateFileMapping(file, NULL, PAGE_READONLY, 0, n_bytes, NULL);
+	if (map == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
+		CloseHandle(file);
+		return TCFieldStatusFileError;
+	}
+
+	/* TODO: This crashes when a (CSV) file is locked by microsoft excel when importing data. */
+
+	unsigned char *bytes = (unsigned char *)MapViewOfFile(map, FILE_MAP_READ,
+														  0, 0, n_bytes);
+	MEMORY_BASIC_INFORMATION mbi;
+	if (bytes == NULL ||
+		VirtualQuery(bytes, &mbi, sizeof(mbi)) < sizeof(mbi) ||
+		mbi.State != MEM_COMMIT ||
+		mbi.BaseAddress != bytes ||
+		mbi.RegionSize < n_bytes) {
+		CloseHandle(map);
+		CloseHandle(file);
+		return TCFieldStatusFileError;
+	}
+	StatsStop(StatsStageMap, start);
+
+	mapping->file = file;
+	mapping->map = map;
+	mapping->bytes = bytes;
+	mapping->n_bytes = n_bytes;
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Reads at most MAX_SIZE bytes (or all of it, if MAX_SIZE is 0) of FILENAME
+ * into MAPPING, in one go. */
+TCFieldTypeOrStatus
+ReadFileHead(char const *filename, FileMapping *mapping, size_t max_size)
+{
+	StatsTime start = StatsStart();
+	HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+							 OPEN_EXISTING,
+							 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+							 NULL);
+	StatsStop(StatsStageOpen, start);
+	if (file == INVALID_HANDLE_VALUE)
+		return TCFieldStatusFileError;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		return TCFieldStatusFieldEmpty;
+	}
+
+	if (max_size == 0 && file_size.HighPart != 0) {
+		CloseHandle(file);
+		return TCFieldStatusFileError;
+	}
+
+	start = StatsStart();
+	DWORD n_bytes = max_size == 0 ? file_size.LowPart : (DWORD)min(file_size.QuadPart, max_size);
+	unsigned char *bytes = (unsigned char *)ArenaAlloc(n_bytes);
+	DWORD n_read = 0;
+	if (bytes == NULL || !ReadFile(file, bytes, n_bytes, &n_read, NULL) || n_read == 0) {
+		ArenaFree(bytes);
+		CloseHandle(file);
+		return TCFieldStatusFileError;
+	}
+	StatsStop(StatsStageMap, start);
+
+	CloseHandle(file);
+
+	mapping->file = INVALID_HANDLE_VALUE;
+	mapping->map = NULL;
+	mapping->bytes = bytes;
+	mapping->n_bytes = n_read;
+
+	return TCFieldStatusSetSuccess;
+}
+
+void
+UnmapFile(FileMapping *mapping)
+{
+	if (mapping->map == NULL) {
+		ArenaFree((void *)mapping->bytes);
+		return;
+	}
+
+	UnmapViewOfFile(mapping->bytes);
+	CloseHandle(mapping->map);
+	CloseHandle(mapping->file);
+}
+
+/* Gets the granularity that the offset of a view must be aligned to. */
+static DWORD
+AllocationGranularity(void)
+{
+	static DWORD granularity;
+
+	if (granularity == 0) {
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		granularity = info.dwAllocationGranularity;
+	}
+
+	return granularity;
+}
+
+/* Opens FILENAME for stepping through it with WINDOW.  No view is mapped
+ * until FileWindowMove() is called. */
+TCFieldTypeOrStatus
+FileWindowOpen(char const *filename, FileWindow *window)
+{
+	HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+							 OPEN_EXISTING,
+							 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+							 NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return TCFieldStatusFileError;
+
+	LARGE_INTEGER file_size;
+	if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+		CloseHandle(file);
+		return TCFieldStatusFieldEmpty;
+	}
+
+	HANDLE map = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (map == NULL) {
+		CloseHandle(file);
+		return TCFieldStatusFileError;
+	}
+
+	window->file = file;
+	window->map = map;
+	window->file_size = file_size.QuadPart;
+	window->bytes = NULL;
+	window->offset = 0;
+	window->n_bytes = 0;
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Moves WINDOW so that its view covers OFFSET and, if the file is long
+ * enough, at least SIZE bytes following it. */
+BOOL
+FileWindowMove(FileWindow *window, ULONGLONG offset, size_t size)
+{
+	if (window->bytes != NULL) {
+		UnmapViewOfFile(window->bytes);
+		window->bytes = NULL;
+	}
+
+	if (offset >= window->file_size)
+		return FALSE;
+
+	ULONGLONG aligned = offset - offset % AllocationGranularity();
+	ULONGLONG end = min(window->file_size, offset + size);
+	size_t n_bytes = (size_t)(end - aligned);
+
+	unsigned char *bytes = (unsigned char *)MapViewOfFile(window->map, FILE_MAP_READ,
+														  (DWORD)(aligned >> 32),
+														  (DWORD)aligned, n_bytes);
+	if (bytes == NULL)
+		return FALSE;
+
+	window->bytes = bytes;
+	window->offset = aligned;
+	window->n_bytes = n_bytes;
+
+	return TRUE;
+}
+
+void
+FileWindowClose(FileWindow *window)
+{
+	if (window->bytes != NULL)
+		UnmapViewOfFile(window->bytes);
+	CloseHandle(window->map);
+	CloseHandle(window->file);
+}
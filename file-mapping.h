@@ -0,0 +1,38 @@
+/* A read-only mapping of (the beginning of) a file.  If MAP is NULL, BYTES
+ * is a copy of it in the scratch arena of the thread that read it, which
+ * must be the one to unmap it, and FILE has been closed. */
+typedef struct _FileMapping FileMapping;
+
+struct _FileMapping
+{
+	HANDLE file;
+	HANDLE map;
+	unsigned char const *bytes;
+	size_t n_bytes;
+};
+
+TCFieldTypeOrStatus MapFile(char const *filename, FileMapping *mapping, size_t max_size);
+TCFieldTypeOrStatus ReadFileHead(char const *filename, FileMapping *mapping, size_t max_size);
+void UnmapFile(FileMapping *mapping);
+
+/* A movable, read-only view onto a file, for stepping through files that
+ * are too large to be mapped in one go.
+ *
+ * FILE_SIZE is the size of the whole file.
+ * BYTES points to the mapped view, which begins OFFSET bytes into the file
+ * and is N_BYTES long. */
+typedef struct _FileWindow FileWindow;
+
+struct _FileWindow
+{
+	HANDLE file;
+	HANDLE map;
+	ULONGLONG file_size;
+	unsigned char const *bytes;
+	ULONGLONG offset;
+	size_t n_bytes;
+};
+
+TCFieldTypeOrStatus FileWindowOpen(char const *filename, FileWindow *window);
+BOOL FileWindowMove(FileWindow *window, ULONGLONG offset, size_t size);
+void FileWindowClose(FileWindow *window);
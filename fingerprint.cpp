@@ -0,0 +1,117 @@
+#include "stdafx.h"
+#include "fingerprint.h"
+
+#include <stdlib.h>
+#include <strsafe.h>
+
+/* Files are fingerprinted with XXH64, which is fast enough to be run over
+ * the bytes that detection looks at without being noticed next to it, and
+ * spreads its hashes well enough to tell versions of files apart.  It
+ * isnt meant to stand up to anyone trying to forge a collision. */
+#define PRIME64_1	11400714785074694791ULL
+#define PRIME64_2	14029467366897019727ULL
+#define PRIME64_3	1609587929392839161ULL
+#define PRIME64_4	9650029242287828579ULL
+#define PRIME64_5	2870177450012600261ULL
+
+/* Gets the little-endian 64-bit value at P, which neednt be aligned. */
+static ULONGLONG
+read64(unsigned char const *p)
+{
+	ULONGLONG value;
+
+	CopyMemory(&value, p, sizeof(value));
+
+	return value;
+}
+
+/* Gets the little-endian 32-bit value at P, which neednt be aligned. */
+static ULONGLONG
+read32(unsigned char const *p)
+{
+	DWORD value;
+
+	CopyMemory(&value, p, sizeof(value));
+
+	return value;
+}
+
+/* Mixes the eight bytes of INPUT into the accumulator ACCUMULATOR. */
+static ULONGLONG
+round64(ULONGLONG accumulator, ULONGLONG input)
+{
+	accumulator += input * PRIME64_2;
+	accumulator = _rotl64(accumulator, 31);
+
+	return accumulator * PRIME64_1;
+}
+
+/* Merges the accumulator VALUE into the hash HASH. */
+static ULONGLONG
+merge_round64(ULONGLONG hash, ULONGLONG value)
+{
+	hash ^= round64(0, value);
+
+	return hash * PRIME64_1 + PRIME64_4;
+}
+
+/* Gets the fingerprint of the N_BYTES of BYTES, their XXH64 hash with a
+ * seed of 0, so that it can be checked against other tools. */
+ULONGLONG
+Fingerprint(unsigned char const *bytes, size_t n_bytes)
+{
+	unsigned char const *p = bytes;
+	unsigned char const *end = bytes + n_bytes;
+	ULONGLONG hash;
+
+	if (n_bytes >= 32) {
+		/* Four lanes of eight bytes each are mixed independently, so that
+		 * the processor can work on them at the same time. */
+		ULONGLONG v1 = PRIME64_1 + PRIME64_2;
+		ULONGLONG v2 = PRIME64_2;
+		ULONGLONG v3 = 0;
+		ULONGLONG v4 = 0 - PRIME64_1;
+		for (; end - p >= 32; p += 32) {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+		}
+
+		hash = _rotl64(v1, 1) + _rotl64(v2, 7) + _rotl64(v3, 12) + _rotl64(v4, 18);
+		hash = merge_round64(hash, v1);
+		hash = merge_round64(hash, v2);
+		hash = merge_round64(hash, v3);
+		hash = merge_round64(hash, v4);
+	} else {
+		hash = PRIME64_5;
+	}
+
+	hash += n_bytes;
+
+	for (; end - p >= 8; p += 8)
+		hash = _rotl64(hash ^ round64(0, read64(p)), 27) * PRIME64_1 + PRIME64_4;
+	if (end - p >= 4) {
+		hash = _rotl64(hash ^ (read32(p) * PRIME64_1), 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+	for (; p < end; p++)
+		hash = _rotl64(hash ^ (*p * PRIME64_5), 11) * PRIME64_1;
+
+	hash ^= hash >> 33;
+	hash *= PRIME64_2;
+	hash ^= hash >> 29;
+	hash *= PRIME64_3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+/* Formats FINGERPRINT as the sixteen hexadecimal digits that other tools
+ * show XXH64 hashes as into FORMATTED, which is SIZE bytes large. */
+void
+FingerprintFormat(ULONGLONG fingerprint, char *formatted, size_t size)
+{
+	if (FAILED(StringCbPrintf(formatted, size, "%016I64x", fingerprint)) && size > 0)
+		formatted[0] = '\0';
+}
@@ -0,0 +1,2 @@
+ULONGLONG Fingerprint(unsigned char const *bytes, size_t n_bytes);
+void FingerprintFormat(ULONGLONG fingerprint, char *formatted, size_t size);
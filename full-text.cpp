@@ -0,0 +1,226 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "file-mapping.h"
+#include "decompress.h"
+#include "transcode.h"
+#include "full-text.h"
+
+#include <strsafe.h>
+
+/* The number of bytes of a file to map at a time while decoding it. */
+#define FULL_TEXT_WINDOW_SIZE	(1024 * 1024)
+
+/* The longest a character can be in any of the encodings we decode. */
+#define FULL_TEXT_MAX_CHAR_SIZE	4
+
+/* The state of the full-text decoding of a file, kept between calls so
+ * that each call picks up where the previous one left off.
+ *
+ * FILENAME is the name of the file being decoded, or empty if none is.
+ * WINDOW is the view onto the file that is currently mapped.
+ * ENCODING is the Encoding the file is being decoded from.
+ * INPUT_OFFSET is the offset into the file of the next byte to decode.
+ * OUTPUT_OFFSET is the number of bytes of text handed out so far.
+ * LAST_USED tells which of the states was used the longest ago. */
+typedef struct _FullText FullText;
+
+struct _FullText
+{
+	char filename[MAX_PATH];
+	FileWindow window;
+	Encoding const *encoding;
+	ULONGLONG input_offset;
+	int output_offset;
+	ULONGLONG last_used;
+};
+
+/* The number of files that can be decoded at once, as the host may search
+ * several of them on threads of its own. */
+#define FULL_TEXT_MAX_FILES	4
+
+/* The states of the files being decoded, guarded by S_FULL_TEXTS_LOCK. */
+static CRITICAL_SECTION s_full_texts_lock;
+static FullText s_full_texts[FULL_TEXT_MAX_FILES];
+static ULONGLONG s_n_full_text_uses;
+
+/* Prepares for decoding files.  Called when the plugin is loaded. */
+void
+FullTextOpen(void)
+{
+	InitializeCriticalSection(&s_full_texts_lock);
+}
+
+/* Stops decoding the file of FULL_TEXT, if any.  Must be called with
+ * S_FULL_TEXTS_LOCK held. */
+static void
+FullTextStop(FullText *full_text)
+{
+	if (full_text->filename[0] == '\0')
+		return;
+
+	FileWindowClose(&full_text->window);
+	full_text->filename[0] = '\0';
+}
+
+/* Stops decoding all files.  Called before the plugin is unloaded. */
+void
+FullTextClose(void)
+{
+	EnterCriticalSection(&s_full_texts_lock);
+	for (int i = 0; i < FULL_TEXT_MAX_FILES; i++)
+		FullTextStop(&s_full_texts[i]);
+	LeaveCriticalSection(&s_full_texts_lock);
+}
+
+/* Finds the state that FILENAME is being decoded in, or, if there is none,
+ * the one that was used the longest ago, storing whether it was found in
+ * FOUND.  Must be called with S_FULL_TEXTS_LOCK held. */
+static FullText *
+FullTextFind(char const *filename, BOOL *found)
+{
+	FullText *oldest = &s_full_texts[0];
+	for (int i = 0; i < FULL_TEXT_MAX_FILES; i++) {
+		FullText *full_text = &s_full_texts[i];
+		if (full_text->filename[0] != '\0' && lstrcmpi(full_text->filename, filename) == 0) {
+			*found = TRUE;
+			return full_text;
+		}
+		if (full_text->last_used < oldest->last_used)
+			oldest = full_text;
+	}
+
+	*found = FALSE;
+	return oldest;
+}
+
+/* Starts decoding FILENAME, whose text is in ENCODING, from the beginning
+ * in FULL_TEXT.  Compressed files are left alone, as their encoding is
+ * that of what they decompress to, which isnt what is in the file. */
+static TCFieldTypeOrStatus
+FullTextStart(FullText *full_text, char const *filename, Encoding const *encoding)
+{
+	FullTextStop(full_text);
+
+	size_t bom_length;
+	if (EncodingTextForm(encoding) == TextFormNone ||
+		FAILED(StringCbLength(EncodingBOM(encoding), STRSAFE_MAX_CCH, &bom_length)))
+		return TCFieldStatusFieldEmpty;
+
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &full_text->window);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+
+	if (!FileWindowMove(&full_text->window, 0, FULL_TEXT_WINDOW_SIZE)) {
+		FileWindowClose(&full_text->window);
+		return TCFieldStatusFileError;
+	}
+
+	if (DecompressIsCompressed(full_text->window.bytes, full_text->window.n_bytes) ||
+		FAILED(StringCbCopy(full_text->filename, sizeof(full_text->filename), filename))) {
+		FileWindowClose(&full_text->window);
+		return TCFieldStatusFieldEmpty;
+	}
+
+	full_text->encoding = encoding;
+	full_text->input_offset = bom_length;
+	full_text->output_offset = 0;
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Decodes the next chunk of the file of FULL_TEXT into the SIZE bytes of
+ * TEXT, returning the number of bytes of text produced. */
+static int
+FullTextDecode(FullText *full_text, char *text, int size)
+{
+	FileWindow *window = &full_text->window;
+	char *out = text;
+	char *out_end = text + size;
+
+	while (full_text->input_offset < window->file_size && !g_get_value_aborted) {
+		/* Move the window along once it no longer holds a whole character
+		 * at the current offset. */
+		ULONGLONG window_end = window->offset + window->n_bytes;
+		if (window->bytes == NULL ||
+			full_text->input_offset < window->offset ||
+			(window_end - full_text->input_offset < FULL_TEXT_MAX_CHAR_SIZE &&
+			 window_end < window->file_size)) {
+			if (!FileWindowMove(window, full_text->input_offset, FULL_TEXT_WINDOW_SIZE))
+				break;
+			window_end = window->offset + window->n_bytes;
+		}
+
+		unsigned char const *in = window->bytes + (size_t)(full_text->input_offset - window->offset);
+		unsigned char const *start = in;
+		TranscodeToHost(full_text->encoding, &in, window->bytes + window->n_bytes,
+						&out, out_end, window_end == window->file_size);
+		full_text->input_offset += in - start;
+
+		if (in == start &&
+			!(window_end - full_text->input_offset < FULL_TEXT_MAX_CHAR_SIZE &&
+			  window_end < window->file_size))
+			break;
+	}
+
+	/* The host treats the text as a string, so it mustnt contain any NULs,
+	 * which may well appear beyond what detection looked at. */
+	for (char *p = text; (p = (char *)memchr(p, '\0', out - p)) != NULL; p++)
+		*p = ' ';
+
+	return (int)(out - text);
+}
+
+/* Gets the next chunk of the text of FILENAME, which is in ENCODING, as a
+ * string in the SIZE bytes of TEXT.  OFFSET is the number of bytes of text
+ * the host has received so far; when it matches what we have handed out,
+ * decoding resumes where it left off instead of starting over.  An OFFSET
+ * of -1 means that the host is done with the file. */
+TCFieldTypeOrStatus
+FullTextGet(char const *filename, Encoding const *encoding, int offset, char *text, int size)
+{
+	if (offset >= 0 && size < FULL_TEXT_MAX_CHAR_SIZE + 1)
+		return TCFieldStatusFieldEmpty;
+
+	EnterCriticalSection(&s_full_texts_lock);
+
+	BOOL found;
+	FullText *full_text = FullTextFind(filename, &found);
+	full_text->last_used = ++s_n_full_text_uses;
+
+	TCFieldTypeOrStatus status = TCFieldTypeFullText;
+	if (offset < 0) {
+		if (found)
+			FullTextStop(full_text);
+		status = TCFieldStatusFieldEmpty;
+	} else if (!found || offset != full_text->output_offset) {
+		status = FullTextStart(full_text, filename, encoding);
+
+		/* Skip whatever the host has already received. */
+		while (status == TCFieldStatusSetSuccess && full_text->output_offset < offset) {
+			int n = FullTextDecode(full_text, text,
+								   min(size - 1, offset - full_text->output_offset));
+			if (n == 0)
+				break;
+			full_text->output_offset += n;
+		}
+		if (status == TCFieldStatusSetSuccess)
+			status = TCFieldTypeFullText;
+	}
+
+	if (status == TCFieldTypeFullText) {
+		int n = FullTextDecode(full_text, text, size - 1);
+		if (n == 0) {
+			FullTextStop(full_text);
+			status = TCFieldStatusFieldEmpty;
+		} else {
+			text[n] = '\0';
+			full_text->output_offset += n;
+		}
+	}
+
+	LeaveCriticalSection(&s_full_texts_lock);
+
+	return status;
+}
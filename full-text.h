@@ -0,0 +1,4 @@
+void FullTextOpen(void);
+void FullTextClose(void);
+TCFieldTypeOrStatus FullTextGet(char const *filename, Encoding const *encoding, int offset,
+								char *text, int size);
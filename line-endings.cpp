@@ -1,7 +1,11 @@
 #include "stdafx.h"
 #include "line-endings.h"
+#include "encoding.h"
+#include "simd.h"
 
 #include <strsafe.h>
+#include <emmintrin.h>
+#include <intrin.h>
 
 /* Obvious names for a couple of Unicode characters. */
 #define UNICODE_NEXT_LINE		0x0085
@@ -31,9 +35,10 @@ LineEnding
 LineEndingFind(unsigned char const * const bytes, size_t n_bytes, GetCharacterFunc getc)
 {
 	CharacterIterator iterator = { bytes, bytes + n_bytes, getc };
+	BOOL volatile const *aborted = EncodingAbortFlag();
 
 	while (iterator.p < iterator.end) {
-		if (g_get_value_aborted)
+		if (*aborted)
 			break;
 
 		unichar c = iterator.getc(&iterator);
@@ -57,3 +62,304 @@ LineEndingFind(unsigned char const * const bytes, size_t n_bytes, GetCharacterFu
 
 	return LineEndingUnknown;
 }
+
+/* Encodes C in FORM into BYTES, returning the number of bytes used, or 0
+ * if C cant be represented in FORM. */
+static size_t
+encode_unichar(TextForm form, unichar c, unsigned char *bytes)
+{
+	switch (form) {
+	case TextFormSingleByte:
+		if (c > 0xff)
+			return 0;
+		bytes[0] = (unsigned char)c;
+		return 1;
+	case TextFormUTF8:
+		if (c < 0x80) {
+			bytes[0] = (unsigned char)c;
+			return 1;
+		} else if (c < 0x800) {
+			bytes[0] = (unsigned char)(0xc0 | (c >> 6));
+			bytes[1] = (unsigned char)(0x80 | (c & 0x3f));
+			return 2;
+		}
+		bytes[0] = (unsigned char)(0xe0 | (c >> 12));
+		bytes[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3f));
+		bytes[2] = (unsigned char)(0x80 | (c & 0x3f));
+		return 3;
+	case TextFormUTF16BE:
+		bytes[0] = (unsigned char)(c >> 8);
+		bytes[1] = (unsigned char)c;
+		return 2;
+	case TextFormUTF16LE:
+		bytes[0] = (unsigned char)c;
+		bytes[1] = (unsigned char)(c >> 8);
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* Sets up CONVERTER for rewriting the line endings of text laid out in FORM
+ * to TARGET, returning FALSE if TARGET cant be represented in FORM.
+ * C1_CONTROLS says whether single-byte text has the C1 control characters,
+ * NEL among them; Unicode always does. */
+BOOL
+LineEndingConverterInit(LineEndingConverter *converter, TextForm form, BOOL c1_controls,
+						LineEnding target)
+{
+	static unichar const endings[][2] = {
+		{ 0, 0 },
+		{ '\n', 0 },
+		{ '\r', '\n' },
+		{ '\r', 0 },
+		{ UNICODE_LINE_SEPARATOR, 0 },
+		{ UNICODE_NEXT_LINE, 0 },
+	};
+
+	BOOL next_line = form != TextFormSingleByte || c1_controls;
+	if (target <= LineEndingUnknown || target >= _countof(endings) ||
+		(target == LineEndingNEL && !next_line))
+		return FALSE;
+
+	converter->form = form;
+	converter->next_line = next_line;
+	converter->target = target;
+	converter->ending_length = 0;
+	for (int i = 0; i < 2 && endings[target][i] != 0; i++) {
+		size_t length = encode_unichar(form, endings[target][i],
+									   converter->ending + converter->ending_length);
+		if (length == 0)
+			return FALSE;
+		converter->ending_length += length;
+	}
+
+	return TRUE;
+}
+
+/* Determines if FORM is one of the UTF-16 forms. */
+static BOOL
+is_utf16(TextForm form)
+{
+	return form == TextFormUTF16BE || form == TextFormUTF16LE;
+}
+
+/* Gets the UTF-16 code unit at P laid out in FORM. */
+static unichar
+utf16_unit(unsigned char const *p, TextForm form)
+{
+	return form == TextFormUTF16BE ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+/* Finds the first byte (or code unit) between P and END, in text laid out in
+ * FORM, that may begin a line ending, looking at sixteen bytes at a time.
+ * NEL is only looked for if NEXT_LINE is set.  Returns END, or the start of
+ * a trailing partial code unit, if there is none. */
+static unsigned char const *
+find_line_ending_candidate(TextForm form, BOOL next_line,
+						   unsigned char const *p, unsigned char const *end)
+{
+	__m128i a, b, c, d;
+	unsigned long index;
+
+	if (is_utf16(form)) {
+		BOOL big = form == TextFormUTF16BE;
+		unsigned char const *units_end = p + ((end - p) & ~1);
+
+		a = _mm_set1_epi16(big ? 0x0d00 : 0x000d);
+		b = _mm_set1_epi16(big ? 0x0a00 : 0x000a);
+		c = _mm_set1_epi16(big ? (short)0x8500 : 0x0085);
+		d = _mm_set1_epi16(big ? 0x2820 : 0x2028);
+		unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 ? units_end : p;
+		for (; p + 16 <= vector_end; p += 16) {
+			__m128i v = _mm_loadu_si128((__m128i const *)p);
+			__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi16(v, a), _mm_cmpeq_epi16(v, b)),
+									 _mm_or_si128(_mm_cmpeq_epi16(v, c), _mm_cmpeq_epi16(v, d)));
+			if (_BitScanForward(&index, _mm_movemask_epi8(m)))
+				return p + index;
+		}
+
+		for (; p < units_end; p += 2) {
+			unichar unit = utf16_unit(p, form);
+			if (unit == '\r' || unit == '\n' ||
+				unit == UNICODE_NEXT_LINE || unit == UNICODE_LINE_SEPARATOR)
+				return p;
+		}
+
+		return p;
+	}
+
+	/* In UTF-8, NEL and LS begin with 0xc2 and 0xe2; in the single-byte
+	 * encodings that have it, NEL is 0x85. */
+	unsigned char nel = form == TextFormUTF8 ? 0xc2 : next_line ? 0x85 : '\n';
+	unsigned char ls = form == TextFormUTF8 ? 0xe2 : '\n';
+
+	a = _mm_set1_epi8('\r');
+	b = _mm_set1_epi8('\n');
+	c = _mm_set1_epi8((char)nel);
+	d = _mm_set1_epi8((char)ls);
+	unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 ? end : p;
+	for (; p + 16 <= vector_end; p += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)p);
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, a), _mm_cmpeq_epi8(v, b)),
+								 _mm_or_si128(_mm_cmpeq_epi8(v, c), _mm_cmpeq_epi8(v, d)));
+		if (_BitScanForward(&index, _mm_movemask_epi8(m)))
+			return p + index;
+	}
+
+	for (; p < end; p++)
+		if (*p == '\r' || *p == '\n' || *p == nel || *p == ls)
+			return p;
+
+	return p;
+}
+
+/* Determines what LineEnding, if any, begins at P, which is a candidate
+ * found by find_line_ending_candidate(), storing the number of bytes it
+ * (or the non-line-ending bytes at P) spans in LENGTH.  LENGTH is set to 0
+ * if the bytes up to END arent enough to tell and FINAL isnt set.  NEL is
+ * only taken for one if NEXT_LINE is set. */
+static LineEnding
+line_ending_at(TextForm form, BOOL next_line, unsigned char const *p, unsigned char const *end,
+			   BOOL final, size_t *length)
+{
+	size_t available = end - p;
+	size_t unit = is_utf16(form) ? 2 : 1;
+
+	if (available < unit) {
+		*length = final ? available : 0;
+		return LineEndingUnknown;
+	}
+
+	unichar c = unit == 2 ? utf16_unit(p, form) : *p;
+	switch (c) {
+	case '\r':
+		if (available < 2 * unit) {
+			*length = final ? unit : 0;
+			return LineEndingCR;
+		}
+		if ((unit == 2 ? utf16_unit(p + 2, form) : p[1]) == '\n') {
+			*length = 2 * unit;
+			return LineEndingCRLF;
+		}
+		*length = unit;
+		return LineEndingCR;
+	case '\n':
+		*length = unit;
+		return LineEndingLF;
+	case UNICODE_NEXT_LINE:
+		if (!next_line)
+			break;
+		*length = unit;
+		return LineEndingNEL;
+	case UNICODE_LINE_SEPARATOR:
+		*length = unit;
+		return LineEndingLS;
+	case 0xc2:
+		if (form != TextFormUTF8)
+			break;
+		if (available < 2) {
+			*length = final ? 1 : 0;
+			return LineEndingUnknown;
+		}
+		*length = p[1] == 0x85 ? 2 : 1;
+		return p[1] == 0x85 ? LineEndingNEL : LineEndingUnknown;
+	case 0xe2:
+		if (form != TextFormUTF8)
+			break;
+		if (available < 3 && !final && (available < 2 || p[1] == 0x80)) {
+			*length = 0;
+			return LineEndingUnknown;
+		}
+		if (available >= 3 && p[1] == 0x80 && p[2] == 0xa8) {
+			*length = 3;
+			return LineEndingLS;
+		}
+		break;
+	}
+
+	*length = unit;
+	return LineEndingUnknown;
+}
+
+/* Rewrites the line endings between *IN and IN_END for CONVERTER into the
+ * OUT_SIZE bytes of OUT, returning the number of bytes produced.  If OUT is
+ * NULL, nothing is written and the number of bytes that would have been
+ * produced is returned.  *IN is advanced past what was consumed; a trailing
+ * partial line ending is left for the next call unless FINAL is set.  The
+ * number of line endings that differ from the target is added to
+ * N_CHANGED, unless it is NULL. */
+static size_t
+line_endings_rewrite(LineEndingConverter const *converter,
+					 unsigned char const **in, unsigned char const *in_end,
+					 unsigned char *out, size_t out_size, BOOL final,
+					 size_t *n_changed)
+{
+	unsigned char const *p = *in;
+	size_t n = 0;
+	size_t unit = is_utf16(converter->form) ? 2 : 1;
+
+	while (p < in_end) {
+		unsigned char const *candidate =
+			find_line_ending_candidate(converter->form, converter->next_line, p, in_end);
+		size_t run = candidate - p;
+		if (out != NULL) {
+			run = min(run, (out_size - n) / unit * unit);
+			memcpy(out + n, p, run);
+		}
+		n += run;
+		p += run;
+		if (p < candidate || p == in_end)
+			break;
+
+		size_t length;
+		LineEnding line_ending = line_ending_at(converter->form, converter->next_line,
+												 p, in_end, final, &length);
+		if (length == 0)
+			break;
+
+		unsigned char const *bytes = p;
+		size_t n_bytes = length;
+		if (line_ending != LineEndingUnknown) {
+			bytes = converter->ending;
+			n_bytes = converter->ending_length;
+			if (n_changed != NULL && line_ending != converter->target)
+				(*n_changed)++;
+		}
+
+		if (out != NULL) {
+			if (out_size - n < n_bytes)
+				break;
+			memcpy(out + n, bytes, n_bytes);
+		}
+		n += n_bytes;
+		p += length;
+	}
+
+	*in = p;
+
+	return n;
+}
+
+/* Measures how many bytes rewriting the line endings between *IN and IN_END
+ * with CONVERTER would produce, advancing *IN as LineEndingConvert() would.
+ * The number of line endings that would change is added to N_CHANGED. */
+size_t
+LineEndingMeasure(LineEndingConverter const *converter,
+				  unsigned char const **in, unsigned char const *in_end,
+				  BOOL final, size_t *n_changed)
+{
+	return line_endings_rewrite(converter, in, in_end, NULL, 0, final, n_changed);
+}
+
+/* Rewrites the line endings between *IN and IN_END with CONVERTER into the
+ * bytes between *OUT and OUT_END, advancing both past what was consumed and
+ * produced.  Stops when the output is full or when the input ends in what
+ * may be the beginning of a line ending, unless FINAL is set. */
+void
+LineEndingConvert(LineEndingConverter const *converter,
+				  unsigned char const **in, unsigned char const *in_end,
+				  unsigned char **out, unsigned char *out_end, BOOL final)
+{
+	*out += line_endings_rewrite(converter, in, in_end, *out, out_end - *out, final, NULL);
+}
@@ -9,6 +9,16 @@ typedef enum LineEnding
 	LineEndingNEL,
 };
 
+/* The ways in which characters can be laid out in bytes. */
+typedef enum TextForm
+{
+	TextFormNone,
+	TextFormSingleByte,
+	TextFormUTF8,
+	TextFormUTF16BE,
+	TextFormUTF16LE,
+};
+
 /* The type of Unicode characters. */
 typedef int unichar;
 
@@ -34,3 +44,27 @@ struct _CharacterIterator
 };
 
 LineEnding LineEndingFind(unsigned char const * const bytes, size_t n_bytes, GetCharacterFunc getc);
+
+/* A converter rewriting every line ending in text laid out in FORM to
+ * TARGET, which is encoded as the ENDING_LENGTH bytes of ENDING.  NEXT_LINE
+ * says whether the text has NEL characters at all, which single-byte code
+ * pages without the C1 controls use 0x85 for something else, if anything. */
+typedef struct _LineEndingConverter LineEndingConverter;
+
+struct _LineEndingConverter
+{
+	TextForm form;
+	BOOL next_line;
+	LineEnding target;
+	unsigned char ending[8];
+	size_t ending_length;
+};
+
+BOOL LineEndingConverterInit(LineEndingConverter *converter, TextForm form, BOOL c1_controls,
+							 LineEnding target);
+size_t LineEndingMeasure(LineEndingConverter const *converter,
+						 unsigned char const **in, unsigned char const *in_end,
+						 BOOL final, size_t *n_changed);
+void LineEndingConvert(LineEndingConverter const *converter,
+					   unsigned char const **in, unsigned char const *in_end,
+					   unsigned char **out, unsigned char *out_end, BOOL final);
@@ -0,0 +1,444 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "file-mapping.h"
+#include "line-index.h"
+#include "settings.h"
+#include "simd.h"
+#include "stats.h"
+
+#include <strsafe.h>
+#include <emmintrin.h>
+#include <intrin.h>
+
+/* Lines are found by looking for the key byte of their line ending, its
+ * last byte that isnt zero, sixteen bytes at a time, and checking the
+ * bytes around each one found.  Large files are split into chunks that
+ * are scanned on several threads twice over: once to count the lines in
+ * each chunk, which gives the number of the first line of each, and once
+ * more to store the offsets of those lines that are sampled. */
+#define LINE_INDEX_CHUNK_SIZE	(16 * 1024 * 1024)
+#define LINE_INDEX_WINDOW_SIZE	(1024 * 1024)
+#define LINE_INDEX_MAX_THREADS	16
+
+C_ASSERT(sizeof(LineIndexHeader) % sizeof(ULONGLONG) == 0);
+
+/* The LENGTH BYTES that end a line in text laid out in units of UNIT
+ * bytes, the byte at KEY of which is looked for. */
+typedef struct _LineTerminator LineTerminator;
+
+struct _LineTerminator
+{
+	unsigned char bytes[8];
+	size_t length;
+	size_t key;
+	size_t unit;
+};
+
+/* The lines found by a scan, the first of which is line number FIRST.
+ *
+ * N_FOUND is the number of lines found so far, of which at most LIMIT are
+ * looked for.
+ * SAMPLES, if not NULL, is where the offset of every INTERVAL-th line of
+ * the file goes.
+ * LAST is the offset of the last line found. */
+typedef struct _LineStarts LineStarts;
+
+struct _LineStarts
+{
+	ULONGLONG first;
+	ULONGLONG n_found;
+	ULONGLONG limit;
+	DWORD interval;
+	ULONGLONG *samples;
+	ULONGLONG last;
+};
+
+/* A chunk of a file being scanned in parallel: the line endings whose key
+ * bytes lie between START and END, and the lines they begin. */
+typedef struct _LineIndexChunk LineIndexChunk;
+
+struct _LineIndexChunk
+{
+	ULONGLONG start;
+	ULONGLONG end;
+	LineStarts starts;
+};
+
+/* The scan of the N_CHUNKS CHUNKS of FILENAME for TERMINATOR, which are
+ * claimed in turn by threads through NEXT.  FAILED is set if any of them
+ * fails. */
+typedef struct _LineIndexScan LineIndexScan;
+
+struct _LineIndexScan
+{
+	char const *filename;
+	LineTerminator const *terminator;
+	LineIndexChunk *chunks;
+	LONG n_chunks;
+	LONG volatile next;
+	BOOL volatile failed;
+};
+
+/* Sets up TERMINATOR for the LINE_ENDING of text laid out in FORM, which
+ * has the C1 control characters if C1_CONTROLS is set.  Text without line
+ * endings is indexed as if it used line feeds. */
+static BOOL
+LineTerminatorInit(LineTerminator *terminator, TextForm form, BOOL c1_controls,
+				   LineEnding line_ending)
+{
+	LineEndingConverter converter;
+	if (!LineEndingConverterInit(&converter, form, c1_controls,
+								 line_ending == LineEndingUnknown ? LineEndingLF : line_ending))
+		return FALSE;
+
+	CopyMemory(terminator->bytes, converter.ending, converter.ending_length);
+	terminator->length = converter.ending_length;
+	terminator->key = terminator->length - 1;
+	while (terminator->key > 0 && terminator->bytes[terminator->key] == 0)
+		terminator->key--;
+	terminator->unit = form == TextFormUTF16BE || form == TextFormUTF16LE ? 2 : 1;
+
+	return TRUE;
+}
+
+/* Adds the line beginning at OFFSET to STARTS. */
+static void
+LineStartsAdd(LineStarts *starts, ULONGLONG offset)
+{
+	if (starts->n_found >= starts->limit)
+		return;
+
+	ULONGLONG line = starts->first + starts->n_found++;
+	if (starts->samples != NULL && line % starts->interval == 0)
+		starts->samples[line / starts->interval] = offset;
+	starts->last = offset;
+}
+
+/* Adds the line begun by the line ending whose key byte is at KEY in the
+ * view of WINDOW to STARTS, if it is one. */
+static void
+LineStartsCheck(LineStarts *starts, LineTerminator const *terminator,
+				FileWindow const *window, unsigned char const *key)
+{
+	unsigned char const *begin = key - terminator->key;
+	unsigned char const *end = begin + terminator->length;
+	if (begin < window->bytes || end > window->bytes + window->n_bytes)
+		return;
+
+	ULONGLONG offset = window->offset + (begin - window->bytes);
+	ULONGLONG line = window->offset + (end - window->bytes);
+	if (offset % terminator->unit != 0 || line >= window->file_size ||
+		memcmp(begin, terminator->bytes, terminator->length) != 0)
+		return;
+
+	LineStartsAdd(starts, line);
+}
+
+/* Finds the lines begun by the line endings of TERMINATOR whose key bytes
+ * lie between OFFSET and END in WINDOW, adding them to STARTS until it has
+ * as many as it looks for. */
+static BOOL
+LineIndexScanBytes(FileWindow *window, LineTerminator const *terminator,
+				   ULONGLONG offset, ULONGLONG end, LineStarts *starts)
+{
+	unsigned char key = terminator->bytes[terminator->key];
+	__m128i keys = _mm_set1_epi8((char)key);
+
+	while (offset < end && starts->n_found < starts->limit) {
+		/* Map enough on either side to check line endings straddling the
+		 * ends of the scanned bytes. */
+		ULONGLONG scan_end = min(end, offset + LINE_INDEX_WINDOW_SIZE);
+		ULONGLONG from = offset - min(offset, (ULONGLONG)terminator->key);
+		if (!FileWindowMove(window, from, (size_t)(scan_end - from) + terminator->length))
+			return FALSE;
+
+		unsigned char const *p = window->bytes + (size_t)(offset - window->offset);
+		unsigned char const *q = window->bytes + (size_t)(scan_end - window->offset);
+		unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 ? q : p;
+		for (; vector_end - p >= 16 && starts->n_found < starts->limit; p += 16) {
+			unsigned long mask = (unsigned long)
+				_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *)p), keys));
+			unsigned long index;
+			while (_BitScanForward(&index, mask)) {
+				mask &= mask - 1;
+				LineStartsCheck(starts, terminator, window, p + index);
+			}
+		}
+
+		for (; p < q && starts->n_found < starts->limit; p++)
+			if (*p == key)
+				LineStartsCheck(starts, terminator, window, p);
+
+		offset = scan_end;
+	}
+
+	return TRUE;
+}
+
+/* The thread scanning the chunks of CLOSURE, a LineIndexScan, that it
+ * manages to claim. */
+static DWORD WINAPI
+LineIndexScanThread(LPVOID closure)
+{
+	LineIndexScan *scan = (LineIndexScan *)closure;
+
+	FileWindow window;
+	if (FileWindowOpen(scan->filename, &window) != TCFieldStatusSetSuccess) {
+		scan->failed = TRUE;
+		return 0;
+	}
+
+	for (;;) {
+		LONG i = InterlockedIncrement(&scan->next) - 1;
+		if (i >= scan->n_chunks || scan->failed)
+			break;
+
+		LineIndexChunk *chunk = &scan->chunks[i];
+		if (!LineIndexScanBytes(&window, scan->terminator, chunk->start, chunk->end,
+								&chunk->starts)) {
+			scan->failed = TRUE;
+			break;
+		}
+	}
+
+	FileWindowClose(&window);
+
+	return 0;
+}
+
+/* Scans all the chunks of SCAN on the calling thread and as many more as
+ * the conversion settings allow. */
+static BOOL
+LineIndexScanRun(LineIndexScan *scan)
+{
+	HANDLE threads[LINE_INDEX_MAX_THREADS];
+	int n_threads = (int)min(min(g_settings.conversion_threads, (DWORD)LINE_INDEX_MAX_THREADS),
+							 (DWORD)scan->n_chunks);
+	int n_started = 0;
+
+	scan->next = 0;
+	for (; n_started < n_threads - 1; n_started++) {
+		threads[n_started] = CreateThread(NULL, 0, LineIndexScanThread, scan, 0, NULL);
+		if (threads[n_started] == NULL)
+			break;
+	}
+	LineIndexScanThread(scan);
+	if (n_started > 0)
+		WaitForMultipleObjects(n_started, threads, TRUE, INFINITE);
+	for (int i = 0; i < n_started; i++)
+		CloseHandle(threads[i]);
+
+	return !scan->failed;
+}
+
+/* Gets the size and last write time of FILENAME. */
+static BOOL
+LineIndexFileVersion(char const *filename, ULONGLONG *size, ULONGLONG *write_time)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesEx(filename, GetFileExInfoStandard, &data))
+		return FALSE;
+
+	*size = ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	*write_time = ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) |
+		data.ftLastWriteTime.dwLowDateTime;
+
+	return TRUE;
+}
+
+/* Writes the N_BYTES of BYTES to FILE. */
+static BOOL
+LineIndexWrite(HANDLE file, void const *bytes, size_t n_bytes)
+{
+	DWORD bytes_written;
+
+	return WriteFile(file, bytes, (DWORD)n_bytes, &bytes_written, NULL) &&
+		bytes_written == n_bytes;
+}
+
+/* Indexes the lines of FILENAME, which is in ENCODING and uses
+ * LINE_ENDING, into the file next to it named after it with
+ * LINE_INDEX_EXTENSION appended, storing the number of lines it has in
+ * N_LINES.  Every g_settings.line_index_interval-th line is indexed. */
+TCFieldTypeOrStatus
+LineIndexBuild(char const *filename, Encoding const *encoding, LineEnding line_ending,
+			   ULONGLONG *n_lines)
+{
+	TextForm form = EncodingTextForm(encoding);
+	LineTerminator terminator;
+	if (form == TextFormNone ||
+		!LineTerminatorInit(&terminator, form, EncodingHasC1Controls(encoding), line_ending))
+		return TCFieldStatusFieldEmpty;
+
+	char index_filename[MAX_PATH];
+	if (FAILED(StringCbPrintf(index_filename, sizeof(index_filename), "%s%s",
+							  filename, LINE_INDEX_EXTENSION)))
+		return TCFieldStatusFileError;
+
+	LineIndexHeader header;
+	ZeroMemory(&header, sizeof(header));
+	header.magic = LINE_INDEX_MAGIC;
+	header.version = LINE_INDEX_VERSION;
+	header.interval = g_settings.line_index_interval;
+	header.form = form;
+	header.line_ending = line_ending;
+	if (!LineIndexFileVersion(filename, &header.file_size, &header.write_time))
+		return TCFieldStatusFileError;
+
+	ULONGLONG bom_length = lstrlen(EncodingBOM(encoding));
+	if (header.file_size <= bom_length)
+		return TCFieldStatusFieldEmpty;
+
+	LONG n_chunks = (LONG)((header.file_size + LINE_INDEX_CHUNK_SIZE - 1) / LINE_INDEX_CHUNK_SIZE);
+	StatsCount(StatsCounterHeapAllocations, 1);
+	LineIndexChunk *chunks = (LineIndexChunk *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+														 n_chunks * sizeof(LineIndexChunk));
+	if (chunks == NULL)
+		return TCFieldStatusFileError;
+
+	for (LONG i = 0; i < n_chunks; i++) {
+		chunks[i].start = max(bom_length, (ULONGLONG)i * LINE_INDEX_CHUNK_SIZE);
+		chunks[i].end = min(header.file_size, (ULONGLONG)(i + 1) * LINE_INDEX_CHUNK_SIZE);
+		chunks[i].starts.limit = (ULONGLONG)-1;
+	}
+
+	/* The first line begins right after the BOM, and each line ending found
+	 * begins another. */
+	LineIndexScan scan = { filename, &terminator, chunks, n_chunks, 0, FALSE };
+	BOOL indexed = LineIndexScanRun(&scan);
+
+	ULONGLONG *samples = NULL;
+	if (indexed) {
+		header.n_lines = 1;
+		for (LONG i = 0; i < n_chunks; i++) {
+			chunks[i].starts.first = header.n_lines;
+			header.n_lines += chunks[i].starts.n_found;
+		}
+
+		size_t n_samples = (size_t)((header.n_lines + header.interval - 1) / header.interval);
+		StatsCount(StatsCounterHeapAllocations, 1);
+		samples = (ULONGLONG *)HeapAlloc(GetProcessHeap(), 0, n_samples * sizeof(ULONGLONG));
+		indexed = samples != NULL;
+		if (indexed) {
+			samples[0] = bom_length;
+			for (LONG i = 0; i < n_chunks; i++) {
+				chunks[i].starts.n_found = 0;
+				chunks[i].starts.interval = header.interval;
+				chunks[i].starts.samples = samples;
+			}
+			indexed = LineIndexScanRun(&scan);
+		}
+
+		if (indexed) {
+			HANDLE file = CreateFile(index_filename, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+									 FILE_ATTRIBUTE_NORMAL, NULL);
+			indexed = file != INVALID_HANDLE_VALUE &&
+				LineIndexWrite(file, &header, sizeof(header)) &&
+				LineIndexWrite(file, samples, n_samples * sizeof(ULONGLONG));
+			if (file != INVALID_HANDLE_VALUE)
+				CloseHandle(file);
+			if (!indexed)
+				DeleteFile(index_filename);
+		}
+	}
+
+	if (samples != NULL)
+		HeapFree(GetProcessHeap(), 0, samples);
+	HeapFree(GetProcessHeap(), 0, chunks);
+
+	if (!indexed)
+		return TCFieldStatusFileError;
+
+	*n_lines = header.n_lines;
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Maps the line index of FILENAME into INDEX, which is to be closed with
+ * LineIndexClose() if it is found.  Returns TCFieldStatusFieldEmpty if
+ * there is no index of this version of the file. */
+TCFieldTypeOrStatus
+LineIndexOpen(char const *filename, LineIndex *index)
+{
+	char index_filename[MAX_PATH];
+	if (FAILED(StringCbPrintf(index_filename, sizeof(index_filename), "%s%s",
+							  filename, LINE_INDEX_EXTENSION)))
+		return TCFieldStatusFileError;
+
+	ULONGLONG file_size, write_time;
+	if (!LineIndexFileVersion(filename, &file_size, &write_time))
+		return TCFieldStatusFileError;
+
+	if (MapFile(index_filename, &index->mapping, 0) != TCFieldStatusSetSuccess)
+		return TCFieldStatusFieldEmpty;
+
+	LineIndexHeader const *header = (LineIndexHeader const *)index->mapping.bytes;
+	size_t n_samples = 0;
+	BOOL valid = index->mapping.n_bytes >= sizeof(LineIndexHeader) &&
+		header->magic == LINE_INDEX_MAGIC && header->version == LINE_INDEX_VERSION &&
+		header->file_size == file_size && header->write_time == write_time &&
+		header->interval > 0;
+	if (valid) {
+		n_samples = (size_t)((header->n_lines + header->interval - 1) / header->interval);
+		valid = (index->mapping.n_bytes - sizeof(LineIndexHeader)) / sizeof(ULONGLONG) >= n_samples;
+	}
+	if (!valid) {
+		UnmapFile(&index->mapping);
+		return TCFieldStatusFieldEmpty;
+	}
+
+	index->header = header;
+	index->offsets = (ULONGLONG const *)(header + 1);
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Finds the OFFSET at which line LINE, counting from 0, of FILENAME begins
+ * by way of its line INDEX, scanning from the nearest line it has the
+ * offset of.  Returns TCFieldStatusFieldEmpty if there is no such line. */
+TCFieldTypeOrStatus
+LineIndexFind(LineIndex const *index, char const *filename, ULONGLONG line, ULONGLONG *offset)
+{
+	LineIndexHeader const *header = index->header;
+	if (line >= header->n_lines)
+		return TCFieldStatusFieldEmpty;
+
+	ULONGLONG sample = index->offsets[line / header->interval];
+	ULONGLONG remaining = line % header->interval;
+	if (remaining == 0) {
+		*offset = sample;
+		return TCFieldStatusSetSuccess;
+	}
+
+	/* Indexes are only built for line endings that their text can have. */
+	LineTerminator terminator;
+	if (!LineTerminatorInit(&terminator, (TextForm)header->form, TRUE,
+							(LineEnding)header->line_ending))
+		return TCFieldStatusFileError;
+
+	FileWindow window;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &window);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+
+	LineStarts starts = { 0, 0, remaining, 0, NULL, 0 };
+	BOOL found = LineIndexScanBytes(&window, &terminator, sample, window.file_size, &starts) &&
+		starts.n_found == remaining;
+
+	FileWindowClose(&window);
+
+	if (!found)
+		return TCFieldStatusFileError;
+
+	*offset = starts.last;
+
+	return TCFieldStatusSetSuccess;
+}
+
+void
+LineIndexClose(LineIndex *index)
+{
+	UnmapFile(&index->mapping);
+}
@@ -0,0 +1,47 @@
+/* The file that the line index of a file is kept in is named after it,
+ * with this appended. */
+#define LINE_INDEX_EXTENSION	".lines"
+
+#define LINE_INDEX_MAGIC		0x4c584457	/* "WDXL" */
+#define LINE_INDEX_VERSION		1
+
+/* The header of a line index, which is followed by the offsets of the
+ * beginnings of every INTERVAL-th line of the file, from the first on, as
+ * ULONGLONGs, so that it can be mapped and used as it is.
+ *
+ * FILE_SIZE and WRITE_TIME are those of the file when it was indexed, so
+ * that stale indexes can be told apart.
+ * FORM and LINE_ENDING are the TextForm and LineEnding of its text, whose
+ * line endings alone end its lines.
+ * N_LINES is the number of lines in it. */
+typedef struct _LineIndexHeader LineIndexHeader;
+
+struct _LineIndexHeader
+{
+	DWORD magic;
+	DWORD version;
+	ULONGLONG file_size;
+	ULONGLONG write_time;
+	ULONGLONG n_lines;
+	DWORD interval;
+	DWORD form;
+	DWORD line_ending;
+	DWORD reserved;
+};
+
+/* The line index of a file, mapped from MAPPING.  OFFSETS follow HEADER. */
+typedef struct _LineIndex LineIndex;
+
+struct _LineIndex
+{
+	FileMapping mapping;
+	LineIndexHeader const *header;
+	ULONGLONG const *offsets;
+};
+
+TCFieldTypeOrStatus LineIndexBuild(char const *filename, Encoding const *encoding,
+								   LineEnding line_ending, ULONGLONG *n_lines);
+TCFieldTypeOrStatus LineIndexOpen(char const *filename, LineIndex *index);
+TCFieldTypeOrStatus LineIndexFind(LineIndex const *index, char const *filename,
+								  ULONGLONG line, ULONGLONG *offset);
+void LineIndexClose(LineIndex *index);
@@ -0,0 +1,594 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "decompress.h"
+#include "file-mapping.h"
+#include "regions.h"
+#include "settings.h"
+#include "simd.h"
+#include "stats.h"
+
+#include <strsafe.h>
+#include <emmintrin.h>
+#include <intrin.h>
+
+/* Files that have been pieced together from text in different encodings,
+ * like logs written to by programs that disagree about it, are split into
+ * regions by looking at each byte that isnt ASCII: those beginning a valid
+ * UTF-8 sequence are UTF-8, and the rest are in a single-byte encoding.
+ * ASCII fits in with either, so it is left with the region before it,
+ * except that where the encoding changes, the new region begins after the
+ * last line feed before it, if there is one, so that lines are kept whole.
+ *
+ * Large files are split into chunks scanned on several threads, each of
+ * which keeps the ASCII at either end of its chunk apart, so that it can be
+ * sorted out once the regions of all the chunks are joined. */
+#define REGIONS_CHUNK_SIZE		(16 * 1024 * 1024)
+#define REGIONS_WINDOW_SIZE		(1024 * 1024)
+#define REGIONS_MAX_THREADS		16
+
+/* What the bytes of a run are known to be in. */
+typedef enum RunKind
+{
+	RunKindASCII,
+	RunKindUTF8,
+	RunKindSingleByte,
+};
+
+/* The bytes between OFFSET and END, of KIND.  NEWLINE is the offset just
+ * past the last line feed in a run of ASCII, or 0 if there is none, and C1
+ * is set if a single-byte run has bytes that are control characters in
+ * ISO-8859-1. */
+typedef struct _Run Run;
+
+struct _Run
+{
+	ULONGLONG offset;
+	ULONGLONG end;
+	RunKind kind;
+	BOOL c1;
+	ULONGLONG newline;
+};
+
+/* Joins the bytes of a file into runs, in order.
+ *
+ * RUNS are the N_RUNS runs that are done, with room for SIZE.
+ * CURRENT is the run being built, which is ASCII until the first byte
+ * that isnt, and GAP is the ASCII following it.
+ * KEEP_EDGES keeps the ASCII before the first run that isnt and after the
+ * last as runs of their own, instead of joining them to it.
+ * FAILED is set if memory runs out. */
+typedef struct _RunJoiner RunJoiner;
+
+struct _RunJoiner
+{
+	Run *runs;
+	size_t n_runs;
+	size_t size;
+	Run current;
+	Run gap;
+	BOOL keep_edges;
+	BOOL failed;
+};
+
+/* A chunk of a file being scanned in parallel: the bytes between START
+ * and END, joined into runs by JOINER. */
+typedef struct _RegionsChunk RegionsChunk;
+
+struct _RegionsChunk
+{
+	ULONGLONG start;
+	ULONGLONG end;
+	RunJoiner joiner;
+};
+
+/* The scan of the N_CHUNKS CHUNKS of FILENAME, which are claimed in turn by
+ * threads through NEXT.  FAILED is set if any of them fails.  ABORTED is
+ * the flag that the thread that asked for the scan stops at, which all of
+ * them stop at. */
+typedef struct _RegionsScan RegionsScan;
+
+struct _RegionsScan
+{
+	char const *filename;
+	RegionsChunk *chunks;
+	LONG n_chunks;
+	LONG volatile next;
+	BOOL volatile failed;
+	BOOL volatile const *aborted;
+};
+
+static void
+RunJoinerInit(RunJoiner *joiner, ULONGLONG offset, BOOL keep_edges)
+{
+	Run empty = { offset, offset, RunKindASCII, FALSE, 0 };
+
+	joiner->runs = NULL;
+	joiner->n_runs = 0;
+	joiner->size = 0;
+	joiner->current = empty;
+	joiner->gap = empty;
+	joiner->keep_edges = keep_edges;
+	joiner->failed = FALSE;
+}
+
+static void
+RunJoinerFree(RunJoiner *joiner)
+{
+	if (joiner->runs != NULL)
+		HeapFree(GetProcessHeap(), 0, joiner->runs);
+	joiner->runs = NULL;
+}
+
+/* Adds RUN to the runs that JOINER is done with. */
+static void
+RunJoinerEmit(RunJoiner *joiner, Run const *run)
+{
+	if (joiner->n_runs == joiner->size) {
+		size_t size = max(16, 2 * joiner->size);
+		StatsCount(StatsCounterHeapAllocations, 1);
+		Run *runs = (Run *)(joiner->runs == NULL ?
+							HeapAlloc(GetProcessHeap(), 0, size * sizeof(Run)) :
+							HeapReAlloc(GetProcessHeap(), 0, joiner->runs, size * sizeof(Run)));
+		if (runs == NULL) {
+			joiner->failed = TRUE;
+			return;
+		}
+		joiner->runs = runs;
+		joiner->size = size;
+	}
+
+	joiner->runs[joiner->n_runs++] = *run;
+}
+
+/* Adds ASCII up to END, with its last line ending just before NEWLINE, or
+ * without any if it is 0, to JOINER. */
+static void
+RunJoinerASCII(RunJoiner *joiner, ULONGLONG end, ULONGLONG newline)
+{
+	joiner->gap.end = end;
+	if (newline != 0)
+		joiner->gap.newline = newline;
+}
+
+/* Adds the bytes between OFFSET and END, of KIND, to JOINER. */
+static void
+RunJoinerBytes(RunJoiner *joiner, ULONGLONG offset, ULONGLONG end, RunKind kind, BOOL c1)
+{
+	if (joiner->current.kind == RunKindASCII) {
+		if (joiner->keep_edges) {
+			if (joiner->gap.end > joiner->gap.offset)
+				RunJoinerEmit(joiner, &joiner->gap);
+			joiner->current.offset = offset;
+		}
+		joiner->current.kind = kind;
+		joiner->current.c1 = c1;
+	} else if (joiner->current.kind == kind) {
+		joiner->current.c1 = joiner->current.c1 || c1;
+	} else {
+		ULONGLONG boundary = joiner->gap.newline != 0 ? joiner->gap.newline : offset;
+		joiner->current.end = boundary;
+		RunJoinerEmit(joiner, &joiner->current);
+		joiner->current.offset = boundary;
+		joiner->current.kind = kind;
+		joiner->current.c1 = c1;
+	}
+
+	joiner->current.end = end;
+	joiner->gap.offset = end;
+	joiner->gap.end = end;
+	joiner->gap.newline = 0;
+}
+
+/* Adds what JOINER is still building to the runs it is done with. */
+static void
+RunJoinerFinish(RunJoiner *joiner)
+{
+	BOOL has_gap = joiner->gap.end > joiner->gap.offset;
+
+	if (joiner->current.kind == RunKindASCII) {
+		if (joiner->keep_edges) {
+			if (has_gap)
+				RunJoinerEmit(joiner, &joiner->gap);
+		} else {
+			joiner->current.end = joiner->gap.end;
+			RunJoinerEmit(joiner, &joiner->current);
+		}
+	} else if (joiner->keep_edges) {
+		RunJoinerEmit(joiner, &joiner->current);
+		if (has_gap)
+			RunJoinerEmit(joiner, &joiner->gap);
+	} else {
+		joiner->current.end = joiner->gap.end;
+		RunJoinerEmit(joiner, &joiner->current);
+	}
+}
+
+/* Skips the ASCII between P and END, returning where it ends and setting
+ * *NEWLINE to the last line feed in it, if it has any. */
+static unsigned char const *
+SkipASCII(unsigned char const *p, unsigned char const *end, unsigned char const **newline)
+{
+	unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 ? end : p;
+	__m128i lf = _mm_set1_epi8('\n');
+
+	for (; vector_end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)p);
+		unsigned long high = (unsigned long)_mm_movemask_epi8(v);
+		unsigned long lfs = (unsigned long)_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		unsigned long index;
+
+		if (high != 0) {
+			unsigned long first;
+			_BitScanForward(&first, high);
+			lfs &= (1UL << first) - 1;
+			if (_BitScanReverse(&index, lfs))
+				*newline = p + index;
+			return p + first;
+		}
+		if (_BitScanReverse(&index, lfs))
+			*newline = p + index;
+	}
+
+	for (; p < end && *p < 0x80; p++)
+		if (*p == '\n')
+			*newline = p;
+
+	return p;
+}
+
+/* Gets the length of the valid UTF-8 sequence beginning at P, whose first
+ * byte isnt ASCII, 0 if it doesnt begin one, or (size_t)-1 if END comes
+ * before the sequence does. */
+static size_t
+UTF8SequenceLength(unsigned char const *p, unsigned char const *end)
+{
+	unsigned char lead = *p;
+	unsigned char low = 0x80;
+	unsigned char high = 0xbf;
+	size_t length;
+
+	if (lead >= 0xc2 && lead <= 0xdf) {
+		length = 2;
+	} else if (lead >= 0xe0 && lead <= 0xef) {
+		length = 3;
+		if (lead == 0xe0)
+			low = 0xa0;
+		else if (lead == 0xed)
+			high = 0x9f;
+	} else if (lead >= 0xf0 && lead <= 0xf4) {
+		length = 4;
+		if (lead == 0xf0)
+			low = 0x90;
+		else if (lead == 0xf4)
+			high = 0x8f;
+	} else {
+		return 0;
+	}
+
+	for (size_t i = 1; i < length; i++) {
+		if (p + i >= end)
+			return (size_t)-1;
+		if (p[i] < low || p[i] > high)
+			return 0;
+		low = 0x80;
+		high = 0xbf;
+	}
+
+	return length;
+}
+
+/* Scans the bytes of WINDOW between START and END into the runs of
+ * JOINER, stopping once ABORTED is set. */
+static BOOL
+RegionsScanBytes(FileWindow *window, ULONGLONG start, ULONGLONG end, RunJoiner *joiner,
+				 BOOL volatile const *aborted)
+{
+	ULONGLONG offset = start;
+
+	while (offset < end) {
+		if (*aborted ||
+			!FileWindowMove(window, offset, (size_t)min(end - offset, (ULONGLONG)REGIONS_WINDOW_SIZE)))
+			return FALSE;
+
+		ULONGLONG base = window->offset;
+		unsigned char const *bytes = window->bytes;
+		unsigned char const *p = bytes + (size_t)(offset - base);
+		unsigned char const *q = bytes + window->n_bytes;
+		BOOL final = base + window->n_bytes >= end;
+
+		while (p < q) {
+			unsigned char const *newline = NULL;
+			p = SkipASCII(p, q, &newline);
+			RunJoinerASCII(joiner, base + (p - bytes),
+						   newline != NULL ? base + (newline + 1 - bytes) : 0);
+			if (p == q)
+				break;
+
+			ULONGLONG at = base + (p - bytes);
+			size_t length = UTF8SequenceLength(p, q);
+			if (length == (size_t)-1 && !final)
+				break;
+			if (length == 0 || length == (size_t)-1) {
+				BOOL c1 = *p < 0xa0 && *p != 0x85;
+				RunJoinerBytes(joiner, at, at + 1, RunKindSingleByte, c1);
+				p++;
+			} else {
+				RunJoinerBytes(joiner, at, at + length, RunKindUTF8, FALSE);
+				p += length;
+			}
+		}
+
+		offset = base + (p - bytes);
+	}
+
+	return !joiner->failed;
+}
+
+/* Moves the chunk boundary at OFFSET back to the beginning of the UTF-8
+ * sequence that it falls in, if any, so that the chunks on either side of
+ * it agree on where one ends and the next begins. */
+static BOOL
+RegionsChunkBoundary(FileWindow *window, ULONGLONG *offset)
+{
+	if (*offset == 0 || *offset >= window->file_size)
+		return TRUE;
+
+	ULONGLONG from = *offset - min(*offset, (ULONGLONG)3);
+	if (!FileWindowMove(window, from, 4))
+		return FALSE;
+
+	unsigned char const *bytes = window->bytes + (size_t)(from - window->offset);
+	size_t i = (size_t)(*offset - from);
+	while (i > 0 && (bytes[i] & 0xc0) == 0x80)
+		i--;
+	*offset = from + i;
+
+	return TRUE;
+}
+
+/* The thread scanning the chunks of CLOSURE, a RegionsScan, that it
+ * manages to claim. */
+static DWORD WINAPI
+RegionsScanThread(LPVOID closure)
+{
+	RegionsScan *scan = (RegionsScan *)closure;
+
+	FileWindow window;
+	if (FileWindowOpen(scan->filename, &window) != TCFieldStatusSetSuccess) {
+		scan->failed = TRUE;
+		return 0;
+	}
+
+	for (;;) {
+		LONG i = InterlockedIncrement(&scan->next) - 1;
+		if (i >= scan->n_chunks || scan->failed)
+			break;
+
+		RegionsChunk *chunk = &scan->chunks[i];
+		if (!RegionsChunkBoundary(&window, &chunk->start) ||
+			!RegionsChunkBoundary(&window, &chunk->end)) {
+			scan->failed = TRUE;
+			break;
+		}
+
+		RunJoinerInit(&chunk->joiner, chunk->start, TRUE);
+		if (!RegionsScanBytes(&window, chunk->start, chunk->end, &chunk->joiner, scan->aborted)) {
+			scan->failed = TRUE;
+			break;
+		}
+		RunJoinerFinish(&chunk->joiner);
+		if (chunk->joiner.failed) {
+			scan->failed = TRUE;
+			break;
+		}
+	}
+
+	FileWindowClose(&window);
+
+	return 0;
+}
+
+/* Gets the Encoding of the regions made from RUN. */
+static Encoding const *
+RunEncoding(Run const *run)
+{
+	switch (run->kind) {
+	case RunKindUTF8:
+		return EncodingNamed("UTF-8");
+	case RunKindSingleByte:
+		return EncodingNamed(run->c1 ? "ASCII++" : "ISO-8859");
+	default:
+		return EncodingNamed("ASCII");
+	}
+}
+
+/* Stores the whole of FILENAME in MAP as a single region in ENCODING. */
+static TCFieldTypeOrStatus
+RegionsWhole(char const *filename, Encoding const *encoding, RegionMap *map)
+{
+	FileWindow window;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &window);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+	ULONGLONG file_size = window.file_size;
+	FileWindowClose(&window);
+
+	StatsCount(StatsCounterHeapAllocations, 1);
+	map->regions = (Region *)HeapAlloc(GetProcessHeap(), 0, sizeof(Region));
+	if (map->regions == NULL)
+		return TCFieldStatusFileError;
+
+	map->regions[0].offset = 0;
+	map->regions[0].length = file_size;
+	map->regions[0].encoding = encoding;
+	map->n_regions = 1;
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Splits FILENAME, found to be in ENCODING, into the regions of MAP, which
+ * is to be freed with RegionsFree() if it is found.  Only uncompressed
+ * files in UTF-8 or a single-byte encoding are split; other text files are
+ * a single region, and files that arent text have none. */
+TCFieldTypeOrStatus
+RegionsFind(char const *filename, Encoding const *encoding, RegionMap *map)
+{
+	map->regions = NULL;
+	map->n_regions = 0;
+
+	TextForm form = EncodingTextForm(encoding);
+	if (form == TextFormNone)
+		return TCFieldStatusFieldEmpty;
+	if (form != TextFormSingleByte && form != TextFormUTF8)
+		return RegionsWhole(filename, encoding, map);
+
+	/* The encoding of compressed files is that of their contents, which
+	 * arent split. */
+	FileWindow window;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &window);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+	ULONGLONG file_size = window.file_size;
+	BOOL compressed = !FileWindowMove(&window, 0, 4) ||
+		DecompressIsCompressed(window.bytes, window.n_bytes);
+	FileWindowClose(&window);
+	if (compressed)
+		return RegionsWhole(filename, encoding, map);
+
+	LONG n_chunks = (LONG)((file_size + REGIONS_CHUNK_SIZE - 1) / REGIONS_CHUNK_SIZE);
+	StatsCount(StatsCounterHeapAllocations, 1);
+	RegionsChunk *chunks = (RegionsChunk *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+													 n_chunks * sizeof(RegionsChunk));
+	if (chunks == NULL)
+		return TCFieldStatusFileError;
+
+	for (LONG i = 0; i < n_chunks; i++) {
+		chunks[i].start = (ULONGLONG)i * REGIONS_CHUNK_SIZE;
+		chunks[i].end = min(file_size, chunks[i].start + REGIONS_CHUNK_SIZE);
+	}
+
+	RegionsScan scan = { filename, chunks, n_chunks, 0, FALSE, EncodingAbortFlag() };
+
+	/* The calling thread scans chunks too. */
+	HANDLE threads[REGIONS_MAX_THREADS];
+	int n_threads = (int)min(min(g_settings.conversion_threads, (DWORD)REGIONS_MAX_THREADS),
+							 (DWORD)n_chunks);
+	int n_started = 0;
+	for (; n_started < n_threads - 1; n_started++) {
+		threads[n_started] = CreateThread(NULL, 0, RegionsScanThread, &scan, 0, NULL);
+		if (threads[n_started] == NULL)
+			break;
+	}
+	RegionsScanThread(&scan);
+	if (n_started > 0)
+		WaitForMultipleObjects(n_started, threads, TRUE, INFINITE);
+	for (int i = 0; i < n_started; i++)
+		CloseHandle(threads[i]);
+
+	RunJoiner joiner;
+	RunJoinerInit(&joiner, 0, FALSE);
+	if (!scan.failed) {
+		for (LONG i = 0; i < n_chunks; i++) {
+			for (size_t j = 0; j < chunks[i].joiner.n_runs; j++) {
+				Run const *run = &chunks[i].joiner.runs[j];
+				if (run->kind == RunKindASCII)
+					RunJoinerASCII(&joiner, run->end, run->newline);
+				else
+					RunJoinerBytes(&joiner, run->offset, run->end, run->kind, run->c1);
+			}
+		}
+		RunJoinerFinish(&joiner);
+	}
+
+	for (LONG i = 0; i < n_chunks; i++)
+		RunJoinerFree(&chunks[i].joiner);
+	HeapFree(GetProcessHeap(), 0, chunks);
+
+	if (scan.failed || joiner.failed) {
+		RunJoinerFree(&joiner);
+		return *scan.aborted ? TCFieldStatusFieldEmpty : TCFieldStatusFileError;
+	}
+
+	StatsCount(StatsCounterHeapAllocations, 1);
+	map->regions = (Region *)HeapAlloc(GetProcessHeap(), 0, joiner.n_runs * sizeof(Region));
+	if (map->regions == NULL) {
+		RunJoinerFree(&joiner);
+		return TCFieldStatusFileError;
+	}
+
+	for (size_t i = 0; i < joiner.n_runs; i++) {
+		map->regions[i].offset = joiner.runs[i].offset;
+		map->regions[i].length = joiner.runs[i].end - joiner.runs[i].offset;
+		map->regions[i].encoding = RunEncoding(&joiner.runs[i]);
+	}
+	map->n_regions = joiner.n_runs;
+
+	RunJoinerFree(&joiner);
+
+	return TCFieldStatusSetSuccess;
+}
+
+void
+RegionsFree(RegionMap *map)
+{
+	if (map->regions != NULL)
+		HeapFree(GetProcessHeap(), 0, map->regions);
+	map->regions = NULL;
+	map->n_regions = 0;
+}
+
+/* Describes MAP in DESCRIPTION, which is SIZE bytes large, as its number
+ * of regions and how much of it is in each encoding, like "5 regions:
+ * UTF-8 97%, ASCII++ 3%". */
+void
+RegionsDescribe(RegionMap const *map, char *description, size_t size)
+{
+	Encoding const *encodings[4];
+	ULONGLONG lengths[_countof(encodings)];
+	int n_encodings = 0;
+	ULONGLONG total = 0;
+
+	description[0] = '\0';
+	if (map->n_regions == 0)
+		return;
+
+	for (size_t i = 0; i < map->n_regions; i++) {
+		Region const *region = &map->regions[i];
+		int j = 0;
+		while (j < n_encodings && encodings[j] != region->encoding)
+			j++;
+		if (j == n_encodings) {
+			if (n_encodings == _countof(encodings))
+				continue;
+			encodings[j] = region->encoding;
+			lengths[j] = 0;
+			n_encodings++;
+		}
+		lengths[j] += region->length;
+		total += region->length;
+	}
+
+	StringCbPrintf(description, size, "%u region%s:", (unsigned int)map->n_regions,
+				   map->n_regions == 1 ? "" : "s");
+
+	/* Largest first, which is as much sorting as a handful needs. */
+	for (int i = 0; i < n_encodings; i++) {
+		int largest = i;
+		for (int j = i + 1; j < n_encodings; j++)
+			if (lengths[j] > lengths[largest])
+				largest = j;
+
+		Encoding const *encoding = encodings[largest];
+		ULONGLONG length = lengths[largest];
+		encodings[largest] = encodings[i];
+		lengths[largest] = lengths[i];
+
+		char part[64];
+		StringCbPrintf(part, sizeof(part), "%s%s %u%%", i == 0 ? " " : ", ",
+					   EncodingName(encoding),
+					   (unsigned int)(total == 0 ? 0 : (length * 100 + total / 2) / total));
+		StringCbCat(description, size, part);
+	}
+}
@@ -0,0 +1,24 @@
+/* A stretch of LENGTH bytes of a file, beginning OFFSET bytes into it,
+ * that is in ENCODING. */
+typedef struct _Region Region;
+
+struct _Region
+{
+	ULONGLONG offset;
+	ULONGLONG length;
+	Encoding const *encoding;
+};
+
+/* The N_REGIONS REGIONS that make up a file, in order. */
+typedef struct _RegionMap RegionMap;
+
+struct _RegionMap
+{
+	Region *regions;
+	size_t n_regions;
+};
+
+TCFieldTypeOrStatus RegionsFind(char const *filename, Encoding const *encoding,
+								RegionMap *map);
+void RegionsFree(RegionMap *map);
+void RegionsDescribe(RegionMap const *map, char *description, size_t size);
@@ -0,0 +1,381 @@
+#include "stdafx.h"
+#include "line-endings.h"
+#include "scripts.h"
+#include "simd.h"
+
+#include <strsafe.h>
+#include <emmintrin.h>
+
+/* Characters are told apart by looking up a 16-bit key of theirs in tables
+ * of ranges, eight keys at a time, so that text never has to be decoded to
+ * find out what it is written in.
+ *
+ * Beyond those of the Scripts, there are counters for characters that
+ * arent letters and for all characters that may be letters, of which those
+ * that arent in the range of any Script are Other. */
+#define SCRIPT_NOT_LETTER	ScriptCount
+#define SCRIPT_ANY			(ScriptCount + 1)
+#define SCRIPT_N_COUNTERS	(ScriptCount + 2)
+
+/* The number of times that keys may be counted before the 16-bit counters
+ * have to be added to the totals, as each of them can only grow by one at
+ * a time. */
+#define SCRIPT_FLUSH_INTERVAL	32768
+
+/* The characters whose keys are between LO and HI are counted by COUNTER. */
+typedef struct _ScriptRange ScriptRange;
+
+struct _ScriptRange
+{
+	int counter;
+	WORD lo;
+	WORD hi;
+};
+
+/* In UTF-8, the key of a character is its first byte followed by its
+ * second, which tells which block of 64 code points it is in.  Continuation
+ * bytes have keys that are in none of the ranges. */
+static ScriptRange const s_utf8_ranges[] = {
+	{ ScriptLatin, 0x4100, 0x5aff },
+	{ ScriptLatin, 0x6100, 0x7aff },
+	{ ScriptLatin, 0xc380, 0xc9bf },
+	{ ScriptLatin, 0xe1b8, 0xe1bb },
+	{ ScriptGreek, 0xcdb0, 0xcfbf },
+	{ ScriptGreek, 0xe1bc, 0xe1bf },
+	{ ScriptCyrillic, 0xd080, 0xd4af },
+	{ ScriptArmenian, 0xd4b0, 0xd68f },
+	{ ScriptHebrew, 0xd690, 0xd7bf },
+	{ ScriptArabic, 0xd880, 0xdbbf },
+	{ ScriptArabic, 0xdd90, 0xddbf },
+	{ ScriptIndic, 0xe0a4, 0xe0b7 },
+	{ ScriptThai, 0xe0b8, 0xe0b9 },
+	{ ScriptHangul, 0xe184, 0xe187 },
+	{ ScriptHangul, 0xeab0, 0xed9e },
+	{ ScriptKana, 0xe381, 0xe383 },
+	{ ScriptHan, 0xe390, 0xe9bf },
+	{ ScriptHan, 0xefa4, 0xefab },
+	{ ScriptHan, 0xf0a0, 0xf0b3 },
+	{ SCRIPT_NOT_LETTER, 0xc280, 0xc2bf },
+	{ SCRIPT_NOT_LETTER, 0xcc80, 0xcdaf },
+	{ SCRIPT_NOT_LETTER, 0xe280, 0xe2b9 },
+	{ SCRIPT_NOT_LETTER, 0xe380, 0xe380 },
+	{ SCRIPT_NOT_LETTER, 0xefbc, 0xefbf },
+	{ SCRIPT_NOT_LETTER, 0xf09f, 0xf09f },
+	{ SCRIPT_ANY, 0x4100, 0x5aff },
+	{ SCRIPT_ANY, 0x6100, 0x7aff },
+	{ SCRIPT_ANY, 0xc000, 0xffff },
+};
+
+/* In UTF-16 and the single-byte encodings, the key of a character is its
+ * code unit.  Characters outside the Basic Multilingual Plane are told
+ * apart by their high surrogates. */
+static ScriptRange const s_unit_ranges[] = {
+	{ ScriptLatin, 0x0041, 0x005a },
+	{ ScriptLatin, 0x0061, 0x007a },
+	{ ScriptLatin, 0x00c0, 0x027f },
+	{ ScriptLatin, 0x1e00, 0x1eff },
+	{ ScriptGreek, 0x0370, 0x03ff },
+	{ ScriptGreek, 0x1f00, 0x1fff },
+	{ ScriptCyrillic, 0x0400, 0x052f },
+	{ ScriptArmenian, 0x0530, 0x058f },
+	{ ScriptHebrew, 0x0590, 0x05ff },
+	{ ScriptArabic, 0x0600, 0x06ff },
+	{ ScriptArabic, 0x0750, 0x077f },
+	{ ScriptIndic, 0x0900, 0x0dff },
+	{ ScriptThai, 0x0e00, 0x0e7f },
+	{ ScriptHangul, 0x1100, 0x11ff },
+	{ ScriptHangul, 0xac00, 0xd7bf },
+	{ ScriptKana, 0x3040, 0x30ff },
+	{ ScriptHan, 0x3400, 0x9fff },
+	{ ScriptHan, 0xf900, 0xfaff },
+	{ ScriptHan, 0xd840, 0xd88f },
+	{ SCRIPT_NOT_LETTER, 0x0080, 0x00bf },
+	{ SCRIPT_NOT_LETTER, 0x0300, 0x036f },
+	{ SCRIPT_NOT_LETTER, 0x2000, 0x2e7f },
+	{ SCRIPT_NOT_LETTER, 0x3000, 0x303f },
+	{ SCRIPT_NOT_LETTER, 0xff00, 0xffff },
+	{ SCRIPT_NOT_LETTER, 0xd83c, 0xd83f },
+	{ SCRIPT_NOT_LETTER, 0xdc00, 0xdfff },
+	{ SCRIPT_ANY, 0x0041, 0x005a },
+	{ SCRIPT_ANY, 0x0061, 0x007a },
+	{ SCRIPT_ANY, 0x0080, 0xffff },
+};
+
+#define SCRIPT_MAX_RANGES	max(_countof(s_utf8_ranges), _countof(s_unit_ranges))
+
+/* The names of the Scripts, in the order of their enum, followed by the
+ * name used when text has no letters. */
+static char const * const script_names[] = {
+	"Latin",
+	"Greek",
+	"Cyrillic",
+	"Armenian",
+	"Hebrew",
+	"Arabic",
+	"Indic",
+	"Thai",
+	"Hangul",
+	"Kana",
+	"Han",
+	"Other",
+	"-",
+};
+
+C_ASSERT(_countof(script_names) == ScriptCount + 1);
+
+/* Counts keys into the counters of the N_RANGES RANGES.
+ *
+ * LO and HI are the bounds of the ranges, ready to be compared with eight
+ * keys at a time.  COUNTERS keep the counts of each lane until they are
+ * added to TOTALS, every SCRIPT_FLUSH_INTERVAL times, and ASCII_LETTERS
+ * those of bytes known to be ASCII, every 255 times. */
+typedef struct _ScriptCounter ScriptCounter;
+
+struct _ScriptCounter
+{
+	ScriptRange const *ranges;
+	size_t n_ranges;
+	__m128i lo[SCRIPT_MAX_RANGES];
+	__m128i hi[SCRIPT_MAX_RANGES];
+	__m128i counters[SCRIPT_N_COUNTERS];
+	int n_counted;
+	__m128i ascii_letters;
+	int n_ascii_counted;
+	ULONGLONG totals[SCRIPT_N_COUNTERS];
+};
+
+static void
+script_counter_init(ScriptCounter *counter, ScriptRange const *ranges, size_t n_ranges)
+{
+	counter->ranges = ranges;
+	counter->n_ranges = n_ranges;
+	for (size_t i = 0; i < n_ranges; i++) {
+		counter->lo[i] = _mm_set1_epi16((short)ranges[i].lo);
+		counter->hi[i] = _mm_set1_epi16((short)ranges[i].hi);
+	}
+	for (int i = 0; i < SCRIPT_N_COUNTERS; i++) {
+		counter->counters[i] = _mm_setzero_si128();
+		counter->totals[i] = 0;
+	}
+	counter->n_counted = 0;
+	counter->ascii_letters = _mm_setzero_si128();
+	counter->n_ascii_counted = 0;
+}
+
+/* Adds the counts kept in the lanes of COUNTER to its totals. */
+static void
+script_counter_flush(ScriptCounter *counter)
+{
+	for (int i = 0; i < SCRIPT_N_COUNTERS; i++) {
+		WORD lanes[8];
+		_mm_storeu_si128((__m128i *)lanes, counter->counters[i]);
+		for (int j = 0; j < 8; j++)
+			counter->totals[i] += lanes[j];
+		counter->counters[i] = _mm_setzero_si128();
+	}
+	counter->n_counted = 0;
+
+	__m128i sums = _mm_sad_epu8(counter->ascii_letters, _mm_setzero_si128());
+	ULONGLONG n_ascii_letters = _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+	counter->totals[ScriptLatin] += n_ascii_letters;
+	counter->totals[SCRIPT_ANY] += n_ascii_letters;
+	counter->ascii_letters = _mm_setzero_si128();
+	counter->n_ascii_counted = 0;
+}
+
+/* Counts the eight KEYS. */
+static void
+script_counter_keys(ScriptCounter *counter, __m128i keys)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	/* A key is in a range if neither bound saturates when subtracted. */
+	for (size_t i = 0; i < counter->n_ranges; i++) {
+		__m128i in = _mm_and_si128(_mm_cmpeq_epi16(_mm_subs_epu16(counter->lo[i], keys), zero),
+								   _mm_cmpeq_epi16(_mm_subs_epu16(keys, counter->hi[i]), zero));
+		__m128i *lanes = &counter->counters[counter->ranges[i].counter];
+		*lanes = _mm_sub_epi16(*lanes, in);
+	}
+
+	if (++counter->n_counted == SCRIPT_FLUSH_INTERVAL)
+		script_counter_flush(counter);
+}
+
+/* Counts the letters among the sixteen BYTES, which are all ASCII. */
+static void
+script_counter_ascii(ScriptCounter *counter, __m128i bytes)
+{
+	__m128i folded = _mm_or_si128(bytes, _mm_set1_epi8(0x20));
+	__m128i letters = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+									_mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+	counter->ascii_letters = _mm_sub_epi8(counter->ascii_letters, letters);
+
+	if (++counter->n_ascii_counted == 255)
+		script_counter_flush(counter);
+}
+
+/* Counts KEY, one at a time. */
+static void
+script_counter_key(ScriptCounter *counter, WORD key)
+{
+	for (size_t i = 0; i < counter->n_ranges; i++)
+		if (key >= counter->ranges[i].lo && key <= counter->ranges[i].hi)
+			counter->totals[counter->ranges[i].counter]++;
+}
+
+/* Counts the characters of the UTF-8 between P and END. */
+static void
+count_utf8(ScriptCounter *counter, unsigned char const *p, unsigned char const *end)
+{
+	/* The key of the last byte of a vector needs the byte after it. */
+	unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 && end - p > 16 ? end - 16 : p;
+	for (; p < vector_end; p += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)p);
+		if (_mm_movemask_epi8(v) == 0) {
+			script_counter_ascii(counter, v);
+			continue;
+		}
+
+		__m128i next = _mm_loadu_si128((__m128i const *)(p + 1));
+		script_counter_keys(counter, _mm_unpacklo_epi8(next, v));
+		script_counter_keys(counter, _mm_unpackhi_epi8(next, v));
+	}
+	script_counter_flush(counter);
+
+	for (; p < end; p++)
+		script_counter_key(counter, (WORD)((p[0] << 8) | (p + 1 < end ? p[1] : 0)));
+}
+
+/* Counts the characters of the single-byte text between P and END. */
+static void
+count_single_bytes(ScriptCounter *counter, unsigned char const *p, unsigned char const *end)
+{
+	__m128i zero = _mm_setzero_si128();
+
+	unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 ? end : p;
+	for (; p + 16 <= vector_end; p += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)p);
+		if (_mm_movemask_epi8(v) == 0) {
+			script_counter_ascii(counter, v);
+			continue;
+		}
+
+		script_counter_keys(counter, _mm_unpacklo_epi8(v, zero));
+		script_counter_keys(counter, _mm_unpackhi_epi8(v, zero));
+	}
+	script_counter_flush(counter);
+
+	for (; p < end; p++)
+		script_counter_key(counter, *p);
+}
+
+/* Counts the characters of the UTF-16 laid out in FORM between P and END. */
+static void
+count_utf16(ScriptCounter *counter, TextForm form, unsigned char const *p, unsigned char const *end)
+{
+	BOOL big = form == TextFormUTF16BE;
+	unsigned char const *units_end = p + ((end - p) & ~1);
+
+	unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 ? units_end : p;
+	for (; p + 16 <= vector_end; p += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)p);
+		if (big)
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		script_counter_keys(counter, v);
+	}
+	script_counter_flush(counter);
+
+	for (; p < units_end; p += 2)
+		script_counter_key(counter, (WORD)(big ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8)));
+}
+
+/* Counts how many of the letters in the N_BYTES of BYTES, which are laid
+ * out in FORM, are in each Script into COUNTS.  BYTES shouldnt begin with
+ * a BOM. */
+void
+ScriptsCount(unsigned char const *bytes, size_t n_bytes, TextForm form, ScriptCounts *counts)
+{
+	ScriptCounter counter;
+
+	switch (form) {
+	case TextFormSingleByte:
+		script_counter_init(&counter, s_unit_ranges, _countof(s_unit_ranges));
+		count_single_bytes(&counter, bytes, bytes + n_bytes);
+		break;
+	case TextFormUTF8:
+		script_counter_init(&counter, s_utf8_ranges, _countof(s_utf8_ranges));
+		count_utf8(&counter, bytes, bytes + n_bytes);
+		break;
+	case TextFormUTF16BE:
+	case TextFormUTF16LE:
+		script_counter_init(&counter, s_unit_ranges, _countof(s_unit_ranges));
+		count_utf16(&counter, form, bytes, bytes + n_bytes);
+		break;
+	default:
+		script_counter_init(&counter, s_unit_ranges, 0);
+		break;
+	}
+
+	counts->letters = counter.totals[SCRIPT_ANY] - counter.totals[SCRIPT_NOT_LETTER];
+	ULONGLONG in_scripts = 0;
+	for (int i = 0; i < ScriptOther; i++) {
+		counts->counts[i] = counter.totals[i];
+		in_scripts += counter.totals[i];
+	}
+	counts->counts[ScriptOther] = counts->letters - in_scripts;
+}
+
+/* Gets the Script that most of the letters in COUNTS are in, or
+ * ScriptCount if there are none. */
+Script
+ScriptsDominant(ScriptCounts const *counts)
+{
+	Script dominant = ScriptCount;
+	ULONGLONG most = 0;
+
+	for (int i = 0; i < ScriptCount; i++)
+		if (counts->counts[i] > most) {
+			dominant = (Script)i;
+			most = counts->counts[i];
+		}
+
+	return dominant;
+}
+
+/* Gets the name of SCRIPT, which is "-" for ScriptCount. */
+char const *
+ScriptName(Script script)
+{
+	return script_names[min(script, ScriptCount)];
+}
+
+/* Describes the share of each Script in the letters in COUNTS, largest
+ * first, as in "Latin 62%, Cyrillic 38%", into the SIZE bytes of
+ * DESCRIPTION. */
+void
+ScriptsDescribe(ScriptCounts const *counts, char *description, size_t size)
+{
+	BOOL described[ScriptCount] = { FALSE };
+
+	description[0] = '\0';
+	for (;;) {
+		int largest = -1;
+		for (int i = 0; i < ScriptCount; i++)
+			if (!described[i] && counts->counts[i] > 0 &&
+				(largest < 0 || counts->counts[i] > counts->counts[largest]))
+				largest = i;
+		if (largest < 0)
+			break;
+		described[largest] = TRUE;
+
+		int percent = (int)((counts->counts[largest] * 100 + counts->letters / 2) / counts->letters);
+		char share[32];
+		if (percent > 0)
+			StringCbPrintf(share, sizeof(share), "%s%s %d%%",
+						   description[0] != '\0' ? ", " : "", script_names[largest], percent);
+		else
+			StringCbPrintf(share, sizeof(share), "%s%s <1%%",
+						   description[0] != '\0' ? ", " : "", script_names[largest]);
+		StringCbCat(description, size, share);
+	}
+}
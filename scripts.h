@@ -0,0 +1,33 @@
+/* The writing systems that the letters of text are told apart by. */
+typedef enum Script
+{
+	ScriptLatin,
+	ScriptGreek,
+	ScriptCyrillic,
+	ScriptArmenian,
+	ScriptHebrew,
+	ScriptArabic,
+	ScriptIndic,
+	ScriptThai,
+	ScriptHangul,
+	ScriptKana,
+	ScriptHan,
+	ScriptOther,
+	ScriptCount,
+};
+
+/* How many of the LETTERS in some text are in each Script.  Digits,
+ * punctuation, symbols and combining marks arent letters. */
+typedef struct _ScriptCounts ScriptCounts;
+
+struct _ScriptCounts
+{
+	ULONGLONG letters;
+	ULONGLONG counts[ScriptCount];
+};
+
+void ScriptsCount(unsigned char const *bytes, size_t n_bytes, TextForm form,
+				  ScriptCounts *counts);
+Script ScriptsDominant(ScriptCounts const *counts);
+char const *ScriptName(Script script);
+void ScriptsDescribe(ScriptCounts const *counts, char *description, size_t size);
@@ -0,0 +1,120 @@
+#include "stdafx.h"
+#include "content-plugin.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "file-mapping.h"
+#include "transcode.h"
+#include "search.h"
+#include "simd.h"
+
+#include <emmintrin.h>
+#include <intrin.h>
+
+/* Files are searched for a query in their own encoding, rather than being
+ * transcoded into that of the query, by encoding the query into each
+ * encoding once and looking for its bytes as they are.  Places where both
+ * its first and last bytes turn up are found sixteen at a time, and only
+ * those are compared in full.  The windows that files are stepped through
+ * overlap by one byte less than the query, so that no match is missed at
+ * their edges. */
+#define SEARCH_WINDOW_SIZE	(1024 * 1024)
+
+/* Lays out the QUERY_LENGTH bytes of the UTF-8 QUERY as text in ENCODING
+ * in NEEDLE.  Text that isnt in any encoding that is known is searched for
+ * the bytes of the query as they are. */
+void
+SearchNeedleInit(SearchNeedle *needle, Encoding const *encoding,
+				 char const *query, size_t query_length)
+{
+	TextForm form = EncodingTextForm(encoding);
+
+	needle->unit = form == TextFormUTF16BE || form == TextFormUTF16LE ? 2 : 1;
+	needle->length = TranscodeFromUTF8(form == TextFormNone ? EncodingNamed("UTF-8") : encoding,
+									   (unsigned char const *)query, query_length,
+									   needle->bytes, sizeof(needle->bytes));
+}
+
+/* Adds the match of NEEDLE at OFFSET to RESULT, if AT really begins one. */
+static void
+SearchCheck(SearchNeedle const *needle, unsigned char const *at, ULONGLONG offset,
+			SearchResult *result)
+{
+	if (offset < result->next || offset % needle->unit != 0 ||
+		memcmp(at, needle->bytes, needle->length) != 0)
+		return;
+
+	if (result->n_matches++ == 0)
+		result->first_match = offset;
+	result->next = offset + needle->length;
+}
+
+/* Finds the matches of NEEDLE that begin between P and END, which begins
+ * OFFSET bytes into the file, adding them to RESULT.  The bytes of the
+ * last of them must be readable too. */
+static void
+SearchBytes(SearchNeedle const *needle, unsigned char const *p, unsigned char const *end,
+			ULONGLONG offset, SearchResult *result)
+{
+	unsigned char const *begin = p;
+	__m128i firsts = _mm_set1_epi8((char)needle->bytes[0]);
+	__m128i lasts = _mm_set1_epi8((char)needle->bytes[needle->length - 1]);
+
+	unsigned char const *vector_end = g_simd_level >= SimdLevelSSE2 ? end : p;
+	for (; vector_end - p >= 16; p += 16) {
+		__m128i first = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *)p), firsts);
+		__m128i last = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i const *)(p + needle->length - 1)),
+									  lasts);
+		unsigned long mask = (unsigned long)_mm_movemask_epi8(_mm_and_si128(first, last));
+		unsigned long index;
+		while (_BitScanForward(&index, mask)) {
+			mask &= mask - 1;
+			SearchCheck(needle, p + index, offset + (p + index - begin), result);
+		}
+	}
+
+	for (; p < end; p++)
+		if (*p == needle->bytes[0])
+			SearchCheck(needle, p, offset + (p - begin), result);
+}
+
+/* Searches FILENAME, which is in ENCODING, for NEEDLE, storing what was
+ * found in RESULT.  The BOM of the file, if any, is skipped. */
+TCFieldTypeOrStatus
+SearchFile(char const *filename, Encoding const *encoding, SearchNeedle const *needle,
+		   SearchResult *result)
+{
+	ZeroMemory(result, sizeof(*result));
+
+	FileWindow window;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &window);
+	if (status == TCFieldStatusFieldEmpty)
+		return TCFieldStatusSetSuccess;
+	else if (status != TCFieldStatusSetSuccess)
+		return status;
+
+	ULONGLONG offset = lstrlen(EncodingBOM(encoding));
+	if (needle->length == 0 || window.file_size < offset + needle->length) {
+		FileWindowClose(&window);
+		return TCFieldStatusSetSuccess;
+	}
+
+	/* The matches begin before END, so that the whole of them is in the
+	 * file. */
+	ULONGLONG end = window.file_size - needle->length + 1;
+	while (offset < end) {
+		ULONGLONG scan_end = min(end, offset + SEARCH_WINDOW_SIZE);
+		if (!FileWindowMove(&window, offset, (size_t)(scan_end - offset) + needle->length - 1)) {
+			status = TCFieldStatusFileError;
+			break;
+		}
+
+		unsigned char const *p = window.bytes + (size_t)(offset - window.offset);
+		SearchBytes(needle, p, p + (size_t)(scan_end - offset), offset, result);
+
+		offset = scan_end;
+	}
+
+	FileWindowClose(&window);
+
+	return status;
+}
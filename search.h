@@ -0,0 +1,32 @@
+/* The most bytes a query may take up in any encoding. */
+#define SEARCH_MAX_NEEDLE	1024
+
+/* A query as it is laid out in the text of one encoding: the LENGTH BYTES
+ * it takes up there, which only count as found at offsets that are
+ * multiples of UNIT.  LENGTH is 0 if the query cant be represented in the
+ * encoding, so that it is never found. */
+typedef struct _SearchNeedle SearchNeedle;
+
+struct _SearchNeedle
+{
+	unsigned char bytes[SEARCH_MAX_NEEDLE];
+	size_t length;
+	size_t unit;
+};
+
+/* What a search of a file has found so far: N_MATCHES matches, the first
+ * of which begins FIRST_MATCH bytes into it.  Matches dont overlap, so the
+ * next one may begin NEXT bytes into it at the earliest. */
+typedef struct _SearchResult SearchResult;
+
+struct _SearchResult
+{
+	ULONGLONG n_matches;
+	ULONGLONG first_match;
+	ULONGLONG next;
+};
+
+void SearchNeedleInit(SearchNeedle *needle, Encoding const *encoding,
+					  char const *query, size_t query_length);
+TCFieldTypeOrStatus SearchFile(char const *filename, Encoding const *encoding,
+							   SearchNeedle const *needle, SearchResult *result);
@@ -0,0 +1,169 @@
+#include "stdafx.h"
+#include "settings.h"
+#include "simd.h"
+
+#include <strsafe.h>
+
+/* The defaults and limits of the settings. */
+#define DEFAULT_SCAN_BUDGET				(256 * 1024)
+#define MIN_SCAN_BUDGET					4096
+#define DEFAULT_CACHE_CAPACITY			65536
+#define MIN_CACHE_CAPACITY				1024
+#define MAX_CACHE_CAPACITY				(16 * 1024 * 1024)
+#define DEFAULT_MAX_WORKER_THREADS		4
+#define DEFAULT_INDEXER_POLL_INTERVAL	60
+#define DEFAULT_LINE_INDEX_INTERVAL		1024
+
+Settings g_settings = {
+	"",
+	DEFAULT_SCAN_BUDGET,
+	SettingsSamplingHead,
+	SettingsIoMap,
+	DEFAULT_CACHE_CAPACITY,
+	"",
+	SettingsValidationMetadata,
+	DEFAULT_MAX_WORKER_THREADS,
+	1,
+	"",
+	DEFAULT_INDEXER_POLL_INTERVAL,
+	"",
+	DEFAULT_LINE_INDEX_INTERVAL,
+};
+
+/* The names of the choices of the settings that have them, in the order
+ * of their enums. */
+static char const * const sampling_names[] = { "Head", "Whole" };
+static char const * const io_names[] = { "Map", "Read" };
+static char const * const simd_names[] = { "None", "SSE2" };
+static char const * const validation_names[] = { "Metadata", "Content" };
+
+/* Reads the setting KEY in SECTION of FILENAME, which should be one of the
+ * N_NAMES NAMES, returning the index of the one it is, or FALLBACK if it is
+ * missing or none of them. */
+static int
+SettingsChoice(char const *filename, char const *section, char const *key,
+			   char const * const *names, int n_names, int fallback)
+{
+	char value[32];
+	GetPrivateProfileString(section, key, "", value, sizeof(value), filename);
+
+	for (int i = 0; i < n_names; i++)
+		if (lstrcmpi(value, names[i]) == 0)
+			return i;
+
+	return fallback;
+}
+
+/* Rounds N up to the nearest power of two in [MIN_CACHE_CAPACITY,
+ * MAX_CACHE_CAPACITY]. */
+static DWORD
+CacheCapacityRound(DWORD n)
+{
+	DWORD capacity = MIN_CACHE_CAPACITY;
+
+	while (capacity < n && capacity < MAX_CACHE_CAPACITY)
+		capacity <<= 1;
+
+	return capacity;
+}
+
+/* Reads the settings from the INI file FILENAME.  Settings missing from
+ * it get their defaults.
+ *
+ * [Detection]
+ * ScanBudget=262144	The number of bytes of a file that are looked at.
+ * Sampling=Head		Head or Whole, to look at all of every file.
+ * IO=Map				Map or Read.
+ * SIMD=SSE2			None or SSE2, which is only used if the processor
+ *						supports it.
+ *
+ * [Cache]
+ * Capacity=65536		The number of files it remembers.
+ * Location=			Empty, Process or the name of a file.
+ * Validate=Metadata	Metadata or Content, to check that the contents of
+ *						files are what they were, whatever their times.
+ *
+ * [Workers]
+ * Threads=4			The number of threads detecting delayed fields,
+ *						by default one per processor, but at most four.
+ *
+ * [Conversion]
+ * Threads=				The number of threads converting large files, by
+ *						default one per processor.
+ *
+ * [Indexer]
+ * Paths=				The trees watched by encoding-indexer.
+ * PollInterval=60		Seconds between rescans of unwatchable trees.
+ *
+ * [Trace]
+ * File=				The file to log the calls into the plugin to, for
+ *						encoding-replay.
+ *
+ * [LineIndex]
+ * Interval=1024		Lines between those whose offsets line indexes keep. */
+void
+SettingsLoad(char const *filename)
+{
+	if (FAILED(StringCbCopy(g_settings.filename, sizeof(g_settings.filename), filename)))
+		return;
+
+	g_settings.scan_budget =
+		max(MIN_SCAN_BUDGET, GetPrivateProfileInt("Detection", "ScanBudget",
+												  DEFAULT_SCAN_BUDGET, filename));
+	g_settings.sampling = (SettingsSampling)
+		SettingsChoice(filename, "Detection", "Sampling",
+					   sampling_names, _countof(sampling_names), SettingsSamplingHead);
+	g_settings.io = (SettingsIo)
+		SettingsChoice(filename, "Detection", "IO",
+					   io_names, _countof(io_names), SettingsIoMap);
+	g_simd_level = min(SimdLevelSupported(), (SimdLevel)
+					   SettingsChoice(filename, "Detection", "SIMD",
+									  simd_names, _countof(simd_names), SimdLevelSSE2));
+
+	g_settings.cache_capacity =
+		CacheCapacityRound(GetPrivateProfileInt("Cache", "Capacity",
+												DEFAULT_CACHE_CAPACITY, filename));
+	GetPrivateProfileString("Cache", "Location", "", g_settings.cache_location,
+							sizeof(g_settings.cache_location), filename);
+	g_settings.cache_validation = (SettingsValidation)
+		SettingsChoice(filename, "Cache", "Validate",
+					   validation_names, _countof(validation_names), SettingsValidationMetadata);
+
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	g_settings.worker_threads =
+		max(1, GetPrivateProfileInt("Workers", "Threads",
+									min(info.dwNumberOfProcessors, DEFAULT_MAX_WORKER_THREADS),
+									filename));
+	g_settings.conversion_threads =
+		max(1, GetPrivateProfileInt("Conversion", "Threads",
+									info.dwNumberOfProcessors, filename));
+
+	GetPrivateProfileString("Indexer", "Paths", "", g_settings.indexer_paths,
+							sizeof(g_settings.indexer_paths), filename);
+	g_settings.indexer_poll_interval =
+		max(1, GetPrivateProfileInt("Indexer", "PollInterval",
+									DEFAULT_INDEXER_POLL_INTERVAL, filename));
+
+	GetPrivateProfileString("Trace", "File", "", g_settings.trace_filename,
+							sizeof(g_settings.trace_filename), filename);
+
+	g_settings.line_index_interval =
+		max(1, GetPrivateProfileInt("LineIndex", "Interval",
+									DEFAULT_LINE_INDEX_INTERVAL, filename));
+}
+
+/* Stores the name of the settings file in the same directory as PATH in
+ * FILENAME, which is SIZE bytes large. */
+BOOL
+SettingsFilenameInDirectoryOf(char *filename, size_t size, char const *path)
+{
+	if (FAILED(StringCbCopy(filename, size, path)))
+		return FALSE;
+
+	char *separator = strrchr(filename, '\\');
+	char *basename = separator != NULL ? separator + 1 : filename;
+	*basename = '\0';
+
+	return SUCCEEDED(StringCbCat(filename, size, SETTINGS_FILENAME));
+}
@@ -0,0 +1,81 @@
+/* The name of the file that the settings are read from, which lives next
+ * to the plugin, or in the directory that Total Commander suggests. */
+#define SETTINGS_FILENAME	"wdx-encoding.ini"
+
+/* The maximum length of the list of trees that the indexer watches. */
+#define SETTINGS_MAX_INDEXER_PATHS	2048
+
+/* How much of a file detection looks at: the first SCAN_BUDGET bytes of
+ * it, or all of it. */
+typedef enum SettingsSampling
+{
+	SettingsSamplingHead,
+	SettingsSamplingWhole,
+};
+
+/* How detection reads files: by mapping them, which is cheapest on local
+ * disks, or by reading them in one go, which saves round trips for every
+ * page faulted in on network shares. */
+typedef enum SettingsIo
+{
+	SettingsIoMap,
+	SettingsIoRead,
+};
+
+/* How results in the detection cache are told to be for the current
+ * version of a file: by its size and the time it was last written to,
+ * or, on shares that keep or make up the times of files, by the
+ * fingerprint of its contents as well. */
+typedef enum SettingsValidation
+{
+	SettingsValidationMetadata,
+	SettingsValidationContent,
+};
+
+/* The settings of the plugin and its tools.  See SettingsLoad() for the
+ * names they go by in the settings file.
+ *
+ * FILENAME is the file they were read from.
+ * SCAN_BUDGET is the number of bytes of a file that detection looks at
+ * with SettingsSamplingHead.
+ * CACHE_CAPACITY is the number of entries in the detection cache, rounded
+ * up to a power of two.
+ * CACHE_LOCATION is where the detection cache is kept: in memory shared
+ * by all processes if empty, in memory private to the process if
+ * "Process", and otherwise in the file it names, so that it survives
+ * restarts.
+ * CACHE_VALIDATION is how the results in it are validated.
+ * WORKER_THREADS is the number of threads detecting delayed fields.
+ * CONVERSION_THREADS is the number of threads that large files are
+ * converted by.
+ * INDEXER_PATHS are the trees that encoding-indexer watches, separated by
+ * semicolons.
+ * INDEXER_POLL_INTERVAL is the number of seconds between rescans of trees
+ * that cant be watched for changes.
+ * TRACE_FILENAME is the file that the calls into the plugin are logged to,
+ * or empty if they arent.
+ * LINE_INDEX_INTERVAL is the number of lines between those whose offsets
+ * are kept in line indexes. */
+typedef struct _Settings Settings;
+
+struct _Settings
+{
+	char filename[MAX_PATH];
+	DWORD scan_budget;
+	SettingsSampling sampling;
+	SettingsIo io;
+	DWORD cache_capacity;
+	char cache_location[MAX_PATH];
+	SettingsValidation cache_validation;
+	DWORD worker_threads;
+	DWORD conversion_threads;
+	char indexer_paths[SETTINGS_MAX_INDEXER_PATHS];
+	DWORD indexer_poll_interval;
+	char trace_filename[MAX_PATH];
+	DWORD line_index_interval;
+};
+
+extern Settings g_settings;
+
+void SettingsLoad(char const *filename);
+BOOL SettingsFilenameInDirectoryOf(char *filename, size_t size, char const *path);
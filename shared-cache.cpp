@@ -0,0 +1,302 @@
+#include "stdafx.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "settings.h"
+#include "shared-cache.h"
+
+/* The number of consecutive entries that a key may be stored in. */
+#define SHARED_CACHE_MAX_PROBES	8
+
+/* The cache location that keeps the cache private to the process. */
+#define SHARED_CACHE_LOCATION_PROCESS	"Process"
+
+/* The shared block, its size and the mapping it belongs to.  If the
+ * shared block cant be created, a block local to the process is used
+ * instead, and S_CACHE_MAP is NULL.  S_CACHE_OPENING is set while the
+ * block is being opened, as that may happen in several threads at once. */
+static SharedCacheHeader *s_cache;
+static SIZE_T s_cache_size;
+static HANDLE s_cache_map;
+static LONG volatile s_cache_opening;
+
+/* Fills in the header of the newly created block CACHE. */
+static void
+SharedCacheInitialize(SharedCacheHeader *cache)
+{
+	cache->entry_size = sizeof(SharedCacheEntry);
+	cache->capacity = g_settings.cache_capacity;
+	cache->n_encodings = EncodingsCount();
+	InterlockedExchange(&cache->version, SHARED_CACHE_VERSION);
+}
+
+/* Checks if CACHE, which is SIZE bytes large, was created by a compatible
+ * version of the plugin and has been filled in. */
+static BOOL
+SharedCacheUsable(SharedCacheHeader const *cache, ULONGLONG size)
+{
+	return cache->version == SHARED_CACHE_VERSION &&
+		cache->entry_size == sizeof(SharedCacheEntry) &&
+		cache->n_encodings == EncodingsCount() &&
+		cache->capacity != 0 &&
+		(cache->capacity & (cache->capacity - 1)) == 0 &&
+		sizeof(SharedCacheHeader) + (ULONGLONG)cache->capacity * sizeof(SharedCacheEntry) <= size;
+}
+
+/* Opens FILENAME for keeping the cache in.  If it holds a usable cache
+ * already, SIZE is set to its size; otherwise it is emptied. */
+static HANDLE
+SharedCacheFileOpen(char const *filename, SIZE_T *size)
+{
+	HANDLE file = CreateFile(filename, GENERIC_READ | GENERIC_WRITE,
+							 FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+							 OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return INVALID_HANDLE_VALUE;
+
+	SharedCacheHeader header;
+	DWORD n_read;
+	LARGE_INTEGER file_size;
+	if (GetFileSizeEx(file, &file_size) &&
+		ReadFile(file, &header, sizeof(header), &n_read, NULL) &&
+		n_read == sizeof(header) &&
+		SharedCacheUsable(&header, file_size.QuadPart) &&
+		file_size.HighPart == 0) {
+		*size = file_size.LowPart;
+		return file;
+	}
+
+	/* This fails if another process has it mapped, in which case we end
+	 * up using its mapping anyway. */
+	LARGE_INTEGER start = { 0 };
+	if (SetFilePointerEx(file, start, NULL, FILE_BEGIN))
+		SetEndOfFile(file);
+
+	return file;
+}
+
+/* Maps the shared block, creating it if no other process already has,
+ * in the file named by the cache location, if there is one.  Its
+ * capacity is only taken from the settings if it is created. */
+static BOOL
+SharedCacheMap(SIZE_T size)
+{
+	HANDLE file = INVALID_HANDLE_VALUE;
+	if (g_settings.cache_location[0] != '\0') {
+		file = SharedCacheFileOpen(g_settings.cache_location, &size);
+		if (file == INVALID_HANDLE_VALUE)
+			return FALSE;
+	}
+
+	HANDLE map = CreateFileMapping(file, NULL, PAGE_READWRITE,
+								   0, (DWORD)size, SHARED_CACHE_NAME);
+	BOOL created = GetLastError() != ERROR_ALREADY_EXISTS;
+	if (file != INVALID_HANDLE_VALUE)
+		CloseHandle(file);
+	if (map == NULL)
+		return FALSE;
+
+	SharedCacheHeader *cache = (SharedCacheHeader *)MapViewOfFile(map, FILE_MAP_WRITE, 0, 0, 0);
+	MEMORY_BASIC_INFORMATION mbi;
+	if (cache == NULL || VirtualQuery(cache, &mbi, sizeof(mbi)) < sizeof(mbi)) {
+		if (cache != NULL)
+			UnmapViewOfFile(cache);
+		CloseHandle(map);
+		return FALSE;
+	}
+
+	/* The header is filled in before the version is set, so anyone
+	 * opening the block at the same time simply finds it unusable until
+	 * then. */
+	if (created && cache->version == 0)
+		SharedCacheInitialize(cache);
+
+	s_cache = cache;
+	s_cache_size = mbi.RegionSize;
+	s_cache_map = map;
+
+	return TRUE;
+}
+
+/* Opens the shared detection cache, falling back to one local to the
+ * process if that fails. */
+BOOL
+SharedCacheOpen(void)
+{
+	if (s_cache != NULL)
+		return TRUE;
+
+	while (InterlockedCompareExchange(&s_cache_opening, TRUE, FALSE))
+		Sleep(0);
+
+	if (s_cache == NULL) {
+		SIZE_T size = sizeof(SharedCacheHeader) +
+			(SIZE_T)g_settings.cache_capacity * sizeof(SharedCacheEntry);
+		if (lstrcmpi(g_settings.cache_location, SHARED_CACHE_LOCATION_PROCESS) == 0 ||
+			!SharedCacheMap(size)) {
+			SharedCacheHeader *cache =
+				(SharedCacheHeader *)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, size);
+			if (cache != NULL) {
+				SharedCacheInitialize(cache);
+				s_cache_size = size;
+				s_cache = cache;
+			}
+		}
+	}
+
+	InterlockedExchange(&s_cache_opening, FALSE);
+
+	return s_cache != NULL;
+}
+
+void
+SharedCacheClose(void)
+{
+	if (s_cache == NULL)
+		return;
+
+	if (s_cache_map != NULL) {
+		UnmapViewOfFile(s_cache);
+		CloseHandle(s_cache_map);
+	} else {
+		HeapFree(GetProcessHeap(), 0, s_cache);
+	}
+	s_cache = NULL;
+	s_cache_map = NULL;
+}
+
+/* Checks if the cache is really shared with other processes. */
+BOOL
+SharedCacheIsShared(void)
+{
+	return s_cache_map != NULL;
+}
+
+/* Gets the entries of the shared cache, or NULL if it is missing or was
+ * created by an incompatible version of the plugin. */
+static SharedCacheEntry *
+SharedCacheEntries(void)
+{
+	if (s_cache == NULL && !SharedCacheOpen())
+		return NULL;
+
+	if (!SharedCacheUsable(s_cache, s_cache_size))
+		return NULL;
+
+	return (SharedCacheEntry *)(s_cache + 1);
+}
+
+/* Gets the KEY of the current version of FILENAME.  Returns FALSE if
+ * FILENAME cant be found or is a directory. */
+BOOL
+SharedCacheKeyGet(char const *filename, SharedCacheKey *key)
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (!GetFileAttributesEx(filename, GetFileExInfoStandard, &data) ||
+		(data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+		return FALSE;
+
+	/* FNV-1a over the path, folding ASCII letters to upper case, as paths
+	 * are compared without regard to case. */
+	ULONGLONG hash = 14695981039346656037ULL;
+	for (unsigned char const *p = (unsigned char const *)filename; *p != '\0'; p++) {
+		unsigned char c = *p;
+		if (c >= 'a' && c <= 'z')
+			c -= 'a' - 'A';
+		hash = (hash ^ c) * 1099511628211ULL;
+	}
+
+	key->path_hash = hash;
+	key->size = ((ULONGLONG)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+	key->write_time = ((ULONGLONG)data.ftLastWriteTime.dwHighDateTime << 32) |
+		data.ftLastWriteTime.dwLowDateTime;
+
+	return TRUE;
+}
+
+/* Checks if A and B are keys of the same version of a file, whatever the
+ * times they were written at if BY_CONTENT is set. */
+static BOOL
+SharedCacheKeyEqual(SharedCacheKey const *a, SharedCacheKey const *b, BOOL by_content)
+{
+	return a->path_hash == b->path_hash && a->size == b->size &&
+		(by_content || a->write_time == b->write_time);
+}
+
+/* Looks up the ENCODING, LINE_ENDING and FINGERPRINT stored for KEY.  If
+ * BY_CONTENT is set, what was stored for the file at any time is found,
+ * for the caller to check against the fingerprint of what is in it now.
+ * Returns FALSE if there are none. */
+BOOL
+SharedCacheLookup(SharedCacheKey const *key, BOOL by_content, Encoding const **encoding,
+				  LineEnding *line_ending, ULONGLONG *fingerprint)
+{
+	SharedCacheEntry *entries = SharedCacheEntries();
+	if (entries == NULL)
+		return FALSE;
+
+	DWORD mask = s_cache->capacity - 1;
+	for (DWORD i = 0; i < SHARED_CACHE_MAX_PROBES; i++) {
+		SharedCacheEntry *entry = &entries[(key->path_hash + i) & mask];
+
+		LONG sequence = entry->sequence;
+		if (sequence & 1)
+			continue;
+		MemoryBarrier();
+		SharedCacheEntry copy = *entry;
+		MemoryBarrier();
+		if (entry->sequence != sequence)
+			continue;
+
+		if (copy.encoding == 0 || !SharedCacheKeyEqual(&copy.key, key, by_content))
+			continue;
+
+		*encoding = EncodingsGet(copy.encoding - 1);
+		*line_ending = (LineEnding)copy.line_ending;
+		*fingerprint = copy.fingerprint;
+
+		return *encoding != NULL;
+	}
+
+	return FALSE;
+}
+
+/* Stores ENCODING, LINE_ENDING and FINGERPRINT for KEY, replacing what was
+ * stored for an older version of the same path, or else taking an empty
+ * entry, or else evicting whatever was stored first in line for it.  Gives
+ * up if someone else is writing the entry at the same time, as the cache
+ * is only an optimization. */
+void
+SharedCachePublish(SharedCacheKey const *key, Encoding const *encoding,
+				   LineEnding line_ending, ULONGLONG fingerprint)
+{
+	SharedCacheEntry *entries = SharedCacheEntries();
+	if (entries == NULL)
+		return;
+
+	DWORD mask = s_cache->capacity - 1;
+	SharedCacheEntry *target = NULL;
+	for (DWORD i = 0; i < SHARED_CACHE_MAX_PROBES; i++) {
+		SharedCacheEntry *entry = &entries[(key->path_hash + i) & mask];
+
+		if (entry->key.path_hash == key->path_hash) {
+			target = entry;
+			break;
+		}
+		if (target == NULL && entry->encoding == 0)
+			target = entry;
+	}
+	if (target == NULL)
+		target = &entries[key->path_hash & mask];
+
+	LONG sequence = target->sequence;
+	if ((sequence & 1) ||
+		InterlockedCompareExchange(&target->sequence, sequence + 1, sequence) != sequence)
+		return;
+
+	target->encoding = (BYTE)(EncodingIndex(encoding) + 1);
+	target->line_ending = (BYTE)line_ending;
+	target->key = *key;
+	target->fingerprint = fingerprint;
+
+	InterlockedExchange(&target->sequence, sequence + 2);
+}
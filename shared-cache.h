@@ -0,0 +1,65 @@
+/* A table of detection results that is shared between all processes that
+ * use the plugin, kept in a block of shared memory named SHARED_CACHE_NAME,
+ * which is backed by a file if the cache location setting names one.
+ * encoding-indexer fills it in the background so that the plugin finds the
+ * results there instead of having to read the files. */
+
+#define SHARED_CACHE_NAME	"Local\\wdx-encoding-cache"
+
+/* The version of the layout of SharedCacheHeader and SharedCacheEntry. */
+#define SHARED_CACHE_VERSION	4
+
+/* What identifies a version of a file: the hash of its path, its size and
+ * the time it was last written to. */
+typedef struct _SharedCacheKey SharedCacheKey;
+
+struct _SharedCacheKey
+{
+	ULONGLONG path_hash;
+	ULONGLONG size;
+	ULONGLONG write_time;
+};
+
+/* An entry in the table.
+ *
+ * SEQUENCE is odd while the entry is being written, and changes every
+ * time it is, so that readers can tell if they read a torn entry.
+ * ENCODING is one more than the index of the encoding, so that zero marks
+ * an empty entry.
+ * FINGERPRINT is that of the bytes of the file that detection looked at. */
+typedef struct _SharedCacheEntry SharedCacheEntry;
+
+struct _SharedCacheEntry
+{
+	LONG volatile sequence;
+	BYTE encoding;
+	BYTE line_ending;
+	WORD reserved;
+	SharedCacheKey key;
+	ULONGLONG fingerprint;
+};
+
+/* The header of the block, which is followed by CAPACITY entries.
+ *
+ * VERSION is SHARED_CACHE_VERSION once the header has been filled in.
+ * N_ENCODINGS is the number of encodings known to whoever created the
+ * block, as the indexes in the entries are meaningless to anyone who
+ * knows of a different number. */
+typedef struct _SharedCacheHeader SharedCacheHeader;
+
+struct _SharedCacheHeader
+{
+	LONG volatile version;
+	DWORD entry_size;
+	DWORD capacity;
+	DWORD n_encodings;
+};
+
+BOOL SharedCacheOpen(void);
+void SharedCacheClose(void);
+BOOL SharedCacheIsShared(void);
+BOOL SharedCacheKeyGet(char const *filename, SharedCacheKey *key);
+BOOL SharedCacheLookup(SharedCacheKey const *key, BOOL by_content, Encoding const **encoding,
+					   LineEnding *line_ending, ULONGLONG *fingerprint);
+void SharedCachePublish(SharedCacheKey const *key, Encoding const *encoding,
+						LineEnding line_ending, ULONGLONG fingerprint);
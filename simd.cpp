@@ -0,0 +1,12 @@
+#include "stdafx.h"
+#include "simd.h"
+
+SimdLevel g_simd_level = SimdLevelSupported();
+
+/* Gets the best SimdLevel that the processor supports. */
+SimdLevel
+SimdLevelSupported(void)
+{
+	return IsProcessorFeaturePresent(PF_XMMI64_INSTRUCTIONS_AVAILABLE) ?
+		SimdLevelSSE2 : SimdLevelNone;
+}
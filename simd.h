@@ -0,0 +1,12 @@
+/* The instruction set extensions that the scanning loops may use, in
+ * increasing order.  G_SIMD_LEVEL is what they actually use, which is
+ * the best the processor supports unless the settings say otherwise. */
+typedef enum SimdLevel
+{
+	SimdLevelNone,
+	SimdLevelSSE2,
+};
+
+extern SimdLevel g_simd_level;
+
+SimdLevel SimdLevelSupported(void);
@@ -0,0 +1,140 @@
+#include "stdafx.h"
+#include "stats.h"
+
+#include <intrin.h>
+#include <strsafe.h>
+
+/* The statistics block, which falls back to S_LOCAL_STATS if the shared
+ * one cant be created, so that recording never has to check. */
+static StatsBlock s_local_stats;
+static StatsBlock *s_stats = &s_local_stats;
+static HANDLE s_stats_map;
+
+/* The frequency of the performance counter, in ticks per second. */
+static LONGLONG s_frequency = 1;
+
+/* Creates the shared statistics block.  Called when the plugin is loaded. */
+void
+StatsOpen(void)
+{
+	LARGE_INTEGER frequency;
+	if (QueryPerformanceFrequency(&frequency))
+		s_frequency = frequency.QuadPart;
+
+	s_local_stats.version = STATS_VERSION;
+	s_local_stats.size = sizeof(s_local_stats);
+
+	char name[64];
+	if (FAILED(StringCbPrintf(name, sizeof(name), STATS_NAME_FORMAT, GetCurrentProcessId())))
+		return;
+
+	s_stats_map = CreateFileMapping(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE,
+									0, sizeof(StatsBlock), name);
+	if (s_stats_map == NULL)
+		return;
+
+	StatsBlock *stats = (StatsBlock *)MapViewOfFile(s_stats_map, FILE_MAP_WRITE,
+													 0, 0, sizeof(StatsBlock));
+	if (stats == NULL) {
+		CloseHandle(s_stats_map);
+		s_stats_map = NULL;
+		return;
+	}
+
+	CopyMemory(stats, &s_local_stats, sizeof(*stats));
+	s_stats = stats;
+}
+
+/* Releases the shared statistics block.  Called when the plugin is
+ * unloaded. */
+void
+StatsClose(void)
+{
+	if (s_stats_map == NULL)
+		return;
+
+	StatsBlock *stats = s_stats;
+	s_stats = &s_local_stats;
+	UnmapViewOfFile(stats);
+	CloseHandle(s_stats_map);
+	s_stats_map = NULL;
+}
+
+/* Checks if anyone is reading the statistics, and thus if the things that
+ * are too expensive to always measure should be measured. */
+BOOL
+StatsWanted(void)
+{
+	return s_stats->readers > 0;
+}
+
+/* Names the encoding probe at INDEX NAME. */
+void
+StatsNameProbe(unsigned int index, char const *name)
+{
+	if (index < STATS_MAX_PROBES)
+		StringCbCopy(s_stats->probe_names[index], sizeof(s_stats->probe_names[index]), name);
+}
+
+/* Starts timing something. */
+StatsTime
+StatsStart(void)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	return now.QuadPart;
+}
+
+/* Adds N to the 64-bit VALUE, atomically. */
+static void
+add64(LONGLONG volatile *value, LONGLONG n)
+{
+	LONGLONG old;
+	do {
+		old = *value;
+	} while (InterlockedCompareExchange64(value, old + n, old) != old);
+}
+
+/* Records the time since START in HISTOGRAM. */
+static void
+histogram_record(StatsHistogram *histogram, StatsTime start)
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	ULONGLONG ns = (ULONGLONG)(now.QuadPart - start) * 1000000000 / s_frequency;
+
+	unsigned long bucket = 0;
+	if ((ns >> 32) != 0 && _BitScanReverse(&bucket, (unsigned long)(ns >> 32)))
+		bucket += 32;
+	else if (!_BitScanReverse(&bucket, (unsigned long)ns))
+		bucket = 0;
+
+	InterlockedIncrement(&histogram->count);
+	InterlockedIncrement(&histogram->buckets[min(bucket, STATS_N_BUCKETS - 1)]);
+	add64(&histogram->total, (LONGLONG)ns);
+}
+
+/* Records the time since START as time spent in STAGE. */
+void
+StatsStop(StatsStage stage, StatsTime start)
+{
+	histogram_record(&s_stats->stages[stage], start);
+}
+
+/* Records the time since START as time spent in the encoding probe at
+ * INDEX. */
+void
+StatsStopProbe(unsigned int index, StatsTime start)
+{
+	if (index < STATS_MAX_PROBES)
+		histogram_record(&s_stats->probes[index], start);
+}
+
+/* Adds N to COUNTER. */
+void
+StatsCount(StatsCounter counter, LONGLONG n)
+{
+	add64(&s_stats->counters[counter], n);
+}
@@ -0,0 +1,89 @@
+/* Statistics about where the plugin spends its time, kept in a block of
+ * shared memory named STATS_NAME_FORMAT (formatted with the process ID of
+ * the host) so that encoding-stats can read them while the host runs. */
+
+#define STATS_NAME_FORMAT	"Local\\wdx-encoding-stats-%lu"
+
+/* The version of the layout of StatsBlock. */
+#define STATS_VERSION	6
+
+/* The number of buckets in a StatsHistogram.  Bucket I counts the timings
+ * that took from 2^I up to 2^(I + 1) nanoseconds; the last bucket also
+ * counts everything slower than that. */
+#define STATS_N_BUCKETS	40
+
+/* The maximum number of encoding probes that are timed separately. */
+#define STATS_MAX_PROBES	16
+
+/* The stages that are timed. */
+typedef enum StatsStage
+{
+	StatsStageGetValue,
+	StatsStageOpen,
+	StatsStageMap,
+	StatsStageDetect,
+	StatsStageLineEndings,
+	StatsStageDecompress,
+	StatsStageFingerprint,
+	StatsStageCount
+};
+
+/* The events that are counted. */
+typedef enum StatsCounter
+{
+	StatsCounterCacheHits,
+	StatsCounterCacheMisses,
+	StatsCounterBytesScanned,
+	StatsCounterPageFaults,
+	StatsCounterSharedCacheHits,
+	StatsCounterContentValidations,
+	StatsCounterHeapAllocations,
+	StatsCounterCount
+};
+
+/* A histogram of timings.
+ *
+ * COUNT is the number of timings.
+ * TOTAL is the sum of the timings in nanoseconds.
+ * BUCKETS counts the timings by their base-2 logarithm. */
+typedef struct _StatsHistogram StatsHistogram;
+
+struct _StatsHistogram
+{
+	LONG count;
+	LONGLONG total;
+	LONG buckets[STATS_N_BUCKETS];
+};
+
+/* The block of shared memory holding the statistics.
+ *
+ * VERSION is STATS_VERSION and SIZE is the size of the block.
+ * READERS is the number of readers currently attached; things that are
+ * too expensive to always measure, like page faults, are only measured
+ * while it is non-zero.
+ * PROBE_NAMES are the names of the encodings whose probes are timed in
+ * PROBES. */
+typedef struct _StatsBlock StatsBlock;
+
+struct _StatsBlock
+{
+	DWORD version;
+	DWORD size;
+	LONG readers;
+	LONGLONG counters[StatsCounterCount];
+	StatsHistogram stages[StatsStageCount];
+	char probe_names[STATS_MAX_PROBES][16];
+	StatsHistogram probes[STATS_MAX_PROBES];
+};
+
+/* A point in time, as returned by StatsStart(). */
+typedef LONGLONG StatsTime;
+
+void StatsOpen(void);
+void StatsClose(void);
+BOOL StatsWanted(void);
+void StatsNameProbe(unsigned int index, char const *name);
+StatsTime StatsStart(void);
+void StatsStop(StatsStage stage, StatsTime start);
+void StatsStopProbe(unsigned int index, StatsTime start);
+void StatsCount(StatsCounter counter, LONGLONG n);
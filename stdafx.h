@@ -1,6 +1,13 @@
 #pragma once
 
 #define WIN32_LEAN_AND_MEAN
+
+/* GetModuleHandleEx(), which the workers hold the plugin loaded with, came
+ * with Windows XP. */
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT	0x0501
+#endif
+
 #include <windows.h>
 
 #include <stdlib.h>
@@ -0,0 +1,144 @@
+#include "stdafx.h"
+#include "trace.h"
+
+#include <strsafe.h>
+
+/* The number of bytes of records that are collected before they are
+ * written out. */
+#define TRACE_BUFFER_SIZE	(64 * 1024)
+
+/* The open log, if any, and the records waiting to be written to it.
+ * S_TRACE_ORIGIN is when it was opened, and S_LAST_FILENAME is the name of
+ * the file that the last record was about.  All guarded by S_TRACE_LOCK,
+ * except that S_TRACE_FILE is read without it to see if there is a log.
+ * The lock is kept once made, as a call may still be on its way to it
+ * when the log is closed. */
+static CRITICAL_SECTION s_trace_lock;
+static BOOL s_trace_lock_made;
+static HANDLE volatile s_trace_file = INVALID_HANDLE_VALUE;
+static LONGLONG s_trace_origin;
+static char s_last_filename[MAX_PATH];
+static BYTE s_trace_buffer[TRACE_BUFFER_SIZE];
+static size_t s_n_trace_buffer;
+
+/* Writes the records waiting in the buffer to the log.  Must be called
+ * with S_TRACE_LOCK held. */
+static void
+TraceFlush(void)
+{
+	DWORD n_written;
+
+	WriteFile(s_trace_file, s_trace_buffer, (DWORD)s_n_trace_buffer, &n_written, NULL);
+	s_n_trace_buffer = 0;
+}
+
+/* Starts logging the calls into the plugin to FILENAME, replacing what it
+ * held, unless FILENAME is empty or a log is already being kept. */
+void
+TraceOpen(char const *filename)
+{
+	if (filename[0] == '\0' || s_trace_file != INVALID_HANDLE_VALUE)
+		return;
+
+	LARGE_INTEGER frequency, now;
+	if (!QueryPerformanceFrequency(&frequency) || !QueryPerformanceCounter(&now))
+		return;
+
+	HANDLE file = CreateFile(filename, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+							 CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+							 NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return;
+
+	TraceHeader header = { TRACE_MAGIC, TRACE_VERSION, frequency.QuadPart };
+	DWORD n_written;
+	if (!WriteFile(file, &header, sizeof(header), &n_written, NULL)) {
+		CloseHandle(file);
+		return;
+	}
+
+	if (!s_trace_lock_made) {
+		InitializeCriticalSection(&s_trace_lock);
+		s_trace_lock_made = TRUE;
+	}
+	s_trace_origin = now.QuadPart;
+	s_last_filename[0] = '\0';
+	s_n_trace_buffer = 0;
+	s_trace_file = file;
+}
+
+/* Writes out what is left of the log and closes it. */
+void
+TraceClose(void)
+{
+	if (s_trace_file == INVALID_HANDLE_VALUE)
+		return;
+
+	EnterCriticalSection(&s_trace_lock);
+	TraceFlush();
+	HANDLE file = s_trace_file;
+	s_trace_file = INVALID_HANDLE_VALUE;
+	LeaveCriticalSection(&s_trace_lock);
+
+	CloseHandle(file);
+}
+
+/* Starts timing a call, if a log is being kept. */
+TraceTime
+TraceStart(void)
+{
+	LARGE_INTEGER now;
+
+	if (s_trace_file == INVALID_HANDLE_VALUE || !QueryPerformanceCounter(&now))
+		return 0;
+
+	return now.QuadPart;
+}
+
+/* Logs a call to CALL about FILENAME, which may be NULL, with the rest of
+ * its arguments and the STATUS it returned, that started at START. */
+void
+TraceEnd(TraceTime start, TraceCall call, char const *filename,
+		 int field_index, int unit_index, int call_flags, int value_size,
+		 int status)
+{
+	LARGE_INTEGER now;
+
+	if (start == 0 || !QueryPerformanceCounter(&now))
+		return;
+
+	size_t filename_length = 0;
+	if (filename != NULL &&
+		FAILED(StringCchLength(filename, MAX_PATH, &filename_length)))
+		return;
+
+	TraceRecord record;
+	record.call = (BYTE)call;
+	record.flags = 0;
+	record.thread_id = GetCurrentThreadId();
+	record.duration = (DWORD)min(now.QuadPart - start, (LONGLONG)MAXDWORD);
+	record.field_index = field_index;
+	record.unit_index = unit_index;
+	record.call_flags = call_flags;
+	record.value_size = value_size;
+	record.status = status;
+
+	EnterCriticalSection(&s_trace_lock);
+	if (s_trace_file != INVALID_HANDLE_VALUE) {
+		record.start = start - s_trace_origin;
+		if (filename != NULL && lstrcmp(filename, s_last_filename) == 0) {
+			record.flags |= TRACE_SAME_FILENAME;
+			filename_length = 0;
+		} else if (filename != NULL) {
+			StringCbCopy(s_last_filename, sizeof(s_last_filename), filename);
+		}
+		record.filename_length = (WORD)filename_length;
+
+		if (s_n_trace_buffer + sizeof(record) + filename_length > sizeof(s_trace_buffer))
+			TraceFlush();
+		CopyMemory(s_trace_buffer + s_n_trace_buffer, &record, sizeof(record));
+		CopyMemory(s_trace_buffer + s_n_trace_buffer + sizeof(record), filename, filename_length);
+		s_n_trace_buffer += sizeof(record) + filename_length;
+	}
+	LeaveCriticalSection(&s_trace_lock);
+}
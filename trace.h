@@ -0,0 +1,69 @@
+/* A log of the calls that the host makes into the plugin, kept when the
+ * settings name a file for it, so that encoding-replay can play them back.
+ *
+ * The file begins with a TraceHeader, followed by a TraceRecord for every
+ * call, each followed by the FILENAME_LENGTH bytes of the name of the file
+ * it was about, unless TRACE_SAME_FILENAME is set in its FLAGS, in which
+ * case it was about the same file as the record before it. */
+
+#define TRACE_MAGIC		0x54584457	/* "WDXT" */
+#define TRACE_VERSION	1
+
+/* The calls that are traced. */
+typedef enum TraceCall
+{
+	TraceCallGetValue,
+	TraceCallStopGetValue,
+	TraceCallSetValue,
+	TraceCallPluginUnloading,
+	TraceCallCount
+};
+
+/* The FLAGS of a TraceRecord. */
+#define TRACE_SAME_FILENAME	0x1
+
+#pragma pack(push, 1)
+
+/* FREQUENCY is the number of ticks per second that times are in. */
+typedef struct _TraceHeader TraceHeader;
+
+struct _TraceHeader
+{
+	DWORD magic;
+	DWORD version;
+	LONGLONG frequency;
+};
+
+/* A call to CALL by thread THREAD_ID, START ticks after the log was
+ * opened, that took DURATION ticks.  FIELD_INDEX, UNIT_INDEX, CALL_FLAGS
+ * and STATUS are the arguments and the result of the call, where it has
+ * them.  VALUE_SIZE is the size of the buffer handed to ContentGetValue(),
+ * and the field type handed to ContentSetValue(). */
+typedef struct _TraceRecord TraceRecord;
+
+struct _TraceRecord
+{
+	BYTE call;
+	BYTE flags;
+	WORD filename_length;
+	DWORD thread_id;
+	LONGLONG start;
+	DWORD duration;
+	int field_index;
+	int unit_index;
+	int call_flags;
+	int value_size;
+	int status;
+};
+
+#pragma pack(pop)
+
+/* A point in time, as returned by TraceStart(). */
+typedef LONGLONG TraceTime;
+
+void TraceOpen(char const *filename);
+void TraceClose(void);
+TraceTime TraceStart(void);
+void TraceEnd(TraceTime start, TraceCall call, char const *filename,
+			  int field_index, int unit_index, int call_flags, int value_size,
+			  int status);
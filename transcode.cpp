@@ -0,0 +1,954 @@
+#include "stdafx.h"
+#include "line-endings.h"
+#include "encoding.h"
+#include "transcode.h"
+#include "simd.h"
+
+#include <emmintrin.h>
+
+/* The maximum number of non-ASCII bytes or code units that are handed to
+ * the system conversion functions at a time. */
+#define WIDE_BATCH_SIZE	128
+
+/* The maximum number of bytes the host code page needs for each byte or
+ * code unit of a non-ASCII run.  (Three is what CP_UTF8 needs for a lone
+ * invalid byte turned into U+FFFD.) */
+#define HOST_BYTES_PER_UNIT	3
+
+/* Copies the leading run of ASCII bytes among the N bytes of IN to OUT,
+ * sixteen at a time, returning how many were copied. */
+static size_t
+copy_ascii_bytes(unsigned char const *in, size_t n, char *out)
+{
+	size_t i = 0;
+	size_t vector_end = g_simd_level >= SimdLevelSSE2 ? n : 0;
+
+	for (; i + 16 <= vector_end; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		if (_mm_movemask_epi8(v) != 0)
+			break;
+		_mm_storeu_si128((__m128i *)(out + i), v);
+	}
+
+	for (; i < n && in[i] < 0x80; i++)
+		out[i] = (char)in[i];
+
+	return i;
+}
+
+/* Gets the code unit at P in UTF-16 laid out in FORM. */
+static unsigned int
+utf16_unit(unsigned char const *p, TextForm form)
+{
+	return form == TextFormUTF16BE ? (p[0] << 8) | p[1] : p[0] | (p[1] << 8);
+}
+
+/* Copies the leading run of ASCII code units among the N_UNITS UTF-16 code
+ * units of IN, laid out in FORM, to OUT, narrowing eight at a time, returning
+ * how many were copied. */
+static size_t
+copy_ascii_units(unsigned char const *in, size_t n_units, char *out, TextForm form)
+{
+	__m128i const non_ascii = _mm_set1_epi16((short)0xff80);
+	__m128i const zero = _mm_setzero_si128();
+	size_t i = 0;
+	size_t vector_end = g_simd_level >= SimdLevelSSE2 ? n_units : 0;
+
+	for (; i + 8 <= vector_end; i += 8) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + 2 * i));
+		if (form == TextFormUTF16BE)
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(v, non_ascii), zero)) != 0xffff)
+			break;
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(v, v));
+	}
+
+	for (; i < n_units; i++) {
+		unsigned int unit = utf16_unit(in + 2 * i, form);
+		if (unit >= 0x80)
+			break;
+		out[i] = (char)unit;
+	}
+
+	return i;
+}
+
+/* Narrows N_WIDE characters of WIDE into the host code page at *OUT,
+ * advancing *OUT past them. */
+static void
+narrow_to_host(WCHAR const *wide, int n_wide, char **out, char *out_end)
+{
+	int n = WideCharToMultiByte(CP_ACP, 0, wide, n_wide, *out, (int)(out_end - *out),
+								NULL, NULL);
+	*out += n;
+}
+
+/* Finds the length of the leading run of non-ASCII bytes among the N bytes
+ * of IN, leaving out a trailing partial UTF-8 character unless FINAL is set. */
+static size_t
+utf8_run_length(unsigned char const *in, size_t n, BOOL final)
+{
+	size_t run = 0;
+	while (run < n && in[run] >= 0x80)
+		run++;
+
+	if (run < n || final)
+		return run;
+
+	/* The run may end in the middle of a character, so back up to the
+	 * beginning of the last one and leave it out if it isnt complete. */
+	size_t last = run;
+	while (last > 0 && run - last < 3 && (in[last - 1] & 0xc0) == 0x80)
+		last--;
+	if (last == 0)
+		return run;
+
+	last--;
+	unsigned char lead = in[last];
+	size_t length = lead >= 0xf0 ? 4 : lead >= 0xe0 ? 3 : lead >= 0xc0 ? 2 : 1;
+
+	return last + length > run ? last : run;
+}
+
+/* Transcodes the characters between *IN and IN_END of text encoded using
+ * ENCODING into text in the hosts ANSI code page between *OUT and OUT_END,
+ * advancing *IN and *OUT past what was consumed and produced.  Runs of ASCII
+ * are copied sixteen bytes (or eight code units) at a time; everything else
+ * goes through the system conversion functions a batch at a time.  Only
+ * whole characters are consumed, unless FINAL is set, in which case a
+ * trailing partial character is consumed as well.  Transcoding stops when
+ * either the input is used up or the output has no room for the next
+ * batch. */
+void
+TranscodeToHost(Encoding const *encoding,
+				unsigned char const **in, unsigned char const *in_end,
+				char **out, char *out_end, BOOL final)
+{
+	TextForm form = EncodingTextForm(encoding);
+	unsigned char const *p = *in;
+	char *q = *out;
+	WCHAR wide[WIDE_BATCH_SIZE];
+
+	while (p < in_end && q < out_end) {
+		size_t room = out_end - q;
+
+		switch (form) {
+		case TextFormSingleByte:
+		case TextFormUTF8: {
+			size_t n = copy_ascii_bytes(p, min((size_t)(in_end - p), room), q);
+			p += n;
+			q += n;
+			if (p == in_end || q == out_end)
+				break;
+
+			size_t limit = min((size_t)(in_end - p), (size_t)WIDE_BATCH_SIZE);
+			limit = min(limit, (out_end - q) / HOST_BYTES_PER_UNIT);
+			size_t run;
+			if (form == TextFormUTF8)
+				run = utf8_run_length(p, limit, final && limit == (size_t)(in_end - p));
+			else
+				for (run = 0; run < limit && p[run] >= 0x80; run++)
+					;
+			if (run == 0)
+				goto done;
+
+			int n_wide = MultiByteToWideChar(EncodingCodePage(encoding), 0,
+											 (char const *)p, (int)run,
+											 wide, _countof(wide));
+			narrow_to_host(wide, n_wide, &q, out_end);
+			p += run;
+			break;
+		}
+		case TextFormUTF16BE:
+		case TextFormUTF16LE: {
+			size_t n_units = (in_end - p) / 2;
+			if (n_units == 0) {
+				if (!final)
+					goto done;
+				/* A dangling byte at the end of the input. */
+				*q++ = '?';
+				p = in_end;
+				break;
+			}
+
+			size_t n = copy_ascii_units(p, min(n_units, room), q, form);
+			p += 2 * n;
+			q += n;
+			n_units -= n;
+			if (n_units == 0 || q == out_end)
+				break;
+
+			size_t limit = min(n_units, (size_t)WIDE_BATCH_SIZE);
+			limit = min(limit, (out_end - q) / HOST_BYTES_PER_UNIT);
+			int n_wide = 0;
+			while ((size_t)n_wide < limit) {
+				unsigned int unit = utf16_unit(p + 2 * n_wide, form);
+				if (unit < 0x80)
+					break;
+
+				/* Keep surrogate pairs together, and dont split one that
+				 * may yet be completed by the following input. */
+				if (unit >= 0xd800 && unit < 0xdc00) {
+					if ((size_t)n_wide + 1 == n_units) {
+						if (!final)
+							break;
+					} else {
+						unsigned int next = utf16_unit(p + 2 * (n_wide + 1), form);
+						if (next >= 0xdc00 && next < 0xe000) {
+							if ((size_t)n_wide + 2 > limit)
+								break;
+							wide[n_wide++] = (WCHAR)unit;
+							unit = next;
+						}
+					}
+				}
+
+				wide[n_wide++] = (WCHAR)unit;
+			}
+			if (n_wide == 0)
+				goto done;
+
+			narrow_to_host(wide, n_wide, &q, out_end);
+			p += 2 * n_wide;
+			break;
+		}
+		default:
+			goto done;
+		}
+	}
+
+done:
+	*in = p;
+	*out = q;
+}
+
+/* Marks the bytes of a single-byte code page that dont stand for any
+ * character. */
+#define NO_CHARACTER	0xffff
+
+/* Sixteen entries of a single-byte table, mapping the bytes 0xR0 to 0xRf
+ * to the characters of the same value, or to none at all. */
+#define IDENTITY_ROW(r) \
+	r##0, r##1, r##2, r##3, r##4, r##5, r##6, r##7, \
+	r##8, r##9, r##a, r##b, r##c, r##d, r##e, r##f
+#define UNMAPPED_ROW \
+	NO_CHARACTER, NO_CHARACTER, NO_CHARACTER, NO_CHARACTER, \
+	NO_CHARACTER, NO_CHARACTER, NO_CHARACTER, NO_CHARACTER, \
+	NO_CHARACTER, NO_CHARACTER, NO_CHARACTER, NO_CHARACTER, \
+	NO_CHARACTER, NO_CHARACTER, NO_CHARACTER, NO_CHARACTER
+
+/* The lower half, shared by all of the single-byte code pages. */
+#define ASCII_ROWS \
+	IDENTITY_ROW(0x0), IDENTITY_ROW(0x1), IDENTITY_ROW(0x2), IDENTITY_ROW(0x3), \
+	IDENTITY_ROW(0x4), IDENTITY_ROW(0x5), IDENTITY_ROW(0x6), IDENTITY_ROW(0x7)
+
+/* The upper half of ISO-8859-1 (minus the C1 controls), shared with
+ * Windows-1252. */
+#define LATIN1_ROWS \
+	IDENTITY_ROW(0xa), IDENTITY_ROW(0xb), IDENTITY_ROW(0xc), IDENTITY_ROW(0xd), \
+	IDENTITY_ROW(0xe), IDENTITY_ROW(0xf)
+
+static WCHAR const s_ascii_table[256] = {
+	ASCII_ROWS,
+	UNMAPPED_ROW, UNMAPPED_ROW, UNMAPPED_ROW, UNMAPPED_ROW,
+	UNMAPPED_ROW, UNMAPPED_ROW, UNMAPPED_ROW, UNMAPPED_ROW
+};
+
+static WCHAR const s_iso8859_1_table[256] = {
+	ASCII_ROWS,
+	IDENTITY_ROW(0x8), IDENTITY_ROW(0x9),
+	LATIN1_ROWS
+};
+
+/* The five bytes that Windows-1252 leaves undefined map to the C1
+ * controls of the same value, as MultiByteToWideChar() does. */
+static WCHAR const s_windows_1252_table[256] = {
+	ASCII_ROWS,
+	0x20ac, 0x0081, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+	0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008d, 0x017d, 0x008f,
+	0x0090, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+	0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0x009d, 0x017e, 0x0178,
+	LATIN1_ROWS
+};
+
+/* Gets the table mapping the bytes of the single-byte ENCODING to
+ * characters, or NULL if there is none for it. */
+static WCHAR const *
+single_byte_table(Encoding const *encoding)
+{
+	if (EncodingTextForm(encoding) != TextFormSingleByte)
+		return NULL;
+
+	switch (EncodingCodePage(encoding)) {
+	case 20127:
+		return s_ascii_table;
+	case 28591:
+		return s_iso8859_1_table;
+	case 1252:
+		return s_windows_1252_table;
+	default:
+		return NULL;
+	}
+}
+
+/* Determines if TextForm FORM is one of the forms of Unicode. */
+static BOOL
+is_unicode(TextForm form)
+{
+	return form == TextFormUTF8 || form == TextFormUTF16BE || form == TextFormUTF16LE;
+}
+
+/* Determines if text can be transcoded from FROM to TO without going
+ * through iconv, which is the case when FROM is a single-byte code page
+ * and TO is either Unicode or a single-byte code page itself, and between
+ * any two forms of Unicode. */
+BOOL
+TranscodeIsBuiltIn(Encoding const *from, Encoding const *to)
+{
+	TextForm to_form = EncodingTextForm(to);
+
+	if (is_unicode(EncodingTextForm(from)))
+		return is_unicode(to_form);
+
+	if (single_byte_table(from) == NULL)
+		return FALSE;
+
+	switch (to_form) {
+	case TextFormUTF8:
+	case TextFormUTF16BE:
+	case TextFormUTF16LE:
+		return TRUE;
+	case TextFormSingleByte:
+		return single_byte_table(to) != NULL;
+	default:
+		return FALSE;
+	}
+}
+
+/* Gets the number of bytes C takes up in UTF-8. */
+static size_t
+utf8_length(unichar c)
+{
+	return c < 0x80 ? 1 : c < 0x800 ? 2 : 3;
+}
+
+/* Widens the leading run of ASCII bytes among the N bytes of IN to UTF-16
+ * laid out in FORM at OUT, sixteen at a time, returning how many were
+ * widened. */
+static size_t
+widen_ascii_bytes(unsigned char const *in, size_t n, unsigned char *out, TextForm form)
+{
+	__m128i const zero = _mm_setzero_si128();
+	size_t i = 0;
+	size_t vector_end = g_simd_level >= SimdLevelSSE2 ? n : 0;
+
+	for (; i + 16 <= vector_end; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		if (_mm_movemask_epi8(v) != 0)
+			break;
+		if (form == TextFormUTF16BE) {
+			_mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(zero, v));
+			_mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(zero, v));
+		} else {
+			_mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(v, zero));
+			_mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(v, zero));
+		}
+	}
+
+	for (; i < n && in[i] < 0x80; i++) {
+		out[2 * i + (form == TextFormUTF16BE)] = in[i];
+		out[2 * i + (form != TextFormUTF16BE)] = 0;
+	}
+
+	return i;
+}
+
+/* Encodes C into FORM at OUT, using TABLE to find its byte if FORM is
+ * TextFormSingleByte, returning the number of bytes used, or 0 if C cant
+ * be represented. */
+static size_t
+encode_character(TextForm form, WCHAR const *table, unichar c, unsigned char *out)
+{
+	switch (form) {
+	case TextFormSingleByte:
+		if (c < 0x100 && table[c] == c) {
+			out[0] = (unsigned char)c;
+			return 1;
+		}
+		for (int b = 0x80; b < 0x100; b++) {
+			if (table[b] == c) {
+				out[0] = (unsigned char)b;
+				return 1;
+			}
+		}
+		return 0;
+	case TextFormUTF8:
+		if (c < 0x80) {
+			out[0] = (unsigned char)c;
+			return 1;
+		} else if (c < 0x800) {
+			out[0] = (unsigned char)(0xc0 | (c >> 6));
+			out[1] = (unsigned char)(0x80 | (c & 0x3f));
+			return 2;
+		}
+		out[0] = (unsigned char)(0xe0 | (c >> 12));
+		out[1] = (unsigned char)(0x80 | ((c >> 6) & 0x3f));
+		out[2] = (unsigned char)(0x80 | (c & 0x3f));
+		return 3;
+	case TextFormUTF16BE:
+		out[0] = (unsigned char)(c >> 8);
+		out[1] = (unsigned char)c;
+		return 2;
+	case TextFormUTF16LE:
+		out[0] = (unsigned char)c;
+		out[1] = (unsigned char)(c >> 8);
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* Transcodes the bytes between *IN and IN_END of text in the single-byte
+ * encoding FROM into TO between *OUT and OUT_END, advancing *IN and *OUT
+ * past what was consumed and produced, for pairs of encodings that
+ * TranscodeIsBuiltIn() where FROM isnt Unicode.  Runs of ASCII are copied
+ * (or widened) sixteen bytes at a time; only the other bytes are looked
+ * up.  Stops when the input is used up or the output has no room for the
+ * next character, and returns FALSE if it stops at a byte that cant be
+ * represented in TO. */
+BOOL
+TranscodeSingleByte(Encoding const *from, Encoding const *to,
+					unsigned char const **in, unsigned char const *in_end,
+					unsigned char **out, unsigned char *out_end)
+{
+	WCHAR const *table = single_byte_table(from);
+	WCHAR const *to_table = single_byte_table(to);
+	TextForm form = EncodingTextForm(to);
+	unsigned char const *p = *in;
+	unsigned char *q = *out;
+	BOOL representable = TRUE;
+
+	while (p < in_end) {
+		size_t n;
+		if (form == TextFormUTF16BE || form == TextFormUTF16LE) {
+			n = widen_ascii_bytes(p, min((size_t)(in_end - p), (size_t)(out_end - q) / 2), q, form);
+			q += 2 * n;
+		} else {
+			n = copy_ascii_bytes(p, min((size_t)(in_end - p), (size_t)(out_end - q)), (char *)q);
+			q += n;
+		}
+		p += n;
+		if (p == in_end || out_end - q < 3)
+			break;
+		if (*p < 0x80)
+			continue;
+
+		unichar c = table[*p];
+		size_t length = c == NO_CHARACTER ? 0 : encode_character(form, to_table, c, q);
+		if (length == 0) {
+			representable = FALSE;
+			break;
+		}
+		q += length;
+		p++;
+	}
+
+	*in = p;
+	*out = q;
+
+	return representable;
+}
+
+/* Determines if the N bytes of IN are all ASCII, looking at sixteen at a
+ * time. */
+BOOL
+TranscodeIsASCII(unsigned char const *in, size_t n)
+{
+	size_t i = 0;
+	size_t vector_end = g_simd_level >= SimdLevelSSE2 ? n : 0;
+
+	for (; i + 16 <= vector_end; i += 16)
+		if (_mm_movemask_epi8(_mm_loadu_si128((__m128i const *)(in + i))) != 0)
+			return FALSE;
+
+	for (; i < n; i++)
+		if (in[i] >= 0x80)
+			return FALSE;
+
+	return TRUE;
+}
+
+/* Determines if transcoding text from FROM to TO leaves the bytes of the
+ * text as they are, so that at most its BOM needs changing.  That is the
+ * case between the encodings of the same Unicode form, which differ only
+ * in their BOMs, and from ASCII to any encoding that extends it, provided
+ * that the text really is ASCII throughout, which ASCII_ONLY is set to say
+ * needs checking with TranscodeIsASCII(). */
+BOOL
+TranscodeKeepsBytes(Encoding const *from, Encoding const *to, BOOL *ascii_only)
+{
+	TextForm form = EncodingTextForm(from);
+	TextForm to_form = EncodingTextForm(to);
+
+	*ascii_only = FALSE;
+	switch (form) {
+	case TextFormUTF8:
+	case TextFormUTF16BE:
+	case TextFormUTF16LE:
+		return to_form == form;
+	case TextFormSingleByte:
+		*ascii_only = TRUE;
+		return single_byte_table(from) == s_ascii_table &&
+			(to_form == TextFormUTF8 || single_byte_table(to) != NULL);
+	default:
+		return FALSE;
+	}
+}
+
+/* Decodes the UTF-8 character at the beginning of the N bytes of IN into
+ * C, returning the number of bytes it takes up, or 0 if they dont begin
+ * with a valid, shortest form UTF-8 sequence. */
+static size_t
+decode_utf8(unsigned char const *in, size_t n, unichar *c)
+{
+	size_t length = in[0] < 0x80 ? 1 : in[0] < 0xc2 ? 0 : in[0] < 0xe0 ? 2 :
+		in[0] < 0xf0 ? 3 : in[0] < 0xf5 ? 4 : 0;
+	if (length == 0 || length > n)
+		return 0;
+
+	*c = length == 1 ? in[0] : in[0] & (0x7f >> length);
+	for (size_t i = 1; i < length; i++) {
+		if ((in[i] & 0xc0) != 0x80)
+			return 0;
+		*c = (*c << 6) | (in[i] & 0x3f);
+	}
+
+	if ((length == 3 && (*c < 0x800 || (*c >= 0xd800 && *c < 0xe000))) ||
+		(length == 4 && (*c < 0x10000 || *c > 0x10ffff)))
+		return 0;
+
+	return length;
+}
+
+/* Encodes the N bytes of UTF-8 text IN into TO at OUT, which has room for
+ * OUT_SIZE bytes, without any BOM.  Returns the number of bytes it takes
+ * up in TO, or 0 if it isnt valid UTF-8, has characters that cant be
+ * represented in TO, or doesnt fit.  Meant for short strings, such as the
+ * queries of a search, rather than for files. */
+size_t
+TranscodeFromUTF8(Encoding const *to, unsigned char const *in, size_t n,
+				  unsigned char *out, size_t out_size)
+{
+	TextForm form = EncodingTextForm(to);
+	WCHAR const *table = single_byte_table(to);
+	if (form == TextFormNone || (form == TextFormSingleByte && table == NULL))
+		return 0;
+
+	size_t n_out = 0;
+	for (size_t i = 0; i < n; ) {
+		unichar c;
+		size_t length = decode_utf8(in + i, n - i, &c);
+		if (length == 0)
+			return 0;
+
+		unsigned char bytes[4];
+		size_t n_bytes;
+		if (form == TextFormUTF8) {
+			CopyMemory(bytes, in + i, length);
+			n_bytes = length;
+		} else if (c >= 0x10000) {
+			if (form == TextFormSingleByte)
+				return 0;
+			c -= 0x10000;
+			n_bytes = encode_character(form, table, 0xd800 | (c >> 10), bytes);
+			n_bytes += encode_character(form, table, 0xdc00 | (c & 0x3ff), bytes + n_bytes);
+		} else {
+			n_bytes = encode_character(form, table, c, bytes);
+			if (n_bytes == 0)
+				return 0;
+		}
+
+		if (n_bytes > out_size - n_out)
+			return 0;
+		CopyMemory(out + n_out, bytes, n_bytes);
+		n_out += n_bytes;
+		i += length;
+	}
+
+	return n_out;
+}
+
+/* Determines if TranscodeCheckBytes() can tell whether text in FROM can be
+ * represented in TO, which it can for Unicode and for the single-byte code
+ * pages that it knows. */
+BOOL
+TranscodeCanCheck(Encoding const *from, Encoding const *to)
+{
+	TextForm form = EncodingTextForm(from);
+	TextForm to_form = EncodingTextForm(to);
+
+	return form != TextFormNone && to_form != TextFormNone &&
+		(form != TextFormSingleByte || single_byte_table(from) != NULL) &&
+		(to_form != TextFormSingleByte || single_byte_table(to) != NULL);
+}
+
+/* Gets the number of bytes C takes up in FORM, using TABLE to find its
+ * byte if FORM is TextFormSingleByte, or 0 if it cant be represented. */
+static size_t
+encoded_length(TextForm form, WCHAR const *table, unichar c)
+{
+	unsigned char byte;
+
+	switch (form) {
+	case TextFormUTF8:
+		return c < 0x10000 ? utf8_length(c) : 4;
+	case TextFormUTF16BE:
+	case TextFormUTF16LE:
+		return c < 0x10000 ? 2 : 4;
+	case TextFormSingleByte:
+		return c < 0x10000 ? encode_character(form, table, c, &byte) : 0;
+	default:
+		return 0;
+	}
+}
+
+/* Gets the number of bytes taken up by the leading run of ASCII characters
+ * among the N bytes of IN, laid out in FORM, looking at sixteen bytes at a
+ * time.  Runs shorter than that are left for the caller. */
+static size_t
+check_ascii_bytes(unsigned char const *in, size_t n, TextForm form)
+{
+	__m128i const zero = _mm_setzero_si128();
+	size_t i = 0;
+	size_t vector_end = g_simd_level >= SimdLevelSSE2 ? n : 0;
+
+	if (form != TextFormUTF16BE && form != TextFormUTF16LE) {
+		for (; i + 16 <= vector_end; i += 16)
+			if (_mm_movemask_epi8(_mm_loadu_si128((__m128i const *)(in + i))) != 0)
+				break;
+		return i;
+	}
+
+	/* The code units are ASCII if none of their bytes have their top bits
+	 * set and their high bytes are zero. */
+	int high = form == TextFormUTF16LE ? 0xaaaa : 0x5555;
+	for (; i + 16 <= vector_end; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		if (_mm_movemask_epi8(v) != 0 ||
+			(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & high) != high)
+			break;
+	}
+
+	return i;
+}
+
+/* Gets the UTF-16 code unit laid out in FORM at IN. */
+static unichar
+read_unit(unsigned char const *in, TextForm form)
+{
+	return form == TextFormUTF16BE ? (in[0] << 8) | in[1] : in[0] | (in[1] << 8);
+}
+
+/* Checks whether the characters of the N bytes of IN, which begin OFFSET
+ * bytes into text in FROM, can be represented in TO, adding what is found
+ * to CHECK, for pairs of encodings that TranscodeCanCheck().  Invalid
+ * bytes in FROM cant be represented in anything.  Returns the number of
+ * bytes checked, which leaves out a trailing partial character, unless
+ * FINAL is set. */
+size_t
+TranscodeCheckBytes(Encoding const *from, Encoding const *to,
+					unsigned char const *in, size_t n, ULONGLONG offset, BOOL final,
+					TranscodeCheck *check)
+{
+	TextForm form = EncodingTextForm(from);
+	WCHAR const *table = single_byte_table(from);
+	TextForm to_form = EncodingTextForm(to);
+	WCHAR const *to_table = single_byte_table(to);
+	BOOL wide = form == TextFormUTF16BE || form == TextFormUTF16LE;
+	BOOL to_wide = to_form == TextFormUTF16BE || to_form == TextFormUTF16LE;
+	size_t i = 0;
+
+	while (i < n) {
+		size_t n_ascii = check_ascii_bytes(in + i, n - i, form);
+		check->size += wide == to_wide ? n_ascii : wide ? n_ascii / 2 : 2 * n_ascii;
+		i += n_ascii;
+		if (i == n)
+			break;
+
+		/* C is left negative for bytes that arent valid in FROM. */
+		unichar c = -1;
+		size_t length = 1;
+		if (form == TextFormSingleByte) {
+			unichar utf8;
+			if (!check->mixed && in[i] >= 0xc2 && decode_utf8(in + i, n - i, &utf8) > 1)
+				check->mixed = TRUE;
+			if (table[in[i]] != NO_CHARACTER)
+				c = table[in[i]];
+		} else if (form == TextFormUTF8) {
+			length = decode_utf8(in + i, n - i, &c);
+			if (length == 0) {
+				if (!final && n - i < 4)
+					break;
+				c = -1;
+				length = 1;
+				check->mixed = TRUE;
+			}
+		} else if (n - i < 2) {
+			if (!final)
+				break;
+		} else {
+			unichar unit = read_unit(in + i, form);
+			length = 2;
+			if (unit >= 0xd800 && unit < 0xdc00) {
+				if (!final && n - i < 4)
+					break;
+				unichar low = n - i >= 4 ? read_unit(in + i + 2, form) : 0;
+				if (low >= 0xdc00 && low < 0xe000) {
+					c = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+					length = 4;
+				}
+			} else if (unit < 0xdc00 || unit >= 0xe000) {
+				c = unit;
+			}
+		}
+
+		size_t n_bytes = c < 0 ? 0 : encoded_length(to_form, to_table, c);
+		if (n_bytes == 0) {
+			if (check->n_lost < TRANSCODE_MAX_LOST)
+				check->lost[check->n_lost] = offset + i;
+			check->n_lost++;
+		}
+		check->size += n_bytes;
+		i += length;
+	}
+
+	return i;
+}
+
+/* The number of bytes taken up by the UTF-8 characters whose first bytes
+ * have the top four bits that they are indexed by, for text that is known
+ * to be valid.  Stray continuation bytes are taken to stand alone. */
+static unsigned char const s_utf8_lengths[16] = {
+	1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 3, 4,
+};
+
+/* Narrows the leading run of ASCII code units among the N bytes of UTF-16
+ * text laid out in FORM at IN to single bytes at OUT, eight at a time,
+ * returning the number of bytes of IN that were narrowed. */
+static size_t
+narrow_ascii_units(unsigned char const *in, size_t n, unsigned char *out, TextForm form)
+{
+	__m128i const zero = _mm_setzero_si128();
+	int high = form == TextFormUTF16LE ? 0xaaaa : 0x5555;
+	size_t i = 0;
+	size_t vector_end = g_simd_level >= SimdLevelSSE2 ? n : 0;
+
+	for (; i + 16 <= vector_end; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		if (_mm_movemask_epi8(v) != 0 ||
+			(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) & high) != high)
+			break;
+		if (form == TextFormUTF16BE)
+			v = _mm_srli_epi16(v, 8);
+		_mm_storel_epi64((__m128i *)(out + i / 2), _mm_packus_epi16(v, v));
+	}
+
+	for (; i + 2 <= n; i += 2) {
+		unichar unit = read_unit(in + i, form);
+		if (unit >= 0x80)
+			break;
+		out[i / 2] = (unsigned char)unit;
+	}
+
+	return i;
+}
+
+/* Copies the N bytes of UTF-16 text laid out in FORM at IN to OUT, eight
+ * code units at a time, swapping the bytes of each if SWAP is set.  Unless
+ * PROVEN is set, it stops at the first surrogate, as those need checking
+ * to be paired up.  Returns the number of bytes copied. */
+static size_t
+copy_units(unsigned char const *in, size_t n, unsigned char *out, TextForm form,
+		   BOOL swap, BOOL proven)
+{
+	__m128i const surrogate_mask = _mm_set1_epi8((char)0xf8);
+	__m128i const surrogate = _mm_set1_epi8((char)0xd8);
+	int high = form == TextFormUTF16LE ? 0xaaaa : 0x5555;
+	size_t i = 0;
+	size_t vector_end = g_simd_level >= SimdLevelSSE2 ? n : 0;
+
+	for (; i + 16 <= vector_end; i += 16) {
+		__m128i v = _mm_loadu_si128((__m128i const *)(in + i));
+		if (!proven &&
+			(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, surrogate_mask), surrogate)) & high) != 0)
+			break;
+		if (swap)
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(out + i), v);
+	}
+
+	for (; i + 2 <= n; i += 2) {
+		unichar unit = read_unit(in + i, form);
+		if (!proven && unit >= 0xd800 && unit < 0xe000)
+			break;
+		out[i] = in[i + (swap ? 1 : 0)];
+		out[i + 1] = in[i + (swap ? 0 : 1)];
+	}
+
+	return i;
+}
+
+/* Transcodes the leading run of the N bytes of IN, text laid out in FORM,
+ * that can be done in bulk into TO_FORM at OUT, which has room for OUT_SIZE
+ * bytes: ASCII, or, if PROVEN is set and only the byte order changes, if
+ * at all, all of it.  Returns the number of bytes of IN transcoded, and
+ * sets *N_OUT to the number of bytes they took up at OUT. */
+static size_t
+transcode_run(TextForm form, TextForm to_form, unsigned char const *in, size_t n,
+			  unsigned char *out, size_t out_size, BOOL proven, size_t *n_out)
+{
+	size_t n_in;
+
+	if (form == TextFormUTF8 && to_form == TextFormUTF8) {
+		n_in = min(n, out_size);
+		if (proven)
+			CopyMemory(out, in, n_in);
+		else
+			n_in = copy_ascii_bytes(in, n_in, (char *)out);
+		*n_out = n_in;
+	} else if (form == TextFormUTF8) {
+		n_in = widen_ascii_bytes(in, min(n, out_size / 2), out, to_form);
+		*n_out = 2 * n_in;
+	} else if (to_form == TextFormUTF8) {
+		n_in = narrow_ascii_units(in, min(n, 2 * out_size) & ~(size_t)1, out, form);
+		*n_out = n_in / 2;
+	} else {
+		n_in = copy_units(in, min(n, out_size) & ~(size_t)1, out, form,
+						  form != to_form, proven);
+		*n_out = n_in;
+	}
+
+	return n_in;
+}
+
+/* Decodes the character at the beginning of the N bytes of IN, text laid
+ * out in the Unicode form FORM, into C, returning the number of bytes it
+ * takes up, or 0 if it may not all be there.  Unless PROVEN is set, it is
+ * checked to be valid, and (size_t)-1 is returned if it isnt; otherwise
+ * it is taken to be, and only the bytes it is said to take up are read. */
+static size_t
+decode_unicode(TextForm form, unsigned char const *in, size_t n, BOOL proven, unichar *c)
+{
+	if (form == TextFormUTF8) {
+		if (!proven) {
+			size_t length = decode_utf8(in, n, c);
+			return length != 0 ? length : n < 4 ? 0 : (size_t)-1;
+		}
+
+		size_t length = s_utf8_lengths[in[0] >> 4];
+		if (length > n)
+			return 0;
+		*c = length == 1 ? in[0] : in[0] & (0x7f >> length);
+		for (size_t i = 1; i < length; i++)
+			*c = (*c << 6) | (in[i] & 0x3f);
+		return length;
+	}
+
+	if (n < 2)
+		return 0;
+	unichar unit = read_unit(in, form);
+	if (unit < 0xd800 || unit >= 0xe000) {
+		*c = unit;
+		return 2;
+	}
+	if (!proven && unit >= 0xdc00)
+		return (size_t)-1;
+	if (n < 4)
+		return 0;
+	unichar low = read_unit(in + 2, form);
+	if (!proven && (low < 0xdc00 || low >= 0xe000))
+		return (size_t)-1;
+	*c = 0x10000 + ((unit - 0xd800) << 10) + (low - 0xdc00);
+	return 4;
+}
+
+/* Encodes C into the Unicode form FORM at OUT, which has room for at least
+ * four bytes, returning the number of bytes used. */
+static size_t
+encode_unicode(TextForm form, unichar c, unsigned char *out)
+{
+	if (c < 0x10000)
+		return encode_character(form, NULL, c, out);
+
+	if (form == TextFormUTF8) {
+		out[0] = (unsigned char)(0xf0 | (c >> 18));
+		out[1] = (unsigned char)(0x80 | ((c >> 12) & 0x3f));
+		out[2] = (unsigned char)(0x80 | ((c >> 6) & 0x3f));
+		out[3] = (unsigned char)(0x80 | (c & 0x3f));
+		return 4;
+	}
+
+	c -= 0x10000;
+	size_t n = encode_character(form, NULL, 0xd800 | (c >> 10), out);
+	return n + encode_character(form, NULL, 0xdc00 | (c & 0x3ff), out + n);
+}
+
+/* Transcodes the bytes between *IN and IN_END of text in the Unicode
+ * encoding FROM into the Unicode encoding TO between *OUT and OUT_END,
+ * advancing *IN and *OUT past what was consumed and produced, the way
+ * TranscodeSingleByte() does.  Unless PROVEN is set, the text is checked
+ * as it goes, and FALSE is returned if it stops at bytes that arent valid
+ * in FROM.  If PROVEN is set, a TranscodeProof has to vouch for the text,
+ * which is then transcoded without checking it: runs that only change
+ * their byte order, if at all, are copied whole, sixteen bytes at a time,
+ * and characters are decoded by their lengths alone.  Such proofs only
+ * come from checking the whole of the file for conversion right before,
+ * never from detecting its encoding, which looks at no more than the
+ * beginning of it and so cant vouch for the rest. */
+BOOL
+TranscodeUnicode(Encoding const *from, Encoding const *to,
+				 unsigned char const **in, unsigned char const *in_end,
+				 unsigned char **out, unsigned char *out_end, BOOL proven)
+{
+	TextForm form = EncodingTextForm(from);
+	TextForm to_form = EncodingTextForm(to);
+	unsigned char const *p = *in;
+	unsigned char *q = *out;
+	BOOL valid = TRUE;
+
+	while (p < in_end) {
+		size_t n_out;
+		p += transcode_run(form, to_form, p, in_end - p, q, out_end - q, proven, &n_out);
+		q += n_out;
+		if (p == in_end || out_end - q < 4)
+			break;
+
+		unichar c;
+		size_t length = decode_unicode(form, p, in_end - p, proven, &c);
+		if (length == 0)
+			break;
+		if (length == (size_t)-1) {
+			valid = FALSE;
+			break;
+		}
+		q += encode_unicode(to_form, c, q);
+		p += length;
+	}
+
+	*in = p;
+	*out = q;
+
+	return valid;
+}
+
+/* Gets the number of bytes of text in ENCODING, from OFFSET on, that PROOF
+ * vouches for. */
+ULONGLONG
+TranscodeProvenLength(TranscodeProof const *proof, Encoding const *encoding, ULONGLONG offset)
+{
+	if (proof->encoding != encoding || offset < proof->offset ||
+		offset - proof->offset >= proof->length)
+		return 0;
+
+	return proof->length - (offset - proof->offset);
+}
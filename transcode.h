@@ -0,0 +1,54 @@
+/* The most offsets of characters that cant be represented that a
+ * TranscodeCheck keeps. */
+#define TRANSCODE_MAX_LOST	16
+
+/* What checking whether text can be represented in another encoding has
+ * found so far.  SIZE is the number of bytes it takes up there, leaving
+ * out the N_LOST characters that cant be represented, the offsets of the
+ * first TRANSCODE_MAX_LOST of which are in LOST.  MIXED is set if it
+ * looks like the text may have been pieced together from text in
+ * different encodings: there are bytes in UTF-8 text that arent valid
+ * there, or bytes in single-byte text that would be valid UTF-8. */
+typedef struct _TranscodeCheck TranscodeCheck;
+
+struct _TranscodeCheck
+{
+	ULONGLONG size;
+	ULONGLONG n_lost;
+	ULONGLONG lost[TRANSCODE_MAX_LOST];
+	BOOL mixed;
+};
+
+/* What checking text has proven about it: the LENGTH bytes of it from
+ * OFFSET are valid ENCODING, made up of whole characters, so they can be
+ * transcoded without being checked again.  No text is proven if ENCODING
+ * is NULL.  Only ConvertibilityCheckWindow() makes them. */
+typedef struct _TranscodeProof TranscodeProof;
+
+struct _TranscodeProof
+{
+	Encoding const *encoding;
+	ULONGLONG offset;
+	ULONGLONG length;
+};
+
+void TranscodeToHost(Encoding const *encoding,
+					 unsigned char const **in, unsigned char const *in_end,
+					 char **out, char *out_end, BOOL final);
+BOOL TranscodeIsBuiltIn(Encoding const *from, Encoding const *to);
+BOOL TranscodeSingleByte(Encoding const *from, Encoding const *to,
+						 unsigned char const **in, unsigned char const *in_end,
+						 unsigned char **out, unsigned char *out_end);
+BOOL TranscodeUnicode(Encoding const *from, Encoding const *to,
+					  unsigned char const **in, unsigned char const *in_end,
+					  unsigned char **out, unsigned char *out_end, BOOL proven);
+ULONGLONG TranscodeProvenLength(TranscodeProof const *proof, Encoding const *encoding,
+								ULONGLONG offset);
+BOOL TranscodeIsASCII(unsigned char const *in, size_t n);
+BOOL TranscodeKeepsBytes(Encoding const *from, Encoding const *to, BOOL *ascii_only);
+size_t TranscodeFromUTF8(Encoding const *to, unsigned char const *in, size_t n,
+						 unsigned char *out, size_t out_size);
+BOOL TranscodeCanCheck(Encoding const *from, Encoding const *to);
+size_t TranscodeCheckBytes(Encoding const *from, Encoding const *to,
+						   unsigned char const *in, size_t n, ULONGLONG offset, BOOL final,
+						   TranscodeCheck *check);
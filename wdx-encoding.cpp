@@ -1,8 +1,23 @@
 #include "stdafx.h"
 #include "content-plugin.h"
 #include "wdx-encoding.h"
+#include "arena.h"
 #include "line-endings.h"
 #include "encoding.h"
+#include "file-mapping.h"
+#include "full-text.h"
+#include "decompress.h"
+#include "fingerprint.h"
+#include "scripts.h"
+#include "detect.h"
+#include "regions.h"
+#include "settings.h"
+#include "shared-cache.h"
+#include "stats.h"
+#include "trace.h"
+#include "transcode.h"
+#include "convertibility.h"
+#include "encoding-detect.h"
 
 #include <strsafe.h>
 
@@ -10,11 +25,17 @@
  * procedure should be aborted as soon as possible. */
 BOOL g_get_value_aborted;
 
-/* The maximum number of bytes to map of a file. */
-#define MAX_MAP_SIZE	(256 * 1024)
+/* The file name that the cached data of the fields refers to.  The cache
+ * is guarded by S_CACHE_LOCK, as Total Commander gets the values of
+ * delayed fields in a thread of its own. */
+static char s_cached_filename[MAX_PATH];
+static CRITICAL_SECTION s_cache_lock;
 
-/* The file name that the cached data of the fields refers to. */
-static char *s_cached_filename;
+/* The cached values of the Scripts, Encoding Regions and Fingerprint
+ * fields. */
+static char s_cached_scripts[256];
+static char s_cached_regions[256];
+static char s_cached_fingerprint[17];
 
 /* The names of line endings. */
 static char const * const line_ending_names[] = {
@@ -41,6 +62,12 @@ typedef enum FieldIndex
 {
 	FieldIndexEncoding,
 	FieldIndexLineEnding,
+	FieldIndexFullText,
+	FieldIndexDominantScript,
+	FieldIndexScripts,
+	FieldIndexEncodingRegions,
+	FieldIndexLostCharacters,
+	FieldIndexFingerprint,
 };
 
 /* A function associated with a field for setting that fields units. */
@@ -101,7 +128,10 @@ EncodingFieldSetUnitsIterator(Encoding const *encoding, VOID *void_closure)
 {
 	EncodingFieldSetUnitsClosure *closure = (EncodingFieldSetUnitsClosure *)void_closure;
 	
-	StringsJoin(closure->units, closure->size, EncodingName(encoding));
+	/* Binary comes last and isnt something to convert to, so it has no
+	 * unit. */
+	if (!EncodingIsBinary(encoding))
+		StringsJoin(closure->units, closure->size, EncodingName(encoding));
 
 	return TRUE;
 }
@@ -123,6 +153,22 @@ LineEndingsFieldSetUnits(char *units, int size)
 		StringsJoin(units, size, line_ending_names[i]);
 }
 
+/* The FieldSetUnitsFunc used for the Dominant Script field. */
+static void
+DominantScriptFieldSetUnits(char *units, int size)
+{
+	for (int i = 0; i <= ScriptCount; i++)
+		StringsJoin(units, size, ScriptName((Script)i));
+}
+
+/* The FieldSetUnitsFunc used for fields without units. */
+static void
+NoFieldSetUnits(char *units, int size)
+{
+	UNREFERENCED_PARAMETER(units);
+	UNREFERENCED_PARAMETER(size);
+}
+
 static TCFieldFlags
 EncodingFieldSetFlags(void)
 {
@@ -135,10 +181,46 @@ LineEndingsFieldSetFlags(void)
 	return TCFieldFlagsEdit | TCFieldFlagsSubstAttributeStr;
 }
 
+static TCFieldFlags
+FullTextFieldSetFlags(void)
+{
+	return TCFieldFlagsNone;
+}
+
+static TCFieldFlags
+ScriptsFieldSetFlags(void)
+{
+	return TCFieldFlagsNone;
+}
+
+static TCFieldFlags
+EncodingRegionsFieldSetFlags(void)
+{
+	return TCFieldFlagsNone;
+}
+
+static TCFieldFlags
+LostCharactersFieldSetFlags(void)
+{
+	return TCFieldFlagsNone;
+}
+
+static TCFieldFlags
+FingerprintFieldSetFlags(void)
+{
+	return TCFieldFlagsNone;
+}
+
 /* These are the fields that this plugin provides. */
 Field s_fields[] = {
 	{ "Encoding", EncodingFieldSetUnits, TCFieldTypeMultipleChoice, EncodingFieldSetFlags, TRUE },
 	{ "Line Endings", LineEndingsFieldSetUnits, TCFieldTypeMultipleChoice, LineEndingsFieldSetFlags, TRUE },
+	{ "Text", NoFieldSetUnits, TCFieldTypeFullText, FullTextFieldSetFlags, FALSE },
+	{ "Dominant Script", DominantScriptFieldSetUnits, TCFieldTypeMultipleChoice, ScriptsFieldSetFlags, TRUE },
+	{ "Scripts", NoFieldSetUnits, TCFieldTypeString, ScriptsFieldSetFlags, TRUE },
+	{ "Encoding Regions", NoFieldSetUnits, TCFieldTypeString, EncodingRegionsFieldSetFlags, TRUE },
+	{ "Lost Characters", EncodingFieldSetUnits, TCFieldTypeNumeric64, LostCharactersFieldSetFlags, TRUE },
+	{ "Fingerprint", NoFieldSetUnits, TCFieldTypeString, FingerprintFieldSetFlags, TRUE },
 };
 
 /* This function is called by Total Commander to retrieve information
@@ -187,11 +269,7 @@ CacheClear(void)
 	for (size_t i = 0; i < _countof(s_fields); i++)
 		s_fields[i].cached_data = NULL;
 
-	if (s_cached_filename == NULL)
-		return;
-
-	HeapFree(GetProcessHeap(), 0, s_cached_filename);
-	s_cached_filename = NULL;
+	s_cached_filename[0] = '\0';
 }
 
 /* Retrieves the given fields cached value, if one exists. */
@@ -223,8 +301,8 @@ CacheGet(int field_index, void *field_value, int field_value_size)
 		break;
 #endif
 	case TCFieldTypeMultipleChoice:
-#if 0
 	case TCFieldTypeString:
+#if 0
 	case TCFieldTypeFullText:
 #endif
 		if (!SUCCEEDED(StringCbCopy((char *)field_value, field_value_size,
@@ -244,98 +322,102 @@ CacheGet(int field_index, void *field_value, int field_value_size)
 
 /* Stores field values in ENCODING associated with FILENAME in the cache. */ 
 static void
-CachePut(char const *filename, Encoding const *encoding, LineEnding line_ending)
+CachePut(char const *filename, Encoding const *encoding, LineEnding line_ending,
+		 ULONGLONG fingerprint)
 {
 	CacheClear();
 
-	size_t filename_length = lstrlen(filename);
-	s_cached_filename = (char *)HeapAlloc(GetProcessHeap(), 0, filename_length + 1);
-	if (s_cached_filename == NULL)
-		return;
-
-	if (!SUCCEEDED(StringCbCopy(s_cached_filename, filename_length + 1, filename)))
+	if (!SUCCEEDED(StringCbCopy(s_cached_filename, sizeof(s_cached_filename), filename))) {
 		CacheClear();
+		return;
+	}
 
 	s_fields[FieldIndexEncoding].cached_data = EncodingName(encoding);
 	s_fields[FieldIndexLineEnding].cached_data = line_ending_names[line_ending];
-}
-
-typedef struct _FileMapping FileMapping;
 
-struct _FileMapping
-{
-	HANDLE file;
-	HANDLE map;
-	unsigned char const *bytes;
-	size_t n_bytes;
-};
+	FingerprintFormat(fingerprint, s_cached_fingerprint, sizeof(s_cached_fingerprint));
+	s_fields[FieldIndexFingerprint].cached_data = s_cached_fingerprint;
+}
 
-static TCFieldTypeOrStatus
-MapFile(char const *filename, FileMapping *mapping, size_t max_size)
+/* Stores the values of the script fields for COUNTS in the cache, which
+ * must already be for the file they were counted in. */
+static void
+CachePutScripts(ScriptCounts const *counts)
 {
-	HANDLE file = CreateFile(filename, GENERIC_READ, FILE_SHARE_READ, NULL,
-							 OPEN_EXISTING,
-							 FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS,
-							 NULL);
-	if (file == INVALID_HANDLE_VALUE)
-		return TCFieldStatusFileError;
+	ScriptsDescribe(counts, s_cached_scripts, sizeof(s_cached_scripts));
 
-	LARGE_INTEGER file_size;
-	if (!GetFileSizeEx(file, &file_size) ||
-		(file_size.LowPart == 0 && file_size.HighPart == 0)) {
-		/* TODO: This should be the Unknown encoding. */
-		CloseHandle(file);
-		return TCFieldStatusFieldEmpty;
-	}
+	s_fields[FieldIndexDominantScript].cached_data = ScriptName(ScriptsDominant(counts));
+	s_fields[FieldIndexScripts].cached_data =
+		s_cached_scripts[0] != '\0' ? s_cached_scripts : NULL;
+}
 
-	size_t n_bytes = max_size == 0 ? file_size.LowPart : min(file_size.LowPart, max_size);
-	HANDLE map = CreateFileMapping(file, NULL, PAGE_READONLY, 0, n_bytes, NULL);
-	if (map == NULL || GetLastError() == ERROR_ALREADY_EXISTS) {
-		CloseHandle(file);
-		return TCFieldStatusFileError;
-	}
+/* Stores the value of the Encoding Regions field for MAP in the cache,
+ * which must already be for the file it was found for. */
+static void
+CachePutRegions(RegionMap const *map)
+{
+	RegionsDescribe(map, s_cached_regions, sizeof(s_cached_regions));
 
-	/* TODO: This crashes when a (CSV) file is locked by microsoft excel when importing data. */
+	s_fields[FieldIndexEncodingRegions].cached_data =
+		s_cached_regions[0] != '\0' ? s_cached_regions : NULL;
+}
 
-	unsigned char *bytes = (unsigned char *)MapViewOfFile(map, FILE_MAP_READ,
-														  0, 0, n_bytes);
-	MEMORY_BASIC_INFORMATION mbi;
-	if (bytes == NULL ||
-		VirtualQuery(bytes, &mbi, sizeof(mbi)) < sizeof(mbi) ||
-		mbi.State != MEM_COMMIT ||
-		mbi.BaseAddress != bytes ||
-		mbi.RegionSize < n_bytes) {
-		CloseHandle(map);
-		CloseHandle(file);
-		return TCFieldStatusFileError;
-	}
+/* Looks for what the indexer, a background worker or another instance of
+ * the plugin has found out about this version of FILENAME in the shared
+ * cache, which is quick enough to not have to be delayed, unless it has to
+ * be validated by the contents of the file. */
+static BOOL
+SharedCacheFind(char const *filename, Encoding const **encoding, LineEnding *line_ending,
+				ULONGLONG *fingerprint)
+{
+	SharedCacheKey key;
+	if (g_settings.cache_validation != SettingsValidationMetadata ||
+		!SharedCacheKeyGet(filename, &key) ||
+		!SharedCacheLookup(&key, FALSE, encoding, line_ending, fingerprint))
+		return FALSE;
 
-	mapping->file = file;
-	mapping->map = map;
-	mapping->bytes = bytes;
-	mapping->n_bytes = n_bytes;
+	StatsCount(StatsCounterSharedCacheHits, 1);
 
-	return TCFieldStatusSetSuccess;
+	return TRUE;
 }
 
-static void
-UnmapFile(FileMapping *mapping)
+/* Gets the next chunk of the Text field of FILENAME, as FullTextGet()
+ * does.  The text is decoded from the encoding that the Encoding field
+ * shows for the file, which is found the same way, so that the two agree. */
+static TCFieldTypeOrStatus
+GetFullText(char *filename, int offset, char *text, int size)
 {
-	UnmapViewOfFile(mapping->bytes);
-	CloseHandle(mapping->map);
-	CloseHandle(mapping->file);
+	Encoding const *encoding = NULL;
+	if (offset < 0)
+		return FullTextGet(filename, encoding, offset, text, size);
+
+	EnterCriticalSection(&s_cache_lock);
+	if (CacheContains(filename) && s_fields[FieldIndexEncoding].cached_data != NULL)
+		encoding = EncodingNamed((char const *)s_fields[FieldIndexEncoding].cached_data);
+	LeaveCriticalSection(&s_cache_lock);
+
+	if (encoding == NULL) {
+		LineEnding line_ending;
+		ULONGLONG fingerprint;
+		if (!SharedCacheFind(filename, &encoding, &line_ending, &fingerprint)) {
+			TCFieldTypeOrStatus status = DetectNow(filename, &encoding, &line_ending,
+												   &fingerprint);
+			if (status != TCFieldStatusSetSuccess)
+				return status;
+		}
+
+		EnterCriticalSection(&s_cache_lock);
+		CachePut(filename, encoding, line_ending, fingerprint);
+		LeaveCriticalSection(&s_cache_lock);
+	}
+
+	return FullTextGet(filename, encoding, offset, text, size);
 }
 
-/* Called by Total Commander to get the value of field FIELD_INDEX for
- * FILENAME.  If units are being used for this field, UNIT_INDEX will
- * point to the unit that the user has chosen to display the field in.
- * FIELD_VALUE_SIZE is the maximum number of bytes we can store in
- * FIELD_VALUE.  FLAGS are any additional flags passed to us by Total
- * Commander, such as the request to delay the calculation of a fields
- * value if it is slow to calculate (see Field.is_slow). */
-TCFieldTypeOrStatus __stdcall
-ContentGetValue(char *filename, int field_index, int unit_index,
-				void *field_value, int field_value_size, TCContentFlag flags)
+/* Does the work of ContentGetValue(). */
+static TCFieldTypeOrStatus
+GetValue(char *filename, int field_index, int unit_index,
+		 void *field_value, int field_value_size, TCContentFlag flags)
 {
 	/* I really dont know when INDEX would be less than 0, but the example
 	 * plugin had this test in there, so we best keep it. (INDEX should be
@@ -345,37 +427,133 @@ ContentGetValue(char *filename, int field_index, int unit_index,
 
 	g_get_value_aborted = FALSE;
 
-	if ((flags & TCContentFlagDelayIfSlow) && s_fields[field_index].is_slow)
-		return TCFieldStatusDelayed;
+	if (s_fields[field_index].type == TCFieldTypeFullText)
+		return GetFullText(filename, unit_index, (char *)field_value, field_value_size);
+
+	/* The script and region fields are only worked out when they are asked
+	 * for, so the cache may be for the file without having them. */
+	BOOL wants_scripts = field_index == FieldIndexDominantScript ||
+		field_index == FieldIndexScripts;
+	BOOL wants_regions = field_index == FieldIndexEncodingRegions;
+
+	/* The number of characters that would be lost converting the file
+	 * depends on the encoding it would be converted to, which is the unit
+	 * of the field, so it isnt cached. */
+	BOOL wants_lost = field_index == FieldIndexLostCharacters;
+
+	EnterCriticalSection(&s_cache_lock);
+	BOOL cached = !wants_lost && CacheContains(filename) &&
+		(!wants_scripts || s_fields[FieldIndexDominantScript].cached_data != NULL) &&
+		(!wants_regions || s_fields[FieldIndexEncodingRegions].cached_data != NULL);
+	TCFieldTypeOrStatus status = cached ?
+		CacheGet(field_index, field_value, field_value_size) : TCFieldStatusFieldEmpty;
+	LeaveCriticalSection(&s_cache_lock);
+	if (cached) {
+		StatsCount(StatsCounterCacheHits, 1);
+		return status;
+	}
 
-	if (CacheContains(filename))
-		return CacheGet(field_index, field_value, field_value_size);
+	Encoding const *encoding;
+	LineEnding line_ending;
+	ULONGLONG fingerprint;
+	if (!SharedCacheFind(filename, &encoding, &line_ending, &fingerprint)) {
+		if ((flags & TCContentFlagDelayIfSlow) && s_fields[field_index].is_slow) {
+			/* Get started right away, so that the result may well be in
+			 * the shared cache when we are asked again. */
+			DetectLater(filename);
+			return TCFieldStatusDelayed;
+		}
 
-	CacheClear();
+		StatsCount(StatsCounterCacheMisses, 1);
+		status = DetectNow(filename, &encoding, &line_ending, &fingerprint);
+		if (status != TCFieldStatusSetSuccess)
+			return status;
+	}
 
-	FileMapping mapping;
-	TCFieldTypeOrStatus status = MapFile(filename, &mapping, MAX_MAP_SIZE);
-	if (status != TCFieldStatusSetSuccess)
-		return status;
+	ScriptCounts counts;
+	if (wants_scripts) {
+		status = DetectScripts(filename, encoding, &counts);
+		if (status != TCFieldStatusSetSuccess)
+			return status;
+	}
+
+	RegionMap map;
+	if (wants_regions) {
+		status = RegionsFind(filename, encoding, &map);
+		if (status != TCFieldStatusSetSuccess)
+			return status;
+	}
+
+	TranscodeCheck check;
+	if (wants_lost) {
+		Encoding const *to = EncodingsGet(unit_index);
+		if (to == NULL || EncodingIsBinary(to))
+			return TCFieldStatusFieldEmpty;
+		status = ConvertibilityCheckFile(filename, encoding, to, &check);
+		if (status != TCFieldStatusSetSuccess)
+			return status;
+	}
 
-	Encoding const *encoding = EncodingFind(mapping.bytes, mapping.n_bytes);
+	EnterCriticalSection(&s_cache_lock);
+	CachePut(filename, encoding, line_ending, fingerprint);
+	if (wants_scripts)
+		CachePutScripts(&counts);
+	if (wants_regions)
+		CachePutRegions(&map);
+	status = wants_lost ? TCFieldTypeNumeric64 :
+		CacheGet(field_index, field_value, field_value_size);
+	LeaveCriticalSection(&s_cache_lock);
 
-	CachePut(filename, encoding, EncodingLineEndings(encoding, mapping.bytes, mapping.n_bytes));
+	if (wants_lost)
+		*(__int64 *)field_value = (__int64)check.n_lost;
 
-	UnmapFile(&mapping);
+	if (wants_regions)
+		RegionsFree(&map);
 
-	return CacheGet(field_index, field_value, field_value_size);
+	return status;
+}
+
+/* Called by Total Commander to get the value of field FIELD_INDEX for
+ * FILENAME.  If units are being used for this field, UNIT_INDEX will
+ * point to the unit that the user has chosen to display the field in.
+ * FIELD_VALUE_SIZE is the maximum number of bytes we can store in
+ * FIELD_VALUE.  FLAGS are any additional flags passed to us by Total
+ * Commander, such as the request to delay the calculation of a fields
+ * value if it is slow to calculate (see Field.is_slow). */
+TCFieldTypeOrStatus __stdcall
+ContentGetValue(char *filename, int field_index, int unit_index,
+				void *field_value, int field_value_size, TCContentFlag flags)
+{
+	PluginOpen();
+
+	TraceTime start = TraceStart();
+	StatsTime stats_start = StatsStart();
+	BOOL abortable = EncodingAbortable(TRUE);
+	TCFieldTypeOrStatus status = GetValue(filename, field_index, unit_index,
+										  field_value, field_value_size, flags);
+	EncodingAbortable(abortable);
+	StatsStop(StatsStageGetValue, stats_start);
+	TraceEnd(start, TraceCallGetValue, filename, field_index, unit_index, flags,
+			 field_value_size, status);
+
+	return status;
 }
 
 /* Called by Total Commander when the user has elected to stop getting values
  * of fields provided by this plugin.  This is usually done when changing
- * directories or the user press Escape. */
+ * directories or the user press Escape.  Only what ContentGetValue() asked
+ * for is stopped, not what was asked for through the batch API. */
 void __stdcall
 ContentStopGetValue(char *filename)
 {
-	UNREFERENCED_PARAMETER(filename);
+	PluginOpen();
+
+	TraceTime start = TraceStart();
+
+	DetectAbort();
+	DetectLaterDrop();
 
-	g_get_value_aborted = TRUE;
+	TraceEnd(start, TraceCallStopGetValue, filename, -1, -1, 0, 0, 0);
 }
 
 static void
@@ -427,149 +605,1320 @@ GenerateTemporaryFileName(char *destination)
 	return TRUE;
 }
 
-static TCFieldTypeOrStatus
-IconvFile(char *filename, Encoding const *from, Encoding const *to)
+/* The number of bytes of a file to map at a time while converting it. */
+#define CONVERT_WINDOW_SIZE	(1024 * 1024)
+
+/* The size of the buffers that converted bytes pass through. */
+#define CONVERT_BUFFER_SIZE	(64 * 1024)
+
+/* The longest a character can be in any of the encodings we convert. */
+#define CONVERT_MAX_CHAR_SIZE	4
+
+/* Files at least this large are converted by several threads, one chunk
+ * of about CONVERT_CHUNK_SIZE bytes each at a time, which they write out
+ * CONVERT_CHUNK_WRITE_SIZE bytes at a time. */
+#define CONVERT_PARALLEL_MIN_SIZE	(32 * 1024 * 1024)
+#define CONVERT_CHUNK_SIZE			(4 * 1024 * 1024)
+#define CONVERT_CHUNK_WRITE_SIZE	(1024 * 1024)
+
+/* The most threads that a file is converted by. */
+#define CONVERT_MAX_THREADS	16
+
+/* Writes N_BYTES of BYTES to FILE, failing on short writes. */
+static BOOL
+WriteAll(HANDLE file, void const *bytes, DWORD n_bytes)
 {
-	if (EncodingIconvName(from) == NULL || EncodingIconvName(to) == NULL)
-		return TCFieldStatusFileError;
+	DWORD bytes_written;
 
-	char temp_file_name[MAX_PATH + 1];
-	if (!GenerateTemporaryFileName(temp_file_name))
-		return TCFieldStatusFileError;
+	return WriteFile(file, bytes, n_bytes, &bytes_written, NULL) &&
+		   bytes_written == n_bytes;
+}
 
-	/* Why is there no STRSAFE_MAX_CB? */
-	size_t from_bom_length, to_bom_length;
-	if (FAILED(StringCbLength(EncodingBOM(from), STRSAFE_MAX_CCH, &from_bom_length)) ||
-		FAILED(StringCbLength(EncodingBOM(to), STRSAFE_MAX_CCH, &to_bom_length)))
-		return TCFieldStatusFileError;
+/* Measures the size of INPUT from OFFSET on once its line endings have been
+ * rewritten by CONVERTER, storing the number of line endings that would
+ * change in N_CHANGED. */
+static BOOL
+LineEndingsMeasureFile(LineEndingConverter const *converter, FileWindow *input,
+					   ULONGLONG offset, ULONGLONG *size, size_t *n_changed)
+{
+	*size = 0;
+	*n_changed = 0;
+	while (offset < input->file_size) {
+		if (!FileWindowMove(input, offset, CONVERT_WINDOW_SIZE))
+			return FALSE;
+
+		unsigned char const *start = input->bytes + (size_t)(offset - input->offset);
+		unsigned char const *p = start;
+		BOOL final = input->offset + input->n_bytes == input->file_size;
+		*size += LineEndingMeasure(converter, &p, input->bytes + input->n_bytes,
+								   final, n_changed);
+		if (p == start)
+			return FALSE;
+		offset += p - start;
+	}
+
+	return TRUE;
+}
+
+/* Streams INPUT from OFFSET on through CONVERTER into OUTPUT, a window and
+ * a buffer at a time, or straight from the window if CONVERTER is NULL. */
+static BOOL
+LineEndingsWriteFile(LineEndingConverter const *converter, FileWindow *input,
+					 ULONGLONG offset, HANDLE output)
+{
+	unsigned char buffer[CONVERT_BUFFER_SIZE];
+
+	while (offset < input->file_size) {
+		if (!FileWindowMove(input, offset, CONVERT_WINDOW_SIZE))
+			return FALSE;
+
+		unsigned char const *start = input->bytes + (size_t)(offset - input->offset);
+		unsigned char const *end = input->bytes + input->n_bytes;
+		if (converter == NULL) {
+			if (!WriteAll(output, start, (DWORD)(end - start)))
+				return FALSE;
+			offset += end - start;
+			continue;
+		}
+
+		unsigned char const *p = start;
+		BOOL final = input->offset + input->n_bytes == input->file_size;
+		while (p < end) {
+			unsigned char const *before = p;
+			unsigned char *out = buffer;
+			LineEndingConvert(converter, &p, end, &out, buffer + sizeof(buffer), final);
+			if (!WriteAll(output, buffer, (DWORD)(out - buffer)))
+				return FALSE;
+			if (p == before)
+				break;
+		}
+		if (p == start)
+			return FALSE;
+		offset += p - start;
+	}
+
+	return TRUE;
+}
 
-	iconv_t cd = iconv_open(EncodingIconvName(to), EncodingIconvName(from));
-	if (cd == (iconv_t)-1)
+/* Rewrites the line endings of FILENAME, whose text is in ENCODING, to
+ * TARGET, unless it is LineEndingUnknown, and replaces its BOM_LENGTH byte
+ * BOM with that of ENCODING.  The size of the result is measured first,
+ * so that files that already look like that are left alone and the output
+ * can be allocated in one go; the file is then rewritten through a
+ * fixed-size buffer, or, if only its BOM changes, streamed straight
+ * through. */
+static TCFieldTypeOrStatus
+LineEndingsFile(char *filename, Encoding const *encoding, LineEnding target,
+				size_t bom_length)
+{
+	char const *bom = EncodingBOM(encoding);
+	size_t new_bom_length;
+	if (FAILED(StringCbLength(bom, STRSAFE_MAX_CCH, &new_bom_length)))
 		return TCFieldStatusFileError;
 
-	FileMapping input;
-	TCFieldTypeOrStatus status = MapFile(filename, &input, 0);
+	LineEndingConverter converter;
+	LineEndingConverter const *rewrite = NULL;
+	if (target != LineEndingUnknown) {
+		if (!LineEndingConverterInit(&converter, EncodingTextForm(encoding),
+									 EncodingHasC1Controls(encoding), target))
+			return TCFieldStatusFileError;
+		rewrite = &converter;
+	}
+
+	FileWindow input;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &input);
+	if (status == TCFieldStatusFieldEmpty)
+		return TCFieldStatusSetSuccess;
 	if (status != TCFieldStatusSetSuccess)
 		return status;
 
+	ULONGLONG size = input.file_size - bom_length;
+	size_t n_changed = 0;
+	if (rewrite != NULL &&
+		!LineEndingsMeasureFile(rewrite, &input, bom_length, &size, &n_changed)) {
+		FileWindowClose(&input);
+		return TCFieldStatusFileError;
+	}
+
+	/* Moving the window by 0 bytes would map the whole file, so there is
+	 * nothing to compare when neither has a BOM. */
+	BOOL same_bom = new_bom_length == bom_length &&
+					(bom_length == 0 ||
+					 (FileWindowMove(&input, 0, bom_length) &&
+					  memcmp(input.bytes, bom, bom_length) == 0));
+	if (n_changed == 0 && same_bom) {
+		FileWindowClose(&input);
+		return TCFieldStatusSetSuccess;
+	}
+
+	char temp_file_name[MAX_PATH + 1];
+	if (!GenerateTemporaryFileName(temp_file_name)) {
+		FileWindowClose(&input);
+		return TCFieldStatusFileError;
+	}
+
 	HANDLE output = CreateFile(temp_file_name, GENERIC_WRITE, 0, NULL,
-							   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+							   CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+							   NULL);
 	if (output == INVALID_HANDLE_VALUE) {
-		UnmapFile(&input);
+		FileWindowClose(&input);
 		return TCFieldStatusFileError;
 	}
 
-#	define ICONVFILE_BUFFER_SIZE	(32768)
-	char const *input_pointer = (char const *)input.bytes + from_bom_length;
-	char output_buffer[ICONVFILE_BUFFER_SIZE];
-	size_t remaining = input.n_bytes - from_bom_length;
+	LARGE_INTEGER end, zero;
+	end.QuadPart = new_bom_length + size;
+	zero.QuadPart = 0;
+	BOOL written = SetFilePointerEx(output, end, NULL, FILE_BEGIN) &&
+				   SetEndOfFile(output) &&
+				   SetFilePointerEx(output, zero, NULL, FILE_BEGIN) &&
+				   WriteAll(output, bom, (DWORD)new_bom_length) &&
+				   LineEndingsWriteFile(rewrite, &input, bom_length, output);
 
-	DWORD bytes_written;
-	if (!WriteFile(output, EncodingBOM(to), to_bom_length, &bytes_written, NULL) ||
-		bytes_written != to_bom_length) {
-			UnmapFile(&input);
-			CloseHandle(output);
-			DeleteFile(temp_file_name);
-			return TCFieldStatusFileError;
+	FileWindowClose(&input);
+	CloseHandle(output);
+
+	if (!written || !CopyFile(temp_file_name, filename, FALSE)) {
+		DeleteFile(temp_file_name);
+		return TCFieldStatusFileError;
+	}
+
+	DeleteFile(temp_file_name);
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* The stages that a file passes through while being converted: it is
+ * transcoded from FROM to TO, by TranscodeSingleByte() or
+ * TranscodeUnicode() if BUILT_IN is set, the latter not checking what
+ * PROOF vouches for again, and by CD otherwise, after which CONVERTER
+ * rewrites its line endings if LINE_ENDINGS is set, before it is written
+ * to OUTPUT, or, if CHUNKED is set, appended to the N_CHUNK bytes of
+ * CHUNK, which has room for CHUNK_SIZE.
+ * MIDDLE holds the N_MIDDLE transcoded bytes waiting for the line-ending
+ * stage, and OUT holds what is waiting to be written.
+ * NEXT is the next conversion kept for reuse. */
+typedef struct _Conversion Conversion;
+
+struct _Conversion
+{
+	Conversion *next;
+	Encoding const *from;
+	Encoding const *to;
+	BOOL built_in;
+	iconv_t cd;
+	TranscodeProof proof;
+	BOOL line_endings;
+	LineEndingConverter converter;
+	HANDLE output;
+	BOOL chunked;
+	unsigned char *chunk;
+	size_t n_chunk;
+	size_t chunk_size;
+	size_t n_middle;
+	char middle[CONVERT_BUFFER_SIZE];
+	unsigned char out[CONVERT_BUFFER_SIZE];
+};
+
+/* The conversions that are no longer in use, kept for reuse along with
+ * their chunks, as their buffers are too large to allocate for every file.
+ * The list is guarded by S_CONVERSIONS_LOCK, as files may be converted on
+ * several threads at once. */
+static CRITICAL_SECTION s_conversions_lock;
+static Conversion *s_free_conversions;
+
+/* Keeps CONVERSION for reuse, along with its chunk, unless the chunk has
+ * grown beyond CONVERT_CHUNK_SIZE. */
+static void
+ConversionKeep(Conversion *conversion)
+{
+	if (conversion->chunk_size > CONVERT_CHUNK_SIZE) {
+		HeapFree(GetProcessHeap(), 0, conversion->chunk);
+		conversion->chunk = NULL;
+		conversion->chunk_size = 0;
+	}
+
+	EnterCriticalSection(&s_conversions_lock);
+	conversion->next = s_free_conversions;
+	s_free_conversions = conversion;
+	LeaveCriticalSection(&s_conversions_lock);
+}
+
+/* Sets up a Conversion from FROM to TO, rewriting line endings to
+ * LINE_ENDING unless it is LineEndingUnknown, writing to OUTPUT.  What
+ * PROOF vouches for, if it isnt NULL, is transcoded without checking. */
+static Conversion *
+ConversionNew(Encoding const *from, Encoding const *to, LineEnding line_ending,
+			  TranscodeProof const *proof, HANDLE output)
+{
+	BOOL built_in = TranscodeIsBuiltIn(from, to);
+	if (!built_in && (EncodingIconvName(from) == NULL || EncodingIconvName(to) == NULL))
+		return NULL;
+
+	EnterCriticalSection(&s_conversions_lock);
+	Conversion *conversion = s_free_conversions;
+	if (conversion != NULL)
+		s_free_conversions = conversion->next;
+	LeaveCriticalSection(&s_conversions_lock);
+
+	if (conversion == NULL) {
+		StatsCount(StatsCounterHeapAllocations, 1);
+		conversion = (Conversion *)HeapAlloc(GetProcessHeap(), 0, sizeof(Conversion));
+		if (conversion == NULL)
+			return NULL;
+		conversion->chunk = NULL;
+		conversion->chunk_size = 0;
+	}
+
+	conversion->from = from;
+	conversion->to = to;
+	conversion->built_in = built_in;
+	if (proof != NULL)
+		conversion->proof = *proof;
+	else
+		ZeroMemory(&conversion->proof, sizeof(conversion->proof));
+	conversion->output = output;
+	conversion->chunked = FALSE;
+	conversion->n_chunk = 0;
+	conversion->n_middle = 0;
+	conversion->line_endings = line_ending != LineEndingUnknown;
+	if (conversion->line_endings &&
+		!LineEndingConverterInit(&conversion->converter, EncodingTextForm(to),
+								 EncodingHasC1Controls(to), line_ending)) {
+		ConversionKeep(conversion);
+		return NULL;
+	}
+
+	if (!built_in) {
+		/* libiconv allocates the state of each descriptor it opens. */
+		StatsCount(StatsCounterHeapAllocations, 1);
+		conversion->cd = iconv_open(EncodingIconvName(to), EncodingIconvName(from));
+		if (conversion->cd == (iconv_t)-1) {
+			ConversionKeep(conversion);
+			return NULL;
+		}
+	}
+
+	return conversion;
+}
+
+static void
+ConversionFree(Conversion *conversion)
+{
+	if (!conversion->built_in)
+		iconv_close(conversion->cd);
+	ConversionKeep(conversion);
+}
+
+/* Frees the conversions kept for reuse.  Called when the plugin is
+ * unloaded. */
+static void
+ConversionsClose(void)
+{
+	EnterCriticalSection(&s_conversions_lock);
+	while (s_free_conversions != NULL) {
+		Conversion *conversion = s_free_conversions;
+		s_free_conversions = conversion->next;
+		if (conversion->chunk != NULL)
+			HeapFree(GetProcessHeap(), 0, conversion->chunk);
+		HeapFree(GetProcessHeap(), 0, conversion);
+	}
+	LeaveCriticalSection(&s_conversions_lock);
+}
+
+/* Writes N_BYTES of BYTES to where the output of CONVERSION goes, growing
+ * its chunk as needed. */
+static BOOL
+ConversionWrite(Conversion *conversion, void const *bytes, size_t n_bytes)
+{
+	if (!conversion->chunked)
+		return WriteAll(conversion->output, bytes, (DWORD)n_bytes);
+
+	if (conversion->chunk_size - conversion->n_chunk < n_bytes) {
+		size_t size = max(2 * conversion->chunk_size, conversion->n_chunk + n_bytes);
+		StatsCount(StatsCounterHeapAllocations, 1);
+		unsigned char *chunk = (unsigned char *)HeapReAlloc(GetProcessHeap(), 0,
+															 conversion->chunk, size);
+		if (chunk == NULL)
+			return FALSE;
+		conversion->chunk = chunk;
+		conversion->chunk_size = size;
+	}
+
+	CopyMemory(conversion->chunk + conversion->n_chunk, bytes, n_bytes);
+	conversion->n_chunk += n_bytes;
+
+	return TRUE;
+}
+
+/* Passes the transcoded bytes in CONVERSION through the line-ending stage
+ * and on to the output.  Bytes that may be the beginning of a line ending
+ * are held back for the next call, unless FINAL is set. */
+static BOOL
+ConversionDrain(Conversion *conversion, BOOL final)
+{
+	if (!conversion->line_endings) {
+		if (!ConversionWrite(conversion, conversion->middle, conversion->n_middle))
+			return FALSE;
+		conversion->n_middle = 0;
+		return TRUE;
+	}
+
+	unsigned char const *p = (unsigned char const *)conversion->middle;
+	unsigned char const *end = p + conversion->n_middle;
+	while (p < end) {
+		unsigned char const *before = p;
+		unsigned char *out = conversion->out;
+		LineEndingConvert(&conversion->converter, &p, end,
+						  &out, conversion->out + sizeof(conversion->out), final);
+		if (!ConversionWrite(conversion, conversion->out, out - conversion->out))
+			return FALSE;
+		if (p == before)
+			break;
 	}
 
+	conversion->n_middle = end - p;
+	MoveMemory(conversion->middle, p, conversion->n_middle);
+
+	return TRUE;
+}
+
+/* Transcodes what it can of the REMAINING bytes at *P into the
+ * MIDDLE_REMAINING bytes at *MIDDLE for CONVERSION, updating all four the
+ * way iconv() does, and returning (size_t)-1 as it does when not all of
+ * the input could be consumed.  PROVEN says that the proof of CONVERSION
+ * vouches for the input. */
+static size_t
+ConversionTranscode(Conversion *conversion, char const **p, size_t *remaining,
+					char **middle, size_t *middle_remaining, BOOL proven)
+{
+	if (!conversion->built_in)
+		return iconv(conversion->cd, p, remaining, middle, middle_remaining);
+
+	unsigned char const *in = (unsigned char const *)*p;
+	unsigned char *out = (unsigned char *)*middle;
+	BOOL representable = EncodingTextForm(conversion->from) == TextFormSingleByte ?
+		TranscodeSingleByte(conversion->from, conversion->to,
+							&in, in + *remaining, &out, out + *middle_remaining) :
+		TranscodeUnicode(conversion->from, conversion->to,
+						 &in, in + *remaining, &out, out + *middle_remaining, proven);
+	*remaining -= in - (unsigned char const *)*p;
+	*middle_remaining -= out - (unsigned char *)*middle;
+	*p = (char const *)in;
+	*middle = (char *)out;
+
+	return representable && *remaining == 0 ? 0 : (size_t)-1;
+}
+
+/* Passes the bytes between *P and END through the stages of CONVERSION,
+ * advancing *P past what was consumed.  A trailing partial character is
+ * left for the next call, unless FINAL is set.  PROVEN is passed on to
+ * ConversionTranscode(). */
+static BOOL
+ConversionFeed(Conversion *conversion, char const **p, char const *end, BOOL final,
+			   BOOL proven)
+{
+	size_t remaining = end - *p;
+
 	while (remaining > 0) {
-		char *output_pointer = output_buffer;
-		size_t output_bytes_remaining = _countof(output_buffer);
-
-		size_t bytes_converted = iconv(cd, &input_pointer, &remaining, &output_pointer, &output_bytes_remaining);
-		if (output_pointer != output_buffer) {
-			DWORD bytes_to_write = output_pointer - output_buffer;
-			if (!WriteFile(output, output_buffer, bytes_to_write, &bytes_written, NULL) ||
-				bytes_written != bytes_to_write) {
-					UnmapFile(&input);
-					CloseHandle(output);
-					DeleteFile(temp_file_name);
-					return TCFieldStatusFileError;
-			}
+		char const *before = *p;
+		char *middle = conversion->middle + conversion->n_middle;
+		size_t middle_remaining = sizeof(conversion->middle) - conversion->n_middle;
+		size_t room = middle_remaining;
+
+		size_t converted = ConversionTranscode(conversion, p, &remaining,
+											   &middle, &middle_remaining, proven);
+		BOOL progressed = *p != before || middle_remaining != room;
+		conversion->n_middle = middle - conversion->middle;
+
+		if (!ConversionDrain(conversion, FALSE))
+			return FALSE;
+
+		/* Transcoding fails when the output is full, when the input ends
+		 * in a partial character and on illegal input, so tell these apart
+		 * by the room it had and the input it was left with. */
+		if (converted == (size_t)-1 && !progressed) {
+			if (room < CONVERT_BUFFER_SIZE / 2)
+				continue;
+			if (final || remaining >= CONVERT_MAX_CHAR_SIZE)
+				return FALSE;
+			break;
 		}
+	}
+
+	return TRUE;
+}
+
+/* Flushes what is left in the stages of CONVERSION to its output. */
+static BOOL
+ConversionFinish(Conversion *conversion)
+{
+	if (!conversion->built_in) {
+		char *middle = conversion->middle + conversion->n_middle;
+		size_t middle_remaining = sizeof(conversion->middle) - conversion->n_middle;
+		if (iconv(conversion->cd, NULL, NULL, &middle, &middle_remaining) == (size_t)-1)
+			return FALSE;
+		conversion->n_middle = middle - conversion->middle;
+	}
+
+	return ConversionDrain(conversion, TRUE);
+}
+
+/* Streams the bytes of INPUT between OFFSET and END through the stages of
+ * CONVERSION, a window at a time.  The window is left where it is if it
+ * already covers them all.  The bytes that the proof of CONVERSION vouches
+ * for are fed apart from the rest, to be transcoded without checking. */
+static BOOL
+ConversionRun(Conversion *conversion, FileWindow *input, ULONGLONG offset, ULONGLONG end)
+{
+	while (offset < end) {
+		BOOL covered = input->bytes != NULL && offset >= input->offset &&
+			end <= input->offset + input->n_bytes;
+		if (!covered && !FileWindowMove(input, offset, CONVERT_WINDOW_SIZE))
+			return FALSE;
+
+		ULONGLONG window_end = min(end, input->offset + input->n_bytes);
+		ULONGLONG n_proven = TranscodeProvenLength(&conversion->proof, conversion->from, offset);
+		if (n_proven > 0)
+			window_end = min(window_end, offset + n_proven);
+		char const *start = (char const *)input->bytes + (size_t)(offset - input->offset);
+		char const *p = start;
+		BOOL final = window_end == end;
+		if (!ConversionFeed(conversion, &p,
+							(char const *)input->bytes + (size_t)(window_end - input->offset),
+							final, n_proven > 0))
+			return FALSE;
+		if (p == start)
+			return FALSE;
+		offset += p - start;
+	}
+
+	return ConversionFinish(conversion);
+}
+
+/* What the threads of a parallel conversion are told to do next. */
+typedef enum ConversionPhase
+{
+	ConversionPhaseTranscode,
+	ConversionPhaseWrite,
+	ConversionPhaseStop,
+};
+
+/* A chunk of a file being converted in parallel, along with the thread
+ * converting it.  The bytes of INPUT between START and END are transcoded
+ * by CONVERSION into its chunk, which is then written at OUT_OFFSET in
+ * OUTPUT.  PHASE is set before GO is signalled, and SUCCEEDED is set
+ * before DONE is. */
+typedef struct _ConversionChunk ConversionChunk;
+
+struct _ConversionChunk
+{
+	Conversion *conversion;
+	FileWindow input;
+	HANDLE output;
+	ULONGLONG start;
+	ULONGLONG end;
+	ULONGLONG out_offset;
+	ConversionPhase phase;
+	BOOL succeeded;
+	HANDLE thread;
+	HANDLE go;
+	HANDLE done;
+};
+
+/* Transcodes the bytes of CHUNK into the chunk of its conversion.  Its
+ * ends lie on character boundaries, so it is all transcoded as final,
+ * though what the proof of its conversion vouches for is fed first, on
+ * its own. */
+static BOOL
+ConversionChunkTranscode(ConversionChunk *chunk)
+{
+	Conversion *conversion = chunk->conversion;
+
+	conversion->n_chunk = 0;
+	conversion->n_middle = 0;
+	if (!conversion->built_in)
+		iconv(conversion->cd, NULL, NULL, NULL, NULL);
+
+	if (!FileWindowMove(&chunk->input, chunk->start, (size_t)(chunk->end - chunk->start)))
+		return FALSE;
+
+	char const *p = (char const *)chunk->input.bytes + (size_t)(chunk->start - chunk->input.offset);
+	char const *end = p + (size_t)(chunk->end - chunk->start);
+	char const *proven_end = p + (size_t)min(chunk->end - chunk->start,
+											 TranscodeProvenLength(&conversion->proof,
+																   conversion->from, chunk->start));
+
+	return ConversionFeed(conversion, &p, proven_end, proven_end == end, TRUE) &&
+		p == proven_end &&
+		ConversionFeed(conversion, &p, end, TRUE, FALSE) && p == end &&
+		ConversionFinish(conversion);
+}
+
+/* Writes the transcoded bytes of CHUNK at its offset in the output, a
+ * buffer at a time. */
+static BOOL
+ConversionChunkWrite(ConversionChunk *chunk)
+{
+	Conversion *conversion = chunk->conversion;
+
+	for (size_t i = 0; i < conversion->n_chunk; i += CONVERT_CHUNK_WRITE_SIZE) {
+		ULONGLONG offset = chunk->out_offset + i;
+		OVERLAPPED overlapped = { 0 };
+		overlapped.Offset = (DWORD)offset;
+		overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+		DWORD n_bytes = (DWORD)min(conversion->n_chunk - i, (size_t)CONVERT_CHUNK_WRITE_SIZE);
+		DWORD bytes_written;
+		if (!WriteFile(chunk->output, conversion->chunk + i, n_bytes, &bytes_written, &overlapped) ||
+			bytes_written != n_bytes)
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* The thread converting CLOSURE, a ConversionChunk, one phase at a time. */
+static DWORD WINAPI
+ConversionChunkThread(LPVOID closure)
+{
+	ConversionChunk *chunk = (ConversionChunk *)closure;
+
+	while (WaitForSingleObject(chunk->go, INFINITE) == WAIT_OBJECT_0 &&
+		   chunk->phase != ConversionPhaseStop) {
+		chunk->succeeded = chunk->phase == ConversionPhaseTranscode ?
+			ConversionChunkTranscode(chunk) : ConversionChunkWrite(chunk);
+		SetEvent(chunk->done);
+	}
+
+	return 0;
+}
+
+/* Stops the thread of CHUNK, if it has one, and frees what it holds. */
+static void
+ConversionChunkClose(ConversionChunk *chunk)
+{
+	if (chunk->thread != NULL) {
+		chunk->phase = ConversionPhaseStop;
+		SetEvent(chunk->go);
+		WaitForSingleObject(chunk->thread, INFINITE);
+		CloseHandle(chunk->thread);
+	}
+	if (chunk->done != NULL)
+		CloseHandle(chunk->done);
+	if (chunk->go != NULL)
+		CloseHandle(chunk->go);
+	if (chunk->output != INVALID_HANDLE_VALUE)
+		CloseHandle(chunk->output);
+	if (chunk->input.map != NULL)
+		FileWindowClose(&chunk->input);
+	if (chunk->conversion != NULL)
+		ConversionFree(chunk->conversion);
+}
+
+/* Sets up CHUNK for converting FILENAME from FROM to TO into the file
+ * named OUTPUT, trusting PROOF, and starts its thread. */
+static BOOL
+ConversionChunkOpen(ConversionChunk *chunk, char const *filename, char const *output,
+					Encoding const *from, Encoding const *to, LineEnding line_ending,
+					TranscodeProof const *proof)
+{
+	ZeroMemory(chunk, sizeof(*chunk));
+	chunk->output = INVALID_HANDLE_VALUE;
+
+	chunk->conversion = ConversionNew(from, to, line_ending, proof, INVALID_HANDLE_VALUE);
+	if (chunk->conversion == NULL)
+		return FALSE;
+
+	Conversion *conversion = chunk->conversion;
+	if (conversion->chunk == NULL) {
+		StatsCount(StatsCounterHeapAllocations, 1);
+		conversion->chunk = (unsigned char *)HeapAlloc(GetProcessHeap(), 0, CONVERT_CHUNK_SIZE);
+		if (conversion->chunk == NULL)
+			return FALSE;
+		conversion->chunk_size = CONVERT_CHUNK_SIZE;
+	}
+	conversion->chunked = TRUE;
+
+	if (FileWindowOpen(filename, &chunk->input) != TCFieldStatusSetSuccess) {
+		chunk->input.map = NULL;
+		return FALSE;
+	}
+
+	chunk->output = CreateFile(output, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+							   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	chunk->go = CreateEvent(NULL, FALSE, FALSE, NULL);
+	chunk->done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (chunk->output == INVALID_HANDLE_VALUE || chunk->go == NULL || chunk->done == NULL)
+		return FALSE;
+
+	chunk->thread = CreateThread(NULL, 0, ConversionChunkThread, chunk, 0, NULL);
+
+	return chunk->thread != NULL;
+}
+
+/* Runs PHASE on the threads of the N_CHUNKS CHUNKS, waiting for all of them
+ * to finish it, and returns whether they all succeeded. */
+static BOOL
+ConversionChunksRun(ConversionChunk *chunks, int n_chunks, ConversionPhase phase)
+{
+	HANDLE done[CONVERT_MAX_THREADS];
+
+	for (int i = 0; i < n_chunks; i++) {
+		chunks[i].phase = phase;
+		done[i] = chunks[i].done;
+		SetEvent(chunks[i].go);
+	}
+	WaitForMultipleObjects(n_chunks, done, TRUE, INFINITE);
+
+	BOOL succeeded = TRUE;
+	for (int i = 0; i < n_chunks; i++)
+		succeeded = succeeded && chunks[i].succeeded;
+
+	return succeeded;
+}
+
+/* Moves OFFSET in INPUT, whose text is laid out in FORM, back to the
+ * nearest character boundary that doesnt follow a carriage return, so that
+ * chunks split there can be transcoded, and have their line endings
+ * rewritten, independently of each other. */
+static BOOL
+ConversionChunkBoundary(FileWindow *input, TextForm form, ULONGLONG *offset)
+{
+	if (!FileWindowMove(input, *offset - 4, 8))
+		return FALSE;
 
-		if (bytes_converted != (size_t)-1) {
-			output_pointer = output_buffer;
-			output_bytes_remaining = _countof(output_buffer);
-			
-			bytes_converted = iconv(cd, NULL, NULL, &output_pointer, &output_bytes_remaining);
-			if (output_pointer != output_buffer) {
-				DWORD bytes_to_write = output_pointer - output_buffer;
-				if (!WriteFile(output, output_buffer, bytes_to_write, &bytes_written, NULL) ||
-					bytes_written != bytes_to_write) {
-						UnmapFile(&input);
-						CloseHandle(output);
-						DeleteFile(temp_file_name);
-						return TCFieldStatusFileError;
+	unsigned char const *bytes = input->bytes + (size_t)(*offset - input->offset);
+	int back = 0;
+	switch (form) {
+	case TextFormUTF8:
+		while (back < 3 && (bytes[-back] & 0xc0) == 0x80)
+			back++;
+		if (bytes[-back - 1] == '\r')
+			back++;
+		break;
+	case TextFormUTF16BE:
+	case TextFormUTF16LE: {
+		unsigned char const *unit = bytes - 2;
+		unsigned int c = form == TextFormUTF16BE ? (unit[0] << 8) | unit[1] : unit[0] | (unit[1] << 8);
+		if ((c >= 0xd800 && c < 0xdc00) || c == '\r')
+			back = 2;
+		break;
+	}
+	default:
+		if (bytes[-1] == '\r')
+			back = 1;
+		break;
+	}
+
+	*offset -= back;
+
+	return TRUE;
+}
+
+/* Streams the bytes of INPUT following its BOM_LENGTH byte BOM through
+ * N_THREADS threads converting CONVERT_CHUNK_SIZE byte chunks of it from
+ * FROM to TO each, with LINE_ENDING and PROOF as in ConvertFile(), into
+ * OUTPUT, the temporary file named OUTPUT_NAME, whose first OUT_OFFSET
+ * bytes have been written already.  The chunks are converted a round of
+ * N_THREADS at a time; the sizes of their output, summed in order, give
+ * the offsets that they are then written at.  Unless PREALLOCATED is set,
+ * OUTPUT is grown to make room for each round before it is written. */
+static BOOL
+ConversionRunParallel(char const *filename, FileWindow *input, size_t bom_length,
+					  HANDLE output, char const *output_name, ULONGLONG out_offset,
+					  BOOL preallocated, int n_threads,
+					  Encoding const *from, Encoding const *to, LineEnding line_ending,
+					  TranscodeProof const *proof)
+{
+	ConversionChunk chunks[CONVERT_MAX_THREADS];
+	BOOL succeeded = TRUE;
+	int n_open = 0;
+
+	for (; n_open < n_threads && succeeded; n_open++)
+		succeeded = ConversionChunkOpen(&chunks[n_open], filename, output_name,
+										from, to, line_ending, proof);
+
+	/* The BOM of UTF-16 is as long as its code units, so chunks measured
+	 * from the end of it begin at code units. */
+	TextForm form = EncodingTextForm(from);
+	ULONGLONG start = bom_length;
+	while (succeeded && start < input->file_size) {
+		int n_chunks = 0;
+		for (; n_chunks < n_threads && start < input->file_size; n_chunks++) {
+			ULONGLONG end = input->file_size;
+			if (end - start > CONVERT_CHUNK_SIZE) {
+				end = start + CONVERT_CHUNK_SIZE;
+				if (!ConversionChunkBoundary(input, form, &end)) {
+					succeeded = FALSE;
+					break;
 				}
 			}
+			chunks[n_chunks].start = start;
+			chunks[n_chunks].end = end;
+			start = end;
+		}
 
-			if (bytes_converted == (size_t)-1) {
-				UnmapFile(&input);
-				CloseHandle(output);
-				DeleteFile(temp_file_name);
-				return TCFieldStatusFileError;
-			}
-		} else {
-			UnmapFile(&input);
-			CloseHandle(output);
-			DeleteFile(temp_file_name);
-			return TCFieldStatusFileError;
+		if (!succeeded || !ConversionChunksRun(chunks, n_chunks, ConversionPhaseTranscode)) {
+			succeeded = FALSE;
+			break;
+		}
+
+		for (int i = 0; i < n_chunks; i++) {
+			chunks[i].out_offset = out_offset;
+			out_offset += chunks[i].conversion->n_chunk;
 		}
+
+		LARGE_INTEGER end;
+		end.QuadPart = out_offset;
+		succeeded = (preallocated ||
+					 (SetFilePointerEx(output, end, NULL, FILE_BEGIN) && SetEndOfFile(output))) &&
+			ConversionChunksRun(chunks, n_chunks, ConversionPhaseWrite);
+	}
+
+	for (int i = 0; i < n_open; i++)
+		ConversionChunkClose(&chunks[i]);
+
+	return succeeded;
+}
+
+/* Converts FILENAME, open in INPUT, from encoding FROM to encoding TO
+ * and, unless LINE_ENDING is LineEndingUnknown, rewrites its line endings
+ * to LINE_ENDING, in a single pass over the file: the line-ending stage
+ * runs on the transcoded text on its way to the output.  Single-byte code
+ * pages and Unicode are transcoded without iconv, and when the line
+ * endings are left alone the output is allocated in one go, as SIZE bytes,
+ * the exact size of the result found by ConvertibilityCheck(), which
+ * also gives the PROOF of what needs no checking.  SIZE is 0 and PROOF is
+ * NULL if the file wasnt checked.  INPUT is closed before the file is
+ * replaced.  Large files are split into chunks converted on several
+ * threads. */
+static TCFieldTypeOrStatus
+ConvertFile(char *filename, FileWindow *input, Encoding const *from, Encoding const *to,
+			LineEnding line_ending, ULONGLONG size, TranscodeProof const *proof)
+{
+	/* Why is there no STRSAFE_MAX_CB? */
+	size_t from_bom_length, to_bom_length;
+	char temp_file_name[MAX_PATH + 1];
+	if (FAILED(StringCbLength(EncodingBOM(from), STRSAFE_MAX_CCH, &from_bom_length)) ||
+		FAILED(StringCbLength(EncodingBOM(to), STRSAFE_MAX_CCH, &to_bom_length)) ||
+		!GenerateTemporaryFileName(temp_file_name)) {
+		FileWindowClose(input);
+		return TCFieldStatusFileError;
+	}
+
+	HANDLE output = CreateFile(temp_file_name, GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+							   NULL, CREATE_ALWAYS,
+							   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	Conversion *conversion = ConversionNew(from, to, line_ending, proof, output);
+	BOOL written = output != INVALID_HANDLE_VALUE && conversion != NULL;
+
+	BOOL preallocated = FALSE;
+	if (written && size != 0 && conversion->built_in && !conversion->line_endings) {
+		LARGE_INTEGER end, zero;
+		zero.QuadPart = 0;
+		end.QuadPart = size;
+		written = SetFilePointerEx(output, end, NULL, FILE_BEGIN) &&
+				  SetEndOfFile(output) &&
+				  SetFilePointerEx(output, zero, NULL, FILE_BEGIN);
+		preallocated = TRUE;
+	}
+	written = written && WriteAll(output, EncodingBOM(to), (DWORD)to_bom_length);
+
+	int n_threads = (int)min(g_settings.conversion_threads, (DWORD)CONVERT_MAX_THREADS);
+	if (n_threads > 1 && input->file_size >= CONVERT_PARALLEL_MIN_SIZE)
+		written = written &&
+				  ConversionRunParallel(filename, input, from_bom_length,
+										output, temp_file_name, to_bom_length,
+										preallocated, n_threads, from, to, line_ending, proof);
+	else
+		written = written && ConversionRun(conversion, input, from_bom_length, input->file_size);
+
+	FileWindowClose(input);
+	if (output != INVALID_HANDLE_VALUE)
+		CloseHandle(output);
+	if (conversion != NULL)
+		ConversionFree(conversion);
+
+	if (!written || !CopyFile(temp_file_name, filename, FALSE)) {
+		DeleteFile(temp_file_name);
+		return TCFieldStatusFileError;
 	}
 
-	UnmapFile(&input);
-	CloseHandle(output);
-	CopyFile(temp_file_name, filename, FALSE);
 	DeleteFile(temp_file_name);
 	/* TODO: Should really restore other attributes, like time and such. */
 
 	return TCFieldStatusSetSuccess;
 }
 
-TCFieldTypeOrStatus __stdcall
-ContentSetValue(char *filename, int field_index, int unit_index,
-				TCFieldTypeOrStatus field_type, void *field_value,
-				TCContentSetValueFlags flags)
+/* Repairs FILENAME, whose text is split into the regions of MAP, each in
+ * an encoding of its own, by converting each of them from its encoding to
+ * TO, with LINE_ENDING as in ConvertFile(), skipping the BOM_LENGTH byte
+ * BOM of the file. */
+static TCFieldTypeOrStatus
+ConvertFileRegions(char const *filename, RegionMap const *map, size_t bom_length,
+				   Encoding const *to, LineEnding line_ending)
 {
-	if (field_index == FieldIndexLineEnding)
+	size_t to_bom_length;
+	if (FAILED(StringCbLength(EncodingBOM(to), STRSAFE_MAX_CCH, &to_bom_length)))
 		return TCFieldStatusFileError;
 
-	Encoding const *new_encoding = EncodingsGet(unit_index);
-	if (new_encoding == NULL)
-		return TCFieldStatusNoSuchField;
+	char temp_file_name[MAX_PATH + 1];
+	if (!GenerateTemporaryFileName(temp_file_name))
+		return TCFieldStatusFileError;
 
-	FileMapping mapping;
-	TCFieldTypeOrStatus status = MapFile(filename, &mapping, MAX_MAP_SIZE);
+	FileWindow input;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &input);
 	if (status != TCFieldStatusSetSuccess)
 		return status;
 
-	Encoding const *old_encoding = EncodingFind(mapping.bytes, mapping.n_bytes);
+	HANDLE output = CreateFile(temp_file_name, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+							   CREATE_ALWAYS,
+							   FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	/* A run leaves its conversion flushed, so there need only be one for
+	 * each encoding, however many regions there are in it. */
+	StatsCount(StatsCounterHeapAllocations, 1);
+	Conversion **conversions = (Conversion **)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY,
+														EncodingsCount() * sizeof(Conversion *));
+	BOOL written = output != INVALID_HANDLE_VALUE && conversions != NULL &&
+		WriteAll(output, EncodingBOM(to), (DWORD)to_bom_length);
+
+	for (size_t i = 0; written && i < map->n_regions; i++) {
+		Region const *region = &map->regions[i];
+		ULONGLONG offset = max(region->offset, (ULONGLONG)bom_length);
+		ULONGLONG end = region->offset + region->length;
+		if (offset >= end)
+			continue;
+
+		Conversion **conversion = &conversions[EncodingIndex(region->encoding)];
+		if (*conversion == NULL)
+			*conversion = ConversionNew(region->encoding, to, line_ending, NULL, output);
+		written = *conversion != NULL && ConversionRun(*conversion, &input, offset, end);
+	}
 
-	UnmapFile(&mapping);
+	FileWindowClose(&input);
+	if (output != INVALID_HANDLE_VALUE)
+		CloseHandle(output);
+	if (conversions != NULL) {
+		for (unsigned int i = 0; i < EncodingsCount(); i++)
+			if (conversions[i] != NULL)
+				ConversionFree(conversions[i]);
+		HeapFree(GetProcessHeap(), 0, conversions);
+	}
 
-	HMODULE iconv_dll = LoadIconv();
-	if (iconv_dll == NULL)
+	if (!written || !CopyFile(temp_file_name, filename, FALSE)) {
+		DeleteFile(temp_file_name);
+		return TCFieldStatusFileError;
+	}
+
+	DeleteFile(temp_file_name);
+
+	return TCFieldStatusSetSuccess;
+}
+
+/* Determines if FILENAME is made up of ASCII only. */
+static BOOL
+FileIsASCII(char const *filename)
+{
+	FileWindow input;
+	TCFieldTypeOrStatus status = FileWindowOpen(filename, &input);
+	if (status == TCFieldStatusFieldEmpty)
+		return TRUE;
+	if (status != TCFieldStatusSetSuccess)
+		return FALSE;
+
+	BOOL ascii = TRUE;
+	for (ULONGLONG offset = 0; ascii && offset < input.file_size; ) {
+		if (!FileWindowMove(&input, offset, CONVERT_WINDOW_SIZE)) {
+			ascii = FALSE;
+			break;
+		}
+
+		size_t skip = (size_t)(offset - input.offset);
+		ascii = TranscodeIsASCII(input.bytes + skip, input.n_bytes - skip);
+		offset = input.offset + input.n_bytes;
+	}
+
+	FileWindowClose(&input);
+
+	return ascii;
+}
+
+/* A change to FILENAME requested through ContentSetValue(), held back until
+ * all of the fields of the file have been set, so that changing both its
+ * ENCODING and its LINE_ENDING is done in a single pass over it.  A NULL
+ * ENCODING or a LINE_ENDING of LineEndingUnknown means that it is to be
+ * left as it is. */
+typedef struct _PendingChange PendingChange;
+
+struct _PendingChange
+{
+	char filename[MAX_PATH];
+	Encoding const *encoding;
+	LineEnding line_ending;
+};
+
+static PendingChange s_pending_change;
+
+/* Carries out CHANGE on its file, split into the regions of MAP, whose
+ * BOM is BOM_LENGTH bytes long. */
+static TCFieldTypeOrStatus
+PendingChangeApplyRegions(PendingChange const *change, RegionMap const *map,
+						  size_t bom_length)
+{
+	TranscodeCheck check;
+	TCFieldTypeOrStatus status = ConvertibilityCheckRegions(change->filename, map, bom_length,
+															change->encoding, &check);
+	if (status == TCFieldStatusSetSuccess && check.n_lost > 0)
 		return TCFieldStatusFileError;
 
-	status = IconvFile(filename, old_encoding, new_encoding);
-	if (status != TCFieldStatusSetSuccess) {
+	BOOL built_in = TRUE;
+	for (size_t i = 0; i < map->n_regions; i++)
+		built_in = built_in && TranscodeIsBuiltIn(map->regions[i].encoding, change->encoding);
+
+	HMODULE iconv_dll = NULL;
+	if (!built_in) {
+		iconv_dll = LoadIconv();
+		if (iconv_dll == NULL)
+			return TCFieldStatusFileError;
+	}
+
+	status = ConvertFileRegions(change->filename, map, bom_length,
+								change->encoding, change->line_ending);
+
+	if (iconv_dll != NULL)
 		UnloadIconv(iconv_dll);
+
+	return status == TCFieldStatusSetSuccess ? status : TCFieldStatusFileError;
+}
+
+/* Carries out CHANGE on its file, open in INPUT, which is in ENCODING and
+ * has a BOM_LENGTH byte BOM, region by region, closing INPUT, if it turns
+ * out to be pieced together from text in several encodings.  Returns
+ * TCFieldStatusFieldEmpty, leaving INPUT open, if it isnt. */
+static TCFieldTypeOrStatus
+PendingChangeApplyMixed(PendingChange const *change, FileWindow *input,
+						Encoding const *encoding, size_t bom_length)
+{
+	RegionMap map;
+	if (RegionsFind(change->filename, encoding, &map) != TCFieldStatusSetSuccess)
+		return TCFieldStatusFieldEmpty;
+	if (map.n_regions <= 1) {
+		RegionsFree(&map);
+		return TCFieldStatusFieldEmpty;
+	}
+
+	FileWindowClose(input);
+	TCFieldTypeOrStatus status = PendingChangeApplyRegions(change, &map, bom_length);
+	RegionsFree(&map);
+
+	return status;
+}
+
+/* Carries out the pending change, if any.  The file is detected, checked
+ * and converted through a single view of it, which, for files no larger
+ * than detection looks at, is mapped only once.  Holding it open keeps
+ * others from writing to the file in between, so what the check proves
+ * about the text still holds when it is converted. */
+static TCFieldTypeOrStatus
+PendingChangeApply(void)
+{
+	if (s_pending_change.filename[0] == '\0')
+		return TCFieldStatusSetSuccess;
+
+	PendingChange change = s_pending_change;
+	s_pending_change.filename[0] = '\0';
+
+	FileWindow input;
+	TCFieldTypeOrStatus status = FileWindowOpen(change.filename, &input);
+	if (status != TCFieldStatusSetSuccess)
+		return status;
+
+	/* All of a file that doesnt fit in the address space cant be mapped. */
+	size_t scan_size = DetectScanSize();
+	if ((scan_size == 0 && input.file_size > (size_t)-1) ||
+		!FileWindowMove(&input, 0, scan_size != 0 ? scan_size : (size_t)input.file_size)) {
+		FileWindowClose(&input);
 		return TCFieldStatusFileError;
 	}
 
-	UnloadIconv(iconv_dll);
+	Encoding const *old_encoding = EncodingFind(input.bytes, input.n_bytes);
 
-	return TCFieldStatusSetSuccess;
+	EnterCriticalSection(&s_cache_lock);
+	if (CacheContains(change.filename))
+		CacheClear();
+	LeaveCriticalSection(&s_cache_lock);
+
+	size_t bom_length;
+	if (FAILED(StringCbLength(EncodingBOM(old_encoding), STRSAFE_MAX_CCH, &bom_length))) {
+		FileWindowClose(&input);
+		return TCFieldStatusFileError;
+	}
+
+	if (change.encoding == NULL) {
+		FileWindowClose(&input);
+		return change.line_ending == LineEndingUnknown ? TCFieldStatusSetSuccess :
+			LineEndingsFile(change.filename, old_encoding, change.line_ending, bom_length);
+	}
+
+	/* Files pieced together from text in different encodings are repaired
+	 * by converting each region of them from its own encoding, which also
+	 * goes for converting them to the encoding they were detected to be
+	 * in.  The regions are only looked for once checking the file finds
+	 * signs of them, which conversions that leave the text as it is, and so
+	 * arent checked, only do for the sake of this. */
+	TranscodeCheck check;
+	TranscodeProof proof;
+	BOOL ascii_only;
+	if (change.encoding == old_encoding ||
+		(TranscodeKeepsBytes(old_encoding, change.encoding, &ascii_only) &&
+		 (!ascii_only || FileIsASCII(change.filename)))) {
+		TextForm old_form = EncodingTextForm(old_encoding);
+		if ((old_form == TextFormSingleByte || old_form == TextFormUTF8) &&
+			ConvertibilityCheckWindow(&input, old_encoding, old_encoding, &check,
+									  &proof) == TCFieldStatusSetSuccess && check.mixed) {
+			status = PendingChangeApplyMixed(&change, &input, old_encoding, bom_length);
+			if (status != TCFieldStatusFieldEmpty)
+				return status;
+		}
+
+		/* Conversions that leave the text as it is only need its BOM, and
+		 * perhaps its line endings, changed. */
+		FileWindowClose(&input);
+		if (change.encoding == old_encoding)
+			return change.line_ending == LineEndingUnknown ? TCFieldStatusSetSuccess :
+				LineEndingsFile(change.filename, old_encoding, change.line_ending, bom_length);
+		return LineEndingsFile(change.filename, change.encoding, change.line_ending,
+							   bom_length);
+	}
+
+	/* Find out if any characters would be lost before writing anything,
+	 * rather than when transcoding fails halfway through the file.  This
+	 * cant be told for all encodings, but it can for all of those that are
+	 * transcoded without iconv, which are the ones that need the size.
+	 * Checking also proves the text valid up to the first character that
+	 * cant be represented, which is then transcoded without checking it
+	 * again. */
+	status = ConvertibilityCheckWindow(&input, old_encoding, change.encoding, &check, &proof);
+	if (status == TCFieldStatusSetSuccess && check.mixed) {
+		status = PendingChangeApplyMixed(&change, &input, old_encoding, bom_length);
+		if (status != TCFieldStatusFieldEmpty)
+			return status;
+		status = TCFieldStatusSetSuccess;
+	}
+	BOOL checked = status == TCFieldStatusSetSuccess;
+	if (checked ? check.n_lost > 0 : status != TCFieldStatusFieldEmpty) {
+		FileWindowClose(&input);
+		return TCFieldStatusFileError;
+	}
+
+	HMODULE iconv_dll = NULL;
+	if (!TranscodeIsBuiltIn(old_encoding, change.encoding)) {
+		iconv_dll = LoadIconv();
+		if (iconv_dll == NULL) {
+			FileWindowClose(&input);
+			return TCFieldStatusFileError;
+		}
+	}
+
+	status = ConvertFile(change.filename, &input, old_encoding, change.encoding,
+						 change.line_ending, checked ? check.size : 0, checked ? &proof : NULL);
+
+	if (iconv_dll != NULL)
+		UnloadIconv(iconv_dll);
+
+	return status == TCFieldStatusSetSuccess ? status : TCFieldStatusFileError;
+}
+
+/* Does the work of ContentSetValue(). */
+static TCFieldTypeOrStatus
+SetValue(char *filename, int field_index, int unit_index, TCContentSetValueFlags flags)
+{
+	if (field_index < 0)
+		return PendingChangeApply();
+
+	if (field_index != FieldIndexEncoding && field_index != FieldIndexLineEnding)
+		return TCFieldStatusNoSuchField;
+
+	Encoding const *new_encoding = NULL;
+	if (field_index == FieldIndexEncoding) {
+		new_encoding = EncodingsGet(unit_index);
+		if (new_encoding == NULL || EncodingIsBinary(new_encoding))
+			return TCFieldStatusNoSuchField;
+	} else if (unit_index <= LineEndingUnknown || unit_index >= _countof(line_ending_names)) {
+		return TCFieldStatusNoSuchField;
+	}
+
+	/* Carry out whatever is left over from another file. */
+	if (s_pending_change.filename[0] != '\0' &&
+		((flags & TCContentSetValueFlagFirstAttribute) ||
+		 lstrcmpi(s_pending_change.filename, filename) != 0))
+		PendingChangeApply();
+
+	if (s_pending_change.filename[0] == '\0') {
+		if (FAILED(StringCbCopy(s_pending_change.filename,
+								sizeof(s_pending_change.filename), filename)))
+			return TCFieldStatusFileError;
+		s_pending_change.encoding = NULL;
+		s_pending_change.line_ending = LineEndingUnknown;
+	}
+
+	if (new_encoding != NULL)
+		s_pending_change.encoding = new_encoding;
+	else
+		s_pending_change.line_ending = (LineEnding)unit_index;
+
+	if (!(flags & TCContentSetValueFlagLastAttribute))
+		return TCFieldStatusSetSuccess;
+
+	return PendingChangeApply();
+}
+
+/* Called by Total Commander to set the value of field FIELD_INDEX of
+ * FILENAME to the unit UNIT_INDEX.  When several fields of a file are set
+ * at once, the first call has TCContentSetValueFlagFirstAttribute set in
+ * FLAGS and the last one TCContentSetValueFlagLastAttribute; the changes
+ * are collected and carried out together on the last one.  A FIELD_INDEX
+ * of -1 marks the end of the whole operation. */
+TCFieldTypeOrStatus __stdcall
+ContentSetValue(char *filename, int field_index, int unit_index,
+				TCFieldTypeOrStatus field_type, void *field_value,
+				TCContentSetValueFlags flags)
+{
+	UNREFERENCED_PARAMETER(field_value);
+
+	PluginOpen();
+
+	TraceTime start = TraceStart();
+	TCFieldTypeOrStatus status = SetValue(filename, field_index, unit_index, flags);
+	TraceEnd(start, TraceCallSetValue, filename, field_index, unit_index, flags,
+			 field_type, status);
+
+	return status;
+}
+
+/* Called by Total Commander right after loading the plugin, with the INI
+ * file it suggests for keeping settings in in PARAMS.  We read ours from
+ * the same directory, over those read from the directory of the plugin. */
+void __stdcall
+ContentSetDefaultParams(TCContentDefaultParamStruct *params)
+{
+	PluginOpen();
+
+	char filename[MAX_PATH];
+	if (params->size >= sizeof(*params) &&
+		SettingsFilenameInDirectoryOf(filename, sizeof(filename), params->default_ini_name)) {
+		SettingsLoad(filename);
+		TraceOpen(g_settings.trace_filename);
+	}
+}
+
+/* The module of the plugin, and whether it has been set up for use, which
+ * is put off from when it is loaded until it is first used, as it is
+ * loaded with the loader lock held, which reading files, mapping shared
+ * memory and starting threads shouldnt be done under.  S_OPENING keeps two
+ * threads from setting it up at once. */
+static HMODULE s_module;
+static BOOL volatile s_opened;
+static LONG volatile s_opening;
+
+/* Sets the plugin up, unless that has been done already: reads the
+ * settings from the directory it is in, opens the trace log and the
+ * shared statistics, and prepares for detecting in the background.  Called
+ * on the way into everything that Total Commander or the batch API calls
+ * that needs any of it. */
+void
+PluginOpen(void)
+{
+	if (s_opened)
+		return;
+
+	while (InterlockedCompareExchange(&s_opening, TRUE, FALSE))
+		Sleep(0);
+
+	if (!s_opened) {
+		char module_filename[MAX_PATH];
+		char filename[MAX_PATH];
+		if (GetModuleFileName(s_module, module_filename, sizeof(module_filename)) > 0 &&
+			SettingsFilenameInDirectoryOf(filename, sizeof(filename), module_filename))
+			SettingsLoad(filename);
+		TraceOpen(g_settings.trace_filename);
+
+		ArenaOpen();
+		EncodingAbortOpen();
+		DetectLaterOpen();
+		StatsOpen();
+		Encoding const *encoding;
+		for (unsigned int i = 0; (encoding = EncodingsGet(i)) != NULL; i++)
+			StatsNameProbe(i, EncodingName(encoding));
+
+		s_opened = TRUE;
+	}
+
+	InterlockedExchange(&s_opening, FALSE);
+}
+
+/* Stops the workers that detect in the background, waiting for those that
+ * are busy, and frees what they keep, if the plugin has been set up.  They
+ * are started again when there is something for them to do. */
+void
+PluginStop(void)
+{
+	if (s_opened)
+		DetectLaterClose();
+}
+
+/* Called by Total Commander just before it unloads the plugin. */
+void __stdcall
+ContentPluginUnloading(void)
+{
+	if (!s_opened)
+		return;
+
+	TraceTime start = TraceStart();
+
+	PluginStop();
+	PendingChangeApply();
+	ConversionsClose();
+	FullTextClose();
+	DecompressUnload();
+
+	TraceEnd(start, TraceCallPluginUnloading, NULL, -1, -1, 0, 0, 0);
+	TraceClose();
 }
 
 /* Entry point into the plugin. */
 BOOL APIENTRY
 DllMain(HANDLE module, DWORD reason_for_call, LPVOID reserved)
 {
-	UNREFERENCED_PARAMETER(module);
-	UNREFERENCED_PARAMETER(reserved);
+	switch (reason_for_call) {
+	case DLL_PROCESS_ATTACH:
+		/* The rest is set up by PluginOpen(), once the plugin is used. */
+		s_module = (HMODULE)module;
+		InitializeCriticalSection(&s_cache_lock);
+		InitializeCriticalSection(&s_conversions_lock);
+		FullTextOpen();
+		break;
+	case DLL_THREAD_DETACH:
+		ArenaThreadClose();
+		break;
+	case DLL_PROCESS_DETACH:
+		if (!s_opened)
+			break;
+
+		/* The workers hold the plugin loaded while they run, so if it is
+		 * being unloaded, rather than the process exiting, they have been
+		 * stopped already and this only frees what they kept.  If the
+		 * process is exiting, they have been killed, and cant be waited
+		 * for. */
+		if (reserved == NULL)
+			EncodingDetectClose();
+		TraceClose();
+		SharedCacheClose();
+		StatsClose();
+		EncodingAbortClose();
+		ArenaClose();
+		break;
+	}
 
     return TRUE;
 }
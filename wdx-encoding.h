@@ -3,7 +3,7 @@ ContentGetSupportedField(int index, char *name, char *units, int size);
 
 TCFieldTypeOrStatus __declspec(dllexport) __stdcall
 ContentGetValue(char *filename, int field_index, int unit_index,
-				void *field_value, int field_value_size, int flags);
+				void *field_value, int field_value_size, TCContentFlag flags);
 
 TCFieldTypeOrStatus __declspec(dllexport) __stdcall
 ContentSetValue(char *filename, int field_index, int unit_index,
@@ -16,5 +16,11 @@ ContentGetSupportedFieldFlags(int field_index);
 void __declspec(dllexport) __stdcall
 ContentStopGetValue(char *filename);
 
+void __declspec(dllexport) __stdcall
+ContentSetDefaultParams(TCContentDefaultParamStruct *params);
+
 void __declspec(dllexport) __stdcall
 ContentPluginUnloading(void);
+
+void PluginOpen(void);
+void PluginStop(void);
@@ -0,0 +1,288 @@
+#include "stdafx.h"
+#include "stats.h"
+#include "work-pool.h"
+
+/* A pool of threads working through a queue of work, newest first: when
+ * the host asks for one screenful of files after another, the screenful
+ * that is visible now is worked on before those that have been scrolled
+ * past.  If more than S_MAX_QUEUED pieces of work are queued, the oldest
+ * ones are dropped. */
+
+/* A piece of work in the queue. */
+typedef struct _Work Work;
+
+struct _Work
+{
+	Work *newer;
+	Work *older;
+	WorkFunc func;
+	void *closure;
+};
+
+/* The queue runs from S_NEWEST to S_OLDEST and is guarded by S_LOCK,
+ * along with S_FREE, the pieces of work kept for reuse, linked through
+ * their OLDER fields.  S_QUEUED is released once for every piece of work
+ * pushed, and once for every thread when the pool is stopped. */
+static CRITICAL_SECTION s_lock;
+static HANDLE s_queued;
+static Work *s_newest;
+static Work *s_oldest;
+static Work *s_free;
+static unsigned int s_n_queued;
+static unsigned int s_max_queued;
+static BOOL s_stopping;
+static HANDLE s_threads[WORK_POOL_MAX_THREADS];
+static unsigned int s_n_threads;
+
+/* Unlinks WORK from the queue.  Must be called with S_LOCK held. */
+static void
+WorkUnlink(Work *work)
+{
+	if (work->newer != NULL)
+		work->newer->older = work->older;
+	else
+		s_newest = work->older;
+
+	if (work->older != NULL)
+		work->older->newer = work->newer;
+	else
+		s_oldest = work->newer;
+
+	s_n_queued--;
+}
+
+/* Keeps WORK for reuse.  Must be called with S_LOCK held. */
+static void
+WorkFree(Work *work)
+{
+	work->older = s_free;
+	s_free = work;
+}
+
+/* Calls the functions of the pieces of work in the list starting at
+ * DROPPED, linked through their OLDER fields, to say they were dropped. */
+static void
+WorksDrop(Work *dropped)
+{
+	if (dropped == NULL)
+		return;
+
+	Work *oldest = dropped;
+	for (Work *work = dropped; work != NULL; work = work->older) {
+		work->func(work->closure, TRUE);
+		oldest = work;
+	}
+
+	EnterCriticalSection(&s_lock);
+	oldest->older = s_free;
+	s_free = dropped;
+	LeaveCriticalSection(&s_lock);
+}
+
+/* The thread procedure of the workers.  CLOSURE is a reference to the
+ * module that the pool is in, taken for the thread, so that the module
+ * isnt unloaded from under it by a host that doesnt stop the pool first;
+ * the thread lets go of it on its way out. */
+static DWORD WINAPI
+WorkPoolThread(LPVOID closure)
+{
+	HMODULE module = (HMODULE)closure;
+
+	Work *done = NULL;
+	for (;;) {
+		WaitForSingleObject(s_queued, INFINITE);
+
+		EnterCriticalSection(&s_lock);
+		if (done != NULL)
+			WorkFree(done);
+		Work *work = s_newest;
+		if (work != NULL)
+			WorkUnlink(work);
+		BOOL stopping = s_stopping;
+		LeaveCriticalSection(&s_lock);
+
+		/* Work that was removed or dropped leaves its release of S_QUEUED
+		 * behind, so WORK may well be NULL. */
+		done = work;
+		if (work != NULL)
+			work->func(work->closure, FALSE);
+		else if (stopping)
+			break;
+	}
+
+	if (module != NULL)
+		FreeLibraryAndExitThread(module, 0);
+
+	return 0;
+}
+
+/* Starts N_THREADS threads, which work at a lower priority than the
+ * thread of the host, so that it stays responsive. */
+BOOL
+WorkPoolStart(unsigned int n_threads, unsigned int max_queued)
+{
+	if (s_n_threads > 0)
+		return TRUE;
+
+	s_queued = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+	if (s_queued == NULL)
+		return FALSE;
+
+	InitializeCriticalSection(&s_lock);
+	s_stopping = FALSE;
+	s_max_queued = max(1, max_queued);
+
+	for (unsigned int i = 0; i < min(n_threads, WORK_POOL_MAX_THREADS); i++) {
+		HMODULE module;
+		if (!GetModuleHandleEx(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS,
+							   (LPCTSTR)WorkPoolThread, &module))
+			module = NULL;
+		HANDLE thread = CreateThread(NULL, 0, WorkPoolThread, module, 0, NULL);
+		if (thread == NULL) {
+			if (module != NULL)
+				FreeLibrary(module);
+			break;
+		}
+		SetThreadPriority(thread, THREAD_PRIORITY_BELOW_NORMAL);
+		s_threads[s_n_threads++] = thread;
+	}
+
+	if (s_n_threads == 0) {
+		DeleteCriticalSection(&s_lock);
+		CloseHandle(s_queued);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/* Drops everything that is queued, waits for the work in progress to
+ * finish and frees the pieces of work kept for reuse. */
+void
+WorkPoolStop(void)
+{
+	if (s_n_threads == 0)
+		return;
+
+	EnterCriticalSection(&s_lock);
+	Work *dropped = s_newest;
+	s_newest = NULL;
+	s_oldest = NULL;
+	s_n_queued = 0;
+	s_stopping = TRUE;
+	LeaveCriticalSection(&s_lock);
+
+	WorksDrop(dropped);
+
+	ReleaseSemaphore(s_queued, s_n_threads, NULL);
+	WaitForMultipleObjects(s_n_threads, s_threads, TRUE, INFINITE);
+
+	for (unsigned int i = 0; i < s_n_threads; i++)
+		CloseHandle(s_threads[i]);
+	s_n_threads = 0;
+
+	while (s_free != NULL) {
+		Work *work = s_free;
+		s_free = work->older;
+		HeapFree(GetProcessHeap(), 0, work);
+	}
+
+	DeleteCriticalSection(&s_lock);
+	CloseHandle(s_queued);
+	s_queued = NULL;
+}
+
+/* Queues the work of calling FUNC with CLOSURE before everything that is
+ * already queued. */
+BOOL
+WorkPoolPush(WorkFunc func, void *closure)
+{
+	if (s_n_threads == 0)
+		return FALSE;
+
+	EnterCriticalSection(&s_lock);
+	Work *work = s_free;
+	if (work != NULL) {
+		s_free = work->older;
+	} else {
+		StatsCount(StatsCounterHeapAllocations, 1);
+		work = (Work *)HeapAlloc(GetProcessHeap(), 0, sizeof(Work));
+		if (work == NULL) {
+			LeaveCriticalSection(&s_lock);
+			return FALSE;
+		}
+	}
+
+	work->func = func;
+	work->closure = closure;
+	work->newer = NULL;
+	work->older = s_newest;
+	if (s_newest != NULL)
+		s_newest->newer = work;
+	else
+		s_oldest = work;
+	s_newest = work;
+	s_n_queued++;
+
+	Work *dropped = NULL;
+	if (s_n_queued > s_max_queued) {
+		dropped = s_oldest;
+		WorkUnlink(dropped);
+		dropped->older = NULL;
+	}
+	LeaveCriticalSection(&s_lock);
+
+	ReleaseSemaphore(s_queued, 1, NULL);
+
+	WorksDrop(dropped);
+
+	return TRUE;
+}
+
+/* Removes the work of calling FUNC with CLOSURE from the queue without
+ * calling FUNC.  Returns FALSE if it isnt queued, which includes when it
+ * has already been started. */
+BOOL
+WorkPoolRemove(WorkFunc func, void *closure)
+{
+	if (s_n_threads == 0)
+		return FALSE;
+
+	EnterCriticalSection(&s_lock);
+	Work *work;
+	for (work = s_newest; work != NULL; work = work->older)
+		if (work->func == func && work->closure == closure)
+			break;
+	if (work != NULL) {
+		WorkUnlink(work);
+		WorkFree(work);
+	}
+	LeaveCriticalSection(&s_lock);
+
+	return work != NULL;
+}
+
+/* Drops all queued work that calls FUNC. */
+void
+WorkPoolDrop(WorkFunc func)
+{
+	if (s_n_threads == 0)
+		return;
+
+	Work *dropped = NULL;
+
+	EnterCriticalSection(&s_lock);
+	Work *work = s_newest;
+	while (work != NULL) {
+		Work *older = work->older;
+		if (work->func == func) {
+			WorkUnlink(work);
+			work->older = dropped;
+			dropped = work;
+		}
+		work = older;
+	}
+	LeaveCriticalSection(&s_lock);
+
+	WorksDrop(dropped);
+}
@@ -0,0 +1,14 @@
+/* A function carrying out a piece of work described by CLOSURE.  It is
+ * called exactly once for every piece of work pushed, with DROPPED set if
+ * the work was dropped before it could be started, so that it can free
+ * CLOSURE either way. */
+typedef void (*WorkFunc)(void *closure, BOOL dropped);
+
+/* The maximum number of threads in the pool. */
+#define WORK_POOL_MAX_THREADS	16
+
+BOOL WorkPoolStart(unsigned int n_threads, unsigned int max_queued);
+void WorkPoolStop(void);
+BOOL WorkPoolPush(WorkFunc func, void *closure);
+BOOL WorkPoolRemove(WorkFunc func, void *closure);
+void WorkPoolDrop(WorkFunc func);